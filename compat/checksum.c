@@ -0,0 +1,389 @@
+/*--------------------------------------------------------------- 
+ * Copyright (c) 2010                              
+ * BNL            
+ * All Rights Reserved.                                           
+ *--------------------------------------------------------------- 
+ * Permission is hereby granted, free of charge, to any person    
+ * obtaining a copy of this software (Iperf) and associated       
+ * documentation files (the "Software"), to deal in the Software  
+ * without restriction, including without limitation the          
+ * rights to use, copy, modify, merge, publish, distribute,        
+ * sublicense, and/or sell copies of the Software, and to permit     
+ * persons to whom the Software is furnished to do
+ * so, subject to the following conditions: 
+ *
+ *     
+ * Redistributions of source code must retain the above 
+ * copyright notice, this list of conditions and 
+ * the following disclaimers. 
+ *
+ *     
+ * Redistributions in binary form must reproduce the above 
+ * copyright notice, this list of conditions and the following 
+ * disclaimers in the documentation and/or other materials 
+ * provided with the distribution. 
+ * 
+ *     
+ * Neither the names of the University of Illinois, NCSA, 
+ * nor the names of its contributors may be used to endorse 
+ * or promote products derived from this Software without
+ * specific prior written permission. 
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, 
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES 
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE CONTIBUTORS OR COPYRIGHT 
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, 
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, 
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. 
+ * ________________________________________________________________
+ * National Laboratory for Applied Network Research 
+ * National Center for Supercomputing Applications 
+ * University of Illinois at Urbana-Champaign 
+ * http://www.ncsa.uiuc.edu
+ * ________________________________________________________________ 
+ *
+ * checksum.c
+ * -------------------------------------------------------------------
+ * CRC32C, and the stamps -E puts at the start of every buffer.
+ *
+ * Where the CPU has SSE4.2 its crc32 instruction does the work, over
+ * three streams at once so that its latency is hidden, and the three
+ * CRCs are joined with tables for shifting a CRC over a run of zeros.
+ * Elsewhere it is slicing-by-8 tables.
+ * ------------------------------------------------------------------- */
+
+#include "headers.h"
+#include "rdma.h"
+#include "checksum.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <nmmintrin.h>
+#define IPERF_CRC32C_HW
+#endif
+
+#define CRC32C_POLY	0x82f63b78	/* reflected */
+
+/* stream lengths of the hardware version, powers of 2 */
+#define CRC32C_LONG	8192
+#define CRC32C_SHORT	256
+
+static uint32_t crc32c_table[8][256];
+static uint32_t crc32c_long[4][256];
+static uint32_t crc32c_short[4][256];
+
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t (*crc32c_fn)(uint32_t crc, const unsigned char *p,
+			     size_t len);
+static const char *crc32c_name;
+
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+	uint32_t sum = 0;
+
+	while (vec) {
+		if (vec & 1)
+			sum ^= *mat;
+		vec >>= 1;
+		mat++;
+	}
+	return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+	int n;
+
+	for (n = 0; n < 32; n++)
+		square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+/*
+ * The operator that runs a CRC over len zero bytes, len a power of 2.
+ */
+static void crc32c_zeros_op(uint32_t *even, size_t len)
+{
+	uint32_t odd[32], row = 1;
+	int n;
+
+	odd[0] = CRC32C_POLY;		/* one zero bit */
+	for (n = 1; n < 32; n++) {
+		odd[n] = row;
+		row <<= 1;
+	}
+	gf2_matrix_square(even, odd);	/* two */
+	gf2_matrix_square(odd, even);	/* four */
+
+	/* each square doubles the zeros, starting from one byte */
+	do {
+		gf2_matrix_square(even, odd);
+		len >>= 1;
+		if (len == 0)
+			return;
+		gf2_matrix_square(odd, even);
+		len >>= 1;
+	} while (len);
+	for (n = 0; n < 32; n++)
+		even[n] = odd[n];
+}
+
+static void crc32c_zeros(uint32_t zeros[][256], size_t len)
+{
+	uint32_t op[32];
+	uint32_t n;
+
+	crc32c_zeros_op(op, len);
+	for (n = 0; n < 256; n++) {
+		zeros[0][n] = gf2_matrix_times(op, n);
+		zeros[1][n] = gf2_matrix_times(op, n << 8);
+		zeros[2][n] = gf2_matrix_times(op, n << 16);
+		zeros[3][n] = gf2_matrix_times(op, n << 24);
+	}
+}
+
+static uint32_t crc32c_shift(uint32_t zeros[][256], uint32_t crc)
+{
+	return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+	       zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint32_t lo, hi;
+
+	crc = ~crc;
+	while (len > 0 && ((uintptr_t) p & 7)) {
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 |
+			    (uint32_t) p[3] << 24);
+		hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t) p[7] << 24;
+		crc = crc32c_table[7][lo & 0xff] ^
+		      crc32c_table[6][(lo >> 8) & 0xff] ^
+		      crc32c_table[5][(lo >> 16) & 0xff] ^
+		      crc32c_table[4][lo >> 24] ^
+		      crc32c_table[3][hi & 0xff] ^
+		      crc32c_table[2][(hi >> 8) & 0xff] ^
+		      crc32c_table[1][(hi >> 16) & 0xff] ^
+		      crc32c_table[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+	while (len > 0) {
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	return ~crc;
+}
+
+#ifdef IPERF_CRC32C_HW
+#ifdef __x86_64__
+#define crc32c_word(crc, p) _mm_crc32_u64(crc, *(const uint64_t *) (p))
+#define CRC32C_WORD	8
+#else
+#define crc32c_word(crc, p) _mm_crc32_u32(crc, *(const uint32_t *) (p))
+#define CRC32C_WORD	4
+#endif
+
+/*
+ * Run streams of n bytes at p, p + n and p + 2n at once, then join
+ * them. Returns the CRC of all three, n a multiple of CRC32C_WORD.
+ */
+__attribute__((target("sse4.2")))
+static inline uint64_t crc32c_hw3(uint64_t crc0, const unsigned char *p,
+				  size_t n, uint32_t zeros[][256])
+{
+	const unsigned char *end = p + n;
+	uint64_t crc1 = 0, crc2 = 0;
+
+	do {
+		crc0 = crc32c_word(crc0, p);
+		crc1 = crc32c_word(crc1, p + n);
+		crc2 = crc32c_word(crc2, p + 2 * n);
+		p += CRC32C_WORD;
+	} while (p < end);
+	crc0 = crc32c_shift(zeros, (uint32_t) crc0) ^ crc1;
+	return crc32c_shift(zeros, (uint32_t) crc0) ^ crc2;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t crc0 = ~crc;
+
+	while (len > 0 && ((uintptr_t) p & (CRC32C_WORD - 1))) {
+		crc0 = _mm_crc32_u8((uint32_t) crc0, *p++);
+		len--;
+	}
+	while (len >= CRC32C_LONG * 3) {
+		crc0 = crc32c_hw3(crc0, p, CRC32C_LONG, crc32c_long);
+		p += CRC32C_LONG * 3;
+		len -= CRC32C_LONG * 3;
+	}
+	while (len >= CRC32C_SHORT * 3) {
+		crc0 = crc32c_hw3(crc0, p, CRC32C_SHORT, crc32c_short);
+		p += CRC32C_SHORT * 3;
+		len -= CRC32C_SHORT * 3;
+	}
+	while (len >= CRC32C_WORD) {
+		crc0 = crc32c_word(crc0, p);
+		p += CRC32C_WORD;
+		len -= CRC32C_WORD;
+	}
+	while (len > 0) {
+		crc0 = _mm_crc32_u8((uint32_t) crc0, *p++);
+		len--;
+	}
+	return ~(uint32_t) crc0;
+}
+#endif
+
+static void crc32c_init(void)
+{
+	uint32_t n, crc;
+	int k;
+
+	for (n = 0; n < 256; n++) {
+		crc = n;
+		for (k = 0; k < 8; k++)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		crc32c_table[0][n] = crc;
+	}
+	for (n = 0; n < 256; n++) {
+		crc = crc32c_table[0][n];
+		for (k = 1; k < 8; k++) {
+			crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+			crc32c_table[k][n] = crc;
+		}
+	}
+	crc32c_fn = crc32c_sw;
+	crc32c_name = "slicing-by-8";
+
+#ifdef IPERF_CRC32C_HW
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc32c_zeros(crc32c_long, CRC32C_LONG);
+		crc32c_zeros(crc32c_short, CRC32C_SHORT);
+		crc32c_fn = crc32c_hw;
+		crc32c_name = "SSE4.2";
+	}
+#endif
+}
+
+/*
+ * CRC32C of len bytes at buf, continuing from crc; start from 0.
+ */
+uint32_t iperf_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+	return crc32c_fn(crc, (const unsigned char *) buf, len);
+}
+
+/*
+ * Which implementation iperf_crc32c() picked.
+ */
+const char *iperf_crc32c_str(void)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+	return crc32c_name;
+}
+
+static uint32_t iperf_stamp_crc(const char *buf, uint32_t len)
+{
+	uint32_t crc = iperf_crc32c(0, buf, IPERF_STAMP_LEN - 4);
+
+	return iperf_crc32c(crc, buf + IPERF_STAMP_LEN,
+			    len - IPERF_STAMP_LEN);
+}
+
+/*
+ * Stamp the len bytes at buf with the next sequence number. Buffers
+ * too short to carry a stamp go out as they are.
+ */
+void iperf_stamp_buf(struct iperf_check_stat *st, char *buf, uint32_t len)
+{
+	uint64_t start = iperf_cycles();
+	uint64_t seq = htonll(st->seq);
+	uint32_t word;
+
+	if (st->start == 0)
+		st->start = start;
+	if (len < IPERF_STAMP_LEN) {
+		st->shorts++;
+		return;
+	}
+	memcpy(buf, &seq, 8);
+	word = htonl(len);
+	memcpy(buf + 8, &word, 4);
+	word = htonl(iperf_stamp_crc(buf, len));
+	memcpy(buf + 12, &word, 4);
+
+	st->seq++;
+	st->bufs++;
+	st->bytes += len;
+	st->cycles += iperf_cycles() - start;
+}
+
+/*
+ * Check the stamp of the len bytes at buf. Returns 0 if they are what
+ * was sent, -1 if not; one out of sequence is counted, but taken as
+ * the new start, so a lost buffer is not counted over and over.
+ */
+int iperf_check_buf(struct iperf_check_stat *st, const char *buf,
+		    uint32_t len)
+{
+	uint64_t start = iperf_cycles();
+	uint64_t seq;
+	uint32_t word, crc;
+	int ret = 0;
+
+	if (st->start == 0)
+		st->start = start;
+	if (len < IPERF_STAMP_LEN) {
+		st->shorts++;
+		return 0;
+	}
+	memcpy(&seq, buf, 8);
+	memcpy(&word, buf + 8, 4);
+	memcpy(&crc, buf + 12, 4);
+
+	if (ntohl(word) != len || ntohl(crc) != iperf_stamp_crc(buf, len)) {
+		st->bad++;
+		ret = -1;
+	} else {
+		seq = ntohll(seq);
+		if (seq != st->seq)
+			st->unordered++;
+		st->seq = seq + 1;
+	}
+
+	st->bufs++;
+	st->bytes += len;
+	st->cycles += iperf_cycles() - start;
+	return ret;
+}
+
+/*
+ * The share of the time since the first buffer spent stamping or
+ * checking, from 0 to 1.
+ */
+double iperf_check_share(struct iperf_check_stat *st)
+{
+	uint64_t all = iperf_cycles() - st->start;
+
+	return st->start && all > 0 ? (double) st->cycles / all : 0;
+}
+
+/*
+ * Bytes per second stamped or checked, counting only the time spent
+ * on it: what validation could keep up with on its own.
+ */
+double iperf_check_rate(struct iperf_check_stat *st)
+{
+	double usec = st->cycles / iperf_cycles_per_usec();
+
+	return usec > 0 ? st->bytes / usec * 1e6 : 0;
+}
@@ -0,0 +1,359 @@
+/*--------------------------------------------------------------- 
+ * Copyright (c) 2010                              
+ * BNL            
+ * All Rights Reserved.                                           
+ *--------------------------------------------------------------- 
+ * Permission is hereby granted, free of charge, to any person    
+ * obtaining a copy of this software (Iperf) and associated       
+ * documentation files (the "Software"), to deal in the Software  
+ * without restriction, including without limitation the          
+ * rights to use, copy, modify, merge, publish, distribute,        
+ * sublicense, and/or sell copies of the Software, and to permit     
+ * persons to whom the Software is furnished to do
+ * so, subject to the following conditions: 
+ *
+ *     
+ * Redistributions of source code must retain the above 
+ * copyright notice, this list of conditions and 
+ * the following disclaimers. 
+ *
+ *     
+ * Redistributions in binary form must reproduce the above 
+ * copyright notice, this list of conditions and the following 
+ * disclaimers in the documentation and/or other materials 
+ * provided with the distribution. 
+ * 
+ *     
+ * Neither the names of the University of Illinois, NCSA, 
+ * nor the names of its contributors may be used to endorse 
+ * or promote products derived from this Software without
+ * specific prior written permission. 
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, 
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES 
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE CONTIBUTORS OR COPYRIGHT 
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, 
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, 
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. 
+ * ________________________________________________________________
+ * National Laboratory for Applied Network Research 
+ * National Center for Supercomputing Applications 
+ * University of Illinois at Urbana-Champaign 
+ * http://www.ncsa.uiuc.edu
+ *
+ * diskio.c
+ * -------------------------------------------------------------------
+ * Writing what the RDMA server receives to the -O file straight from
+ * its registered buffers (-X odirect).
+ *
+ * Each connection queues its writes on an io_uring of its own and
+ * keeps receiving while they run; a buffer is only given back to the
+ * client once its write completed. Writes whose buffer, length or
+ * offset O_DIRECT cannot take, typically the last piece of a file, go
+ * through the page cache instead. Where there is no io_uring, or the
+ * kernel's cannot write yet, it is pwrite(), one buffer at a time.
+ * ------------------------------------------------------------------- */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE		/* O_DIRECT */
+#endif
+
+#include "headers.h"
+#include "rdma.h"
+#include "diskio.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define IPERF_IO_URING
+#endif
+#endif
+
+#ifndef O_DIRECT
+#define O_DIRECT	0
+#endif
+
+/*
+ * Open name for -O, appending to what is in it. Where the filesystem
+ * takes no O_DIRECT every write goes through the page cache.
+ */
+int iperf_disk_open(struct iperf_disk_file *f, const char *name)
+{
+	off_t end;
+
+	f->bfd = open(name, O_WRONLY | O_CREAT, 0666);
+	if (f->bfd < 0)
+		return -1;
+	f->fd = (O_DIRECT ? open(name, O_WRONLY | O_DIRECT) : -1);
+	f->direct = f->fd >= 0;
+	if (!f->direct)
+		f->fd = f->bfd;
+
+	end = lseek(f->bfd, 0, SEEK_END);
+	f->offset = (end > 0 ? (uint64_t) end : 0);
+	return 0;
+}
+
+#ifdef IPERF_IO_URING
+
+static void iperf_uring_free(struct iperf_disk *d)
+{
+	if (d->sqes)
+		munmap(d->sqes, d->sqes_len);
+	if (d->cq_ptr && d->cq_ptr != d->sq_ptr)
+		munmap(d->cq_ptr, d->cq_len);
+	if (d->sq_ptr)
+		munmap(d->sq_ptr, d->sq_len);
+	close(d->ring_fd);
+	d->sqes = d->cq_ptr = d->sq_ptr = NULL;
+	d->ring_fd = -1;
+}
+
+static void *iperf_uring_map(struct iperf_disk *d, size_t len, off_t what)
+{
+	void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, d->ring_fd, what);
+
+	return p == MAP_FAILED ? NULL : p;
+}
+
+/*
+ * Set up an io_uring of entries entries and map its rings, without
+ * liburing: it takes little more than the three mmap()s.
+ */
+static int iperf_uring_setup(struct iperf_disk *d, int entries)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	d->ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (d->ring_fd < 0)
+		return -1;
+	/* came with IORING_OP_WRITE, which we need */
+	if (!(p.features & IORING_FEAT_RW_CUR_POS))
+		goto err;
+
+	d->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	d->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (d->cq_len > d->sq_len)
+			d->sq_len = d->cq_len;
+		d->cq_len = d->sq_len;
+	}
+	d->sq_ptr = iperf_uring_map(d, d->sq_len, IORING_OFF_SQ_RING);
+	if (!d->sq_ptr)
+		goto err;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		d->cq_ptr = d->sq_ptr;
+	else
+		d->cq_ptr = iperf_uring_map(d, d->cq_len, IORING_OFF_CQ_RING);
+	if (!d->cq_ptr)
+		goto err;
+	d->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	d->sqes = iperf_uring_map(d, d->sqes_len, IORING_OFF_SQES);
+	if (!d->sqes)
+		goto err;
+
+	sq = (char *) d->sq_ptr;
+	cq = (char *) d->cq_ptr;
+	d->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	d->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+	d->sq_array = (unsigned *) (sq + p.sq_off.array);
+	d->cq_head = (unsigned *) (cq + p.cq_off.head);
+	d->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	d->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+	d->cqes = cq + p.cq_off.cqes;
+	d->entries = p.sq_entries;
+	return 0;
+
+err:
+	iperf_uring_free(d);
+	return -1;
+}
+
+/* queue a write, 0 if the kernel took it */
+static int iperf_uring_write(struct iperf_disk *d, int fd, const char *buf,
+			     uint32_t len, uint64_t off, int tag)
+{
+	unsigned tail = *d->sq_tail, idx = tail & *d->sq_mask;
+	struct io_uring_sqe *sqe = (struct io_uring_sqe *) d->sqes + idx;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) buf;
+	sqe->len = len;
+	sqe->off = off;
+	/* the length comes back too, to tell short writes */
+	sqe->user_data = (uint64_t) tag << 32 | len;
+	d->sq_array[idx] = idx;
+	__atomic_store_n(d->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	if (syscall(__NR_io_uring_enter, d->ring_fd, 1, 0, 0, NULL, 0) == 1)
+		return 0;
+	/* not consumed: take it back, nobody else looks at the tail */
+	__atomic_store_n(d->sq_tail, tail, __ATOMIC_RELEASE);
+	return -1;
+}
+
+#endif /* IPERF_IO_URING */
+
+/*
+ * Get ready to write to f, with up to entries writes in flight.
+ */
+void iperf_disk_init(struct iperf_disk *d, struct iperf_disk_file *f,
+		     int entries)
+{
+	memset(d, 0, sizeof(*d));
+	d->file = f;
+	d->ring_fd = -1;
+#ifdef IPERF_IO_URING
+	iperf_uring_setup(d, entries);
+#endif
+}
+
+static void iperf_disk_error(struct iperf_disk *d, int err)
+{
+	if (d->errors++ == 0)
+		fprintf(stderr, "Unable to write to the output file: %s\n",
+			err ? strerror(err) : "short write");
+}
+
+/*
+ * Write len bytes at buf to the next part of the file. With tag >= 0
+ * the write is queued if it can be, and iperf_disk_reap() returns tag
+ * once it is done: the buffer must stay as it is until then. Returns
+ * 1 if queued, 0 if the data is written already, -1 if that failed.
+ */
+int iperf_disk_write(struct iperf_disk *d, const char *buf, uint32_t len,
+		     int tag)
+{
+	struct iperf_disk_file *f = d->file;
+	uint64_t off = __sync_fetch_and_add(&f->offset, len);
+	uint64_t start = iperf_cycles();
+	int direct = f->direct &&
+		((unsigned long) buf | len | off) % IPERF_DISK_ALIGN == 0;
+	uint32_t done = 0;
+	ssize_t n;
+
+	if (direct)
+		d->direct++;
+	else
+		d->buffered++;
+
+#ifdef IPERF_IO_URING
+	if (tag >= 0 && d->ring_fd >= 0 && d->inflight < d->entries &&
+	    iperf_uring_write(d, direct ? f->fd : f->bfd, buf, len, off,
+			      tag) == 0) {
+		if (d->inflight++ == 0)
+			d->since = start;
+		if (d->inflight > d->peak)
+			d->peak = d->inflight;
+		return 1;
+	}
+#endif
+
+	while (done < len) {
+		n = pwrite(direct ? f->fd : f->bfd, buf + done, len - done,
+			   off + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			iperf_disk_error(d, n < 0 ? errno : 0);
+			break;
+		}
+		done += n;
+		/* what is left of a short write is no longer aligned */
+		direct = 0;
+	}
+	d->bytes += done;
+	/* in flight writes count this time already */
+	if (d->inflight == 0)
+		d->busy += iperf_cycles() - start;
+	return done == len ? 0 : -1;
+}
+
+/*
+ * Collect up to max finished writes, their tags into tags. With wait,
+ * sleep until there is one if any are in flight. Returns how many.
+ */
+int iperf_disk_reap(struct iperf_disk *d, int *tags, int max, int wait)
+{
+#ifdef IPERF_IO_URING
+	struct io_uring_cqe *cqe;
+	unsigned head, tail;
+	uint32_t len;
+	int n = 0;
+
+	if (d->inflight == 0)
+		return 0;
+
+	head = *d->cq_head;
+	tail = __atomic_load_n(d->cq_tail, __ATOMIC_ACQUIRE);
+	while (head == tail && wait) {
+		if (syscall(__NR_io_uring_enter, d->ring_fd, 0, 1,
+			    IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+		    errno != EINTR)
+			return 0;
+		tail = __atomic_load_n(d->cq_tail, __ATOMIC_ACQUIRE);
+	}
+
+	while (head != tail && n < max) {
+		cqe = (struct io_uring_cqe *) d->cqes + (head & *d->cq_mask);
+		len = (uint32_t) cqe->user_data;
+		if (cqe->res == (int32_t) len)
+			d->bytes += len;
+		else
+			iperf_disk_error(d, cqe->res < 0 ? -cqe->res : 0);
+		tags[n++] = (int) (cqe->user_data >> 32);
+		head++;
+	}
+	__atomic_store_n(d->cq_head, head, __ATOMIC_RELEASE);
+
+	d->inflight -= n;
+	if (n > 0 && d->inflight == 0)
+		d->busy += iperf_cycles() - d->since;
+	return n;
+#else
+	return 0;
+#endif
+}
+
+/* wait for every write in flight, dropping their tags */
+void iperf_disk_drain(struct iperf_disk *d)
+{
+	int tags[64];
+
+	while (d->inflight > 0 && iperf_disk_reap(d, tags, 64, 1) > 0)
+		;
+}
+
+void iperf_disk_close(struct iperf_disk *d)
+{
+	if (d->file == NULL)
+		return;
+	iperf_disk_drain(d);
+#ifdef IPERF_IO_URING
+	if (d->ring_fd >= 0)
+		iperf_uring_free(d);
+#endif
+	d->file = NULL;
+}
+
+const char *iperf_disk_str(struct iperf_disk *d)
+{
+	return d->ring_fd >= 0 ? "io_uring" : "pwrite";
+}
+
+/* seconds with writes going */
+double iperf_disk_secs(struct iperf_disk *d)
+{
+	return d->busy / iperf_cycles_per_usec() / 1e6;
+}
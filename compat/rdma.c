@@ -51,69 +51,21 @@
  * threads are not available, this does nothing.
  * ------------------------------------------------------------------- */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE		/* CPU_SET, pthread_setaffinity_np */
+#endif
+
 #include "headers.h"
 #include "rdma.h"
+#include <limits.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
 
 extern struct acptq acceptedTqh;
 
-static int server_recv(struct rdma_cb *cb, struct ibv_wc *wc)
-{
-	if (wc->byte_len != sizeof(cb->recv_buf)) {
-		fprintf(stderr, "Received bogus data, size %d\n", wc->byte_len);
-		return -1;
-	}
-
-	cb->remote_rkey = ntohl(cb->recv_buf.rkey);
-	cb->remote_addr = ntohll(cb->recv_buf.buf);
-	cb->remote_len  = ntohl(cb->recv_buf.size);
-	cb->remote_mode = ntohl(cb->recv_buf.mode);
-	DEBUG_LOG("Received rkey %x addr %" PRIx64 " len %d from peer\n",
-		  cb->remote_rkey, cb->remote_addr, cb->remote_len);
-	
-	switch ( cb->remote_mode ) {
-	case MODE_RDMA_ACTRD:
-		cb->trans_mode = kRdmaTrans_PasRead;
-		break;
-	case MODE_RDMA_ACTWR:
-		cb->trans_mode = kRdmaTrans_PasWrte;
-		break;
-	case MODE_RDMA_PASRD:
-		cb->trans_mode = kRdmaTrans_ActRead;
-		break;
-	case MODE_RDMA_PASWR:
-		cb->trans_mode = kRdmaTrans_ActWrte;
-		break;
-	default:
-		fprintf(stderr, "unrecognize transfer mode %d\n", \
-			cb->remote_mode);
-		break;
-	}
-	
-	if (cb->state <= CONNECTED || cb->state == RDMA_WRITE_COMPLETE)
-		cb->state = RDMA_READ_ADV;
-	else
-		cb->state = RDMA_WRITE_ADV;
-	DPRINTF(("server_recv success\n"));
-	
-	return 0;
-}
-
-static int client_recv(struct rdma_cb *cb, struct ibv_wc *wc)
-{
-	if (wc->byte_len != sizeof(cb->recv_buf)) {
-		fprintf(stderr, "Received bogus data, size %d\n", wc->byte_len);
-		return -1;
-	}
-
-	if (cb->state == RDMA_READ_ADV)
-		cb->state = RDMA_WRITE_ADV;
-	else
-		cb->state = RDMA_WRITE_COMPLETE;
-
-	return 0;
-}
-
-
 int iperf_cma_event_handler(struct rdma_cm_id *cma_id,
 				    struct rdma_cm_event *event)
 {
@@ -129,8 +81,8 @@ int iperf_cma_event_handler(struct rdma_cm_id *cma_id,
 	switch (event->event) {
 	case RDMA_CM_EVENT_ADDR_RESOLVED:
 		cb->state = ADDR_RESOLVED;
-		ret = rdma_resolve_route(cma_id, 2000);
-		if (ret) {
+		cb->conn_at[IPERF_CONN_ROUTE] = iperf_cycles();
+		if (rdma_resolve_route(cma_id, 2000)) {
 			cb->state = ERROR;
 			perror("rdma_resolve_route");
 			sem_post(&cb->sem);
@@ -154,7 +106,15 @@ int iperf_cma_event_handler(struct rdma_cm_id *cma_id,
 		}
 		
 		item->child_cm_id = cma_id;
-				
+		item->initiator_depth = event->param.conn.initiator_depth;
+		item->responder_resources = \
+			event->param.conn.responder_resources;
+		/* the client's first message, if it came along */
+		memset(&item->pdata, 0, sizeof item->pdata);
+		if (event->param.conn.private_data_len >= sizeof item->pdata)
+			memcpy(&item->pdata, event->param.conn.private_data,
+			       sizeof item->pdata);
+
 		TAILQ_INSERT_TAIL(&acceptedTqh, item, entries);
 		
 		TAILQ_UNLOCK(&acceptedTqh);
@@ -171,31 +131,54 @@ int iperf_cma_event_handler(struct rdma_cm_id *cma_id,
 		 * Server will wake up when first RECV completes.
 		 */
 		if (!cb->server) {
+			/* the server's answer to it, if it came along */
+			if (event->param.conn.private_data_len >=
+			    sizeof cb->accept_pdata)
+				memcpy(&cb->accept_pdata,
+				       event->param.conn.private_data,
+				       sizeof cb->accept_pdata);
 			cb->state = CONNECTED;
 		}
 		sem_post(&cb->sem);
 		break;
 
+	/*
+	 * These fail this connection only: whoever waits on it sees
+	 * ERROR, the other streams on the channel go on.
+	 */
 	case RDMA_CM_EVENT_ADDR_ERROR:
 	case RDMA_CM_EVENT_ROUTE_ERROR:
 	case RDMA_CM_EVENT_CONNECT_ERROR:
 	case RDMA_CM_EVENT_UNREACHABLE:
-	case RDMA_CM_EVENT_REJECTED:
 		fprintf(stderr, "cma event %s, error %d\n",
 			rdma_event_str(event->event), event->status);
+		cb->state = ERROR;
+		sem_post(&cb->sem);
+		break;
+
+	/* the server could not set this stream up, see Server::OpenRDMA */
+	case RDMA_CM_EVENT_REJECTED:
+		if (cb->trans_mode != kRdmaTrans_Connect)
+			fprintf(stderr, "RDMA connection rejected by the "
+				"server, status %d\n", event->status);
+		cb->state = ERROR;
 		sem_post(&cb->sem);
-		ret = -1;
 		break;
 
 	case RDMA_CM_EVENT_DISCONNECTED:
-		fprintf(stderr, "RDMA %s DISCONNECT EVENT...\n",
-			cb->server ? "server" : "client");
+		/* connection-rate probes come and go by the thousand */
+		if (cb->trans_mode != kRdmaTrans_Connect)
+			fprintf(stderr, "RDMA %s DISCONNECT EVENT...\n",
+				cb->server ? "server" : "client");
+		if (cb->state != ERROR)
+			cb->state = DISCONNECTED;
 		sem_post(&cb->sem);
 		break;
 
 	case RDMA_CM_EVENT_DEVICE_REMOVAL:
 		fprintf(stderr, "cma detected device removal!!!!\n");
-		ret = -1;
+		cb->state = ERROR;
+		sem_post(&cb->sem);
 		break;
 
 	default:
@@ -207,98 +190,127 @@ int iperf_cma_event_handler(struct rdma_cm_id *cma_id,
 	return ret;
 }
 
+/*
+ * The events iperf_cma_event_handler() fails a connection on.
+ */
+int iperf_cm_failed(int event)
+{
+	switch (event) {
+	case RDMA_CM_EVENT_ADDR_ERROR:
+	case RDMA_CM_EVENT_ROUTE_ERROR:
+	case RDMA_CM_EVENT_CONNECT_ERROR:
+	case RDMA_CM_EVENT_UNREACHABLE:
+	case RDMA_CM_EVENT_REJECTED:
+	case RDMA_CM_EVENT_DEVICE_REMOVAL:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Wait for the CM to report the connection gone, after either side
+ * called rdma_disconnect(). Returns -1 if it failed instead.
+ */
+int iperf_wait_disconnect(struct rdma_cb *cb)
+{
+	while (cb->state != DISCONNECTED && cb->state != ERROR)
+		while (sem_wait(&cb->sem) && errno == EINTR)
+			;
+	return cb->state == DISCONNECTED ? 0 : -1;
+}
+
+const char *iperf_conn_phase_str(int phase)
+{
+	switch (phase) {
+	case IPERF_CONN_ADDR:
+		return "resolve addr";
+	case IPERF_CONN_ROUTE:
+		return "resolve route";
+	case IPERF_CONN_QP:
+		return "create QP";
+	case IPERF_CONN_REG:
+		return "register";
+	case IPERF_CONN_ESTAB:
+		return "connect";
+	default:
+		return "teardown";
+	}
+}
+
+static int iperf_place_self(struct iperf_rdma_dev *dev);
+static int iperf_place_vec(struct iperf_rdma_dev *dev,
+			   struct iperf_comp_vec *vec);
+static struct iperf_rdma_dev *iperf_find_dev(struct ibv_context *verbs);
+
+/*
+ * Read one event channel for good. Events find their connection
+ * through cm_id->context, so a channel may serve any number of them.
+ */
 void *cm_thread(void *arg) {
-	struct rdma_cb *cb = arg;
+	struct rdma_event_channel *channel = arg;
 	struct rdma_cm_event *event;
-	int ret;
+	int ret, placed = 0;
 
 	while (1) {
-		ret = rdma_get_cm_event(cb->cm_channel, &event);
+		ret = rdma_get_cm_event(channel, &event);
 		if (ret) {
 			perror("rdma_get_cm_event");
 			exit(ret);
 		}
-		ret = iperf_cma_event_handler(event->id, event);
+		/* near the device, once there is one set up */
+		if (!placed && event->id->verbs)
+			placed = iperf_place_self(iperf_find_dev(
+					event->id->verbs)) == 0;
+		/* failures are the connection's, see its state */
+		iperf_cma_event_handler(event->id, event);
 		rdma_ack_cm_event(event);
-		if (ret)
-			exit(ret);
 	}
 }
 
 
+/*
+ * Drain the CQ in batches into the connection's completion ring and
+ * wake the data thread once per batch rather than once per completion.
+ */
 int iperf_cq_event_handler(struct rdma_cb *cb)
 {
-	struct ibv_wc wc;
-	struct ibv_recv_wr *bad_wr;
-	int ret;
-	
-	DPRINTF(("2 cq_handler cb @ %x\n", (unsigned long)cb));
-	DPRINTF(("cq_handler sem_post @ %x\n", (unsigned long)&cb->sem));
-
-	while ((ret = ibv_poll_cq(cb->cq, 1, &wc)) == 1) {
-		ret = 0;
+	struct ibv_wc wc[IPERF_WC_BATCH];
+	int i, n, total = 0;
 
-		if (wc.status) {
-			fprintf(stderr, "cq completion failed status %d\n",
-				wc.status);
-			// IBV_WC_WR_FLUSH_ERR == 5
-			if (wc.status != IBV_WC_WR_FLUSH_ERR)
-				ret = -1;
+	while ((n = ibv_poll_cq(cb->cq, IPERF_WC_BATCH, wc)) > 0) {
+		cb->cq_polls++;
+		cb->cq_wcs += n;
+		pthread_mutex_lock(&cb->wc_lock);
+		if (cb->wc_count + n > cb->wc_size) {
+			pthread_mutex_unlock(&cb->wc_lock);
+			fprintf(stderr, "completion ring overflow\n");
 			goto error;
 		}
-
-		switch (wc.opcode) {
-		case IBV_WC_SEND:
-			DEBUG_LOG("send completion\n");
-			break;
-
-		case IBV_WC_RDMA_WRITE:
-			DEBUG_LOG("rdma write completion\n");
-			cb->state = RDMA_WRITE_COMPLETE;
-			sem_post(&cb->sem);
-			break;
-
-		case IBV_WC_RDMA_READ:
-			DEBUG_LOG("rdma read completion\n");
-			cb->state = RDMA_READ_COMPLETE;
-			sem_post(&cb->sem);
-			break;
-
-		case IBV_WC_RECV:
-			DEBUG_LOG("recv completion\n");
-			DPRINTF(("IBV_WC_RECV cb->server %d\n", cb->server));
-			ret = cb->server ? server_recv(cb, &wc) :
-					   client_recv(cb, &wc);
-			if (ret) {
-				fprintf(stderr, "recv wc error: %d\n", ret);
-				goto error;
-			}
-
-			ret = ibv_post_recv(cb->qp, &cb->rq_wr, &bad_wr);
-			if (ret) {
-				fprintf(stderr, "post recv error: %d\n", ret);
-				goto error;
-			}
-			sem_post(&cb->sem);
-			DPRINTF(("IBV_WC_RECV success\n"));
-			break;
-
-		default:
-			DEBUG_LOG("unknown!!!!! completion\n");
-			ret = -1;
-			goto error;
+		for (i = 0; i < n; i++) {
+			cb->wc_ring[(cb->wc_head + cb->wc_count) % cb->wc_size]
+				= wc[i];
+			cb->wc_count++;
 		}
+		pthread_mutex_unlock(&cb->wc_lock);
+		total += n;
 	}
-	if (ret) {
-		fprintf(stderr, "poll error %d\n", ret);
+	cb->cq_polls++;
+	if (n < 0) {
+		fprintf(stderr, "poll error %d\n", n);
 		goto error;
 	}
+	cb->cq_empty++;
+
+	DEBUG_LOG("cq handler reaped %d completions\n", total);
+	if (total)
+		sem_post(&cb->wc_sem);
 	return 0;
 
 error:
 	cb->state = ERROR;
-	sem_post(&cb->sem);
-	return ret;
+	sem_post(&cb->wc_sem);
+	return -1;
 }
 
 
@@ -310,6 +322,7 @@ void *cq_thread(void *arg)
 	int ret;
 	
 	DEBUG_LOG("cq_thread started.\n");
+	iperf_place_vec(cb->dev, cb->vec);
 
 	while (1) {	
 		pthread_testcancel();
@@ -323,6 +336,7 @@ void *cq_thread(void *arg)
 			fprintf(stderr, "Unknown CQ!\n");
 			pthread_exit(NULL);
 		}
+		cb->cq_events++;
 		ret = ibv_req_notify_cq(cb->cq, 0);
 		if (ret) {
 			fprintf(stderr, "Failed to set notify!\n");
@@ -336,6 +350,163 @@ void *cq_thread(void *arg)
 }
 
 
+/*
+ * Only event mode has a cq_thread; the polling modes reap from the
+ * data thread itself.
+ */
+int iperf_start_cq(struct rdma_cb *cb)
+{
+	if (cb->cq_mode != IPERF_CQ_EVENT)
+		return 0;
+	return pthread_create(&cb->cqthread, NULL, cq_thread, cb);
+}
+
+void iperf_stop_cq(struct rdma_cb *cb)
+{
+	if (cb->cq_mode != IPERF_CQ_EVENT)
+		return;
+	pthread_cancel(cb->cqthread);
+	pthread_join(cb->cqthread, NULL);
+}
+
+const char *iperf_cq_mode_str(int mode)
+{
+	switch (mode) {
+	case IPERF_CQ_POLL:
+		return "poll";
+	case IPERF_CQ_HYBRID:
+		return "hybrid";
+	case IPERF_CQ_SHARED:
+		return "shared";
+	case IPERF_CQ_WORKER:
+		return "worker";
+	default:
+		return "event";
+	}
+}
+
+/*
+ * Poll the CQ from the calling thread. Poll mode spins until something
+ * completes. Hybrid mode spins cq_spin times, then arms the CQ and
+ * sleeps on the completion channel until the next completion.
+ */
+static int iperf_poll_wc(struct rdma_cb *cb, struct ibv_wc *wc, int max)
+{
+	struct ibv_cq *ev_cq;
+	void *ev_ctx;
+	int n, spin = 0, armed = 0;
+
+	while (1) {
+		n = ibv_poll_cq(cb->cq, max, wc);
+		cb->cq_polls++;
+		if (n > 0) {
+			cb->cq_wcs += n;
+			return n;
+		}
+		if (n < 0) {
+			fprintf(stderr, "poll error %d\n", n);
+			cb->state = ERROR;
+			return -1;
+		}
+		cb->cq_empty++;
+
+		if (cb->cq_mode == IPERF_CQ_POLL || ++spin < cb->cq_spin)
+			continue;
+
+		/*
+		 * Arm first and poll once more before sleeping, or a
+		 * completion landing in between would never wake us.
+		 */
+		if (!armed) {
+			if (ibv_req_notify_cq(cb->cq, 0)) {
+				fprintf(stderr, "Failed to set notify!\n");
+				cb->state = ERROR;
+				return -1;
+			}
+			armed = 1;
+			continue;
+		}
+
+		if (ibv_get_cq_event(cb->channel, &ev_cq, &ev_ctx)) {
+			fprintf(stderr, "Failed to get cq event!\n");
+			cb->state = ERROR;
+			return -1;
+		}
+		ibv_ack_cq_events(cb->cq, 1);
+		cb->cq_events++;
+		spin = 0;
+		armed = 0;
+	}
+}
+
+/*
+ * Take up to max completions, waiting until there is at least one.
+ * Returns the count, or -1 once the CQ failed. In event and shared
+ * mode they come from the hand-over ring filled by cq_thread or the
+ * shared CQ poller.
+ */
+static int iperf_take_wc(struct rdma_cb *cb, struct ibv_wc *wc, int max)
+{
+	int n = 0;
+
+	pthread_mutex_lock(&cb->wc_lock);
+	while (n < max && cb->wc_count > 0) {
+		wc[n++] = cb->wc_ring[cb->wc_head];
+		cb->wc_head = (cb->wc_head + 1) % cb->wc_size;
+		cb->wc_count--;
+	}
+	pthread_mutex_unlock(&cb->wc_lock);
+	return n;
+}
+
+int iperf_get_wc(struct rdma_cb *cb, struct ibv_wc *wc, int max)
+{
+	int n;
+
+	if (cb->cq_mode == IPERF_CQ_POLL || cb->cq_mode == IPERF_CQ_HYBRID)
+		return iperf_poll_wc(cb, wc, max);
+
+	while (1) {
+		n = iperf_take_wc(cb, wc, max);
+		if (n > 0)
+			return n;
+		if (cb->state == ERROR)
+			return -1;
+
+		while (sem_wait(&cb->wc_sem) && errno == EINTR)
+			;
+	}
+}
+
+/*
+ * Like iperf_get_wc(), but never waits: returns 0 if nothing is there.
+ * Completions cq_thread handed over before the switch to poll mode
+ * are returned first. A worker's connections are polled directly.
+ */
+int iperf_try_wc(struct rdma_cb *cb, struct ibv_wc *wc, int max)
+{
+	int n;
+
+	if (cb->wc_count > 0 ||
+	    (cb->cq_mode != IPERF_CQ_POLL && cb->cq_mode != IPERF_CQ_HYBRID &&
+	     cb->cq_mode != IPERF_CQ_WORKER)) {
+		n = iperf_take_wc(cb, wc, max);
+		return n > 0 || cb->state != ERROR ? n : -1;
+	}
+
+	n = ibv_poll_cq(cb->cq, max, wc);
+	cb->cq_polls++;
+	if (n > 0) {
+		cb->cq_wcs += n;
+	} else if (n == 0) {
+		cb->cq_empty++;
+	} else {
+		fprintf(stderr, "poll error %d\n", n);
+		cb->state = ERROR;
+	}
+	return n;
+}
+
 int rdma_init( struct rdma_cb *cb ) {
 	int ret = 0;
 	
@@ -362,7 +533,7 @@ int rdma_init( struct rdma_cb *cb ) {
 		return -1;
 	}
 
-	pthread_create(&cb->cmthread, NULL, cm_thread, cb);
+	pthread_create(&cb->cmthread, NULL, cm_thread, cb->cm_channel);
 
 /*	if (cb->server) {
 		if (persistent_server)
@@ -377,540 +548,4288 @@ int rdma_init( struct rdma_cb *cb ) {
 	return 0;
 }
 
+/*
+ * Client streams do not get an event channel and CM thread each: they
+ * all share the first one, made on demand, so -P 64 starts one CM
+ * thread instead of 64.
+ */
+static struct rdma_event_channel *iperf_cli_channel;
+static pthread_t iperf_cli_cmthread;
+static pthread_once_t iperf_cli_once = PTHREAD_ONCE_INIT;
 
-// setup queue pair
-int iperf_setup_qp(struct rdma_cb *cb, struct rdma_cm_id *cm_id)
+static void iperf_cli_channel_init(void)
 {
-	int ret;
-
-	cb->pd = ibv_alloc_pd(cm_id->verbs);
-	if (!cb->pd) {
-		fprintf(stderr, "ibv_alloc_pd failed\n");
-		return errno;
+	iperf_cli_channel = rdma_create_event_channel();
+	if (!iperf_cli_channel) {
+		perror("rdma_create_event_channel");
+		return;
 	}
-	DEBUG_LOG("created pd %p\n", cb->pd);
-
-	cb->channel = ibv_create_comp_channel(cm_id->verbs);
-	if (!cb->channel) {
-		fprintf(stderr, "ibv_create_comp_channel failed\n");
-		ret = errno;
-		goto err1;
+	if (pthread_create(&iperf_cli_cmthread, NULL, cm_thread,
+			   iperf_cli_channel)) {
+		perror("pthread_create");
+		rdma_destroy_event_channel(iperf_cli_channel);
+		iperf_cli_channel = NULL;
 	}
-	DEBUG_LOG("created channel %p\n", cb->channel);
+}
 
-	cb->cq = ibv_create_cq(cm_id->verbs, IPERF_RDMA_SQ_DEPTH * 2, cb,
-				cb->channel, 0);
-	if (!cb->cq) {
-		fprintf(stderr, "ibv_create_cq failed\n");
-		ret = errno;
-		goto err2;
-	}
-	DEBUG_LOG("created cq %p\n", cb->cq);
-	
-	DEBUG_LOG("before ibv_req_notify_cq\n");
-	ret = ibv_req_notify_cq(cb->cq, 0);
-	if (ret) {
-		fprintf(stderr, "ibv_create_cq failed\n");
-		ret = errno;
-		goto err3;
-	}
+int rdma_init_client(struct rdma_cb *cb)
+{
+	pthread_once(&iperf_cli_once, iperf_cli_channel_init);
+	if (!iperf_cli_channel)
+		return -1;
 
-	DPRINTF(("before iperf_create_qp\n"));
-	ret = iperf_create_qp(cb);
-	if (ret) {
-		perror("rdma_create_qp");
-		goto err3;
+	cb->cm_channel = iperf_cli_channel;
+	cb->cmthread = iperf_cli_cmthread;
+	if (rdma_create_id(cb->cm_channel, &cb->cm_id, cb, RDMA_PS_TCP)) {
+		perror("rdma_create_id");
+		return -1;
 	}
-	DEBUG_LOG("created qp %p\n", cb->qp);
 	return 0;
-
-err3:
-	ibv_destroy_cq(cb->cq);
-err2:
-	ibv_destroy_comp_channel(cb->channel);
-err1:
-	ibv_dealloc_pd(cb->pd);
-	return ret;
 }
 
 
-int iperf_create_qp(struct rdma_cb *cb)
-{
-	struct ibv_qp_init_attr init_attr;
-	int ret;
-
-	memset(&init_attr, 0, sizeof(init_attr));
-	init_attr.cap.max_send_wr = IPERF_RDMA_SQ_DEPTH;
-	init_attr.cap.max_recv_wr = 2;
-	init_attr.cap.max_recv_sge = 1;
-	init_attr.cap.max_send_sge = 1;
-	init_attr.qp_type = IBV_QPT_RC;
-	init_attr.send_cq = cb->cq;
-	init_attr.recv_cq = cb->cq;
-
-	DPRINTF(("before rdma_create_qp\n"));
-	DPRINTF(("cb->server: %d\n", cb->server));
-	if (cb->server) {
-		ret = rdma_create_qp(cb->child_cm_id, cb->pd, &init_attr);
-		if (!ret)
-			cb->qp = cb->child_cm_id->qp;
-	} else {
-		ret = rdma_create_qp(cb->cm_id, cb->pd, &init_attr);
-		if (!ret)
-			cb->qp = cb->cm_id->qp;
-	}
-	DPRINTF(("after rdma_create_qp, ret = %d\n", ret));
+/*
+ * Per device state.
+ *
+ * All connections on a device share one protection domain, so the
+ * registration pool below can serve every one of them, and with
+ * -X cqs=N the server also shares its completion queues. Devices are
+ * opened once by rdma_cm and stay open, so this state lives for the
+ * lifetime of the process.
+ */
 
-	return ret;
-}
+static struct iperf_rdma_dev *iperf_devs;
+static pthread_mutex_t iperf_devs_lock = PTHREAD_MUTEX_INITIALIZER;
 
-void iperf_free_qp(struct rdma_cb *cb)
+static unsigned long iperf_usec(void)
 {
-	ibv_destroy_qp(cb->qp);
-	ibv_destroy_cq(cb->cq);
-	ibv_destroy_comp_channel(cb->channel);
-	ibv_dealloc_pd(cb->pd);
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000UL + tv.tv_usec;
 }
 
+/*
+ * Buffer memory.
+ *
+ * By default buffers come from the heap. -X mem=numa maps them on 4KB
+ * pages instead, -X mem=huge and huge1g on 2MB and 1GB huge pages,
+ * all bound to the device's NUMA node, see placement below, and touched
+ * page by page before they are registered, so neither ibv_reg_mr nor
+ * the first transfer faults them in. Where no huge pages are left a
+ * buffer falls back to 4KB pages. Mappings are remembered so that
+ * iperf_mem_free() knows what to unmap.
+ */
 
-int iperf_setup_buffers(struct rdma_cb *cb)
-{
-	int ret;
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB	0x40000
+#endif
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT	26
+#endif
+#ifndef MPOL_BIND
+#define MPOL_BIND	2
+#endif
 
-	DEBUG_LOG("rping_setup_buffers called on cb %p\n", cb);
+typedef struct iperf_mapping {
+	char *buf;
+	size_t len;
+	struct iperf_mapping *next;
+} iperf_mapping;
 
-	cb->recv_mr = ibv_reg_mr(cb->pd, &cb->recv_buf, sizeof cb->recv_buf,
-				 IBV_ACCESS_LOCAL_WRITE);
-	if (!cb->recv_mr) {
-		fprintf(stderr, "recv_buf reg_mr failed\n");
-		return errno;
-	}
+static iperf_mapping *iperf_mappings;
+static pthread_mutex_t iperf_mappings_lock = PTHREAD_MUTEX_INITIALIZER;
 
-	cb->send_mr = ibv_reg_mr(cb->pd, &cb->send_buf, sizeof cb->send_buf, 0);
-	if (!cb->send_mr) {
-		fprintf(stderr, "send_buf reg_mr failed\n");
-		ret = errno;
-		goto err1;
+const char *iperf_mem_str(int mem)
+{
+	switch (mem) {
+	case IPERF_MEM_NUMA:
+		return "4KB pages";
+	case IPERF_MEM_HUGE:
+		return "2MB huge pages";
+	case IPERF_MEM_HUGE1G:
+		return "1GB huge pages";
+	case IPERF_MEM_COMPARE:
+		return "each kind in turn";
+	default:
+		return "heap";
 	}
+}
 
-	cb->rdma_buf = malloc(cb->size);
-	if (!cb->rdma_buf) {
-		fprintf(stderr, "rdma_buf malloc failed\n");
-		ret = -ENOMEM;
-		goto err2;
-	}
+static int iperf_numa_node(struct ibv_context *verbs)
+{
+	char path[256];
+	int node = -1;
+	FILE *f;
 
-	cb->rdma_mr = ibv_reg_mr(cb->pd, cb->rdma_buf, cb->size,
-				 IBV_ACCESS_LOCAL_WRITE |
-				 IBV_ACCESS_REMOTE_READ |
-				 IBV_ACCESS_REMOTE_WRITE);
-	if (!cb->rdma_mr) {
-		fprintf(stderr, "rdma_buf reg_mr failed\n");
-		ret = errno;
-		goto err3;
-	}
+	snprintf(path, sizeof path, "/sys/class/infiniband/%s/device/numa_node",
+		 ibv_get_device_name(verbs->device));
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (fscanf(f, "%d", &node) != 1)
+		node = -1;
+	fclose(f);
+	return node;
+}
 
-	if (!cb->server) {
-		cb->start_buf = malloc(cb->size);
-		if (!cb->start_buf) {
-			fprintf(stderr, "start_buf malloc failed\n");
-			ret = -ENOMEM;
-			goto err4;
-		}
+/*
+ * Placement.
+ *
+ * Unless -X numa=off, the data, CM and CQ threads of a device's
+ * connections run on the CPUs sysfs lists as local to the device and
+ * prefer its NUMA node for what they allocate, heap buffers included;
+ * mapped buffers are bound to the node outright. -X numa=# puts all of
+ * it on node # instead. A CM thread can only follow once it sees an
+ * event for a device that is set up already.
+ */
 
-		cb->start_mr = ibv_reg_mr(cb->pd, cb->start_buf, cb->size,
-					  IBV_ACCESS_LOCAL_WRITE | 
-					  IBV_ACCESS_REMOTE_READ |
-					  IBV_ACCESS_REMOTE_WRITE);
-		if (!cb->start_mr) {
-			fprintf(stderr, "start_buf reg_mr failed\n");
-			ret = errno;
-			goto err5;
-		}
-	}
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED	1
+#endif
 
-	iperf_setup_wr(cb);
-	DEBUG_LOG("allocated & registered buffers...\n");
-	return 0;
+static void iperf_read_line(const char *path, char *buf, size_t len)
+{
+	FILE *f = fopen(path, "r");
 
-err5:
-	free(cb->start_buf);
-err4:
-	ibv_dereg_mr(cb->rdma_mr);
-err3:
-	free(cb->rdma_buf);
-err2:
-	ibv_dereg_mr(cb->send_mr);
-err1:
-	ibv_dereg_mr(cb->recv_mr);
-	return ret;
+	buf[0] = '\0';
+	if (!f)
+		return;
+	if (!fgets(buf, len, f))
+		buf[0] = '\0';
+	fclose(f);
+	buf[strcspn(buf, "\n")] = '\0';
 }
 
-
-void iperf_free_buffers(struct rdma_cb *cb)
+/*
+ * Where dev's buffers and threads go, given -X numa as numa.
+ */
+static void iperf_place_init(struct iperf_rdma_dev *dev, int numa)
 {
-	DEBUG_LOG("rping_free_buffers called on cb %p\n", cb);
-	ibv_dereg_mr(cb->recv_mr);
-	ibv_dereg_mr(cb->send_mr);
-	ibv_dereg_mr(cb->rdma_mr);
-	free(cb->rdma_buf);
-	if (!cb->server) {
-		ibv_dereg_mr(cb->start_mr);
-		free(cb->start_buf);
+	char path[256];
+
+	dev->numa = numa;
+	dev->node = -1;
+	dev->cpus[0] = '\0';
+	if (numa == IPERF_NUMA_OFF)
+		return;
+	if (numa == IPERF_NUMA_AUTO) {
+		dev->node = dev->numa_node;
+		snprintf(path, sizeof path,
+			 "/sys/class/infiniband/%s/device/local_cpulist",
+			 ibv_get_device_name(dev->verbs->device));
+	} else {
+		dev->node = numa;
+		snprintf(path, sizeof path,
+			 "/sys/devices/system/node/node%d/cpulist", numa);
 	}
+	iperf_read_line(path, dev->cpus, sizeof dev->cpus);
+	DEBUG_LOG("%s: buffers on node %d, threads on cpus %s\n",
+		  ibv_get_device_name(dev->verbs->device), dev->node,
+		  dev->cpus);
 }
 
-
-void iperf_setup_wr(struct rdma_cb *cb)
+/*
+ * A sysfs cpulist such as "0-7,16-23" as a CPU set. Returns the number
+ * of CPUs in it.
+ */
+static int iperf_cpulist(const char *list, cpu_set_t *set)
 {
-	cb->recv_sgl.addr = (uint64_t) (unsigned long) &cb->recv_buf;
-	cb->recv_sgl.length = sizeof cb->recv_buf;
-	cb->recv_sgl.lkey = cb->recv_mr->lkey;
-	cb->rq_wr.sg_list = &cb->recv_sgl;
-	cb->rq_wr.num_sge = 1;
-
-	cb->send_sgl.addr = (uint64_t) (unsigned long) &cb->send_buf;
-	cb->send_sgl.length = sizeof cb->send_buf;
-	cb->send_sgl.lkey = cb->send_mr->lkey;
-
-	cb->sq_wr.opcode = IBV_WR_SEND;
-	cb->sq_wr.send_flags = IBV_SEND_SIGNALED;
-	cb->sq_wr.sg_list = &cb->send_sgl;
-	cb->sq_wr.num_sge = 1;
+	const char *p = list;
+	char *end;
+	long lo, hi;
+	int n = 0;
 
-	cb->rdma_sgl.addr = (uint64_t) (unsigned long) cb->rdma_buf;
-	cb->rdma_sgl.lkey = cb->rdma_mr->lkey;
-	cb->rdma_sq_wr.send_flags = IBV_SEND_SIGNALED;
-	cb->rdma_sq_wr.sg_list = &cb->rdma_sgl;
-	cb->rdma_sq_wr.num_sge = 1;
+	CPU_ZERO(set);
+	while (*p) {
+		lo = hi = strtol(p, &end, 10);
+		if (end == p)
+			break;
+		if (*end == '-') {
+			p = end + 1;
+			hi = strtol(p, &end, 10);
+			if (end == p)
+				break;
+		}
+		for (; lo <= hi && lo < CPU_SETSIZE; lo++, n++)
+			CPU_SET(lo, set);
+		p = *end == ',' ? end + 1 : end;
+	}
+	return n;
 }
 
-
-int rdma_connect_client(struct rdma_cb *cb)
+/*
+ * Pin the calling thread to dev's CPUs and have it prefer dev's node.
+ * Returns -1 if there is nowhere to put it.
+ */
+static int iperf_place_self(struct iperf_rdma_dev *dev)
 {
-	struct rdma_conn_param conn_param;
-	int ret;
+	cpu_set_t set;
+	int ret = -1;
+#ifdef SYS_set_mempolicy
+	unsigned long mask[4];
+	int bits = 8 * sizeof(unsigned long);
+#endif
 
-	memset(&conn_param, 0, sizeof conn_param);
-	conn_param.responder_resources = 1;
-	conn_param.initiator_depth = 1;
+	if (!dev)
+		return -1;
+	if (iperf_cpulist(dev->cpus, &set) > 0) {
+		if (pthread_setaffinity_np(pthread_self(), sizeof set, &set))
+			DEBUG_LOG("cannot pin to cpus %s\n", dev->cpus);
+		ret = 0;
+	}
+#ifdef SYS_set_mempolicy
+	if (dev->node >= 0 && dev->node < (int) (sizeof mask * 8)) {
+		memset(mask, 0, sizeof mask);
+		mask[dev->node / bits] |= 1UL << (dev->node % bits);
+		if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask,
+			    sizeof mask * 8 + 1))
+			DEBUG_LOG("cannot prefer node %d\n", dev->node);
+		ret = 0;
+	}
+#endif
+	return ret;
+}
+
+static struct iperf_rdma_dev *iperf_find_dev(struct ibv_context *verbs)
+{
+	struct iperf_rdma_dev *dev;
+
+	pthread_mutex_lock(&iperf_devs_lock);
+	for (dev = iperf_devs; dev; dev = dev->next)
+		if (dev->verbs == verbs)
+			break;
+	pthread_mutex_unlock(&iperf_devs_lock);
+	return dev;
+}
+
+/*
+ * Completion vectors.
+ *
+ * Connections' CQs signal on the device's vectors in turn rather than
+ * all on vector 0, so that the interrupts of -P streams are spread over
+ * as many CPUs as the device has vectors. Under placement only vectors
+ * whose interrupts go to CPUs of the device's take turns, where there
+ * are any, and a CQ thread or shared CQ poller runs where the
+ * interrupts of its vector go. They are found in /proc/interrupts by
+ * the names drivers give them, "mlx5_comp3@pci:0000:3b:00.0" and the
+ * like.
+ */
+
+static void iperf_vec_irqs(struct iperf_rdma_dev *dev)
+{
+	char path[256], link[256], line[1024], *pci, *p;
+	struct iperf_comp_vec *vec;
+	ssize_t len;
+	int irq, v;
+	FILE *f;
+
+	/* interrupts are named after the PCI function */
+	snprintf(path, sizeof path, "/sys/class/infiniband/%s/device",
+		 ibv_get_device_name(dev->verbs->device));
+	len = readlink(path, link, sizeof link - 1);
+	if (len <= 0)
+		return;
+	link[len] = '\0';
+	pci = strrchr(link, '/');
+	pci = pci ? pci + 1 : link;
+
+	f = fopen("/proc/interrupts", "r");
+	if (!f)
+		return;
+	while (fgets(line, sizeof line, f)) {
+		if (sscanf(line, " %d:", &irq) != 1 || !strstr(line, pci))
+			continue;
+		p = strstr(line, "comp");
+		if (!p)
+			continue;
+		p += 4;
+		if (*p == '-' || *p == '_')
+			p++;
+		if (!isdigit((unsigned char) *p))
+			continue;
+		v = atoi(p);
+		if (v >= dev->nvec)
+			continue;
+		vec = &dev->vecs[v];
+		vec->irq = irq;
+		snprintf(path, sizeof path, "/proc/irq/%d/smp_affinity_list",
+			 irq);
+		iperf_read_line(path, vec->cpus, sizeof vec->cpus);
+	}
+	fclose(f);
+}
+
+static void iperf_vec_init(struct iperf_rdma_dev *dev)
+{
+	struct iperf_comp_vec tmp;
+	cpu_set_t local, irq, both;
+	int i, j;
+
+	dev->nvec = dev->verbs->num_comp_vectors > 0 ?
+		    dev->verbs->num_comp_vectors : 1;
+	dev->vecs = (struct iperf_comp_vec *) calloc(dev->nvec,
+						     sizeof *dev->vecs);
+	if (!dev->vecs) {
+		dev->nvec = 0;
+		return;
+	}
+	for (i = 0; i < dev->nvec; i++) {
+		dev->vecs[i].vector = i;
+		dev->vecs[i].irq = -1;
+	}
+	if (dev->numa == IPERF_NUMA_OFF)
+		return;
+	iperf_vec_irqs(dev);
+	if (iperf_cpulist(dev->cpus, &local) == 0)
+		return;
+
+	/* the local ones to the front, in order */
+	for (i = 0; i < dev->nvec; i++) {
+		if (iperf_cpulist(dev->vecs[i].cpus, &irq) == 0)
+			continue;
+		CPU_AND(&both, &local, &irq);
+		if (CPU_COUNT(&both) == 0)
+			continue;
+		tmp = dev->vecs[i];
+		for (j = i; j > dev->nlocal; j--)
+			dev->vecs[j] = dev->vecs[j - 1];
+		dev->vecs[dev->nlocal++] = tmp;
+	}
+	DEBUG_LOG("%s: %d of %d completion vectors local\n",
+		  ibv_get_device_name(dev->verbs->device), dev->nlocal,
+		  dev->nvec);
+}
+
+/*
+ * The vector for the next CQ: the next local one, or the next of all.
+ */
+static struct iperf_comp_vec *iperf_next_vec(struct iperf_rdma_dev *dev)
+{
+	int n = dev->nlocal > 0 ? dev->nlocal : dev->nvec;
+
+	if (n == 0)
+		return NULL;
+	return &dev->vecs[__sync_fetch_and_add(&dev->next_vec, 1) % n];
+}
+
+/*
+ * Place the calling thread, which is woken by vec's interrupts, on the
+ * CPUs they go to, or near the device where that is not known.
+ */
+static int iperf_place_vec(struct iperf_rdma_dev *dev,
+			   struct iperf_comp_vec *vec)
+{
+	cpu_set_t set;
+	int ret = iperf_place_self(dev);
+
+	if (!dev || dev->numa == IPERF_NUMA_OFF || !vec ||
+	    iperf_cpulist(vec->cpus, &set) == 0)
+		return ret;
+	if (pthread_setaffinity_np(pthread_self(), sizeof set, &set))
+		DEBUG_LOG("cannot pin to cpus %s\n", vec->cpus);
+	return 0;
+}
+
+/*
+ * The placement cb's connection got, for its report.
+ */
+int iperf_place_str(struct rdma_cb *cb, char *buf, size_t len)
+{
+	struct iperf_rdma_dev *dev = cb->dev;
+	struct iperf_comp_vec *vec = cb->vec;
+	int n;
+
+	if (!dev)
+		return snprintf(buf, len, "no device");
+	if (dev->node < 0 && dev->cpus[0] == '\0')
+		n = snprintf(buf, len, "%s on NUMA node %d, left to the OS",
+			     ibv_get_device_name(dev->verbs->device),
+			     dev->numa_node);
+	else
+		n = snprintf(buf, len, "%s on NUMA node %d, threads on CPUs "
+			     "%s, memory on node %d",
+			     ibv_get_device_name(dev->verbs->device),
+			     dev->numa_node, dev->cpus[0] ? dev->cpus : "any",
+			     dev->node);
+	if (!vec || n < 0 || (size_t) n >= len)
+		return n;
+	if (vec->irq < 0)
+		return n + snprintf(buf + n, len - n,
+				    ", completion vector %d of %d",
+				    vec->vector, dev->nvec);
+	return n + snprintf(buf + n, len - n, ", completion vector %d of %d, "
+			    "IRQ %d on CPUs %s", vec->vector, dev->nvec,
+			    vec->irq, vec->cpus);
+}
+
+static void iperf_mem_bind(char *buf, size_t len, int node)
+{
+#ifdef SYS_mbind
+	unsigned long mask[4];
+	int bits = 8 * sizeof(unsigned long);
+
+	if (node < 0 || node >= (int) (sizeof mask * 8))
+		return;
+	memset(mask, 0, sizeof mask);
+	mask[node / bits] |= 1UL << (node % bits);
+	if (syscall(SYS_mbind, buf, len, MPOL_BIND, mask,
+		    sizeof mask * 8 + 1, 0))
+		DEBUG_LOG("mbind to node %d failed\n", node);
+#endif
+}
+
+/*
+ * Get len bytes of kind *mem near node, lowering *mem to what it
+ * really is.
+ */
+static char *iperf_mem_alloc(size_t len, int *mem, int node)
+{
+	static int warned;
+	iperf_mapping *m;
+	size_t i, page = 4096;
+	void *buf = MAP_FAILED;
+	int shift;
+
+	if (*mem == IPERF_MEM_MALLOC) {
+		if (posix_memalign(&buf, IPERF_POOL_ALIGN, len))
+			return NULL;
+		return (char *) buf;
+	}
+
+	m = (iperf_mapping *) malloc(sizeof *m);
+	if (!m)
+		return NULL;
+	if (*mem == IPERF_MEM_HUGE || *mem == IPERF_MEM_HUGE1G) {
+		shift = *mem == IPERF_MEM_HUGE1G ? 30 : 21;
+		page = (size_t) 1 << shift;
+		m->len = (len + page - 1) & ~(page - 1);
+		buf = mmap(NULL, m->len, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+			   (shift << MAP_HUGE_SHIFT), -1, 0);
+		if (buf == MAP_FAILED) {
+			if (!warned++)
+				fprintf(stderr, "no %s free, using 4KB pages\n",
+					iperf_mem_str(*mem));
+			*mem = IPERF_MEM_NUMA;
+			page = 4096;
+		}
+	}
+	if (buf == MAP_FAILED) {
+		m->len = (len + page - 1) & ~(page - 1);
+		buf = mmap(NULL, m->len, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (buf == MAP_FAILED) {
+			perror("mmap");
+			free(m);
+			return NULL;
+		}
+	}
+
+	/* bind first, so the pages are faulted in on the right node */
+	iperf_mem_bind((char *) buf, m->len, node);
+	for (i = 0; i < m->len; i += page)
+		((volatile char *) buf)[i] = 0;
+
+	m->buf = (char *) buf;
+	pthread_mutex_lock(&iperf_mappings_lock);
+	m->next = iperf_mappings;
+	iperf_mappings = m;
+	pthread_mutex_unlock(&iperf_mappings_lock);
+	return m->buf;
+}
+
+static void iperf_mem_free(char *buf)
+{
+	iperf_mapping **pp, *m = NULL;
+
+	pthread_mutex_lock(&iperf_mappings_lock);
+	for (pp = &iperf_mappings; *pp; pp = &(*pp)->next) {
+		if ((*pp)->buf == buf) {
+			m = *pp;
+			*pp = m->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&iperf_mappings_lock);
+
+	if (m) {
+		munmap(m->buf, m->len);
+		free(m);
+	} else {
+		free(buf);
+	}
+}
+
+/*
+ * Register the pool: one region of pool_size bytes, pinned up front by
+ * a single ibv_reg_mr. It carries remote access rights since ring
+ * slices handed out from it are RDMA targets.
+ */
+static void iperf_pool_init(struct iperf_rdma_dev *dev, size_t pool_size,
+			    int mem)
+{
+	struct iperf_pool *pool = &dev->pool;
+	char *base;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	dev->pool_mem = dev->pool_mem_got = mem;
+	if (pool_size == 0)
+		return;
+
+	base = iperf_mem_alloc(pool_size, &dev->pool_mem_got,
+			       dev->node);
+	if (!base) {
+		fprintf(stderr, "pool malloc failed\n");
+		return;
+	}
+	pool->mr = ibv_reg_mr(dev->pd, base, pool_size,
+			      IBV_ACCESS_LOCAL_WRITE |
+			      IBV_ACCESS_REMOTE_READ |
+			      IBV_ACCESS_REMOTE_WRITE);
+	if (!pool->mr) {
+		fprintf(stderr, "pool reg_mr failed\n");
+		iperf_mem_free(base);
+		return;
+	}
+	pool->base = base;
+	pool->size = pool_size;
+	DEBUG_LOG("registered pool of %lu bytes\n", (unsigned long) pool_size);
+}
+
+/*
+ * The device of verbs, set up with the pool, memory kind and cache
+ * size of the first connection that comes along on it.
+ */
+static struct iperf_rdma_dev *iperf_get_dev(struct ibv_context *verbs,
+					    struct rdma_cb *cb)
+{
+	struct iperf_rdma_dev *dev;
+
+	pthread_mutex_lock(&iperf_devs_lock);
+	for (dev = iperf_devs; dev; dev = dev->next)
+		if (dev->verbs == verbs)
+			goto out;
+
+	dev = (struct iperf_rdma_dev *) calloc(1, sizeof *dev);
+	if (!dev)
+		goto out;
+	dev->verbs = verbs;
+	dev->pd = ibv_alloc_pd(verbs);
+	if (!dev->pd) {
+		fprintf(stderr, "ibv_alloc_pd failed\n");
+		free(dev);
+		dev = NULL;
+		goto out;
+	}
+	DEBUG_LOG("created pd %p on %s\n", dev->pd,
+		  ibv_get_device_name(verbs->device));
+	pthread_mutex_init(&dev->lock, NULL);
+	dev->numa_node = iperf_numa_node(verbs);
+	iperf_place_init(dev, cb->numa);
+	iperf_vec_init(dev);
+	iperf_pool_init(dev, cb->pool_size, cb->mem);
+	pthread_mutex_init(&dev->mrc.lock, NULL);
+	dev->mrc.cap = cb->mr_cache;
+
+	dev->next = iperf_devs;
+	iperf_devs = dev;
+out:
+	pthread_mutex_unlock(&iperf_devs_lock);
+	return dev;
+}
+
+
+/*
+ * Registration pool.
+ *
+ * Buffers are carved from the pool in power of two size classes and
+ * go back on a per class free list when a connection is done with
+ * them, so a connection that finds what it needs there costs no
+ * registration at all. Requests the pool cannot serve fall back to
+ * malloc and ibv_reg_mr of their own.
+ */
+
+static int iperf_pool_class(size_t len)
+{
+	int cls = IPERF_POOL_MIN_SHIFT;
+
+	while (((size_t) 1 << cls) < len)
+		cls++;
+	return cls;
+}
+
+static char *iperf_pool_get(struct iperf_pool *pool, size_t len)
+{
+	int cls = iperf_pool_class(len);
+	size_t clen = (size_t) 1 << cls, align, off;
+	char *buf = NULL;
+
+	if (!pool->mr || cls >= IPERF_POOL_CLASSES)
+		return NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->free[cls]) {
+		buf = (char *) pool->free[cls];
+		pool->free[cls] = *(void **) buf;
+	} else {
+		align = clen < IPERF_POOL_ALIGN ? clen : IPERF_POOL_ALIGN;
+		off = (pool->used + align - 1) & ~(align - 1);
+		if (off + clen <= pool->size) {
+			buf = pool->base + off;
+			pool->used = off + clen;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return buf;
+}
+
+static void iperf_pool_put(struct iperf_pool *pool, char *buf, size_t len)
+{
+	int cls = iperf_pool_class(len);
+
+	pthread_mutex_lock(&pool->lock);
+	*(void **) buf = pool->free[cls];
+	pool->free[cls] = buf;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Registration cache.
+ *
+ * With -X mrcache=N a region is not deregistered when its last user
+ * lets go of it: it stays in the device's cache, keyed by address
+ * range, until the idle regions add up to more than N bytes and the
+ * least recently used of them goes. A later registration that falls
+ * inside a cached range with the access it needs costs a list walk.
+ * Buffers iperf_reg_buf() allocated itself are kept with their
+ * memory, so the next connection asking for the same size and kind
+ * gets them back as they are.
+ */
+
+static void iperf_mrc_evict(struct iperf_mr_cache *mrc)
+{
+	struct iperf_mr_entry **pp, **lru;
+	struct iperf_mr_entry *e;
+
+	while (mrc->idle > mrc->cap) {
+		lru = NULL;
+		for (pp = &mrc->entries; *pp; pp = &(*pp)->next)
+			if ((*pp)->refs == 0 &&
+			    (!lru || (*pp)->last_use < (*lru)->last_use))
+				lru = pp;
+		if (!lru)
+			break;
+		e = *lru;
+		*lru = e->next;
+		mrc->idle -= e->len;
+		mrc->evictions++;
+		ibv_dereg_mr(e->mr);
+		if (e->mem >= 0)
+			iperf_mem_free(e->addr);
+		free(e);
+	}
+}
+
+/* deregister an idle range now, whatever room is left */
+static void iperf_mrc_drop(struct iperf_mr_cache *mrc, struct ibv_mr *mr)
+{
+	struct iperf_mr_entry **pp, *e;
+
+	pthread_mutex_lock(&mrc->lock);
+	for (pp = &mrc->entries; *pp; pp = &(*pp)->next) {
+		e = *pp;
+		if (e->mr == mr && e->refs == 0) {
+			*pp = e->next;
+			mrc->idle -= e->len;
+			ibv_dereg_mr(e->mr);
+			free(e);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&mrc->lock);
+}
+
+static struct iperf_mr_entry *iperf_mrc_insert(struct iperf_mr_cache *mrc,
+					       char *addr, size_t len,
+					       int access, int mem,
+					       int mem_got, struct ibv_mr *mr)
+{
+	struct iperf_mr_entry *e;
+
+	e = (struct iperf_mr_entry *) calloc(1, sizeof *e);
+	if (!e)
+		return NULL;
+	e->addr = addr;
+	e->len = len;
+	e->access = access;
+	e->mem = mem;
+	e->mem_got = mem_got;
+	e->mr = mr;
+	e->refs = 1;
+	pthread_mutex_lock(&mrc->lock);
+	e->last_use = ++mrc->tick;
+	e->next = mrc->entries;
+	mrc->entries = e;
+	pthread_mutex_unlock(&mrc->lock);
+	return e;
+}
+
+static void iperf_mrc_hold(struct iperf_mr_cache *mrc,
+			   struct iperf_mr_entry *e)
+{
+	if (e->refs++ == 0)
+		mrc->idle -= e->len;
+	e->last_use = ++mrc->tick;
+}
+
+/*
+ * Get an MR covering len bytes at addr with at least access rights,
+ * from the cache or by registering it.
+ */
+struct ibv_mr *iperf_mr_get(struct rdma_cb *cb, char *addr, size_t len,
+			    int access)
+{
+	struct iperf_mr_cache *mrc = &cb->dev->mrc;
+	struct iperf_mr_entry *e;
+	struct ibv_mr *mr;
+
+	pthread_mutex_lock(&mrc->lock);
+	for (e = mrc->entries; e; e = e->next) {
+		if (e->mem < 0 && e->addr <= addr &&
+		    addr + len <= e->addr + e->len &&
+		    (e->access & access) == access) {
+			iperf_mrc_hold(mrc, e);
+			pthread_mutex_unlock(&mrc->lock);
+			cb->mr_hits++;
+			return e->mr;
+		}
+	}
+	pthread_mutex_unlock(&mrc->lock);
+
+	mr = ibv_reg_mr(cb->pd, addr, len, access);
+	if (!mr)
+		return NULL;
+	cb->mr_misses++;
+	if (!iperf_mrc_insert(mrc, addr, len, access, -1, -1, mr)) {
+		ibv_dereg_mr(mr);
+		return NULL;
+	}
+	return mr;
+}
+
+/*
+ * Let go of an MR from iperf_mr_get() or a cached buffer. Returns -1
+ * if the cache does not know it.
+ */
+int iperf_mr_put(struct rdma_cb *cb, struct ibv_mr *mr)
+{
+	struct iperf_mr_cache *mrc = &cb->dev->mrc;
+	struct iperf_mr_entry *e;
+
+	pthread_mutex_lock(&mrc->lock);
+	for (e = mrc->entries; e; e = e->next)
+		if (e->mr == mr)
+			break;
+	if (e && --e->refs == 0) {
+		mrc->idle += e->len;
+		iperf_mrc_evict(mrc);
+	}
+	pthread_mutex_unlock(&mrc->lock);
+	return e ? 0 : -1;
+}
+
+/* a cached buffer of our own with exactly this size, access and kind */
+static char *iperf_mrc_get_buf(struct rdma_cb *cb, size_t len, int access,
+			       struct ibv_mr **mr, int *mem)
+{
+	struct iperf_mr_cache *mrc = &cb->dev->mrc;
+	struct iperf_mr_entry *e;
+	char *buf = NULL;
+
+	pthread_mutex_lock(&mrc->lock);
+	for (e = mrc->entries; e; e = e->next) {
+		if (e->refs == 0 && e->len == len && e->access == access &&
+		    e->mem == cb->mem) {
+			iperf_mrc_hold(mrc, e);
+			*mr = e->mr;
+			*mem = e->mem_got;
+			buf = e->addr;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&mrc->lock);
+	if (buf)
+		cb->mr_hits++;
+	return buf;
+}
+
+/*
+ * Time ibv_reg_mr and ibv_dereg_mr of a pre-faulted buffer of len
+ * bytes, at most IPERF_REG_ITERS times or for a second, and a cache
+ * hit on the same range for comparison.
+ */
+int iperf_reg_bench(struct rdma_cb *cb, size_t len, struct iperf_reg_stat *st)
+{
+	int access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ |
+		     IBV_ACCESS_REMOTE_WRITE;
+	double cpu = iperf_cycles_per_usec();
+	uint64_t t0, t1, t2, reg = 0, dereg = 0, end;
+	struct ibv_mr *mr, *held;
+	int mem = cb->mem, i;
+	char *buf;
+
+	buf = iperf_mem_alloc(len, &mem, cb->dev->node);
+	if (!buf)
+		return -ENOMEM;
+	memset(buf, 0, len);
+
+	end = iperf_cycles() + (uint64_t) (1000000 * cpu);
+	for (i = 0; i < IPERF_REG_ITERS && (i == 0 || iperf_cycles() < end);
+	     i++) {
+		t0 = iperf_cycles();
+		mr = ibv_reg_mr(cb->pd, buf, len, access);
+		t1 = iperf_cycles();
+		if (!mr) {
+			perror("ibv_reg_mr");
+			iperf_mem_free(buf);
+			return -1;
+		}
+		ibv_dereg_mr(mr);
+		t2 = iperf_cycles();
+		reg += t1 - t0;
+		dereg += t2 - t1;
+	}
+	st->iters = i;
+	st->reg_usec = reg / cpu / i;
+	st->dereg_usec = dereg / cpu / i;
+
+	/* hold one reference so the hits below never evict it */
+	held = iperf_mr_get(cb, buf, len, access);
+	if (!held) {
+		iperf_mem_free(buf);
+		return -1;
+	}
+	t0 = iperf_cycles();
+	for (i = 0; i < st->iters; i++) {
+		iperf_mr_get(cb, buf, len, access);
+		iperf_mr_put(cb, held);
+	}
+	st->hit_usec = (iperf_cycles() - t0) / cpu / st->iters;
+	iperf_mr_put(cb, held);
+
+	/* the cache may keep it: make sure it is gone with the buffer */
+	iperf_mrc_drop(&cb->dev->mrc, held);
+	iperf_mem_free(buf);
+	return 0;
+}
+
+/*
+ * Get a registered, zeroed buffer of len bytes, from the pool or the
+ * registration cache when it can, and account the time spent in
+ * cb->reg_usec.
+ */
+static char *iperf_reg_buf(struct rdma_cb *cb, size_t len, int access,
+			   struct ibv_mr **mr)
+{
+	unsigned long start = iperf_usec();
+	int mem = cb->mem;
+	char *buf = NULL;
+
+	/* the pool only serves buffers of the kind it was made of */
+	if (cb->mem == cb->dev->pool_mem)
+		buf = iperf_pool_get(&cb->dev->pool, len);
+	if (buf) {
+		*mr = cb->dev->pool.mr;
+		mem = cb->dev->pool_mem_got;
+		cb->buf_pooled++;
+	} else if (cb->dev->mrc.cap > 0 &&
+		   (buf = iperf_mrc_get_buf(cb, len, access, mr, &mem))) {
+		cb->buf_cached++;
+	} else {
+		buf = iperf_mem_alloc(len, &mem, cb->dev->node);
+		if (!buf) {
+			fprintf(stderr, "buffer malloc failed\n");
+			return NULL;
+		}
+		*mr = ibv_reg_mr(cb->pd, buf, len, access);
+		if (!*mr) {
+			fprintf(stderr, "buffer reg_mr failed\n");
+			iperf_mem_free(buf);
+			return NULL;
+		}
+		/* if the cache has no room to track it, it is just ours */
+		if (cb->dev->mrc.cap > 0 &&
+		    iperf_mrc_insert(&cb->dev->mrc, buf, len, access,
+				     cb->mem, mem, *mr))
+			cb->mr_misses++;
+		cb->buf_reg++;
+	}
+	if (mem < cb->mem_got)
+		cb->mem_got = mem;
+	memset(buf, 0, len);
+	cb->reg_usec += iperf_usec() - start;
+	return buf;
+}
+
+static void iperf_dereg_buf(struct rdma_cb *cb, char *buf, size_t len,
+			    struct ibv_mr *mr)
+{
+	if (!buf)
+		return;
+	if (mr == cb->dev->pool.mr) {
+		iperf_pool_put(&cb->dev->pool, buf, len);
+	} else if (iperf_mr_put(cb, mr) != 0) {
+		ibv_dereg_mr(mr);
+		iperf_mem_free(buf);
+	}
+}
+
+
+/*
+ * Shared completion queues.
+ *
+ * With -X cqs=N the server does not give every connection its own CQ
+ * and cq_thread. Instead each device gets N CQs spread over its
+ * completion vectors, each drained by one poller thread. Connections
+ * attach to the least loaded CQ. The poller finds the owner of each
+ * completion through the qp_num table and hands it over exactly as
+ * cq_thread would, so the data path does not see the difference.
+ */
+
+static struct rdma_cb **iperf_conn_slot(struct iperf_rdma_dev *dev,
+					uint32_t qp_num)
+{
+	struct rdma_cb **pp = &dev->conns[qp_num % IPERF_CONN_HASH];
+
+	while (*pp && (*pp)->qp_num != qp_num)
+		pp = &(*pp)->dev_next;
+	return pp;
+}
+
+static void iperf_wc_deliver(struct rdma_cb *cb, struct ibv_wc *wc)
+{
+	pthread_mutex_lock(&cb->wc_lock);
+	if (cb->wc_count < cb->wc_size) {
+		cb->wc_ring[(cb->wc_head + cb->wc_count) % cb->wc_size] = *wc;
+		cb->wc_count++;
+	} else {
+		fprintf(stderr, "completion ring overflow\n");
+		cb->state = ERROR;
+	}
+	pthread_mutex_unlock(&cb->wc_lock);
+}
+
+static void *iperf_cq_poller(void *arg)
+{
+	struct iperf_shared_cq *scq = arg;
+	struct iperf_rdma_dev *dev = scq->dev;
+	struct ibv_wc wc[IPERF_WC_BATCH];
+	struct rdma_cb *woken[IPERF_WC_BATCH], *cb;
+	struct ibv_cq *ev_cq;
+	void *ev_ctx;
+	int i, j, n, nwoken;
+
+	iperf_place_vec(dev, scq->vec);
+	while (1) {
+		if (ibv_get_cq_event(scq->channel, &ev_cq, &ev_ctx)) {
+			fprintf(stderr, "Failed to get cq event!\n");
+			pthread_exit(NULL);
+		}
+		ibv_ack_cq_events(scq->cq, 1);
+		if (ibv_req_notify_cq(scq->cq, 0)) {
+			fprintf(stderr, "Failed to set notify!\n");
+			pthread_exit(NULL);
+		}
+
+		while ((n = ibv_poll_cq(scq->cq, IPERF_WC_BATCH, wc)) > 0) {
+			nwoken = 0;
+			pthread_mutex_lock(&dev->lock);
+			for (i = 0; i < n; i++) {
+				cb = *iperf_conn_slot(dev, wc[i].qp_num);
+				if (cb == NULL)
+					continue;	/* already gone */
+				cb->cq_wcs++;
+				iperf_wc_deliver(cb, &wc[i]);
+				for (j = 0; j < nwoken && woken[j] != cb; j++)
+					;
+				if (j == nwoken)
+					woken[nwoken++] = cb;
+			}
+			/* one wakeup per connection per batch */
+			for (j = 0; j < nwoken; j++) {
+				woken[j]->cq_events++;
+				sem_post(&woken[j]->wc_sem);
+			}
+			pthread_mutex_unlock(&dev->lock);
+		}
+		if (n < 0)
+			fprintf(stderr, "poll error %d\n", n);
+	}
+	return NULL;
+}
+
+/*
+ * Create the shared CQs of a device, called with dev->lock held.
+ */
+static void iperf_create_shared_cqs(struct iperf_rdma_dev *dev, int ncq)
+{
+	struct ibv_context *verbs = dev->verbs;
+	struct ibv_device_attr attr;
+	struct iperf_shared_cq *scq;
+	int i;
+
+	if (ibv_query_device(verbs, &attr)) {
+		fprintf(stderr, "ibv_query_device failed\n");
+		return;
+	}
+	dev->cqs = (struct iperf_shared_cq *) calloc(ncq, sizeof *dev->cqs);
+	if (!dev->cqs)
+		return;
+
+	dev->max_cqe = attr.max_cqe;
+	for (i = 0; i < ncq; i++) {
+		scq = &dev->cqs[i];
+		scq->dev = dev;
+		scq->cqe = attr.max_cqe < IPERF_SHARED_CQE ?
+			   attr.max_cqe : IPERF_SHARED_CQE;
+		scq->channel = ibv_create_comp_channel(verbs);
+		if (!scq->channel) {
+			fprintf(stderr, "ibv_create_comp_channel failed\n");
+			break;
+		}
+		scq->vec = iperf_next_vec(dev);
+		scq->cq = ibv_create_cq(verbs, scq->cqe, dev, scq->channel,
+					scq->vec ? scq->vec->vector : 0);
+		if (!scq->cq) {
+			fprintf(stderr, "ibv_create_cq failed\n");
+			ibv_destroy_comp_channel(scq->channel);
+			break;
+		}
+		ibv_req_notify_cq(scq->cq, 0);
+		pthread_create(&scq->poller, NULL, iperf_cq_poller, scq);
+	}
+	dev->ncq = i;
+	if (dev->ncq == 0) {
+		free(dev->cqs);
+		dev->cqs = NULL;
+	}
+	DEBUG_LOG("%d shared cqs on %s\n", dev->ncq,
+		  ibv_get_device_name(verbs->device));
+}
+
+/*
+ * Grow a shared CQ so that it holds need entries, doubling up to the
+ * device's max_cqe. Called with dev->lock held; the poller keeps
+ * polling while the provider resizes.
+ */
+static int iperf_shared_cq_grow(struct iperf_rdma_dev *dev,
+				struct iperf_shared_cq *scq, int need)
+{
+	int cqe = scq->cqe;
+
+	while (cqe < need && cqe < dev->max_cqe)
+		cqe = cqe > dev->max_cqe / 2 ? dev->max_cqe : cqe * 2;
+	if (cqe < need)
+		return -1;
+	if (ibv_resize_cq(scq->cq, cqe)) {
+		perror("ibv_resize_cq");
+		return -1;
+	}
+	DEBUG_LOG("shared cq grown from %d to %d entries\n", scq->cqe, cqe);
+	scq->cqe = cqe;
+	return 0;
+}
+
+/*
+ * Reserve cqe entries on the least loaded shared CQ of the device,
+ * growing it when the connection does not fit.
+ */
+static int iperf_shared_cq_get(struct rdma_cb *cb, int cqe)
+{
+	struct iperf_rdma_dev *dev = cb->dev;
+	struct iperf_shared_cq *scq = NULL;
+	int i;
+
+	pthread_mutex_lock(&dev->lock);
+	if (!dev->cqs)
+		iperf_create_shared_cqs(dev, cb->shared_cqs);
+	for (i = 0; i < dev->ncq; i++)
+		if (!scq || dev->cqs[i].used < scq->used)
+			scq = &dev->cqs[i];
+	if (!scq || (scq->used + cqe > scq->cqe &&
+		     iperf_shared_cq_grow(dev, scq, scq->used + cqe))) {
+		pthread_mutex_unlock(&dev->lock);
+		fprintf(stderr, "shared cqs are full\n");
+		return -1;
+	}
+	scq->used += cqe;
+	pthread_mutex_unlock(&dev->lock);
+
+	cb->scq = scq;
+	cb->vec = scq->vec;
+	cb->cq = scq->cq;
+	cb->channel = scq->channel;
+	cb->cq_mode = IPERF_CQ_SHARED;
+	return 0;
+}
+
+/*
+ * Make completions of cb's QP reach it, or stop them from doing so.
+ */
+static void iperf_shared_cq_attach(struct rdma_cb *cb)
+{
+	struct rdma_cb **pp;
+
+	pthread_mutex_lock(&cb->dev->lock);
+	cb->qp_num = cb->qp->qp_num;
+	pp = iperf_conn_slot(cb->dev, cb->qp_num);
+	cb->dev_next = *pp;
+	*pp = cb;
+	pthread_mutex_unlock(&cb->dev->lock);
+}
+
+static void iperf_shared_cq_put(struct rdma_cb *cb, int cqe, int attached)
+{
+	struct rdma_cb **pp;
+
+	pthread_mutex_lock(&cb->dev->lock);
+	if (attached) {
+		pp = iperf_conn_slot(cb->dev, cb->qp_num);
+		if (*pp == cb)
+			*pp = cb->dev_next;
+	}
+	cb->scq->used -= cqe;
+	pthread_mutex_unlock(&cb->dev->lock);
+	cb->scq = NULL;
+}
+
+
+/*
+ * Give back the connection's CQ: its own is destroyed, a shared one
+ * only forgets about it.
+ */
+static void iperf_release_cq(struct rdma_cb *cb, int attached)
+{
+	if (cb->scq) {
+		iperf_shared_cq_put(cb, cb->wc_size, attached);
+	} else {
+		ibv_destroy_cq(cb->cq);
+		ibv_destroy_comp_channel(cb->channel);
+	}
+}
+
+/*
+ * Shared receive queue.
+ *
+ * With -X srq=N the server's QPs take their receives from one SRQ of N
+ * buffers per device instead of queues of their own, so receive memory
+ * stays the same however many clients connect. Buffers are the size of
+ * the server's -l. Completions still arrive on the CQ of the QP that
+ * consumed the receive; the context of an SRQ buffer has no cb.
+ */
+
+static int iperf_post_data_recv(struct rdma_cb *cb, struct iperf_wr *ctx);
+
+/*
+ * Create the SRQ of cb's device and fill it, called with dev->lock
+ * held. On failure the device has none and connections fall back to
+ * receive queues of their own.
+ */
+static void iperf_create_srq(struct rdma_cb *cb)
+{
+	struct iperf_rdma_dev *dev = cb->dev;
+	struct ibv_srq_init_attr init_attr;
+	struct ibv_device_attr attr;
+	int i, n = cb->srq_size;
+
+	if (ibv_query_device(dev->verbs, &attr)) {
+		fprintf(stderr, "ibv_query_device failed\n");
+		return;
+	}
+	if (n > attr.max_srq_wr)
+		n = attr.max_srq_wr;
+
+	dev->srq_ctx = (struct iperf_wr *) calloc(n, sizeof(struct iperf_wr));
+	if (!dev->srq_ctx)
+		return;
+	dev->srq_buf = iperf_reg_buf(cb, (size_t) n * cb->size,
+				     IBV_ACCESS_LOCAL_WRITE, &dev->srq_mr);
+	if (!dev->srq_buf)
+		goto err1;
+
+	memset(&init_attr, 0, sizeof init_attr);
+	init_attr.attr.max_wr = n;
+	init_attr.attr.max_sge = 1;
+	dev->srq = ibv_create_srq(dev->pd, &init_attr);
+	if (!dev->srq) {
+		fprintf(stderr, "ibv_create_srq failed\n");
+		goto err2;
+	}
+	dev->srq_size = n;
+	dev->srq_len = cb->size;
+
+	for (i = 0; i < n; i++) {
+		dev->srq_ctx[i].type = IPERF_WR_DATA;
+		dev->srq_ctx[i].slot = i;
+		if (iperf_post_data_recv(cb, &dev->srq_ctx[i]))
+			break;
+	}
+	DEBUG_LOG("srq of %d x %d bytes on %s\n", n, cb->size,
+		  ibv_get_device_name(dev->verbs->device));
+	return;
+
+err2:
+	iperf_dereg_buf(cb, dev->srq_buf, (size_t) n * cb->size, dev->srq_mr);
+	dev->srq_buf = NULL;
+err1:
+	free(dev->srq_ctx);
+	dev->srq_ctx = NULL;
+}
+
+/*
+ * Hand a data buffer back: an SRQ buffer to the device's SRQ, a ring
+ * slot to the connection's own receive queue.
+ */
+static int iperf_post_data_recv(struct rdma_cb *cb, struct iperf_wr *ctx)
+{
+	struct iperf_rdma_dev *dev = cb->dev;
+	struct ibv_recv_wr wr, *bad_wr;
+	struct ibv_sge sge;
+	int ret;
+
+	memset(&wr, 0, sizeof wr);
+	wr.wr_id = (uint64_t) (unsigned long) ctx;
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+
+	if (ctx->cb == NULL) {
+		sge.addr = (uint64_t) (unsigned long)
+			   (dev->srq_buf + (size_t) ctx->slot * dev->srq_len);
+		sge.length = dev->srq_len;
+		sge.lkey = dev->srq_mr->lkey;
+		__sync_fetch_and_add(&dev->srq_posted, 1);
+		ret = ibv_post_srq_recv(dev->srq, &wr, &bad_wr);
+	} else {
+		sge.addr = (uint64_t) (unsigned long) cb->ring[ctx->slot].buf;
+		sge.length = cb->size;
+		sge.lkey = cb->rdma_mr->lkey;
+		cb->recv_posted++;
+		ret = ibv_post_recv(cb->qp, &wr, &bad_wr);
+	}
+	if (ret)
+		fprintf(stderr, "post recv error %d\n", ret);
+	return ret;
+}
+
+/*
+ * Read one of the device's hardware counters, -1 if it has none by
+ * that name. mlx5 counts the RNR NAKs a requester got as
+ * rnr_nak_retry_err and the messages a responder had no receive for
+ * as out_of_buffer.
+ */
+static long iperf_hw_counter(struct rdma_cm_id *cm_id, const char *name)
+{
+	char path[256];
+	long val = -1;
+	FILE *f;
+
+	snprintf(path, sizeof path,
+		 "/sys/class/infiniband/%s/ports/%d/hw_counters/%s",
+		 ibv_get_device_name(cm_id->verbs->device),
+		 cm_id->port_num, name);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (fscanf(f, "%ld", &val) != 1)
+		val = -1;
+	fclose(f);
+	return val;
+}
+
+static const char *iperf_rnr_counter(struct rdma_cb *cb)
+{
+	return cb->server ? "out_of_buffer" : "rnr_nak_retry_err";
+}
+
+/*
+ * RNR NAKs the device sent (server) or received (client) since the
+ * connection was set up, -1 if it does not count them. The counters
+ * are per port, so other connections on it show up as well.
+ */
+long iperf_rnr_count(struct rdma_cb *cb)
+{
+	long now;
+
+	if (cb->rnr_base < 0)
+		return -1;
+	now = iperf_hw_counter(cb->server ? cb->child_cm_id : cb->cm_id,
+			       iperf_rnr_counter(cb));
+	return now < 0 ? -1 : now - cb->rnr_base;
+}
+
+
+// setup queue pair
+int iperf_setup_qp(struct rdma_cb *cb, struct rdma_cm_id *cm_id)
+{
+	struct ibv_device_attr attr;
+	struct ibv_port_attr pattr;
+	unsigned long start = iperf_usec();
+	int ret, cqe;
+
+	/*
+	 * Size the pipeline to what the device can hold: every slot may
+	 * have its RDMA ops (one per chunk) and a message in flight on
+	 * the send queue, plus one receive, and one of each extra for FIN.
+	 */
+	ret = ibv_query_device(cm_id->verbs, &attr);
+	if (ret) {
+		fprintf(stderr, "ibv_query_device failed\n");
+		return ret;
+	}
+
+	/* no WR may be larger than the port allows, or than -X chunk */
+	if (cb->chunk == 0)
+		cb->chunk = IPERF_MAX_CHUNK;
+	if (ibv_query_port(cm_id->verbs, cm_id->port_num, &pattr) == 0 &&
+	    pattr.max_msg_sz > 0 && cb->chunk > pattr.max_msg_sz)
+		cb->chunk = pattr.max_msg_sz;
+	cb->chunks = cb->server ? 1 :
+		     (int) (((uint64_t) cb->size + cb->chunk - 1) / cb->chunk);
+	if (cb->chunks < 1)
+		cb->chunks = 1;
+	if (cb->nsge > attr.max_sge)
+		cb->nsge = attr.max_sge;
+	if (cb->nsge > IPERF_MAX_SGE)
+		cb->nsge = IPERF_MAX_SGE;
+	if (cb->nsge < 1 || cb->server)
+		cb->nsge = 1;
+
+	if (cb->depth <= 0)
+		cb->depth = IPERF_RDMA_DEF_DEPTH;
+	if (cb->depth > (attr.max_qp_wr - 1) / (cb->chunks + 1))
+		cb->depth = (attr.max_qp_wr - 1) / (cb->chunks + 1);
+	if (cb->depth > (attr.max_cqe - 2) / (cb->chunks + 2))
+		cb->depth = (attr.max_cqe - 2) / (cb->chunks + 2);
+	cb->rd_atom = cb->depth < attr.max_qp_rd_atom ?
+		      cb->depth : attr.max_qp_rd_atom;
+	cb->init_rd_atom = cb->depth < attr.max_qp_init_rd_atom ?
+			   cb->depth : attr.max_qp_init_rd_atom;
+	DEBUG_LOG("pipeline depth %d, rd_atom %d, init_rd_atom %d\n",
+		  cb->depth, cb->rd_atom, cb->init_rd_atom);
+
+	cb->dev = iperf_get_dev(cm_id->verbs, cb);
+	if (!cb->dev)
+		return -ENOMEM;
+	/* the data thread, before it allocates anything for the QP */
+	if (!cb->pinned)
+		iperf_place_self(cb->dev);
+	cb->pd = cb->dev->pd;
+	cb->mem_got = cb->mem;
+
+	if (cb->server && cb->srq_size > 0) {
+		pthread_mutex_lock(&cb->dev->lock);
+		if (!cb->dev->srq && !cb->dev->srq_ctx)
+			iperf_create_srq(cb);
+		pthread_mutex_unlock(&cb->dev->lock);
+		cb->srq = cb->dev->srq;
+	}
+
+	cqe = (cb->chunks + 2) * cb->depth + 2;
+	if (cb->shared_cqs > 0) {
+		ret = iperf_shared_cq_get(cb, cqe);
+		if (ret)
+			goto err1;
+	} else {
+		cb->channel = ibv_create_comp_channel(cm_id->verbs);
+		if (!cb->channel) {
+			fprintf(stderr, "ibv_create_comp_channel failed\n");
+			ret = errno;
+			goto err1;
+		}
+		DEBUG_LOG("created channel %p\n", cb->channel);
+
+		/* spread over the device's vectors, see iperf_next_vec() */
+		cb->vec = iperf_next_vec(cb->dev);
+		cb->cq = ibv_create_cq(cm_id->verbs, cqe, cb, cb->channel,
+				       cb->vec ? cb->vec->vector : 0);
+		if (!cb->cq) {
+			fprintf(stderr, "ibv_create_cq failed\n");
+			ret = errno;
+			ibv_destroy_comp_channel(cb->channel);
+			goto err1;
+		}
+		DEBUG_LOG("created cq %p\n", cb->cq);
+	}
+
+	cb->wc_ring = (struct ibv_wc *) malloc(cqe * sizeof(struct ibv_wc));
+	if (!cb->wc_ring) {
+		fprintf(stderr, "wc_ring malloc failed\n");
+		ret = -ENOMEM;
+		goto err2;
+	}
+	cb->wc_size = cqe;
+	cb->wc_head = cb->wc_count = 0;
+	
+	if (cb->cq_mode == IPERF_CQ_EVENT || cb->cq_mode == IPERF_CQ_WORKER) {
+		DEBUG_LOG("before ibv_req_notify_cq\n");
+		ret = ibv_req_notify_cq(cb->cq, 0);
+		if (ret) {
+			fprintf(stderr, "ibv_create_cq failed\n");
+			ret = errno;
+			goto err3;
+		}
+	}
+	if (cb->cq_spin <= 0)
+		cb->cq_spin = IPERF_CQ_SPIN;
+	if (cb->signal <= 0)
+		cb->signal = 1;
+	if (cb->batch <= 0)
+		cb->batch = 1;
+
+	DPRINTF(("before iperf_create_qp\n"));
+	ret = iperf_create_qp(cb);
+	if (ret) {
+		perror("rdma_create_qp");
+		goto err3;
+	}
+	DEBUG_LOG("created qp %p\n", cb->qp);
+
+	if (cb->scq)
+		iperf_shared_cq_attach(cb);
+	cb->rnr_base = iperf_hw_counter(cm_id, iperf_rnr_counter(cb));
+	cb->setup_usec += iperf_usec() - start;
+	return 0;
+
+err3:
+	free(cb->wc_ring);
+	cb->wc_ring = NULL;
+err2:
+	iperf_release_cq(cb, 0);
+err1:
+	return ret;
+}
+
+
+int iperf_create_qp(struct rdma_cb *cb)
+{
+	struct ibv_qp_init_attr init_attr;
+	struct rdma_cm_id *id;
+	int ret;
+
+	memset(&init_attr, 0, sizeof(init_attr));
+	init_attr.cap.max_send_wr = (cb->chunks + 1) * cb->depth + 1;
+	init_attr.cap.max_recv_wr = cb->depth + 1;
+	init_attr.cap.max_recv_sge = 2;
+	init_attr.cap.max_send_sge = cb->nsge;
+	init_attr.qp_type = IBV_QPT_RC;
+	init_attr.send_cq = cb->cq;
+	init_attr.recv_cq = cb->cq;
+	init_attr.srq = cb->srq;
+	/*
+	 * Message rate: inline as much as the device lets us. There is
+	 * no attribute telling how much that is, so halve until the QP
+	 * can be created.
+	 */
+	init_attr.cap.max_inline_data = cb->rate ? IPERF_RATE_INLINE : 0;
+
+	DPRINTF(("before rdma_create_qp\n"));
+	DPRINTF(("cb->server: %d\n", cb->server));
+	id = cb->server ? cb->child_cm_id : cb->cm_id;
+	while ((ret = rdma_create_qp(id, cb->pd, &init_attr)) &&
+	       init_attr.cap.max_inline_data > 0)
+		init_attr.cap.max_inline_data /= 2;
+	if (!ret) {
+		cb->qp = id->qp;
+		cb->max_inline = init_attr.cap.max_inline_data;
+	}
+	DPRINTF(("after rdma_create_qp, ret = %d\n", ret));
+
+	return ret;
+}
+
+static void iperf_ud_free(struct rdma_cb *cb);
+
+void iperf_free_qp(struct rdma_cb *cb)
+{
+	unsigned long start = iperf_usec();
+
+	iperf_ud_free(cb);
+	ibv_destroy_qp(cb->qp);
+	iperf_release_cq(cb, 1);
+	free(cb->wc_ring);
+	cb->wc_ring = NULL;
+	cb->teardown_usec += iperf_usec() - start;
+}
+
+
+/*
+ * Register the control messages. The client also sets up its ring
+ * here; the server waits for the first advertisement to learn the
+ * buffer size and granted depth, see iperf_setup_ring().
+ */
+int iperf_setup_buffers(struct rdma_cb *cb)
+{
+	unsigned long start = iperf_usec();
+	int i, ret, nwr, nmsg = cb->depth + 1;
+
+	DEBUG_LOG("rping_setup_buffers called on cb %p\n", cb);
+
+	cb->recv_ctx = (struct iperf_wr *) \
+		calloc(nmsg, sizeof(struct iperf_wr));
+	if (!cb->recv_ctx) {
+		fprintf(stderr, "recv_ctx malloc failed\n");
+		return -ENOMEM;
+	}
+
+	cb->msg_buf = (struct iperf_rdma_info *) \
+		iperf_reg_buf(cb, 2 * nmsg * sizeof(struct iperf_rdma_info),
+			      IBV_ACCESS_LOCAL_WRITE, &cb->msg_mr);
+	if (!cb->msg_buf) {
+		ret = -ENOMEM;
+		goto err1;
+	}
+
+	for (i = 0; i < nmsg; i++) {
+		cb->recv_ctx[i].cb = cb;
+		cb->recv_ctx[i].type = IPERF_WR_RECV;
+		cb->recv_ctx[i].slot = i;
+	}
+	cb->ctrl_ctx.cb = cb;
+	cb->ctrl_ctx.type = IPERF_WR_SEND;
+	cb->ctrl_ctx.slot = cb->depth;
+	cb->flush_ctx.cb = cb;
+	cb->flush_ctx.type = IPERF_WR_RDMA;
+	cb->flush_ctx.slot = -1;
+
+	if (!cb->server) {
+		/* WRs for every chunk of every slot, and one to flush */
+		nwr = cb->depth * cb->chunks + 1;
+		cb->pend_wr = (struct ibv_send_wr *) \
+			calloc(nwr, sizeof(struct ibv_send_wr));
+		cb->pend_sge = (struct ibv_sge *) \
+			calloc(nwr * cb->nsge, sizeof(struct ibv_sge));
+		if (!cb->pend_wr || !cb->pend_sge) {
+			fprintf(stderr, "pending WR malloc failed\n");
+			ret = -ENOMEM;
+			goto err2;
+		}
+		ret = iperf_setup_ring(cb, cb->depth, cb->size);
+		if (ret)
+			goto err2;
+	}
+
+	DEBUG_LOG("allocated & registered buffers...\n");
+	cb->setup_usec += iperf_usec() - start;
+	return 0;
+
+err2:
+	free(cb->pend_wr);
+	free(cb->pend_sge);
+	cb->pend_wr = NULL;
+	cb->pend_sge = NULL;
+	iperf_dereg_buf(cb, (char *) cb->msg_buf,
+			2 * nmsg * sizeof(struct iperf_rdma_info), cb->msg_mr);
+	cb->msg_buf = NULL;
+err1:
+	free(cb->recv_ctx);
+	cb->recv_ctx = NULL;
+	return ret;
+}
+
+
+static void iperf_free_ring(struct rdma_cb *cb);
+
+/*
+ * Get one registered region of depth * size bytes and slice it into
+ * the ring, so a whole pipeline costs at most a single registration.
+ *
+ * With nsge > 1 each slot is spread over nsge regions registered on
+ * their own instead: piece j of every slot lives in region j, the
+ * first of which is rdma_buf, and slot->buf points at piece 0. See
+ * cli_slot_gather().
+ */
+int iperf_setup_ring(struct rdma_cb *cb, int depth, int size)
+{
+	unsigned long start = iperf_usec();
+	int i, piece = size;
+
+	cb->ring = (struct iperf_slot *) calloc(depth, sizeof(struct iperf_slot));
+	if (!cb->ring) {
+		fprintf(stderr, "ring malloc failed\n");
+		return -ENOMEM;
+	}
+
+	if (cb->nsge > 1)
+		piece = (size + cb->nsge - 1) / cb->nsge;
+	cb->sge_len = piece;
+
+	cb->rdma_buf = iperf_reg_buf(cb, (size_t) depth * piece,
+				     IBV_ACCESS_LOCAL_WRITE |
+				     IBV_ACCESS_REMOTE_READ |
+				     IBV_ACCESS_REMOTE_WRITE, &cb->rdma_mr);
+	if (!cb->rdma_buf) {
+		free(cb->ring);
+		cb->ring = NULL;
+		return -ENOMEM;
+	}
+	cb->sge_buf[0] = cb->rdma_buf;
+	cb->sge_mr[0] = cb->rdma_mr;
+	for (i = 1; i < cb->nsge; i++) {
+		cb->sge_buf[i] = iperf_reg_buf(cb, (size_t) depth * piece,
+					       IBV_ACCESS_LOCAL_WRITE,
+					       &cb->sge_mr[i]);
+		if (!cb->sge_buf[i]) {
+			cb->ring_depth = depth;
+			iperf_free_ring(cb);
+			return -ENOMEM;
+		}
+	}
+
+	for (i = 0; i < depth; i++) {
+		cb->ring[i].buf = cb->rdma_buf + (size_t) i * piece;
+		cb->ring[i].rdma_ctx.cb = cb;
+		cb->ring[i].rdma_ctx.type = IPERF_WR_RDMA;
+		cb->ring[i].rdma_ctx.slot = i;
+		cb->ring[i].send_ctx.cb = cb;
+		cb->ring[i].send_ctx.type = IPERF_WR_SEND;
+		cb->ring[i].send_ctx.slot = i;
+	}
+	cb->size = size;
+	cb->ring_depth = depth;
+	cb->next_slot = 0;
+	cb->outstanding = 0;
+
+	DEBUG_LOG("ring of %d x %d bytes registered\n", depth, size);
+	cb->setup_usec += iperf_usec() - start;
+	return 0;
+}
+
+
+static void iperf_free_ring(struct rdma_cb *cb)
+{
+	int i;
+
+	for (i = 1; i < cb->nsge; i++) {
+		iperf_dereg_buf(cb, cb->sge_buf[i],
+				(size_t) cb->ring_depth * cb->sge_len,
+				cb->sge_mr[i]);
+		cb->sge_buf[i] = NULL;
+	}
+	iperf_dereg_buf(cb, cb->rdma_buf,
+			(size_t) cb->ring_depth * cb->sge_len, cb->rdma_mr);
+	free(cb->ring);
+	cb->rdma_mr = NULL;
+	cb->rdma_buf = NULL;
+	cb->ring = NULL;
+}
+
+/*
+ * Rebuild a drained ring out of another kind of memory, for -X
+ * mem=compare. Slots carry their own address, so the peer needs no
+ * word of it.
+ */
+int iperf_remap_ring(struct rdma_cb *cb, int mem)
+{
+	int depth = cb->ring_depth, size = cb->size;
+
+	if (cb->outstanding)
+		return -EBUSY;
+	iperf_free_ring(cb);
+	cb->mem = cb->mem_got = mem;
+	return iperf_setup_ring(cb, depth, size);
+}
+
+void iperf_free_buffers(struct rdma_cb *cb)
+{
+	unsigned long start = iperf_usec();
+
+	DEBUG_LOG("rping_free_buffers called on cb %p\n", cb);
+	iperf_dereg_buf(cb, (char *) cb->msg_buf,
+			2 * (cb->depth + 1) * sizeof(struct iperf_rdma_info),
+			cb->msg_mr);
+	free(cb->recv_ctx);
+	free(cb->pend_wr);
+	free(cb->pend_sge);
+	free(cb->atomic_seen);
+	/* writes still in flight point into the ring */
+	iperf_disk_close(&cb->disk);
+	if (cb->rdma_buf)
+		iperf_free_ring(cb);
+	cb->msg_buf = NULL;
+	cb->recv_ctx = NULL;
+	cb->atomic_seen = NULL;
+	cb->pend_wr = NULL;
+	cb->pend_sge = NULL;
+	cb->teardown_usec += iperf_usec() - start;
+}
+
+
+static int iperf_post_recv(struct rdma_cb *cb, int idx)
+{
+	struct ibv_recv_wr wr, *bad_wr;
+	struct ibv_sge sge[2];
+
+	/* everything lands in the device's SRQ */
+	if (cb->srq)
+		return 0;
+
+	sge[0].addr = (uint64_t) (unsigned long) &cb->msg_buf[idx];
+	sge[0].length = sizeof(struct iperf_rdma_info);
+	sge[0].lkey = cb->msg_mr->lkey;
+
+	memset(&wr, 0, sizeof wr);
+	wr.wr_id = (uint64_t) (unsigned long) &cb->recv_ctx[idx];
+	wr.sg_list = sge;
+	wr.num_sge = 1;
+
+	/* pings are bigger than a message, the rest lands in slot 1 */
+	if (cb->trans_mode == kRdmaTrans_LatSend && cb->ring) {
+		sge[1].addr = (uint64_t) (unsigned long) cb->ring[1].buf;
+		sge[1].length = cb->size;
+		sge[1].lkey = cb->rdma_mr->lkey;
+		wr.num_sge = 2;
+	}
+
+	return ibv_post_recv(cb->qp, &wr, &bad_wr);
+}
+
+/*
+ * Post a receive for every control message slot. Must be done before
+ * connecting so the peer never runs into an empty receive queue. The
+ * server only posts the first one: until it has answered, the client
+ * sends nothing else, and what the others look like depends on the
+ * mode the first message asks for, see svr_handle_recv().
+ */
+int iperf_post_recvs(struct rdma_cb *cb)
+{
+	int i, ret;
+
+	for (i = 0; i <= (cb->server ? 0 : cb->depth); i++) {
+		ret = iperf_post_recv(cb, i);
+		if (ret) {
+			fprintf(stderr, "post recv error %d\n", ret);
+			return ret;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Send the message at index idx of the send half of msg_buf.
+ */
+static int iperf_post_msg(struct rdma_cb *cb, int idx, struct iperf_wr *ctx)
+{
+	struct ibv_send_wr wr, *bad_wr;
+	struct ibv_sge sge;
+	int ret;
+
+	sge.addr = (uint64_t) (unsigned long) &cb->msg_buf[cb->depth + 1 + idx];
+	sge.length = sizeof(struct iperf_rdma_info);
+	sge.lkey = cb->msg_mr->lkey;
+
+	memset(&wr, 0, sizeof wr);
+	wr.wr_id = (uint64_t) (unsigned long) ctx;
+	wr.opcode = IBV_WR_SEND;
+	wr.send_flags = IBV_SEND_SIGNALED;
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+
+	ret = ibv_post_send(cb->qp, &wr, &bad_wr);
+	if (ret)
+		fprintf(stderr, "post send error %d\n", ret);
+	return ret;
+}
+
+static struct iperf_rdma_info *iperf_send_msg(struct rdma_cb *cb, int idx)
+{
+	return &cb->msg_buf[cb->depth + 1 + idx];
+}
+
+
+/*
+ * Fill in a signaled RDMA READ, WRITE or SEND of len bytes at buf.
+ */
+static void iperf_build_wr(struct rdma_cb *cb, struct ibv_send_wr *wr,
+			   struct ibv_sge *sge, struct iperf_wr *ctx,
+			   char *buf, uint32_t len, enum ibv_wr_opcode opcode,
+			   uint64_t remote_addr, uint32_t rkey)
+{
+	sge->addr = (uint64_t) (unsigned long) buf;
+	sge->length = len;
+	sge->lkey = cb->rdma_mr->lkey;
+
+	memset(wr, 0, sizeof *wr);
+	wr->wr_id = (uint64_t) (unsigned long) ctx;
+	wr->opcode = opcode;
+	wr->send_flags = IBV_SEND_SIGNALED;
+	wr->sg_list = sge;
+	wr->num_sge = len ? 1 : 0;
+	wr->wr.rdma.rkey = rkey;
+	wr->wr.rdma.remote_addr = remote_addr;
+	if (opcode == IBV_WR_SEND_WITH_IMM ||
+	    opcode == IBV_WR_RDMA_WRITE_WITH_IMM)
+		wr->imm_data = htonl(ctx->slot);
+
+	/* small enough to be copied into the WQE, no DMA read needed */
+	if (opcode != IBV_WR_RDMA_READ && cb->max_inline > 0 &&
+	    len <= (uint32_t) cb->max_inline)
+		wr->send_flags |= IBV_SEND_INLINE;
+}
+
+/*
+ * Post a signaled RDMA READ, WRITE or SEND of one whole slot.
+ */
+static int iperf_post_rdma(struct rdma_cb *cb, struct iperf_slot *slot,
+			   enum ibv_wr_opcode opcode, uint64_t remote_addr,
+			   uint32_t rkey)
+{
+	struct ibv_send_wr wr, *bad_wr;
+	struct ibv_sge sge;
+	int ret;
+
+	iperf_build_wr(cb, &wr, &sge, &slot->rdma_ctx, slot->buf, slot->len,
+		       opcode, remote_addr, rkey);
+
+	ret = ibv_post_send(cb->qp, &wr, &bad_wr);
+	if (ret)
+		fprintf(stderr, "post send error %d\n", ret);
+	return ret;
+}
+
+
+static void cli_take_info(struct rdma_cb *cb, struct iperf_rdma_info *info);
+
+/*
+ * Connect with our first message in the request's private data. A
+ * server that knows about it answers in the accept's, see
+ * svr_accept_info(), and the message exchange after connecting is
+ * skipped; one that does not ignores it and gets the message later.
+ */
+int rdma_connect_client(struct rdma_cb *cb)
+{
+	struct rdma_conn_param conn_param;
+	int ret;
+
+	cb->conn_pdata.magic = htonl(IPERF_PDATA_MAGIC);
+	if (iperf_is_latency(cb))
+		iperf_format_send(cb, &cb->conn_pdata.info, cb->rdma_buf,
+				  cb->rdma_mr->rkey, cb->size, cb->depth);
+	else
+		iperf_format_send(cb, &cb->conn_pdata.info, NULL, 0,
+				  cb->size, cb->depth);
+
+	memset(&conn_param, 0, sizeof conn_param);
+	conn_param.responder_resources = cb->rd_atom;
+	conn_param.initiator_depth = cb->init_rd_atom;
 	conn_param.retry_count = 10;
+	conn_param.private_data = &cb->conn_pdata;
+	conn_param.private_data_len = sizeof cb->conn_pdata;
+	/* a send may find the server's receives used up, retry forever */
+	if (cb->trans_mode == kRdmaTrans_SendRecv)
+		conn_param.rnr_retry_count = 7;
+
+	ret = rdma_connect(cb->cm_id, &conn_param);
+	if (ret) {
+		perror("rdma_connect");
+		return ret;
+	}
+
+	sem_wait(&cb->sem);
+	if (cb->state != CONNECTED) {
+		fprintf(stderr, "wait for CONNECTED state %d\n", cb->state);
+		return -1;
+	}
+
+	if (cb->accept_pdata.magic == htonl(IPERF_PDATA_MAGIC)) {
+		DEBUG_LOG("server answered in the accept\n");
+		cli_take_info(cb, &cb->accept_pdata.info);
+	}
+	DEBUG_LOG("rdma_connect successful\n");
+	return 0;
+}
+
+
+/*
+ * Accept the connection request, without waiting for it to be
+ * established; a worker learns that from its CM channel.
+ */
+int iperf_accept_post(struct rdma_cb *cb)
+{
+	struct rdma_conn_param conn_param;
+	int ret;
+
+	DEBUG_LOG("accepting client connection request\n");
+
+	/*
+	 * Never promise more outstanding RDMA READs than the client
+	 * asked for in its connect request, nor more than we can take.
+	 */
+	memset(&conn_param, 0, sizeof conn_param);
+	conn_param.responder_resources = \
+		cb->rd_atom < cb->peer_init_rd_atom ?
+		cb->rd_atom : cb->peer_init_rd_atom;
+	conn_param.initiator_depth = \
+		cb->init_rd_atom < cb->peer_rd_atom ?
+		cb->init_rd_atom : cb->peer_rd_atom;
+	if (cb->accept_pdata.magic == htonl(IPERF_PDATA_MAGIC)) {
+		conn_param.private_data = &cb->accept_pdata;
+		conn_param.private_data_len = sizeof cb->accept_pdata;
+	}
+
+	DPRINTF(("tid %ld, child_cm_id %p\n", pthread_self(), cb->child_cm_id));
+
+	ret = rdma_accept(cb->child_cm_id, &conn_param);
+	if (ret)
+		perror("rdma_accept");
+	return ret;
+}
+
+int iperf_accept(struct rdma_cb *cb)
+{
+	int ret;
+
+	ret = iperf_accept_post(cb);
+	if (ret)
+		return ret;
+
+	sem_wait(&cb->sem);
+	if (cb->state == ERROR) {
+		fprintf(stderr, "wait for CONNECTED state %d\n", cb->state);
+		return -1;
+	}
+	DPRINTF(("iperf_accept finish with state %d\n", cb->state));
+	return 0;
+}
+
+
+void iperf_format_send(struct rdma_cb *cb, struct iperf_rdma_info *info,
+		       char *buf, uint32_t rkey, uint32_t size, int slot)
+{
+	info->buf = htonll((uint64_t) (unsigned long) buf);
+	info->rkey = htonl(rkey);
+	info->size = htonl(size);
+	info->slot = htonl(slot);
+	info->depth = htonl(cb->granted ? cb->granted : cb->depth);
+	
+	switch ( cb->trans_mode ) {
+	case kRdmaTrans_ActRead:
+		info->mode = htonl(MODE_RDMA_ACTRD);
+		break;
+	case kRdmaTrans_ActWrte:
+		info->mode = htonl(MODE_RDMA_ACTWR);
+		break;
+	case kRdmaTrans_PasRead:
+		info->mode = htonl(MODE_RDMA_PASRD);
+		break;
+	case kRdmaTrans_PasWrte:
+		info->mode = htonl(MODE_RDMA_PASWR);
+		break;
+	case kRdmaTrans_LatWrite:
+		info->mode = htonl(MODE_RDMA_LATWR);
+		break;
+	case kRdmaTrans_LatSend:
+		info->mode = htonl(MODE_RDMA_LATSN);
+		break;
+	case kRdmaTrans_LatRead:
+		info->mode = htonl(MODE_RDMA_LATRD);
+		break;
+	case kRdmaTrans_SendRecv:
+		info->mode = htonl(MODE_RDMA_SNDRCV);
+		break;
+	case kRdmaTrans_FetchAdd:
+		info->mode = htonl(MODE_RDMA_FADD);
+		break;
+	case kRdmaTrans_CmpSwap:
+		info->mode = htonl(MODE_RDMA_CSWP);
+		break;
+	case kRdmaTrans_CreditWrite:
+		info->mode = htonl(MODE_RDMA_CRDWR);
+		break;
+	case kRdmaTrans_Connect:
+		info->mode = htonl(MODE_RDMA_CONN);
+		break;
+	case kRdmaTrans_Datagram:
+		info->mode = htonl(MODE_RDMA_UD);
+		break;
+	default:
+		fprintf(stderr, "unrecognize transfer mode %d\n", \
+			cb->trans_mode);
+		break;
+	}
+
+	DEBUG_LOG("RDMA addr %" PRIx64" rkey %x len %d slot %d\n",
+		  ntohll(info->buf), ntohl(info->rkey), ntohl(info->size),
+		  slot);
+}
+
+
+static int iperf_wc_error(struct rdma_cb *cb, struct ibv_wc *wc)
+{
+	// IBV_WC_WR_FLUSH_ERR == 5, the peer went away
+	if (wc->status == IBV_WC_WR_FLUSH_ERR) {
+		DEBUG_LOG("flushed completion\n");
+	} else if (wc->status == IBV_WC_RNR_RETRY_EXC_ERR) {
+		fprintf(stderr, "receiver not ready, RNR retries exhausted\n");
+	} else {
+		fprintf(stderr, "cq completion failed status %d\n",
+			wc->status);
+	}
+	cb->state = ERROR;
+	return -1;
+}
+
+static int iperf_is_active(struct rdma_cb *cb)
+{
+	return cb->trans_mode == kRdmaTrans_ActRead ||
+	       cb->trans_mode == kRdmaTrans_ActWrte;
+}
+
+int iperf_is_latency(struct rdma_cb *cb)
+{
+	return cb->trans_mode == kRdmaTrans_LatWrite ||
+	       cb->trans_mode == kRdmaTrans_LatSend ||
+	       cb->trans_mode == kRdmaTrans_LatRead;
+}
+
+
+static int lat_drain(struct rdma_cb *cb);
+static int atomic_drain(struct rdma_cb *cb);
+static int cli_ud_drain(struct rdma_cb *cb);
+static int svr_pas_rdma_xfer(struct rdma_cb *cb);
+static int svr_atomic_setup(struct rdma_cb *cb, struct iperf_wr *ctx);
+
+
+/*
+ * Client side of the pipelined ring.
+ *
+ * Passive modes (pr/pw): each free slot is advertised to the server
+ * with one SEND; the server moves the data with RDMA READ or WRITE and
+ * acknowledges the slot with a SEND of its own. The first
+ * advertisement goes alone and carries the requested depth, the server
+ * answers with the depth it granted.
+ *
+ * Active modes (ac/aw): the server advertises one region of granted
+ * slots once, see cli_act_rdma_start(). The client then READs/WRITEs
+ * slot i of its ring from/to slot i of that region and the server CPU
+ * is not involved until FIN.
+ *
+ * Credit writes (cw): the server advertises its region the same way,
+ * but the client WRITEs slot i with immediate data naming i, so the
+ * server sees every arrival on its CQ without a message. Slots are
+ * credits: one is free again only once the server has returned it,
+ * which it does for several slots at once, see svr_handle_crd().
+ *
+ * Either way up to granted slots are in flight at once, or fewer while
+ * a sweep holds the ring at cb->inflight.
+ *
+ * The WRs of active and send/recv modes are queued and posted as one
+ * chain every batch WRs, and only every signal-th of them, or the one
+ * that fills the ring, asks for a completion. A completion frees its
+ * slot and the unsignaled ones before it, oldest first, except in
+ * credit writes where it only frees send queue entries. When the ring
+ * stops short of full with an unsignaled tail, a zero length WR is
+ * posted to collect it.
+ */
+
+char *iperf_slot_buf(struct rdma_cb *cb)
+{
+	int i, s, n = cb->granted ? cb->granted : 1;
+
+	if (!cb->granted && cb->outstanding)
+		return NULL;
+	if (cb->inflight && cb->outstanding >= cb->inflight)
+		return NULL;
+
+	for (i = 0; i < n; i++) {
+		s = (cb->next_slot + i) % n;
+		if (!cb->ring[s].busy) {
+			cb->next_slot = s;
+			return cb->ring[s].buf;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Post the queued WRs with a single ibv_post_send. With flush, first
+ * add a signaled zero length WR for any unsignaled ones, unless the
+ * last such WR is still out.
+ */
+static int cli_post_pending(struct rdma_cb *cb, int flush)
+{
+	struct ibv_send_wr *bad_wr;
+	enum ibv_wr_opcode opcode = IBV_WR_RDMA_WRITE;
+	int i, ret;
+
+	if (flush && cb->unsignaled > 0 && cb->flush_ctx.retire == 0) {
+		/* credit writes too: no immediate data, nothing to count */
+		if (cb->trans_mode == kRdmaTrans_ActRead)
+			opcode = IBV_WR_RDMA_READ;
+		else if (cb->trans_mode == kRdmaTrans_SendRecv)
+			opcode = IBV_WR_SEND_WITH_IMM;
+		iperf_build_wr(cb, &cb->pend_wr[cb->npend],
+			       &cb->pend_sge[cb->npend * cb->nsge],
+			       &cb->flush_ctx, cb->rdma_buf, 0, opcode,
+			       cb->remote_addr, cb->remote_rkey);
+		cb->flush_ctx.retire = cb->unsignaled;
+		cb->unsignaled = 0;
+		cb->npend++;
+	}
+	if (cb->npend == 0)
+		return 0;
+
+	for (i = 0; i < cb->npend - 1; i++)
+		cb->pend_wr[i].next = &cb->pend_wr[i + 1];
+	cb->pend_wr[cb->npend - 1].next = NULL;
+
+	ret = ibv_post_send(cb->qp, cb->pend_wr, &bad_wr);
+	if (ret)
+		fprintf(stderr, "post send error %d\n", ret);
+	cb->npend = 0;
+	cb->doorbells++;
+	return ret;
+}
+
+/*
+ * Point sge at bytes off to off + len of slot s, which are spread over
+ * the nsge regions. Returns the number of entries used.
+ */
+static int cli_slot_gather(struct rdma_cb *cb, int s, uint32_t off,
+			   uint32_t len, struct ibv_sge *sge)
+{
+	uint32_t piece = cb->sge_len, at, n;
+	int j, nsge = 0;
+
+	for (j = off / piece; len > 0 && j < cb->nsge; j++) {
+		at = off - j * piece;
+		n = piece - at < len ? piece - at : len;
+		sge[nsge].addr = (uint64_t) (unsigned long)
+				 (cb->sge_buf[j] + (size_t) s * piece + at);
+		sge[nsge].length = n;
+		sge[nsge].lkey = cb->sge_mr[j]->lkey;
+		nsge++;
+		off += n;
+		len -= n;
+	}
+	return nsge;
+}
+
+/*
+ * Queue the RDMA ops or SENDs of slot s, see above: one WR per chunk
+ * of at most cb->chunk bytes, linked, only the last of which may ask
+ * for a completion, or in credit writes carry the immediate data.
+ */
+static int cli_slot_queue(struct rdma_cb *cb, int s)
+{
+	struct iperf_slot *slot = &cb->ring[s];
+	struct ibv_send_wr *wr = NULL;
+	struct ibv_sge *sge;
+	enum ibv_wr_opcode opcode = IBV_WR_SEND_WITH_IMM;
+	uint64_t remote = 0;
+	uint32_t off, len;
+
+	if (cb->trans_mode != kRdmaTrans_SendRecv) {
+		opcode = cb->trans_mode == kRdmaTrans_ActRead ?
+			 IBV_WR_RDMA_READ : IBV_WR_RDMA_WRITE;
+		remote = cb->remote_addr + (uint64_t) s * cb->remote_len;
+	}
+
+	for (off = 0; off == 0 || off < slot->len; off += len) {
+		len = slot->len - off < cb->chunk ? slot->len - off : cb->chunk;
+		wr = &cb->pend_wr[cb->npend];
+		sge = &cb->pend_sge[cb->npend * cb->nsge];
+		iperf_build_wr(cb, wr, sge, &slot->rdma_ctx, slot->buf + off,
+			       len, opcode, remote + off, cb->remote_rkey);
+		if (cb->nsge > 1)
+			wr->num_sge = cli_slot_gather(cb, s, off, len, sge);
+		wr->send_flags &= ~IBV_SEND_SIGNALED;
+		cb->npend++;
+		if (len == 0)
+			break;
+	}
+	if (cb->trans_mode == kRdmaTrans_CreditWrite)
+		wr->opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+
+	cb->unsignaled++;
+	if (cb->unsignaled >= cb->signal ||
+	    cb->outstanding + 1 == (cb->inflight ? cb->inflight :
+				    cb->granted ? cb->granted : 1)) {
+		wr->send_flags |= IBV_SEND_SIGNALED;
+		slot->rdma_ctx.retire = cb->unsignaled;
+		cb->unsignaled = 0;
+	}
+
+	if (cb->npend >= cb->batch)
+		return cli_post_pending(cb, 0);
+	return 0;
+}
+
+/*
+ * Start the transfer of the slot last returned by iperf_slot_buf(),
+ * holding len bytes. In passive modes the server may be pointed at
+ * len bytes at src, registered as mr, instead of the slot's buffer.
+ */
+static int cli_slot_post(struct rdma_cb *cb, int len, char *src,
+			 struct ibv_mr *mr)
+{
+	int s = cb->next_slot;
+	struct iperf_slot *slot = &cb->ring[s];
+	int ret;
+
+	slot->len = len;
+	if (cb->slot_lat)
+		slot->posted = iperf_cycles();
+	if (iperf_is_active(cb) || cb->trans_mode == kRdmaTrans_SendRecv ||
+	    cb->trans_mode == kRdmaTrans_CreditWrite) {
+		ret = cli_slot_queue(cb, s);
+	} else {
+		iperf_format_send(cb, iperf_send_msg(cb, s),
+				  src ? src : slot->buf,
+				  (mr ? mr : cb->rdma_mr)->rkey, len, s);
+		ret = iperf_post_msg(cb, s, &slot->send_ctx);
+	}
+	if (ret)
+		return ret;
+
+	slot->busy = 1;
+	cb->outstanding++;
+	cb->next_slot = (s + 1) % (cb->granted ? cb->granted : 1);
+	return 0;
+}
+
+int iperf_slot_post(struct rdma_cb *cb, int len)
+{
+	return cli_slot_post(cb, len, NULL, NULL);
+}
+
+static int cli_slot_done(struct rdma_cb *cb, uint32_t s, int *acked)
+{
+	int len;
+
+	if (s >= (uint32_t) cb->depth || !cb->ring[s].busy) {
+		fprintf(stderr, "ack for idle slot %d\n", s);
+		return -1;
+	}
+	len = cb->ring[s].len;
+	if (cb->slot_lat)
+		iperf_hist_add(cb->slot_lat, (uint64_t)
+			       ((iperf_cycles() - cb->ring[s].posted) * 1000 /
+				iperf_cycles_per_usec()));
+	cb->ring[s].busy = 0;
+	cb->outstanding--;
+	cb->msgs++;
+	(*acked)++;
+	return len;
+}
+
+/*
+ * Free the count oldest busy slots. Returns the bytes they carried.
+ */
+static int cli_slot_free(struct rdma_cb *cb, int count, int *acked)
+{
+	int n = cb->granted ? cb->granted : 1;
+	int s, ret, len = 0;
+
+	for (; count > 0; count--) {
+		/* the oldest slot still busy */
+		s = (cb->next_slot - cb->outstanding + n) % n;
+		ret = cli_slot_done(cb, s, acked);
+		if (ret < 0)
+			return -1;
+		len += ret;
+	}
+	return len;
+}
+
+/*
+ * A signaled WR completed: free the slots it stands for, unless they
+ * wait for credits.
+ */
+static int cli_slot_retire(struct rdma_cb *cb, struct iperf_wr *ctx,
+			   int *acked)
+{
+	int count = ctx->retire;
+
+	ctx->retire = 0;
+	if (cb->trans_mode == kRdmaTrans_CreditWrite)
+		return 0;
+	return cli_slot_free(cb, count, acked);
+}
+
+/*
+ * Credit writes: the server returned credits for the oldest slots.
+ */
+static int cli_slot_credit(struct rdma_cb *cb, uint32_t credits,
+			   int *acked)
+{
+	if (credits < 1 || credits > (uint32_t) cb->outstanding) {
+		fprintf(stderr, "bogus credit return %d of %d\n", credits,
+			cb->outstanding);
+		return -1;
+	}
+	cb->credit_msgs++;
+	cb->credits += credits;
+	return cli_slot_free(cb, credits, acked);
+}
+
+/*
+ * The server's answer to our first message: the depth it granted and,
+ * in the modes that work on the server's memory, its region.
+ */
+static void cli_take_info(struct rdma_cb *cb, struct iperf_rdma_info *info)
+{
+	uint32_t depth = ntohl(info->depth);
+
+	cb->granted = depth < (uint32_t) cb->depth ? depth : cb->depth;
+	if (cb->granted < 1)
+		cb->granted = 1;
+	DEBUG_LOG("server granted depth %d\n", cb->granted);
+
+	if (iperf_is_active(cb) || iperf_is_latency(cb) ||
+	    iperf_is_atomic(cb) || cb->trans_mode == kRdmaTrans_SendRecv ||
+	    cb->trans_mode == kRdmaTrans_CreditWrite ||
+	    cb->trans_mode == kRdmaTrans_Datagram) {
+		cb->remote_rkey = ntohl(info->rkey);
+		cb->remote_addr = ntohll(info->buf);
+		cb->remote_len  = ntohl(info->size);
+		DEBUG_LOG("server region addr %" PRIx64 " rkey %x, %d x %d\n",
+			  cb->remote_addr, cb->remote_rkey, cb->granted,
+			  cb->remote_len);
+	}
+}
+
+static int cli_handle_wc(struct rdma_cb *cb, struct ibv_wc *wc, int *acked)
+{
+	struct iperf_wr *ctx = (struct iperf_wr *) (unsigned long) wc->wr_id;
+	struct iperf_rdma_info *info;
+	int len;
+
+	if (wc->status)
+		return iperf_wc_error(cb, wc);
+
+	if (ctx->type == IPERF_WR_RDMA)
+		return cli_slot_retire(cb, ctx, acked);
+	if (ctx->type != IPERF_WR_RECV)
+		return 0;
+
+	if (wc->byte_len != sizeof(struct iperf_rdma_info)) {
+		fprintf(stderr, "Received bogus data, size %d\n", wc->byte_len);
+		return -1;
+	}
+	info = &cb->msg_buf[ctx->slot];
+
+	if (ntohl(info->size) == 0) {
+		DEBUG_LOG("server acknowledged FIN\n");
+		cb->fin = 2;
+		return 0;
+	}
+
+	if (!cb->granted)
+		cli_take_info(cb, info);
+
+	if (cb->trans_mode == kRdmaTrans_CreditWrite && info->buf == 0) {
+		/* credits come without a region */
+		len = cli_slot_credit(cb, ntohl(info->slot), acked);
+		if (len < 0)
+			return -1;
+	} else if (iperf_is_active(cb) || iperf_is_latency(cb) ||
+		   iperf_is_atomic(cb) ||
+		   cb->trans_mode == kRdmaTrans_SendRecv ||
+		   cb->trans_mode == kRdmaTrans_CreditWrite ||
+		   cb->trans_mode == kRdmaTrans_Datagram) {
+		/* the server's region, sent once */
+		len = 0;
+	} else {
+		len = cli_slot_done(cb, ntohl(info->slot), acked);
+		if (len < 0)
+			return -1;
+	}
+
+	if (iperf_post_recv(cb, ctx->slot)) {
+		fprintf(stderr, "post recv error\n");
+		return -1;
+	}
+	return len;
+}
+
+/*
+ * Wait until at least one slot is free again. Returns the bytes the
+ * finished slots carried, or -1 on error.
+ */
+int iperf_slot_reap(struct rdma_cb *cb)
+{
+	struct ibv_wc wc[IPERF_WC_BATCH];
+	int i, n, ret, acked = 0, bytes = 0;
+
+	if (cb->outstanding == 0)
+		return 0;
+	if (cli_post_pending(cb, 1))
+		return -1;
+
+	while (acked == 0) {
+		n = iperf_get_wc(cb, wc, IPERF_WC_BATCH);
+		if (n < 0)
+			return -1;
+		for (i = 0; i < n; i++) {
+			ret = cli_handle_wc(cb, &wc[i], &acked);
+			if (ret < 0)
+				return -1;
+			bytes += ret;
+		}
+	}
+	return bytes;
+}
+
+/*
+ * Send a control message and wait for the server's answer: the region
+ * descriptor for active modes, the FIN ack at the end.
+ */
+static int cli_ctrl_exchange(struct rdma_cb *cb, uint64_t buf, uint32_t rkey,
+			     uint32_t size)
+{
+	struct ibv_wc wc[IPERF_WC_BATCH];
+	struct iperf_rdma_info *info = iperf_send_msg(cb, cb->depth);
+	int i, n, acked = 0;
+
+	/* answered in the accept already */
+	if (size && cb->granted)
+		return 0;
+
+	iperf_format_send(cb, info, NULL, rkey, size, cb->depth);
+	info->buf = htonll(buf);
+	if (iperf_post_msg(cb, cb->depth, &cb->ctrl_ctx))
+		return -1;
+
+	while (size ? !cb->granted : cb->fin != 2) {
+		n = iperf_get_wc(cb, wc, IPERF_WC_BATCH);
+		if (n < 0)
+			return -1;
+		for (i = 0; i < n; i++)
+			if (cli_handle_wc(cb, &wc[i], &acked) < 0)
+				return -1;
+	}
+	return 0;
+}
+
+/*
+ * Ask the server for a region of depth slots of our buffer size to
+ * READ from or WRITE into.
+ */
+int cli_act_rdma_start(struct rdma_cb *cb)
+{
+	return cli_ctrl_exchange(cb, 0, 0, cb->size);
+}
+
+/*
+ * Latency modes: trade rings with the server, so either side knows
+ * where to put its message.
+ */
+int cli_lat_rdma_start(struct rdma_cb *cb)
+{
+	return cli_ctrl_exchange(cb, (uint64_t) (unsigned long) cb->rdma_buf,
+				 cb->rdma_mr->rkey, cb->size);
+}
+
+/*
+ * Tell the server the transfer is over and wait for its answer, so
+ * that the disconnect cannot overtake the last acknowledgement. The
+ * byte count lets a passive server report what it never saw.
+ */
+int iperf_send_fin(struct rdma_cb *cb, uint64_t total)
+{
+	/* the last ping may still be on its way out */
+	if (iperf_is_latency(cb) && lat_drain(cb))
+		return -1;
+	if (iperf_is_atomic(cb) && atomic_drain(cb))
+		return -1;
+	if (cb->trans_mode == kRdmaTrans_Datagram && cli_ud_drain(cb))
+		return -1;
+	cb->fin = 1;
+	return cli_ctrl_exchange(cb, total, 0, 0);
+}
+
+
+/*
+ * Keep every granted slot busy, then wait for at least one to finish.
+ */
+static int cli_rdma_xfer(struct rdma_cb *cb)
+{
+	while (iperf_slot_buf(cb) != NULL)
+		if (iperf_slot_post(cb, cb->size))
+			return -1;
+
+	return iperf_slot_reap(cb);
+}
+
+int cli_act_rdma_rd(struct rdma_cb *cb)
+{
+	return cli_rdma_xfer(cb);
+}
+
+int cli_act_rdma_wr(struct rdma_cb *cb)
+{
+	return cli_rdma_xfer(cb);
+}
+
+int cli_pas_rdma_rd(struct rdma_cb *cb)
+{
+	return cli_rdma_xfer(cb);
+}
+
+int cli_pas_rdma_wr(struct rdma_cb *cb)
+{
+	return cli_rdma_xfer(cb);
+}
+
+
+/*
+ * Server side of the pipelined ring.
+ */
+
+static int svr_snd_setup(struct rdma_cb *cb, uint32_t size);
+static int svr_ud_setup(struct rdma_cb *cb, struct iperf_wr *ctx,
+			uint32_t size);
+
+/*
+ * Answer the client's first message, in the accept's private data if
+ * that is still to come, else with a SEND of message 0.
+ */
+static int svr_reply(struct rdma_cb *cb, struct iperf_wr *ctx, char *buf,
+		     uint32_t rkey, uint32_t size)
+{
+	if (cb->reply) {
+		iperf_format_send(cb, &cb->accept_pdata.info, buf, rkey,
+				  size, 0);
+		cb->accept_pdata.magic = htonl(IPERF_PDATA_MAGIC);
+		return 0;
+	}
+	iperf_format_send(cb, iperf_send_msg(cb, 0), buf, rkey, size, 0);
+	return iperf_post_msg(cb, 0, ctx);
+}
+
+/*
+ * Set up for the mode, buffer size and depth in the client's first
+ * message: info, received into ctx, or out of the connect request
+ * with ctx NULL. In the modes where the client advertises its slots
+ * the message was the first of them and is left to the caller.
+ */
+static int svr_setup(struct rdma_cb *cb, struct iperf_rdma_info *info,
+		     struct iperf_wr *ctx)
+{
+	uint32_t size = ntohl(info->size), depth;
+	int i, ret;
+
+	cb->remote_rkey = ntohl(info->rkey);
+	cb->remote_addr = ntohll(info->buf);
+	cb->remote_len  = size;
+	cb->remote_mode = ntohl(info->mode);
+
+	switch ( cb->remote_mode ) {
+	case MODE_RDMA_ACTRD:
+		cb->trans_mode = kRdmaTrans_PasRead;
+		break;
+	case MODE_RDMA_ACTWR:
+		cb->trans_mode = kRdmaTrans_PasWrte;
+		break;
+	case MODE_RDMA_PASRD:
+		cb->trans_mode = kRdmaTrans_ActRead;
+		break;
+	case MODE_RDMA_PASWR:
+		cb->trans_mode = kRdmaTrans_ActWrte;
+		break;
+	case MODE_RDMA_LATWR:
+		cb->trans_mode = kRdmaTrans_LatWrite;
+		break;
+	case MODE_RDMA_LATSN:
+		cb->trans_mode = kRdmaTrans_LatSend;
+		break;
+	case MODE_RDMA_LATRD:
+		cb->trans_mode = kRdmaTrans_LatRead;
+		break;
+	case MODE_RDMA_SNDRCV:
+		cb->trans_mode = kRdmaTrans_SendRecv;
+		break;
+	case MODE_RDMA_FADD:
+		cb->trans_mode = kRdmaTrans_FetchAdd;
+		break;
+	case MODE_RDMA_CSWP:
+		cb->trans_mode = kRdmaTrans_CmpSwap;
+		break;
+	case MODE_RDMA_CRDWR:
+		cb->trans_mode = kRdmaTrans_CreditWrite;
+		break;
+	case MODE_RDMA_CONN:
+		cb->trans_mode = kRdmaTrans_Connect;
+		break;
+	case MODE_RDMA_UD:
+		cb->trans_mode = kRdmaTrans_Datagram;
+		break;
+	default:
+		fprintf(stderr, "unrecognize transfer mode %d\n", \
+			cb->remote_mode);
+		return -1;
+	}
+
+	depth = ntohl(info->depth);
+	if (depth < 1)
+		depth = 1;
+	if (iperf_is_latency(cb))
+		cb->granted = IPERF_LAT_DEPTH;
+	else
+		cb->granted = depth < (uint32_t) cb->depth ?
+			      depth : cb->depth;
+	/* a connection-rate probe, there is nothing to set up */
+	if (cb->trans_mode == kRdmaTrans_Connect)
+		return svr_reply(cb, &cb->ctrl_ctx, NULL, 0, size);
+	if (cb->srq && (cb->trans_mode == kRdmaTrans_SendRecv ||
+			cb->trans_mode == kRdmaTrans_LatSend) &&
+	    size > (uint32_t) cb->dev->srq_len) {
+		fprintf(stderr, "client sends %d bytes, shared receives "
+			"hold %d, see -l\n", size, cb->dev->srq_len);
+		return -1;
+	}
+	if (cb->trans_mode == kRdmaTrans_SendRecv)
+		return svr_snd_setup(cb, size);
+	if (iperf_is_atomic(cb))
+		return svr_atomic_setup(cb, ctx);
+	if (cb->trans_mode == kRdmaTrans_Datagram)
+		return svr_ud_setup(cb, ctx, size);
+	ret = iperf_setup_ring(cb, cb->granted, size);
+	if (ret)
+		return -1;
+	DEBUG_LOG("granted depth %d of %d\n", cb->granted, depth);
+
+	if (cb->trans_mode == kRdmaTrans_CreditWrite) {
+		if (cb->credit_batch < 1)
+			cb->credit_batch = cb->granted / IPERF_CREDIT_SHARE;
+		if (cb->credit_batch > cb->granted)
+			cb->credit_batch = cb->granted;
+		if (cb->credit_batch < 1)
+			cb->credit_batch = 1;
+		DEBUG_LOG("credits returned %d at a time\n", cb->credit_batch);
+	}
+
+	/* the client may send more from now on */
+	for (i = 1; i <= cb->depth; i++) {
+		if (iperf_post_recv(cb, i)) {
+			fprintf(stderr, "post recv error\n");
+			return -1;
+		}
+	}
+
+	if (cb->trans_mode == kRdmaTrans_PasRead ||
+	    cb->trans_mode == kRdmaTrans_PasWrte ||
+	    cb->trans_mode == kRdmaTrans_CreditWrite ||
+	    iperf_is_latency(cb)) {
+		/* advertise the whole region, once */
+		if (ctx && iperf_post_recv(cb, ctx->slot)) {
+			fprintf(stderr, "post recv error\n");
+			return -1;
+		}
+		return svr_reply(cb, &cb->ring[0].send_ctx, cb->rdma_buf,
+				 cb->rdma_mr->rkey, size);
+	}
+
+	/* only the granted depth to tell, the slots come one by one */
+	if (!ctx)
+		return svr_reply(cb, NULL, NULL, 0, size);
+	return 0;
+}
+
+/*
+ * The client's first message came with its connect request: set up
+ * for it now and leave the answer for iperf_accept() to carry, saving
+ * a round trip and a completion on either side.
+ */
+int svr_accept_info(struct rdma_cb *cb)
+{
+	int ret;
+
+	if (cb->conn_pdata.magic != htonl(IPERF_PDATA_MAGIC))
+		return 0;
+	cb->reply = 1;
+	ret = svr_setup(cb, &cb->conn_pdata.info, NULL);
+	cb->reply = 0;
+	return ret;
+}
+
+static int svr_handle_recv(struct rdma_cb *cb, struct iperf_wr *ctx,
+			   struct ibv_wc *wc)
+{
+	struct iperf_rdma_info *info = &cb->msg_buf[ctx->slot];
+	struct iperf_slot *slot;
+	uint32_t s, size;
+	int ret;
+
+	if (wc->byte_len != sizeof(struct iperf_rdma_info)) {
+		fprintf(stderr, "Received bogus data, size %d\n", wc->byte_len);
+		return -1;
+	}
+
+	cb->remote_rkey = ntohl(info->rkey);
+	cb->remote_addr = ntohll(info->buf);
+	cb->remote_len  = ntohl(info->size);
+	cb->remote_mode = ntohl(info->mode);
+	s = ntohl(info->slot);
+	size = cb->remote_len;
+	DEBUG_LOG("Received rkey %x addr %" PRIx64 " len %d slot %d from peer\n",
+		  cb->remote_rkey, cb->remote_addr, cb->remote_len, s);
+
+	if (size == 0) {
+		DEBUG_LOG("client sent FIN\n");
+		cb->fin = 1;
+		cb->fin_bytes = cb->remote_addr;
+		iperf_format_send(cb, iperf_send_msg(cb, cb->depth), NULL,
+				  0, 0, cb->depth);
+		return iperf_post_msg(cb, cb->depth, &cb->ctrl_ctx);
+	}
+
+	if (!cb->granted) {
+		if (svr_setup(cb, info, ctx))
+			return -1;
+		if (cb->trans_mode != kRdmaTrans_ActRead &&
+		    cb->trans_mode != kRdmaTrans_ActWrte)
+			return 0;
+	}
+
+	if (cb->trans_mode == kRdmaTrans_PasRead ||
+	    cb->trans_mode == kRdmaTrans_PasWrte ||
+	    cb->trans_mode == kRdmaTrans_SendRecv ||
+	    cb->trans_mode == kRdmaTrans_CreditWrite ||
+	    iperf_is_latency(cb) || iperf_is_atomic(cb)) {
+		fprintf(stderr, "unexpected message in passive mode\n");
+		return -1;
+	}
+	if (s >= (uint32_t) cb->granted || size > (uint32_t) cb->size) {
+		fprintf(stderr, "bogus advertisement slot %d len %d\n", s, size);
+		return -1;
+	}
+	slot = &cb->ring[s];
+	slot->len = size;
+
+	ret = iperf_post_rdma(cb, slot,
+		cb->trans_mode == kRdmaTrans_ActRead ?
+		IBV_WR_RDMA_READ : IBV_WR_RDMA_WRITE,
+		cb->remote_addr, cb->remote_rkey);
+	if (ret)
+		return -1;
+
+	if (iperf_post_recv(cb, ctx->slot)) {
+		fprintf(stderr, "post recv error\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Data of the client's landed in buf: with -E check its stamp, then
+ * hand what follows the stamp to the output file.
+ *
+ * With -X odirect the write is queued from buf itself, which is ring
+ * slot slot: it stays the disk's until svr_disk_done() gives it back
+ * to the client, and 1 is returned. Pass slot -1 for a buffer that
+ * must be free again on return.
+ */
+static int svr_deliver(struct rdma_cb *cb, char *buf, uint32_t len,
+		       int slot)
+{
+	/* the zero length WR that collects an unsignaled tail */
+	if (len == 0)
+		return 0;
+	if (cb->validate) {
+		iperf_check_buf(&cb->check, buf, len);
+		if (len < IPERF_STAMP_LEN)
+			return 0;
+		buf += IPERF_STAMP_LEN;
+		len -= IPERF_STAMP_LEN;
+	}
+	if (len == 0)
+		return 0;
+
+	if (cb->disk_file != NULL) {
+		if (cb->disk.file == NULL)
+			iperf_disk_init(&cb->disk, cb->disk_file,
+					cb->ring_depth);
+		return iperf_disk_write(&cb->disk, buf, len, slot) == 1;
+	}
+
+	/* write data to file output */
+	if (cb->outputfile != NULL)
+	    if ( fwrite( buf, len, 1, cb->outputfile ) != 1 )
+	        fprintf( stderr, "Unable to write to the file stream\n");
+	return 0;
+}
+
+/* tell the client the slot is free again */
+static int svr_slot_ack(struct rdma_cb *cb, int s)
+{
+	struct iperf_slot *slot = &cb->ring[s];
+
+	iperf_format_send(cb, iperf_send_msg(cb, s), NULL, 0, slot->len, s);
+	return iperf_post_msg(cb, s, &slot->send_ctx);
+}
+
+/*
+ * The RDMA op on a slot finished: hand the data to the output file
+ * and tell the client the slot is free again, or have svr_disk_done()
+ * do so once it is on disk. Returns the bytes moved.
+ */
+static int svr_handle_rdma(struct rdma_cb *cb, struct iperf_wr *ctx)
+{
+	struct iperf_slot *slot = &cb->ring[ctx->slot];
+
+	if (cb->trans_mode == kRdmaTrans_ActRead &&
+	    svr_deliver(cb, slot->buf, slot->len, ctx->slot))
+		return slot->len;
+
+	if (svr_slot_ack(cb, ctx->slot))
+		return -1;
+
+	return slot->len;
+}
+
+/*
+ * Credit writes: hand the client back the slots consumed since last
+ * time, all in one message. The message uses the buffer of the last
+ * consumed slot: the client cannot WRITE that slot again until it
+ * has these credits, so the buffer is not overwritten while the
+ * message is in flight.
+ */
+static int svr_crd_return(struct rdma_cb *cb)
+{
+	int s = cb->credit_last;
+
+	iperf_format_send(cb, iperf_send_msg(cb, s), NULL, 0, cb->size,
+			  cb->credits_held);
+	if (iperf_post_msg(cb, s, &cb->ring[s].send_ctx))
+		return -1;
+	cb->credit_msgs++;
+	cb->credits += cb->credits_held;
+	cb->credits_held = 0;
+	return 0;
+}
+
+/*
+ * Keep the credit of slot s until there are credit_batch of them, or
+ * until svr_rdma_reap() runs out of completions.
+ */
+static int svr_crd_take(struct rdma_cb *cb, int s)
+{
+	cb->credits_held++;
+	cb->credit_last = s;
+	if (cb->credits_held >= cb->credit_batch)
+		return svr_crd_return(cb);
+	return 0;
+}
+
+/*
+ * Credit writes: a WRITE of the client landed in the slot its
+ * immediate data names and took a receive, which the caller gave back
+ * already. Hand the data to the output file and take the slot's
+ * credit, unless the disk has it. Returns the bytes received.
+ */
+static int svr_handle_crd(struct rdma_cb *cb, struct ibv_wc *wc)
+{
+	uint32_t s = ntohl(wc->imm_data);
+
+	if (s >= (uint32_t) cb->granted ||
+	    wc->byte_len > (uint32_t) cb->size) {
+		fprintf(stderr, "bogus credit write slot %d len %d\n", s,
+			wc->byte_len);
+		return -1;
+	}
+
+	if (!svr_deliver(cb, cb->ring[s].buf, wc->byte_len, s) &&
+	    svr_crd_take(cb, s))
+		return -1;
+	return wc->byte_len;
+}
+
+/*
+ * A receive into a data buffer, an SRQ buffer or a slot of the ring,
+ * completed. Sends carry immediate data; what comes without is a
+ * control message, copied to where svr_handle_recv() expects it. The
+ * buffer goes back right away. Returns the bytes of data received, 0
+ * for a control message, -1 on error.
+ */
+static int svr_handle_data(struct rdma_cb *cb, struct iperf_wr *ctx,
+			   struct ibv_wc *wc)
+{
+	struct iperf_rdma_dev *dev = cb->dev;
+	char *buf;
+
+	if (ctx->cb == NULL) {
+		buf = dev->srq_buf + (size_t) ctx->slot * dev->srq_len;
+		if (__sync_sub_and_fetch(&dev->srq_posted, 1) == 0)
+			__sync_fetch_and_add(&dev->srq_dry, 1);
+	} else {
+		buf = cb->ring[ctx->slot].buf;
+		if (--cb->recv_posted == 0)
+			cb->recv_dry++;
+	}
+
+	if (wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+		if (iperf_post_data_recv(cb, ctx))
+			return -1;
+		return svr_handle_crd(cb, wc);
+	}
+
+	if (!(wc->wc_flags & IBV_WC_WITH_IMM)) {
+		if (wc->byte_len == sizeof(struct iperf_rdma_info))
+			memcpy(&cb->msg_buf[0], buf, wc->byte_len);
+		if (iperf_post_data_recv(cb, ctx))
+			return -1;
+		return svr_handle_recv(cb, &cb->recv_ctx[0], wc) ? -1 : 0;
+	}
+
+	/* a receive of our own goes back once on disk */
+	if (cb->trans_mode == kRdmaTrans_SendRecv &&
+	    svr_deliver(cb, buf, wc->byte_len, ctx->cb ? ctx->slot : -1))
+		return wc->byte_len;
+
+	if (iperf_post_data_recv(cb, ctx))
+		return -1;
+	return wc->byte_len;
+}
+
+static int svr_handle_wc(struct rdma_cb *cb, struct ibv_wc *wc)
+{
+	struct iperf_wr *ctx = (struct iperf_wr *) (unsigned long) wc->wr_id;
+
+	if (wc->status)
+		return iperf_wc_error(cb, wc);
+
+	switch (ctx->type) {
+	case IPERF_WR_RECV:
+		if (wc->opcode != IBV_WC_RECV_RDMA_WITH_IMM)
+			return svr_handle_recv(cb, ctx, wc) ? -1 : 0;
+		if (iperf_post_recv(cb, ctx->slot)) {
+			fprintf(stderr, "post recv error\n");
+			return -1;
+		}
+		return svr_handle_crd(cb, wc);
+	case IPERF_WR_DATA:
+		return svr_handle_data(cb, ctx, wc);
+	case IPERF_WR_RDMA:
+		return svr_handle_rdma(cb, ctx);
+	case IPERF_WR_SEND:
+		if (ctx == &cb->ctrl_ctx && cb->fin)
+			cb->fin = 2;	/* FIN acknowledged */
+		return 0;
+	default:
+		fprintf(stderr, "unknown!!!!! completion\n");
+		return -1;
+	}
+}
+
+/*
+ * Handle a batch of n completions. One short of IPERF_WC_BATCH means
+ * the CQ ran dry. Returns the bytes moved, -1 on error.
+ */
+int svr_rdma_handle(struct rdma_cb *cb, struct ibv_wc *wc, int n)
+{
+	int i, ret, bytes = 0;
+
+	for (i = 0; i < n; i++) {
+		ret = svr_handle_wc(cb, &wc[i]);
+		if (ret < 0)
+			return -1;
+		bytes += ret;
+	}
+	/* caught up with the client: return what credits we hold */
+	if (cb->credits_held > 0 && n < IPERF_WC_BATCH && svr_crd_return(cb))
+		return -1;
+	return bytes;
+}
+
+/*
+ * -X odirect: give the slots whose writes completed back to the
+ * client, the way svr_deliver()'s caller would have. Returns how many,
+ * -1 on error.
+ */
+static int svr_disk_done(struct rdma_cb *cb)
+{
+	int tags[IPERF_WC_BATCH];
+	int i, s, n, ret = 0;
+
+	n = iperf_disk_reap(&cb->disk, tags, IPERF_WC_BATCH, 0);
+	for (i = 0; i < n && !ret; i++) {
+		s = tags[i];
+		switch (cb->trans_mode) {
+		case kRdmaTrans_ActRead:
+			ret = svr_slot_ack(cb, s);
+			break;
+		case kRdmaTrans_CreditWrite:
+			ret = svr_crd_take(cb, s);
+			break;
+		case kRdmaTrans_SendRecv:
+			ret = iperf_post_data_recv(cb, &cb->ring[s].rdma_ctx);
+			break;
+		default:
+			break;
+		}
+	}
+	return ret ? -1 : n;
+}
+
+/*
+ * Reap completions until at least one RDMA op has landed or the client
+ * said FIN and got its answer. Returns the bytes moved, 0 after FIN,
+ * -1 on error.
+ *
+ * While writes to disk hold slots nothing may sleep on the CQ, which
+ * may stay quiet until the slots are back: both are polled then.
+ */
+static int svr_rdma_reap(struct rdma_cb *cb)
+{
+	struct ibv_wc wc[IPERF_WC_BATCH];
+	int n, ret, bytes = 0;
+
+	while (bytes == 0 && cb->fin != 2) {
+		if (cb->disk.inflight > 0) {
+			if (svr_disk_done(cb) < 0)
+				return -1;
+			n = iperf_try_wc(cb, wc, IPERF_WC_BATCH);
+		} else
+			n = iperf_get_wc(cb, wc, IPERF_WC_BATCH);
+		if (n < 0)
+			return -1;
+		ret = svr_rdma_handle(cb, wc, n);
+		if (ret < 0)
+			return -1;
+		bytes += ret;
+	}
+	/* the report counts the disk's time too */
+	if (cb->fin == 2)
+		iperf_disk_drain(&cb->disk);
+	return bytes;
+}
+
+/*
+ * Wait for the client's first message, which sets the transfer mode,
+ * the buffer size and the pipeline depth.
+ */
+int svr_rdma_start(struct rdma_cb *cb)
+{
+	struct ibv_wc wc;
+
+	while (!cb->granted && !cb->fin) {
+		if (iperf_get_wc(cb, &wc, 1) < 0)
+			return -1;
+		if (svr_handle_wc(cb, &wc) < 0)
+			return -1;
+	}
+	return cb->granted ? 0 : -1;
+}
+
+int svr_act_rdma_rd(struct rdma_cb *cb)
+{
+	return svr_rdma_reap(cb);
+}
+
+int svr_act_rdma_wr(struct rdma_cb *cb)
+{
+	return svr_rdma_reap(cb);
+}
+
+/*
+ * The client READs/WRITEs our region on its own; all we see is FIN,
+ * which reports the bytes moved. Hands them out in int sized pieces,
+ * then returns 0.
+ */
+static int svr_pas_rdma_xfer(struct rdma_cb *cb)
+{
+	int len;
+
+	if (cb->fin != 2 && svr_rdma_reap(cb) < 0)
+		return -1;
+
+	len = cb->fin_bytes > INT_MAX ? INT_MAX : (int) cb->fin_bytes;
+	cb->fin_bytes -= len;
+	return len;
+}
+
+int svr_pas_rdma_rd(struct rdma_cb *cb)
+{
+	return svr_pas_rdma_xfer(cb);
+}
+
+int svr_pas_rdma_wr(struct rdma_cb *cb)
+{
+	return svr_pas_rdma_xfer(cb);
+}
+
+
+/*
+ * Send/recv streaming (-G sr).
+ *
+ * The client SENDs whole slots with immediate data and a slot is done
+ * once its send completes. The server receives them into a ring of its
+ * own, one receive per granted slot plus one for FIN, or with -X srq
+ * into the device's shared receive queue. Either way the client learns
+ * the largest message the server takes from the answer to its first
+ * message. When a send finds no receive posted the server's HCA
+ * answers with an RNR NAK and the client retries until it finds one;
+ * the hardware counters tell how often that happened, where there are
+ * any.
+ */
+
+int cli_snd_rdma_start(struct rdma_cb *cb)
+{
+	if (cli_ctrl_exchange(cb, 0, 0, cb->size))
+		return -1;
+	if ((uint32_t) cb->size > cb->remote_len) {
+		fprintf(stderr, "server receives at most %d bytes per message, "
+			"see -l\n", cb->remote_len);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Called for the client's first message: set up the receives, unless
+ * the SRQ has them, and tell the client how much each one holds.
+ */
+static int svr_snd_setup(struct rdma_cb *cb, uint32_t size)
+{
+	int i;
+
+	if (!cb->srq) {
+		if (iperf_setup_ring(cb, cb->granted + 1, size))
+			return -1;
+		for (i = 0; i < cb->ring_depth; i++) {
+			cb->ring[i].rdma_ctx.type = IPERF_WR_DATA;
+			if (iperf_post_data_recv(cb, &cb->ring[i].rdma_ctx))
+				return -1;
+		}
+	}
+	DEBUG_LOG("granted depth %d, %s receives\n", cb->granted,
+		  cb->srq ? "shared" : "own");
+
+	return svr_reply(cb, &cb->ctrl_ctx, NULL, 0,
+			 cb->srq ? cb->dev->srq_len : size);
+}
+
+int svr_snd_rdma_recv(struct rdma_cb *cb)
+{
+	return svr_rdma_reap(cb);
+}
+
+/*
+ * Credit writes (-G cw), see the client side of the ring. The WRITEs
+ * land on their own, the server only returns the credits.
+ */
+int svr_crd_rdma_recv(struct rdma_cb *cb)
+{
+	return svr_rdma_reap(cb);
+}
+
+
+/*
+ * Datagrams (-G ud).
+ *
+ * The connection stays RC for the control messages, FIN included, and
+ * either side adds a UD QP for the data, on a CQ of its own. The
+ * server posts a receive ring of its whole depth, a datagram and the
+ * GRH ahead of it per slot, and answers the client's first message
+ * with the QP's number and the largest datagram it takes, no more
+ * than its port's MTU. The client sends to it over the path of the RC
+ * connection, round robin over its ring and at most a ring's worth in
+ * flight. Nothing is retried: what the server finds missing is what
+ * the fabric or its receive queue dropped.
+ */
+
+/* the largest datagram cb's port carries */
+static uint32_t iperf_ud_mtu(struct rdma_cb *cb)
+{
+	struct rdma_cm_id *id = cb->server ? cb->child_cm_id : cb->cm_id;
+	struct ibv_port_attr attr;
+
+	if (ibv_query_port(id->verbs, id->port_num, &attr)) {
+		fprintf(stderr, "ibv_query_port failed\n");
+		return 256;
+	}
+	return 128U << attr.active_mtu;
+}
+
+/* a UD QP of depth WRs either way on a CQ of its own, taken to RTS */
+static int iperf_ud_create(struct rdma_cb *cb, int depth)
+{
+	struct rdma_cm_id *id = cb->server ? cb->child_cm_id : cb->cm_id;
+	struct ibv_qp_init_attr init_attr;
+	struct ibv_qp_attr attr;
+
+	cb->ud_cq = ibv_create_cq(id->verbs, 2 * depth, cb, NULL, 0);
+	if (!cb->ud_cq) {
+		fprintf(stderr, "ud ibv_create_cq failed\n");
+		return -1;
+	}
+
+	memset(&init_attr, 0, sizeof init_attr);
+	init_attr.cap.max_send_wr = depth;
+	init_attr.cap.max_recv_wr = depth;
+	init_attr.cap.max_send_sge = 1;
+	init_attr.cap.max_recv_sge = 1;
+	init_attr.qp_type = IBV_QPT_UD;
+	init_attr.send_cq = cb->ud_cq;
+	init_attr.recv_cq = cb->ud_cq;
+	cb->ud_qp = ibv_create_qp(cb->pd, &init_attr);
+	if (!cb->ud_qp) {
+		fprintf(stderr, "ud ibv_create_qp failed\n");
+		return -1;
+	}
+
+	memset(&attr, 0, sizeof attr);
+	attr.qp_state = IBV_QPS_INIT;
+	attr.pkey_index = 0;
+	attr.port_num = id->port_num;
+	attr.qkey = IPERF_UD_QKEY;
+	if (ibv_modify_qp(cb->ud_qp, &attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX |
+			  IBV_QP_PORT | IBV_QP_QKEY))
+		goto err;
+	attr.qp_state = IBV_QPS_RTR;
+	if (ibv_modify_qp(cb->ud_qp, &attr, IBV_QP_STATE))
+		goto err;
+	attr.qp_state = IBV_QPS_RTS;
+	attr.sq_psn = 0;
+	if (ibv_modify_qp(cb->ud_qp, &attr, IBV_QP_STATE | IBV_QP_SQ_PSN))
+		goto err;
+	DEBUG_LOG("ud qp %x, %d deep\n", cb->ud_qp->qp_num, depth);
+	return 0;
+err:
+	fprintf(stderr, "ud ibv_modify_qp failed\n");
+	return -1;
+}
+
+static void iperf_ud_free(struct rdma_cb *cb)
+{
+	if (cb->ud_ah)
+		ibv_destroy_ah(cb->ud_ah);
+	if (cb->ud_qp)
+		ibv_destroy_qp(cb->ud_qp);
+	if (cb->ud_cq)
+		ibv_destroy_cq(cb->ud_cq);
+	cb->ud_ah = NULL;
+	cb->ud_qp = NULL;
+	cb->ud_cq = NULL;
+}
+
+/*
+ * Client: the server's QP and the size it takes came with its answer;
+ * datagrams go to it the way the RC connection does. cb->size comes
+ * down to what the path carries.
+ */
+int cli_ud_rdma_start(struct rdma_cb *cb)
+{
+	struct ibv_qp_init_attr init_attr;
+	struct ibv_qp_attr attr;
+	uint32_t mtu = iperf_ud_mtu(cb);
+
+	if (cli_ctrl_exchange(cb, 0, 0, cb->size))
+		return -1;
+	cb->ud_qpn = cb->remote_rkey;
+	if (mtu > cb->remote_len)
+		mtu = cb->remote_len;
+	if ((uint32_t) cb->size > mtu)
+		cb->size = mtu;
+
+	if (iperf_ud_create(cb, cb->ring_depth))
+		return -1;
+	if (ibv_query_qp(cb->qp, &attr, IBV_QP_AV, &init_attr)) {
+		fprintf(stderr, "ibv_query_qp failed\n");
+		return -1;
+	}
+	cb->ud_ah = ibv_create_ah(cb->pd, &attr.ah_attr);
+	if (!cb->ud_ah) {
+		fprintf(stderr, "ibv_create_ah failed\n");
+		return -1;
+	}
+
+	/* a completion for every half ring frees all the sends before it */
+	cb->ud_sig = cb->ring_depth / 2 > 0 ? cb->ring_depth / 2 : 1;
+	cb->ud_posted = cb->ud_done = 0;
+	return 0;
+}
+
+/* take the send completions there are; with wait, at least one */
+static int cli_ud_reap(struct rdma_cb *cb, int wait)
+{
+	struct ibv_wc wc[IPERF_WC_BATCH];
+	int i, n;
+
+	do {
+		n = ibv_poll_cq(cb->ud_cq, IPERF_WC_BATCH, wc);
+	} while (n == 0 && wait);
+	if (n < 0) {
+		fprintf(stderr, "ud ibv_poll_cq failed\n");
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		if (wc[i].status)
+			return iperf_wc_error(cb, &wc[i]);
+		cb->ud_done = wc[i].wr_id + 1;
+	}
+	return n;
+}
+
+/*
+ * The slot to send the next datagram from, once the send that used it
+ * last is done. NULL on error.
+ */
+char *cli_ud_buf(struct rdma_cb *cb)
+{
+	while (cb->ud_posted - cb->ud_done >= (uint64_t) cb->ring_depth)
+		if (cli_ud_reap(cb, 1) < 0)
+			return NULL;
+	return cb->ring[cb->ud_posted % cb->ring_depth].buf;
+}
+
+/* send the first len bytes of cli_ud_buf()'s slot */
+int cli_ud_send(struct rdma_cb *cb, uint32_t len)
+{
+	struct iperf_slot *slot = &cb->ring[cb->ud_posted % cb->ring_depth];
+	struct ibv_send_wr wr, *bad_wr;
+	struct ibv_sge sge;
+
+	sge.addr = (uint64_t) (unsigned long) slot->buf;
+	sge.length = len;
+	sge.lkey = cb->rdma_mr->lkey;
+
+	memset(&wr, 0, sizeof wr);
+	wr.wr_id = cb->ud_posted;
+	wr.opcode = IBV_WR_SEND;
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	wr.wr.ud.ah = cb->ud_ah;
+	wr.wr.ud.remote_qpn = cb->ud_qpn;
+	wr.wr.ud.remote_qkey = IPERF_UD_QKEY;
+	if ((cb->ud_posted + 1) % cb->ud_sig == 0)
+		wr.send_flags = IBV_SEND_SIGNALED;
+
+	if (ibv_post_send(cb->ud_qp, &wr, &bad_wr)) {
+		fprintf(stderr, "ud post send error\n");
+		return -1;
+	}
+	cb->ud_posted++;
+	return 0;
+}
+
+/*
+ * Before FIN: wait for the last signaled send, the few after it are
+ * out right behind it.
+ */
+static int cli_ud_drain(struct rdma_cb *cb)
+{
+	uint64_t last = cb->ud_posted - cb->ud_posted % cb->ud_sig;
+
+	while (cb->ud_done < last)
+		if (cli_ud_reap(cb, 1) < 0)
+			return -1;
+	return 0;
+}
+
+static int iperf_ud_post_recv(struct rdma_cb *cb, int s)
+{
+	struct ibv_recv_wr wr, *bad_wr;
+	struct ibv_sge sge;
+
+	sge.addr = (uint64_t) (unsigned long) cb->ring[s].buf;
+	sge.length = cb->size;
+	sge.lkey = cb->rdma_mr->lkey;
+
+	memset(&wr, 0, sizeof wr);
+	wr.wr_id = s;
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+
+	if (ibv_post_recv(cb->ud_qp, &wr, &bad_wr)) {
+		fprintf(stderr, "ud post recv error\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Called for the client's first message: the receive ring and the QP
+ * it is posted to, and the answer with what the client needs of them.
+ */
+static int svr_ud_setup(struct rdma_cb *cb, struct iperf_wr *ctx,
+			uint32_t size)
+{
+	uint32_t mtu = iperf_ud_mtu(cb);
+	int i;
+
+	if (size > mtu)
+		size = mtu;
+	if (iperf_setup_ring(cb, cb->depth, size + IPERF_UD_GRH))
+		return -1;
+	if (iperf_ud_create(cb, cb->ring_depth))
+		return -1;
+	for (i = 0; i < cb->ring_depth; i++)
+		if (iperf_ud_post_recv(cb, i))
+			return -1;
+	cb->ud_held = 0;
+	DEBUG_LOG("%d receives of %d byte datagrams\n", cb->ring_depth, size);
+
+	if (ctx && iperf_post_recv(cb, ctx->slot)) {
+		fprintf(stderr, "post recv error\n");
+		return -1;
+	}
+	return svr_reply(cb, &cb->ctrl_ctx, NULL, cb->ud_qp->qp_num, size);
+}
+
+/*
+ * Hand out the datagrams that came in, up to max of them. Their
+ * receives are posted again on the next call, so msg must be the
+ * same array every time. With none in, look for the client's FIN on
+ * the RC connection. Returns how many, 0 once FIN was answered and
+ * none is left ahead of it, -1 on error.
+ */
+int svr_ud_recv(struct rdma_cb *cb, struct iperf_ud_msg *msg, int max)
+{
+	struct ibv_wc wc[IPERF_WC_BATCH];
+	int i, n;
+
+	for (i = 0; i < cb->ud_held; i++)
+		if (iperf_ud_post_recv(cb, msg[i].slot))
+			return -1;
+	cb->ud_held = 0;
+	if (max > IPERF_WC_BATCH)
+		max = IPERF_WC_BATCH;
+
+	for (;;) {
+		n = ibv_poll_cq(cb->ud_cq, max, wc);
+		if (n < 0) {
+			fprintf(stderr, "ud ibv_poll_cq failed\n");
+			return -1;
+		}
+		if (n > 0)
+			break;
+		if (cb->fin == 2)
+			return 0;
+		n = iperf_try_wc(cb, wc, IPERF_WC_BATCH);
+		if (n < 0 || svr_rdma_handle(cb, wc, n) < 0)
+			return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (wc[i].status)
+			return iperf_wc_error(cb, &wc[i]);
+		msg[i].slot = (int) wc[i].wr_id;
+		msg[i].buf = cb->ring[msg[i].slot].buf + IPERF_UD_GRH;
+		msg[i].len = wc[i].byte_len - IPERF_UD_GRH;
+	}
+	cb->ud_held = n;
+	return n;
+}
+
+
+/*
+ * Latency modes (-G lw, ls, lr).
+ *
+ * One message is in flight at a time, over a ring of IPERF_LAT_DEPTH
+ * slots on either side: slot 0 goes out, the peer's message lands in
+ * slot 1. In write mode each side WRITEs into the peer's slot 1 and
+ * spins on the last byte of its own, which carries a sequence number
+ * that changes every round. Send mode does the same with SEND/RECV,
+ * immediate data telling pings from control messages. In read mode
+ * the client READs the server's slot 0 and the server only waits for
+ * FIN. Completions are polled without ever blocking, so nothing on
+ * the round trip sleeps, takes a semaphore or asks for the time of
+ * day.
+ */
+
+/*
+ * Cheap timestamps for the hot path: the TSC where there is one,
+ * CLOCK_MONOTONIC otherwise. iperf_cycles_per_usec() calibrates them
+ * once against gettimeofday().
+ */
+uint64_t iperf_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	uint32_t lo, hi;
+
+	__asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t) hi << 32) | lo;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
 
-	ret = rdma_connect(cb->cm_id, &conn_param);
-	if (ret) {
-		perror("rdma_connect");
-		return ret;
-	}
+static double iperf_cpu_mhz;
+static pthread_once_t iperf_cpu_once = PTHREAD_ONCE_INIT;
 
-	sem_wait(&cb->sem);
-	if (cb->state != CONNECTED) {
-		fprintf(stderr, "wait for CONNECTED state %d\n", cb->state);
-		return -1;
-	}
+static void iperf_calibrate(void)
+{
+	struct timeval t0, t1;
+	uint64_t c0, c1;
+	double usec;
 
-	DEBUG_LOG("rdma_connect successful\n");
-	return 0;
+	gettimeofday(&t0, NULL);
+	c0 = iperf_cycles();
+	do {
+		gettimeofday(&t1, NULL);
+		usec = (t1.tv_sec - t0.tv_sec) * 1e6 +
+		       (t1.tv_usec - t0.tv_usec);
+	} while (usec < 50000);
+	c1 = iperf_cycles();
+	iperf_cpu_mhz = (c1 - c0) / usec;
+	DEBUG_LOG("%.1f cycles per usec\n", iperf_cpu_mhz);
 }
 
+double iperf_cycles_per_usec(void)
+{
+	pthread_once(&iperf_cpu_once, iperf_calibrate);
+	return iperf_cpu_mhz;
+}
 
-int iperf_accept(struct rdma_cb *cb)
+static int iperf_hist_index(uint64_t ns)
 {
-	struct rdma_conn_param conn_param;
-	int ret;
+	int shift;
 
-	DEBUG_LOG("accepting client connection request\n");
+	if (ns < (2 << IPERF_HIST_SUB_BITS))
+		return (int) ns;
+	shift = 63 - __builtin_clzll(ns) - IPERF_HIST_SUB_BITS;
+	return (shift << IPERF_HIST_SUB_BITS) + (int) (ns >> shift);
+}
 
-	memset(&conn_param, 0, sizeof conn_param);
-	conn_param.responder_resources = 1;
-	conn_param.initiator_depth = 1;
+/* middle of the bucket */
+static uint64_t iperf_hist_value(int idx)
+{
+	int shift;
 
-	DPRINTF(("tid %ld, child_cm_id %p\n", pthread_self(), cb->child_cm_id));
+	if (idx < (2 << IPERF_HIST_SUB_BITS))
+		return idx;
+	shift = (idx >> IPERF_HIST_SUB_BITS) - 1;
+	return ((uint64_t) (idx - (shift << IPERF_HIST_SUB_BITS)) << shift) +
+	       ((1ULL << shift) >> 1);
+}
 
-	ret = rdma_accept(cb->child_cm_id, &conn_param);
-	if (ret) {
-		perror("rdma_accept");
-		return ret;
+void iperf_hist_reset(struct iperf_lat_hist *h)
+{
+	memset(h, 0, sizeof *h);
+}
+
+void iperf_hist_add(struct iperf_lat_hist *h, uint64_t ns)
+{
+	if (h->count == 0 || ns < h->min)
+		h->min = ns;
+	if (ns > h->max)
+		h->max = ns;
+	h->count++;
+	h->sum += ns;
+	h->bucket[iperf_hist_index(ns)]++;
+}
+
+void iperf_hist_merge(struct iperf_lat_hist *dst, struct iperf_lat_hist *src)
+{
+	int i;
+
+	if (src->count == 0)
+		return;
+	if (dst->count == 0 || src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+	dst->count += src->count;
+	dst->sum += src->sum;
+	for (i = 0; i < IPERF_HIST_BUCKETS; i++)
+		dst->bucket[i] += src->bucket[i];
+}
+
+/*
+ * The smallest sample at least a fraction q of all samples are not
+ * above, to within a bucket.
+ */
+uint64_t iperf_hist_quantile(struct iperf_lat_hist *h, double q)
+{
+	uint64_t want, seen = 0, v;
+	int i;
+
+	if (h->count == 0)
+		return 0;
+	want = (uint64_t) (q * h->count);
+	if (want < 1)
+		want = 1;
+	for (i = 0; i < IPERF_HIST_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen >= want)
+			break;
 	}
+	v = iperf_hist_value(i);
+	return v < h->min ? h->min : v > h->max ? h->max : v;
+}
 
-	sem_wait(&cb->sem);
-	if (cb->state == ERROR) {
-		fprintf(stderr, "wait for CONNECTED state %d\n", cb->state);
-		return -1;
+static int lat_handle_wc(struct rdma_cb *cb, struct ibv_wc *wc)
+{
+	struct iperf_wr *ctx = (struct iperf_wr *) (unsigned long) wc->wr_id;
+	int ret, acked = 0;
+
+	if (wc->status)
+		return iperf_wc_error(cb, wc);
+
+	switch (ctx->type) {
+	case IPERF_WR_RDMA:
+		/* our ping or pong is out, or the READ is back */
+		cb->outstanding--;
+		return 0;
+	case IPERF_WR_RECV:
+		if (wc->wc_flags & IBV_WC_WITH_IMM) {
+			cb->lat_rcvd++;
+			return iperf_post_recv(cb, ctx->slot) ? -1 : 0;
+		}
+		if (cb->server)
+			return svr_handle_recv(cb, ctx, wc) ? -1 : 0;
+		return cli_handle_wc(cb, wc, &acked) < 0 ? -1 : 0;
+	case IPERF_WR_DATA:
+		/* shared receives, see svr_handle_data() */
+		ret = svr_handle_data(cb, ctx, wc);
+		if (ret > 0)
+			cb->lat_rcvd++;
+		return ret < 0 ? -1 : 0;
+	default:
+		if (ctx == &cb->ctrl_ctx && cb->server && cb->fin)
+			cb->fin = 2;	/* FIN acknowledged */
+		return 0;
 	}
-	DPRINTF(("iperf_accept finish with state %d\n", cb->state));
-	return 0;
 }
 
+/*
+ * Look at the CQ once, without waiting.
+ */
+static int lat_poll(struct rdma_cb *cb)
+{
+	struct ibv_wc wc[IPERF_WC_BATCH];
+	int i, n;
+
+	n = iperf_try_wc(cb, wc, IPERF_WC_BATCH);
+	for (i = 0; i < n; i++)
+		if (lat_handle_wc(cb, &wc[i]))
+			return -1;
+	return n < 0 ? -1 : 0;
+}
 
-void iperf_format_send(struct rdma_cb *cb, char *buf, struct ibv_mr *mr)
+static int lat_drain(struct rdma_cb *cb)
 {
-	struct iperf_rdma_info *info = &cb->send_buf;
+	while (cb->outstanding > 0)
+		if (lat_poll(cb))
+			return -1;
+	return 0;
+}
 
-	info->buf = htonll((uint64_t) (unsigned long) buf);
-	info->rkey = htonl(mr->rkey);
-	info->size = htonl(cb->size);
-	
-	switch ( cb->trans_mode ) {
-	case kRdmaTrans_ActRead:
-		info->mode = htonl(MODE_RDMA_ACTRD);
+/*
+ * Send slot 0, ending in lat_seq, to the peer's slot 1, or READ the
+ * peer's slot 0 into our slot 1.
+ */
+static int lat_post(struct rdma_cb *cb)
+{
+	struct iperf_slot *out = &cb->ring[0], *in = &cb->ring[1];
+	struct ibv_send_wr wr, *bad_wr;
+	struct ibv_sge sge;
+	int ret;
+
+	if (lat_drain(cb))
+		return -1;
+
+	out->len = in->len = cb->size;
+	out->buf[cb->size - 1] = cb->lat_seq;
+
+	switch (cb->trans_mode) {
+	case kRdmaTrans_LatWrite:
+		ret = iperf_post_rdma(cb, out, IBV_WR_RDMA_WRITE,
+				      cb->remote_addr + cb->remote_len,
+				      cb->remote_rkey);
 		break;
-	case kRdmaTrans_ActWrte:
-		info->mode = htonl(MODE_RDMA_ACTWR);
+	case kRdmaTrans_LatRead:
+		ret = iperf_post_rdma(cb, in, IBV_WR_RDMA_READ,
+				      cb->remote_addr, cb->remote_rkey);
 		break;
-	case kRdmaTrans_PasRead:
-		info->mode = htonl(MODE_RDMA_PASRD);
+	default:
+		sge.addr = (uint64_t) (unsigned long) out->buf;
+		sge.length = cb->size;
+		sge.lkey = cb->rdma_mr->lkey;
+
+		memset(&wr, 0, sizeof wr);
+		wr.wr_id = (uint64_t) (unsigned long) &out->rdma_ctx;
+		wr.opcode = IBV_WR_SEND_WITH_IMM;
+		wr.send_flags = IBV_SEND_SIGNALED;
+		wr.imm_data = htonl(cb->lat_seq);
+		wr.sg_list = &sge;
+		wr.num_sge = 1;
+
+		ret = ibv_post_send(cb->qp, &wr, &bad_wr);
+		if (ret)
+			fprintf(stderr, "post send error %d\n", ret);
 		break;
-	case kRdmaTrans_PasWrte:
-		info->mode = htonl(MODE_RDMA_PASWR);
+	}
+	if (ret)
+		return -1;
+	cb->outstanding++;
+	return 0;
+}
+
+/*
+ * One round trip. Returns 0 and the iperf_cycles() it started and
+ * ended at, or -1 on error.
+ */
+int cli_lat_ping(struct rdma_cb *cb, uint64_t *sent, uint64_t *rcvd)
+{
+	volatile unsigned char *in =
+		(unsigned char *) cb->ring[1].buf + cb->size - 1;
+	int spin = 0;
+
+	/* the last ping's completion must not be timed */
+	if (lat_drain(cb))
+		return -1;
+	cb->lat_seq = cb->lat_seq % 255 + 1;
+
+	*sent = iperf_cycles();
+	if (lat_post(cb))
+		return -1;
+
+	switch (cb->trans_mode) {
+	case kRdmaTrans_LatWrite:
+		while (*in != cb->lat_seq) {
+			/* still look for errors once in a while */
+			if (++spin == IPERF_LAT_SPIN) {
+				spin = 0;
+				if (lat_poll(cb))
+					return -1;
+			}
+		}
+		break;
+	case kRdmaTrans_LatSend:
+		while (cb->lat_rcvd == 0)
+			if (lat_poll(cb))
+				return -1;
+		cb->lat_rcvd--;
 		break;
 	default:
-		fprintf(stderr, "unrecognize transfer mode %d\n", \
-			cb->trans_mode);
+		if (lat_drain(cb))
+			return -1;
 		break;
 	}
-
-	DEBUG_LOG("RDMA addr %" PRIx64" rkey %x len %d\n",
-		  ntohll(info->buf), ntohl(info->rkey), ntohl(info->size));
+	*rcvd = iperf_cycles();
+	return 0;
 }
 
-
-int cli_act_rdma_rd(struct rdma_cb *cb)
+/*
+ * Answer pings until FIN, or until IPERF_LAT_BATCH of them are done
+ * so the caller gets to report. Returns the bytes received, 0 after
+ * FIN, -1 on error.
+ */
+int svr_lat_pong(struct rdma_cb *cb)
 {
-	return 0;
+	volatile unsigned char *in =
+		(unsigned char *) cb->ring[1].buf + cb->size - 1;
+	int rounds = 0, spin = 0;
+
+	/* the client READs on its own */
+	if (cb->trans_mode == kRdmaTrans_LatRead)
+		return svr_pas_rdma_xfer(cb);
+
+	while (rounds < IPERF_LAT_BATCH && cb->fin != 2) {
+		if (cb->trans_mode == kRdmaTrans_LatWrite ?
+		    *in != cb->lat_seq : cb->lat_rcvd > 0) {
+			if (cb->trans_mode == kRdmaTrans_LatWrite)
+				cb->lat_seq = *in;
+			else
+				cb->lat_rcvd--;
+			if (lat_post(cb))
+				return -1;
+			rounds++;
+			continue;
+		}
+		if (cb->trans_mode == kRdmaTrans_LatSend ||
+		    ++spin == IPERF_LAT_SPIN) {
+			spin = 0;
+			if (lat_poll(cb))
+				return -1;
+		}
+	}
+	return rounds * cb->size;
 }
 
-int cli_act_rdma_wr(struct rdma_cb *cb)
+
+/*
+ * Atomics (-G fa, -G cs).
+ *
+ * The server registers one region of IPERF_ATOMIC_WORDS words per
+ * device, a cache line apart, and advertises it to every atomic
+ * client, so all streams on a device contend for the same words. The
+ * client keeps up to granted FETCH_AND_ADDs or CMP_AND_SWPs in flight,
+ * round robin over the first atomic_words words, and times each one
+ * from post to completion. Every WR is signaled and RC completes them
+ * in order, so the slots are used as a plain ring.
+ */
+
+int iperf_is_atomic(struct rdma_cb *cb)
 {
-	return 0;
+	return cb->trans_mode == kRdmaTrans_FetchAdd ||
+	       cb->trans_mode == kRdmaTrans_CmpSwap;
 }
 
-int cli_pas_rdma_rd(struct rdma_cb *cb)
+static int iperf_atomic_region(struct rdma_cb *cb)
 {
-	int err;
-	struct ibv_send_wr* bad_wr;
-	
-	cb->state = RDMA_READ_ADV;
-	
-	iperf_format_send(cb, cb->start_buf, cb->start_mr);
+	struct iperf_rdma_dev *dev = cb->dev;
+	size_t len = IPERF_ATOMIC_WORDS * IPERF_ATOMIC_STRIDE;
+	int mem = cb->mem;
 
-	err = ibv_post_send(cb->qp, &cb->sq_wr, &bad_wr);
-	if (err) {
-		fprintf(stderr, "post send error %d\n", err);
-		return -err;
+	pthread_mutex_lock(&dev->lock);
+	if (!dev->atomic_mr) {
+		dev->atomic_buf = iperf_mem_alloc(len, &mem, dev->node);
+		if (dev->atomic_buf) {
+			memset(dev->atomic_buf, 0, len);
+			dev->atomic_mr = ibv_reg_mr(cb->pd, dev->atomic_buf, len,
+						    IBV_ACCESS_LOCAL_WRITE |
+						    IBV_ACCESS_REMOTE_READ |
+						    IBV_ACCESS_REMOTE_ATOMIC);
+			if (!dev->atomic_mr) {
+				iperf_mem_free(dev->atomic_buf);
+				dev->atomic_buf = NULL;
+			}
+		}
 	}
-	DPRINTF(("client ibv_post_send success\n"));
+	pthread_mutex_unlock(&dev->lock);
 
-	/* Wait for server to ACK read complete */
-	DPRINTF(("client RunRDMA cb @ %x\n", (unsigned long)cb));
-	DPRINTF(("client RunRDMA sem_wait @ %x\n", (unsigned long)&cb->sem));
-	DPRINTF(("wait server to say go ahead\n"));
-	sem_wait(&cb->sem);
-	if (cb->state != RDMA_WRITE_ADV) {
-		fprintf(stderr, "wait for RDMA_WRITE_ADV state %d\n",
-			cb->state);
-		err = -1;
-		return err;
+	if (!dev->atomic_mr) {
+		fprintf(stderr, "atomic region reg_mr failed\n");
+		return -1;
 	}
-	DPRINTF(("client: server ACK read complete success\n"));
-	
-	return cb->size;
+	return 0;
 }
 
-int cli_pas_rdma_wr(struct rdma_cb *cb)
+/* advertise the device's words, then only FIN is left to come */
+static int svr_atomic_setup(struct rdma_cb *cb, struct iperf_wr *ctx)
 {
-	int err;
-	struct ibv_send_wr* bad_wr;
-	
-	cb->state = RDMA_WRITE_ADV;
-
-	iperf_format_send(cb, cb->rdma_buf, cb->rdma_mr);
-	err = ibv_post_send(cb->qp, &cb->sq_wr, &bad_wr);
-	if (err) {
-		fprintf(stderr, "post send error %d\n", err);
-		return -err;
+	if (iperf_atomic_region(cb))
+		return -1;
+	if (ctx && iperf_post_recv(cb, ctx->slot)) {
+		fprintf(stderr, "post recv error\n");
+		return -1;
 	}
-	DPRINTF(("cli_pas_rdma_wr: ibv_post_send success\n"));
+	return svr_reply(cb, &cb->ctrl_ctx, cb->dev->atomic_buf,
+			 cb->dev->atomic_mr->rkey,
+			 IPERF_ATOMIC_WORDS * IPERF_ATOMIC_STRIDE);
+}
 
-	/* Wait for the server to say the RDMA Write is complete. */
-	sem_wait(&cb->sem);
-	if (cb->state != RDMA_WRITE_COMPLETE) {
-		fprintf(stderr, "wait for RDMA_WRITE_COMPLETE state %d\n",
-			cb->state);
-		err = -1;
-		return err;
+/*
+ * The client works on our words on its own; all we see is FIN.
+ */
+int svr_atomic_wait(struct rdma_cb *cb)
+{
+	return svr_pas_rdma_xfer(cb);
+}
+
+/*
+ * Get the server's words. Fails early on a device without atomics.
+ */
+int cli_atomic_start(struct rdma_cb *cb)
+{
+	struct ibv_device_attr attr;
+	int words;
+
+	if (ibv_query_device(cb->cm_id->verbs, &attr) == 0 &&
+	    attr.atomic_cap == IBV_ATOMIC_NONE) {
+		fprintf(stderr, "%s has no atomic operations\n",
+			ibv_get_device_name(cb->cm_id->verbs->device));
+		return -1;
 	}
-	DPRINTF(("cli_pas_rdma_wr: RDMA_WRITE_COMPLETE\n"));
+	if (cli_ctrl_exchange(cb, 0, 0, cb->size))
+		return -1;
 
-	return cb->size;
+	words = cb->remote_len / IPERF_ATOMIC_STRIDE;
+	if (cb->atomic_words < 1)
+		cb->atomic_words = 1;
+	if (cb->atomic_words > words)
+		cb->atomic_words = words;
+	cb->atomic_seen = (uint64_t *) calloc(cb->atomic_words,
+					      sizeof(uint64_t));
+	return cb->atomic_seen ? 0 : -1;
 }
 
-int svr_act_rdma_rd(struct rdma_cb *cb)
+static int atomic_post(struct rdma_cb *cb)
 {
+	struct iperf_slot *slot = &cb->ring[cb->next_slot];
+	struct ibv_send_wr wr, *bad_wr;
+	struct ibv_sge sge;
 	int ret;
-	
-	struct ibv_send_wr *bad_send_wr;
-	struct ibv_recv_wr *bad_recv_wr;
-	
-	/* Issue RDMA Read. */
-	cb->rdma_sq_wr.opcode = IBV_WR_RDMA_READ;
-	cb->rdma_sq_wr.wr.rdma.rkey = cb->remote_rkey;
-	cb->rdma_sq_wr.wr.rdma.remote_addr = cb->remote_addr;
-	cb->rdma_sq_wr.sg_list->length = cb->remote_len;
-	
-	ret = ibv_post_send(cb->qp, &cb->rdma_sq_wr, &bad_send_wr);
-	if (ret) {
-		fprintf(stderr, "post send error %d\n", ret);
-		return ret;
-	}
-	DEBUG_LOG("server posted rdma read req\n");
-//if (cb->firstrans == 0)
-//printf("@ %x server posted rdma read req\n", (unsigned long)&cb->sem);
-	/* Wait for read completion */
-	sem_wait(&cb->sem);
-	if (cb->state != RDMA_READ_COMPLETE) {
-		fprintf(stderr, "wait for RDMA_READ_COMPLETE state %d\n",
-			cb->state);
-		ret = -1;
-		return ret;
+
+	slot->word = cb->atomic_next;
+	cb->atomic_next = (cb->atomic_next + 1) % cb->atomic_words;
+
+	sge.addr = (uint64_t) (unsigned long) slot->buf;
+	sge.length = sizeof(uint64_t);
+	sge.lkey = cb->rdma_mr->lkey;
+
+	memset(&wr, 0, sizeof wr);
+	wr.wr_id = (uint64_t) (unsigned long) &slot->rdma_ctx;
+	wr.send_flags = IBV_SEND_SIGNALED;
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	wr.wr.atomic.remote_addr = cb->remote_addr +
+				   (uint64_t) slot->word * IPERF_ATOMIC_STRIDE;
+	wr.wr.atomic.rkey = cb->remote_rkey;
+	if (cb->trans_mode == kRdmaTrans_CmpSwap) {
+		/* take the word from what we saw last to one more */
+		slot->expect = cb->atomic_seen[slot->word];
+		wr.opcode = IBV_WR_ATOMIC_CMP_AND_SWP;
+		wr.wr.atomic.compare_add = slot->expect;
+		wr.wr.atomic.swap = slot->expect + 1;
+	} else {
+		wr.opcode = IBV_WR_ATOMIC_FETCH_AND_ADD;
+		wr.wr.atomic.compare_add = 1;
 	}
-	DEBUG_LOG("server received read complete\n");
-//if (cb->firstrans == 0)
-//printf("@ %x server received read complete\n", (unsigned long)&cb->sem);
-	/* Display data in recv buf */
-	if (cb->verbose)
-		printf("server ping data: %s\n", cb->rdma_buf);
-	
-	/* write data to file output */
-	if (cb->outputfile != NULL)
-	    if ( fwrite( cb->rdma_buf, cb->remote_len, 1, cb->outputfile ) < 0 )
-	        fprintf( stderr, "Unable to write to the file stream\n");
 
-	/* Tell client to continue */
-	ret = ibv_post_send(cb->qp, &cb->sq_wr, &bad_send_wr);
+	slot->posted = iperf_cycles();
+	ret = ibv_post_send(cb->qp, &wr, &bad_wr);
 	if (ret) {
 		fprintf(stderr, "post send error %d\n", ret);
-		return ret;
+		return -1;
 	}
-	DEBUG_LOG("server posted go ahead\n");
-//if (cb->firstrans == 0)
-//printf("@ %x server posted go ahead\n", (unsigned long)&cb->sem);
-//cb->firstrans = 1;
-	/* Wait for client's RDMA STAG/TO/Len
-	sem_wait(&mCb->sem);
-	if (mCb->state != RDMA_WRITE_ADV) {
-		fprintf(stderr, "wait for RDMA_WRITE_ADV state %d\n",
-			mCb->state);
-		ret = -1;
-		break;
-	}
-	DEBUG_LOG("server received sink adv\n"); */
-
-	/* RDMA Write echo data
-	mCb->rdma_sq_wr.opcode = IBV_WR_RDMA_WRITE;
-	mCb->rdma_sq_wr.wr.rdma.rkey = mCb->remote_rkey;
-	mCb->rdma_sq_wr.wr.rdma.remote_addr = mCb->remote_addr;
-	mCb->rdma_sq_wr.sg_list->length = strlen(mCb->rdma_buf) + 1;
-	DEBUG_LOG("rdma write from lkey %x laddr %x len %d\n",
-		  mCb->rdma_sq_wr.sg_list->lkey,
-		  mCb->rdma_sq_wr.sg_list->addr,
-		  mCb->rdma_sq_wr.sg_list->length);
-
-	ret = ibv_post_send(mCb->qp, &mCb->rdma_sq_wr, &bad_send_wr);
-	if (ret) {
-		fprintf(stderr, "post send error %d\n", ret);
-		break;
-	} */
+	cb->next_slot = (cb->next_slot + 1) % cb->granted;
+	cb->outstanding++;
+	return 0;
+}
 
-	/* Wait for completion
-	ret = sem_wait(&mCb->sem);
-	if (mCb->state != RDMA_WRITE_COMPLETE) {
-		fprintf(stderr, "wait for RDMA_WRITE_COMPLETE state %d\n",
-			mCb->state);
-		ret = -1;
-		break;
+/* one completion: 1 for an atomic done, 0 for anything else */
+static int atomic_handle_wc(struct rdma_cb *cb, struct ibv_wc *wc,
+			    struct iperf_lat_hist *h, uint64_t now)
+{
+	struct iperf_wr *ctx = (struct iperf_wr *) (unsigned long) wc->wr_id;
+	struct iperf_slot *slot;
+	uint64_t old;
+	int acked = 0;
+
+	if (wc->status)
+		return iperf_wc_error(cb, wc);
+	if (ctx->type != IPERF_WR_RDMA)
+		return cli_handle_wc(cb, wc, &acked) < 0 ? -1 : 0;
+
+	slot = &cb->ring[ctx->slot];
+	if (h)
+		iperf_hist_add(h, (uint64_t) ((now - slot->posted) * 1000 /
+					      iperf_cycles_per_usec()));
+	if (cb->trans_mode == kRdmaTrans_CmpSwap) {
+		old = *(uint64_t *) slot->buf;
+		cb->cas_tries++;
+		if (old == slot->expect) {
+			cb->cas_won++;
+			old++;
+		}
+		cb->atomic_seen[slot->word] = old;
 	}
-	DEBUG_LOG("server rdma write complete \n"); */
+	cb->outstanding--;
+	return 1;
+}
 
-	/* Tell client to begin again
-	ret = ibv_post_send(mCb->qp, &mCb->sq_wr, &bad_send_wr);
-	if (ret) {
-		fprintf(stderr, "post send error %d\n", ret);
-		break;
+/*
+ * Fill the ring with atomics and wait for at least one to finish,
+ * adding the latencies to h. Returns the operations done and the
+ * iperf_cycles() they were reaped at in *done, or -1 on error.
+ */
+int cli_atomic_xfer(struct rdma_cb *cb, struct iperf_lat_hist *h,
+		    uint64_t *done)
+{
+	struct ibv_wc wc[IPERF_WC_BATCH];
+	int i, n, ret, ops = 0;
+
+	while (cb->outstanding < cb->granted)
+		if (atomic_post(cb))
+			return -1;
+
+	while (ops == 0) {
+		n = iperf_try_wc(cb, wc, IPERF_WC_BATCH);
+		if (n < 0)
+			return -1;
+		*done = iperf_cycles();
+		for (i = 0; i < n; i++) {
+			ret = atomic_handle_wc(cb, &wc[i], h, *done);
+			if (ret < 0)
+				return -1;
+			ops += ret;
+		}
 	}
-	DEBUG_LOG("server posted go ahead\n"); */
+	return ops;
+}
+
+static int atomic_drain(struct rdma_cb *cb)
+{
+	struct ibv_wc wc[IPERF_WC_BATCH];
+	int i, n;
 
-	return cb->remote_len;
+	while (cb->outstanding > 0) {
+		n = iperf_try_wc(cb, wc, IPERF_WC_BATCH);
+		if (n < 0)
+			return -1;
+		for (i = 0; i < n; i++)
+			if (atomic_handle_wc(cb, &wc[i], NULL, 0) < 0)
+				return -1;
+	}
+	return 0;
 }
 
-int svr_act_rdma_wr(struct rdma_cb *cb)
+
+/*
+ * Worker pool (-X workers=#).
+ *
+ * Rather than a thread per connection, and one more on its CQ, each of
+ * a few workers runs an epoll loop over the connections it was handed:
+ * over a CM event channel of its own, to which their ids migrate, and
+ * over their completion channels. Nothing here may wait; the worker
+ * itself is in Server.cpp.
+ */
+
+/*
+ * Can the connection run on a worker? Its first message must have come
+ * with the connect request, so the mode is known, and must not ask for
+ * a latency mode, which spins on its round trips.
+ */
+int iperf_worker_ok(struct iperf_pdata *pdata)
 {
-	int ret;
-	
-	struct ibv_send_wr *bad_send_wr;
-	struct ibv_recv_wr *bad_recv_wr;
-
-	/* Wait for client's RDMA STAG/TO/Len */
-	if ( cb->state == RDMA_READ_ADV ) // established, key recved
-		cb->state = RDMA_WRITE_ADV;
-	else {// established, key not recved
-		cb->state = RDMA_READ_COMPLETE;
-		sem_wait(&cb->sem);
-	}
-	DPRINTF(("sem_wait @ %x RDMA_WRITE_ADV\n", \
-		(unsigned long)&cb->sem));
-	if (cb->state != RDMA_WRITE_ADV) {
-		fprintf(stderr, "wait for RDMA_WRITE_ADV state %d\n",
-			cb->state);
-		ret = -1;
-		return ret;
+	if (pdata->magic != htonl(IPERF_PDATA_MAGIC))
+		return 0;
+	switch (ntohl(pdata->info.mode)) {
+	case MODE_RDMA_LATWR:
+	case MODE_RDMA_LATSN:
+	case MODE_RDMA_LATRD:
+	case MODE_RDMA_UD:
+		return 0;
+	default:
+		return 1;
 	}
-	DEBUG_LOG("server received sink adv\n");
-
-	/* RDMA Write echo data */
-	cb->rdma_sq_wr.opcode = IBV_WR_RDMA_WRITE;
-	cb->rdma_sq_wr.wr.rdma.rkey = cb->remote_rkey;
-	cb->rdma_sq_wr.wr.rdma.remote_addr = cb->remote_addr;
-//	cb->rdma_sq_wr.sg_list->length = strlen(cb->rdma_buf) + 1;
-	cb->rdma_sq_wr.sg_list->length = cb->remote_len;
-/* ?????????????? */
-	DEBUG_LOG("rdma write from lkey %x laddr %x len %d\n",
-		  cb->rdma_sq_wr.sg_list->lkey,
-		  cb->rdma_sq_wr.sg_list->addr,
-		  cb->rdma_sq_wr.sg_list->length);
-	
-	ret = ibv_post_send(cb->qp, &cb->rdma_sq_wr, &bad_send_wr);
-	if (ret) {
-		fprintf(stderr, "post send error %d\n", ret);
-		return -ret;
+}
+
+static int iperf_set_nonblock(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		perror("fcntl");
+		return -1;
 	}
+	return 0;
+}
 
-	/* Wait for completion */
-	ret = sem_wait(&cb->sem);
-	if (cb->state != RDMA_WRITE_COMPLETE) {
-		fprintf(stderr, "wait for RDMA_WRITE_COMPLETE state %d\n",
-			cb->state);
-		ret = -1;
-		return ret;
+/*
+ * A worker's CM channel, read only when epoll says so.
+ */
+struct rdma_event_channel *iperf_worker_channel(void)
+{
+	struct rdma_event_channel *ch;
+
+	ch = rdma_create_event_channel();
+	if (!ch) {
+		perror("rdma_create_event_channel");
+		return NULL;
+	}
+	if (iperf_set_nonblock(ch->fd)) {
+		rdma_destroy_event_channel(ch);
+		return NULL;
 	}
-	DEBUG_LOG("server rdma write complete \n");
+	return ch;
+}
 
-	/* Tell client to begin again */
-	ret = ibv_post_send(cb->qp, &cb->sq_wr, &bad_send_wr);
-	if (ret) {
-		fprintf(stderr, "post send error %d\n", ret);
-		return -ret;
+/*
+ * Give the connection to the worker reading channel, before its QP is
+ * set up: the CQ gets a completion channel of its own and is reaped by
+ * the worker, and CM events come to the worker's channel from now on.
+ */
+int iperf_worker_attach(struct rdma_cb *cb, struct rdma_event_channel *ch)
+{
+	cb->cq_mode = IPERF_CQ_WORKER;
+	cb->shared_cqs = 0;
+	if (rdma_migrate_id(cb->child_cm_id, ch)) {
+		perror("rdma_migrate_id");
+		return -1;
 	}
-	DEBUG_LOG("server posted go ahead\n");
+	return 0;
+}
 
-	return cb->remote_len;
+/*
+ * The completion channel to watch, once iperf_setup_qp() made it.
+ */
+int iperf_worker_fd(struct rdma_cb *cb)
+{
+	if (iperf_set_nonblock(cb->channel->fd))
+		return -1;
+	return cb->channel->fd;
 }
 
-int svr_pas_rdma_rd(struct rdma_cb *cb)
+/*
+ * The completion channel is readable: take its events and arm the CQ
+ * again. The caller polls it dry afterwards, or a completion landing
+ * before the arm would never be seen.
+ */
+int iperf_worker_arm(struct rdma_cb *cb)
 {
+	struct ibv_cq *ev_cq;
+	void *ev_ctx;
+	unsigned int n = 0;
+
+	while (ibv_get_cq_event(cb->channel, &ev_cq, &ev_ctx) == 0)
+		n++;
+	if (errno != EAGAIN) {
+		fprintf(stderr, "Failed to get cq event!\n");
+		return -1;
+	}
+	if (n == 0)
+		return 0;
+	ibv_ack_cq_events(cb->cq, n);
+	cb->cq_events += n;
+	if (ibv_req_notify_cq(cb->cq, 0)) {
+		fprintf(stderr, "Failed to set notify!\n");
+		return -1;
+	}
 	return 0;
 }
 
-int svr_pas_rdma_wr(struct rdma_cb *cb)
+/*
+ * Take one event off a worker's CM channel and run it through the
+ * handler. Returns its connection, with the event in *event, or -1
+ * there if it failed the connection; NULL once there are none.
+ */
+struct rdma_cb *iperf_worker_cm(struct rdma_event_channel *ch, int *event)
+{
+	struct rdma_cm_event *ev;
+	struct rdma_cb *cb;
+
+	if (rdma_get_cm_event(ch, &ev)) {
+		if (errno != EAGAIN)
+			perror("rdma_get_cm_event");
+		return NULL;
+	}
+	cb = ev->id->context;
+	*event = ev->event;
+	iperf_cma_event_handler(ev->id, ev);
+	if (iperf_cm_failed(ev->event))
+		*event = -1;
+	rdma_ack_cm_event(ev);
+	return cb;
+}
+
+
+/*
+ * Mapped file source (-X mmap).
+ *
+ * In passive read the server READs whatever the client points it at,
+ * so with -F the file need not be copied into the ring: the client
+ * maps it and hands out pieces of the mapping slot by slot, and the
+ * server READs them out of the page cache. Where the device pages in
+ * on demand for RC READs the whole mapping is registered once and
+ * faulted in as it is read. Elsewhere IPERF_FILE_CHUNK bytes at a time
+ * are registered and pinned; a slot never spans two chunks, and the
+ * next is only registered once the slots of the one before are done.
+ */
+
+static int iperf_file_odp(struct rdma_cb *cb)
+{
+	struct ibv_device_attr_ex attr;
+
+	memset(&attr, 0, sizeof(attr));
+	if (ibv_query_device_ex(cb->pd->context, NULL, &attr))
+		return 0;
+	return (attr.odp_caps.general_caps & IBV_ODP_SUPPORT) &&
+	       (attr.odp_caps.per_transport_caps.rc_odp_caps &
+		IBV_ODP_SUPPORT_READ);
+}
+
+/* map name, which must not be empty; nothing is registered yet */
+int iperf_file_open(struct rdma_cb *cb, const char *name)
 {
+	struct iperf_file_src *f = &cb->file;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		perror(name);
+		return -1;
+	}
+	if (fstat(fd, &st) || st.st_size == 0) {
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	memset(f, 0, sizeof(*f));
+	f->map = (char *) map;
+	f->len = st.st_size;
+	f->odp = iperf_file_odp(cb);
+	f->chunk = f->odp ? f->len : IPERF_FILE_CHUNK;
 	return 0;
 }
+
+/* let go of the registered chunk, none of whose slots may be out */
+static void iperf_file_unreg(struct rdma_cb *cb)
+{
+	struct iperf_file_src *f = &cb->file;
+
+	if (!f->mr)
+		return;
+	iperf_mr_put(cb, f->mr);
+	/* the cache must not keep it past the mapping */
+	iperf_mrc_drop(&cb->dev->mrc, f->mr);
+	f->mr = NULL;
+}
+
+/*
+ * Point the server at the next piece of the file, a slot's worth at
+ * most, in the slot last returned by iperf_slot_buf(). Returns the
+ * bytes posted, 0 if it has to wait for the slots in flight, -1 on
+ * error. The file is done once cb->file.off reaches cb->file.len.
+ */
+int iperf_file_post(struct rdma_cb *cb)
+{
+	struct iperf_file_src *f = &cb->file;
+	int access = IBV_ACCESS_REMOTE_READ |
+		     (f->odp ? IBV_ACCESS_ON_DEMAND : 0);
+	unsigned long start;
+	size_t len, end;
+
+	if (!f->mr || f->off >= f->reg_off + f->chunk) {
+		if (f->mr && cb->outstanding > 0)
+			return 0;
+		iperf_file_unreg(cb);
+
+		start = iperf_usec();
+		f->reg_off = f->off;
+		len = f->len - f->off < f->chunk ? f->len - f->off : f->chunk;
+		f->mr = iperf_mr_get(cb, f->map + f->off, len, access);
+		if (!f->mr) {
+			perror("ibv_reg_mr");
+			return -1;
+		}
+		f->regs++;
+		f->reg_usec += iperf_usec() - start;
+	}
+
+	end = f->reg_off + f->chunk < f->len ? f->reg_off + f->chunk : f->len;
+	len = end - f->off < (size_t) cb->size ? end - f->off : cb->size;
+	if (cli_slot_post(cb, len, f->map + f->off, f->mr))
+		return -1;
+	f->off += len;
+	return len;
+}
+
+void iperf_file_close(struct rdma_cb *cb)
+{
+	struct iperf_file_src *f = &cb->file;
+
+	if (!f->map)
+		return;
+	iperf_file_unreg(cb);
+	munmap(f->map, f->len);
+	f->map = NULL;
+}
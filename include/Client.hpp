@@ -75,6 +75,33 @@ public:
     // RDMA specific version of above;
     void RunRDMA( void );
 
+    // what -E stamped into the buffers sent
+    void ReportStamped( iperf_check_stat *inCheck );
+
+    // RDMA ping-pong latency test
+    void RunRDMALatency( void );
+
+    // RDMA datagrams, paced and stamped like UDP's
+    void RunRDMADatagram( void );
+
+    // RDMA message rate across sizes
+    void RunRDMASweep( void );
+
+    // RDMA throughput over each kind of buffer memory
+    void RunRDMAMemCompare( void );
+
+    // RDMA memory registration cost
+    void RunRDMARegBench( void );
+
+    // RDMA connections opened and closed back to back
+    void RunRDMAConnRate( void );
+
+    // one timed phase of a sweep or comparison
+    double RunRDMAPhase( int size, double phase, max_size_t *totLen );
+
+    // FIN and teardown after either of the above
+    void CloseRDMA( max_size_t totLen, bool ok );
+
     void InitiateServer();
 
     // UDP / TCP
@@ -86,7 +113,7 @@ public:
     void Connect( );
     
     // client connect rdma
-    void ConnectRDMA( );
+    int ConnectRDMA( );
     
     // get control block address
     // void GetRdmaCB( struct rdma_cb **cb );
@@ -94,6 +121,8 @@ public:
 protected:
     thread_Settings *mSettings;
     rdma_cb *mCb;
+    rdma_cb *mConnTmpl;     // -X connrate: mCb before connecting
+    bool mConnected;        // RDMA: ConnectRDMA succeeded
     char* mBuf;
     Timestamp mEndTime;
     Timestamp lastPacketTime;
@@ -82,6 +82,40 @@ extern const char rdma_server_port[];
 
 extern const char rdma_client_port[];
 
+extern const char rdma_depth[];
+
+extern const char rdma_depth_max[];
+
+extern const char rdma_cq_mode[];
+
+extern const char rdma_shared_cqs[];
+
+extern const char rdma_pool[];
+
+extern const char rdma_srq[];
+
+extern const char rdma_credits[];
+
+extern const char rdma_workers[];
+
+extern const char rdma_mmap[];
+
+extern const char rdma_odirect[];
+
+extern const char validate_on[];
+
+extern const char rdma_msgrate[];
+
+extern const char rdma_sge[];
+
+extern const char rdma_mem[];
+
+extern const char rdma_numa[];
+
+extern const char rdma_mrcache[];
+
+extern const char rdma_atomic[];
+
 extern const char bind_address[];
 
 extern const char multicast_ttl[];
@@ -112,6 +146,10 @@ extern const char report_bw_header[];
 
 extern const char report_bw_format[];
 
+extern const char report_latency_header[];
+
+extern const char report_latency_format[];
+
 extern const char report_sum_bw_format[];
 
 extern const char report_bw_jitter_loss_header[];
@@ -124,6 +162,60 @@ extern const char report_outoforder[];
 
 extern const char report_sum_outoforder[];
 
+extern const char report_rdma_cost[];
+
+extern const char report_rdma_cq[];
+
+extern const char report_rdma_connect[];
+
+extern const char report_rdma_recv[];
+
+extern const char report_rdma_msgrate[];
+
+extern const char report_rdma_sweep_header[];
+
+extern const char report_rdma_sweep_format[];
+
+extern const char report_rdma_mem[];
+
+extern const char report_rdma_place[];
+
+extern const char report_rdma_mmap[];
+
+extern const char report_rdma_disk[];
+
+extern const char report_rdma_mem_header[];
+
+extern const char report_rdma_mem_format[];
+
+extern const char report_rdma_mrcache[];
+
+extern const char report_rdma_atomic[];
+
+extern const char report_rdma_cas[];
+
+extern const char report_rdma_credits[];
+
+extern const char report_stamped[];
+
+extern const char report_checked[];
+
+extern const char report_rdma_reg_header[];
+
+extern const char report_rdma_reg_format[];
+
+extern const char report_rdma_conn_header[];
+
+extern const char report_rdma_conn_format[];
+
+extern const char report_rdma_conn_sum_format[];
+
+extern const char report_rdma_conn[];
+
+extern const char report_rdma_conn_sum[];
+
+extern const char report_rdma_rnr[];
+
 extern const char report_peer[];
 
 extern const char report_mss_unsupported[];
@@ -138,6 +230,8 @@ extern const char server_reporting[];
 
 extern const char reportCSV_peer[];
 
+extern const char reportCSV_rdma_sweep_format[];
+
 extern const char reportCSV_bw_format[];
 
 extern const char reportCSV_bw_jitter_loss_format[];
@@ -186,6 +280,24 @@ extern const char warn_invalid_report[];
 
 extern const char warn_invalid_rdma_style[];
 
+extern const char warn_invalid_rdma_option[];
+
+extern const char warn_invalid_rdma_rate[];
+
+extern const char warn_invalid_rdma_sge[];
+
+extern const char warn_invalid_rdma_chunk[];
+
+extern const char warn_rdma_validate[];
+
+extern const char warn_rdma_ud_len[];
+
+extern const char warn_rdma_mmap[];
+
+extern const char warn_rdma_odirect[];
+
+extern const char warn_invalid_rdma_words[];
+
 #ifdef __cplusplus
 } /* end extern "C" */
 #endif
@@ -68,6 +68,20 @@ struct server_hdr;
 extern "C" {
 #endif
 
+/*
+ * Round trip times of an interval or of the whole test, in
+ * microseconds. Only RDMA latency tests fill it in.
+ */
+typedef struct Latency_Info {
+    unsigned long count;
+    double min;
+    double avg;
+    double p50;
+    double p99;
+    double p999;
+    double max;
+} Latency_Info;
+
 /*
  * This struct contains all important information from the sending or
  * recieving thread.
@@ -77,6 +91,7 @@ typedef struct ReportStruct {
     max_size_t packetLen;
     struct timeval packetTime;
     struct timeval sentTime;
+    Latency_Info latency;           // RDMA latency tests only
 } ReportStruct;
 
 /*
@@ -106,6 +121,7 @@ typedef struct Transfer_Info {
     u_char mTTL;                    // -T
     char   mUDP;
     char   free;
+    Latency_Info latency;
 } Transfer_Info;
 
 typedef struct Connection_Info {
@@ -130,6 +146,27 @@ typedef struct ReporterData {
     int mBufLen;                    // -l
     int mMSS;                       // -M
     int mTCPWin;                    // -w
+    int mRdmaDepth;                 // -X depth
+    int mRdmaCqMode;                // -X cq
+    int mRdmaSharedCqs;             // -X cqs
+    max_size_t mRdmaPool;           // -X pool
+    int mRdmaSrq;                   // -X srq
+    int mRdmaCredits;               // -X credits
+    int mRdmaWorkers;               // -X workers
+    int mRdmaPinWorkers;            // -X pinworkers
+    int mRdmaNuma;                  // -X numa
+    int mRdmaODirect;               // -X odirect
+    int mRdmaRate;                  // -X rate, also set by -X sweep
+    int mRdmaSignal;                // -X signal
+    int mRdmaBatch;                 // -X batch
+    int mRdmaSge;                   // -X sge
+    max_size_t mRdmaChunk;          // -X chunk
+    int mRdmaMem;                   // -X mem
+    max_size_t mRdmaMrCache;        // -X mrcache
+    max_size_t mRdmaRegBench;       // -X regbench
+    int mRdmaWords;                 // -X words
+    int mRdmaMmap;                  // -X mmap
+    int mRdmaLatency;               // -G lw/ls/lr/fa/cs
     /*   flags is a BitMask of old bools
         bool   mBufLenSet;              // -l
         bool   mCompat;                 // -C
@@ -152,6 +189,7 @@ typedef struct ReporterData {
     max_size_t lastTotal;
     // doubles
     double lastTransit;
+    Latency_Info latency;           // of the interval not yet printed
     // shorts
     unsigned short mPort;           // -p
     // structs or miscellaneous
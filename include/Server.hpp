@@ -59,6 +59,8 @@
 #include "util.h"
 #include "Timestamp.hpp"
 
+struct RdmaWorker;
+
 /* ------------------------------------------------------------------- */
 class Server {
 public:
@@ -73,16 +75,44 @@ public:
     
     void RunRDMA( void );
 
+    // hands the connection to the worker pool (-X workers) instead
+    static void AssignRDMA( thread_Settings *inSettings );
+
     void write_UDP_AckFIN( );
 
     static void Sig_Int( int inSigno );
 
 private:
+    long MoveRDMA( void );
+    void RecvDatagrams( ReportStruct *reportstruct );
+    void StatsRDMA( void );
+    void CostRDMA( void );
+    void ReportChecked( iperf_check_stat *inCheck );
+
+    // the test driven by a worker's events
+    static void *WorkerRDMA( void *inWorker );
+    void OpenRDMA( RdmaWorker *inWorker );
+    void EventRDMA( int inEvent );
+    void PollRDMA( int inBudget );
+    void BeginRDMA( void );
+    void AccountRDMA( long inLen );
+    void EndRDMA( void );
+
     thread_Settings *mSettings;
     rdma_cb *mCb;
     char* mBuf;
     Timestamp mEndTime;
 
+    // worker pool: where the connection is between events
+    RdmaWorker *mWorker;
+    int mWorkerFd;              // what we added to its epoll set
+    Server *mNext;              // on the incoming or dead list
+    Server *mNextReady;         // on the ready list
+    bool mReady;
+    bool mDone;
+    ReportStruct *mReport;      // once reporting
+    max_size_t mTotLen;
+
 }; // end class Server
 
 #endif // SERVER_H
@@ -99,6 +99,14 @@ typedef enum TestMode {
     kTest_RDMA_ActWrte,
     kTest_RDMA_PasRead,
     kTest_RDMA_PasWrte,
+    kTest_RDMA_LatWrite,
+    kTest_RDMA_LatSend,
+    kTest_RDMA_LatRead,
+    kTest_RDMA_SendRecv,
+    kTest_RDMA_FetchAdd,
+    kTest_RDMA_CmpSwap,
+    kTest_RDMA_CreditWrite,
+    kTest_RDMA_Datagram,
 //    kTest_RDMA_RdWr
 } TestMode;
 
@@ -123,6 +131,7 @@ typedef struct thread_Settings {
     char*  mOutputDataFileName;     // -O
     FILE*  Extractor_file;
     FILE*  Output_file;
+    struct iperf_disk_file* Output_disk; // -O with -X odirect
     ReportHeader*  reporthdr;
     MultiHeader*   multihdr;
     struct thread_Settings *runNow;
@@ -135,6 +144,30 @@ typedef struct thread_Settings {
     int mBufLen;                    // -l
     int mMSS;                       // -M
     int mTCPWin;                    // -w
+    int mRdmaDepth;                 // -X depth
+    int mRdmaCqMode;                // -X cq
+    int mRdmaSpin;                  // -X spin
+    int mRdmaSharedCqs;             // -X cqs
+    max_size_t mRdmaPool;           // -X pool
+    int mRdmaSrq;                   // -X srq
+    int mRdmaCredits;               // -X credits
+    int mRdmaWorkers;               // -X workers
+    int mRdmaPinWorkers;            // -X pinworkers
+    int mRdmaNuma;                  // -X numa, IPERF_NUMA_* or a node
+    int mRdmaODirect;               // -X odirect
+    int mRdmaRate;                  // -X rate, also set by -X sweep
+    int mRdmaSweep;                 // -X sweep=, IPERF_SWEEP_* axes
+    int mRdmaSignal;                // -X signal
+    int mRdmaBatch;                 // -X batch
+    int mRdmaSge;                   // -X sge
+    max_size_t mRdmaChunk;          // -X chunk
+    int mRdmaMem;                   // -X mem
+    max_size_t mRdmaMrCache;        // -X mrcache
+    max_size_t mRdmaRegBench;       // -X regbench
+    int mRdmaConnRate;              // -X connrate
+    int mRdmaMmap;                  // -X mmap
+    int mRdmaWords;                 // -X words
+    TestMode mRdmaDual;             // -d/-r, where mMode is -G's
     /*   flags is a BitMask of old bools
         bool   mBufLenSet;              // -l
         bool   mCompat;                 // -C
@@ -182,6 +215,9 @@ typedef struct thread_Settings {
     nthread_t mTID;
     char* mCongestion;
     struct rdma_cm_id *child_cm_id;	// for RDMA server's child
+    int child_initiator_depth;		// from the child's connect request
+    int child_responder_resources;
+    struct iperf_pdata child_pdata;     // ... and the first message in it
 #if defined( HAVE_WIN32_THREAD )
     HANDLE mHandle;
 #endif
@@ -221,6 +257,7 @@ typedef struct thread_Settings {
 #define FLAG_SINGLECLIENT   0x00100000
 #define FLAG_SINGLEUDP      0x00200000
 #define FLAG_CONGESTION     0x00400000
+#define FLAG_VALIDATE       0x00800000
 
 #define isBuflenSet(settings)      ((settings->flags & FLAG_BUFLENSET) != 0)
 #define isCompat(settings)         ((settings->flags & FLAG_COMPAT) != 0)
@@ -247,6 +284,7 @@ typedef struct thread_Settings {
 #define isSingleClient(settings)   ((settings->flags & FLAG_SINGLECLIENT) != 0)
 #define isSingleUDP(settings)      ((settings->flags & FLAG_SINGLEUDP) != 0)
 #define isCongestionControl(settings) ((settings->flags & FLAG_CONGESTION) != 0)
+#define isValidate(settings)       ((settings->flags & FLAG_VALIDATE) != 0)
 
 #define setBuflenSet(settings)     settings->flags |= FLAG_BUFLENSET
 #define setCompat(settings)        settings->flags |= FLAG_COMPAT
@@ -271,6 +309,7 @@ typedef struct thread_Settings {
 #define setSingleClient(settings)  settings->flags |= FLAG_SINGLECLIENT
 #define setSingleUDP(settings)     settings->flags |= FLAG_SINGLEUDP
 #define setCongestionControl(settings) settings->flags |= FLAG_CONGESTION
+#define setValidate(settings)      settings->flags |= FLAG_VALIDATE
 
 #define unsetBuflenSet(settings)   settings->flags &= ~FLAG_BUFLENSET
 #define unsetCompat(settings)      settings->flags &= ~FLAG_COMPAT
@@ -295,6 +334,7 @@ typedef struct thread_Settings {
 #define unsetSingleClient(settings)   settings->flags &= ~FLAG_SINGLECLIENT
 #define unsetSingleUDP(settings)      settings->flags &= ~FLAG_SINGLEUDP
 #define unsetCongestionControl(settings) settings->flags &= ~FLAG_CONGESTION
+#define unsetValidate(settings)    settings->flags &= ~FLAG_VALIDATE
 
 
 #define HEADER_VERSION1 0x80000000
@@ -438,6 +478,12 @@ typedef struct server_hdr {
     // generate client header for server
     void Settings_GenerateClientHdr( thread_Settings *client, client_hdr *hdr );
 
+    // ... the same over RDMA, in the connect request's private data
+    void Settings_GenerateRdmaClientSettings( thread_Settings *server, 
+                                              thread_Settings **client,
+                                              struct iperf_pdata *pdata );
+    void Settings_GenerateRdmaHdr( thread_Settings *client, struct iperf_pdata *pdata );
+
 #ifdef __cplusplus
 } /* end extern "C" */
 #endif
@@ -0,0 +1,90 @@
+/*--------------------------------------------------------------- 
+ * Copyright (c) 2010                              
+ * BNL            
+ * All Rights Reserved.                                           
+ *--------------------------------------------------------------- 
+ * Permission is hereby granted, free of charge, to any person    
+ * obtaining a copy of this software (Iperf) and associated       
+ * documentation files (the "Software"), to deal in the Software  
+ * without restriction, including without limitation the          
+ * rights to use, copy, modify, merge, publish, distribute,        
+ * sublicense, and/or sell copies of the Software, and to permit     
+ * persons to whom the Software is furnished to do
+ * so, subject to the following conditions: 
+ *
+ *     
+ * Redistributions of source code must retain the above 
+ * copyright notice, this list of conditions and 
+ * the following disclaimers. 
+ *
+ *     
+ * Redistributions in binary form must reproduce the above 
+ * copyright notice, this list of conditions and the following 
+ * disclaimers in the documentation and/or other materials 
+ * provided with the distribution. 
+ * 
+ *     
+ * Neither the names of the University of Illinois, NCSA, 
+ * nor the names of its contributors may be used to endorse 
+ * or promote products derived from this Software without
+ * specific prior written permission. 
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, 
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES 
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE CONTIBUTORS OR COPYRIGHT 
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, 
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, 
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. 
+ * ________________________________________________________________
+ * National Laboratory for Applied Network Research 
+ * National Center for Supercomputing Applications 
+ * University of Illinois at Urbana-Champaign 
+ * http://www.ncsa.uiuc.edu
+ * ________________________________________________________________ 
+ *
+ * checksum.h
+ * -------------------------------------------------------------------
+ * CRC32C, and the stamps -E puts at the start of every buffer.
+ * ------------------------------------------------------------------- */
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A stamp: sequence number, buffer length and the CRC32C of both and
+ * of everything after the stamp, in network byte order.
+ */
+#define IPERF_STAMP_LEN		16
+
+/* buffers stamped by a sender, or checked by a receiver */
+struct iperf_check_stat {
+	uint64_t seq;			/* next to stamp, or expected */
+	uint64_t bufs;
+	uint64_t bytes;
+	uint64_t bad;			/* ... whose CRC or length was wrong */
+	uint64_t unordered;		/* ... not the sequence number expected */
+	uint64_t shorts;		/* ... too short to carry a stamp */
+	uint64_t cycles;		/* iperf_cycles() spent on them */
+	uint64_t start;			/* iperf_cycles() at the first */
+};
+
+uint32_t iperf_crc32c(uint32_t crc, const void *buf, size_t len);
+const char *iperf_crc32c_str(void);
+
+void iperf_stamp_buf(struct iperf_check_stat *st, char *buf, uint32_t len);
+int iperf_check_buf(struct iperf_check_stat *st, const char *buf,
+		    uint32_t len);
+double iperf_check_share(struct iperf_check_stat *st);
+double iperf_check_rate(struct iperf_check_stat *st);
+
+#ifdef __cplusplus
+} /* end extern "C" */
+#endif
+
+#endif
@@ -0,0 +1,105 @@
+/*--------------------------------------------------------------- 
+ * Copyright (c) 2010                              
+ * BNL            
+ * All Rights Reserved.                                           
+ *--------------------------------------------------------------- 
+ * Permission is hereby granted, free of charge, to any person    
+ * obtaining a copy of this software (Iperf) and associated       
+ * documentation files (the "Software"), to deal in the Software  
+ * without restriction, including without limitation the          
+ * rights to use, copy, modify, merge, publish, distribute,        
+ * sublicense, and/or sell copies of the Software, and to permit     
+ * persons to whom the Software is furnished to do
+ * so, subject to the following conditions: 
+ *
+ *     
+ * Redistributions of source code must retain the above 
+ * copyright notice, this list of conditions and 
+ * the following disclaimers. 
+ *
+ *     
+ * Redistributions in binary form must reproduce the above 
+ * copyright notice, this list of conditions and the following 
+ * disclaimers in the documentation and/or other materials 
+ * provided with the distribution. 
+ * 
+ *     
+ * Neither the names of the University of Illinois, NCSA, 
+ * nor the names of its contributors may be used to endorse 
+ * or promote products derived from this Software without
+ * specific prior written permission. 
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, 
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES 
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE CONTIBUTORS OR COPYRIGHT 
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, 
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, 
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. 
+ * ________________________________________________________________
+ * National Laboratory for Applied Network Research 
+ * National Center for Supercomputing Applications 
+ * University of Illinois at Urbana-Champaign 
+ * http://www.ncsa.uiuc.edu
+ *
+ * diskio.h
+ * -------------------------------------------------------------------
+ * Writing what the RDMA server receives to the -O file straight from
+ * its registered buffers, O_DIRECT through an io_uring.
+ * ------------------------------------------------------------------- */
+
+#ifndef DISKIO_H
+#define DISKIO_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* O_DIRECT wants buffer, length and file offset aligned to this */
+#define IPERF_DISK_ALIGN	4096
+
+/* the -O file, shared by all connections writing to it */
+struct iperf_disk_file {
+	int fd;				/* O_DIRECT where the filesystem can */
+	int bfd;			/* buffered, for what O_DIRECT cannot take */
+	int direct;			/* fd is O_DIRECT */
+	uint64_t offset;		/* where the next write goes */
+};
+
+/* a connection's writes: an io_uring, or pwrite() where there is none */
+struct iperf_disk {
+	struct iperf_disk_file *file;	/* NULL until iperf_disk_init() */
+	int ring_fd;			/* -1: pwrite() */
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	void *sqes, *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+	int entries;
+	int inflight;
+	int peak;			/* most writes ever in flight */
+	uint64_t bytes;
+	uint64_t direct;		/* writes from where the data lay */
+	uint64_t buffered;		/* ... and through the page cache */
+	uint64_t errors;
+	uint64_t busy;			/* iperf_cycles() with writes going */
+	uint64_t since;			/* iperf_cycles() at the first of them */
+};
+
+int iperf_disk_open(struct iperf_disk_file *f, const char *name);
+void iperf_disk_init(struct iperf_disk *d, struct iperf_disk_file *f,
+		     int entries);
+int iperf_disk_write(struct iperf_disk *d, const char *buf, uint32_t len,
+		     int tag);
+int iperf_disk_reap(struct iperf_disk *d, int *tags, int max, int wait);
+void iperf_disk_drain(struct iperf_disk *d);
+void iperf_disk_close(struct iperf_disk *d);
+const char *iperf_disk_str(struct iperf_disk *d);
+double iperf_disk_secs(struct iperf_disk *d);
+
+#ifdef __cplusplus
+} /* end extern "C" */
+#endif
+
+#endif
@@ -62,6 +62,8 @@ extern "C" {
 #include <infiniband/arch.h>
 
 #include "queue.h"
+#include "checksum.h"
+#include "diskio.h"
 
 extern int rdma_debug;
 #define DEBUG_LOG if (rdma_debug) printf
@@ -76,6 +78,15 @@ typedef enum RdmaTransMode {
     kRdmaTrans_ActWrte,
     kRdmaTrans_PasRead,
     kRdmaTrans_PasWrte,
+    kRdmaTrans_LatWrite,
+    kRdmaTrans_LatSend,
+    kRdmaTrans_LatRead,
+    kRdmaTrans_SendRecv,
+    kRdmaTrans_FetchAdd,
+    kRdmaTrans_CmpSwap,
+    kRdmaTrans_CreditWrite,
+    kRdmaTrans_Connect,
+    kRdmaTrans_Datagram,
     kRdmaTrans_Unknown,
 } RdmaTransMode;
 
@@ -106,6 +117,7 @@ enum test_state {
 	RDMA_READ_COMPLETE,
 	RDMA_WRITE_ADV,
 	RDMA_WRITE_COMPLETE,
+	DISCONNECTED,
 	ERROR
 };
 
@@ -114,13 +126,46 @@ struct iperf_rdma_info {
 	uint32_t rkey;
 	uint32_t size;
 	uint32_t mode;	// for rdma transfer mode
+	uint32_t slot;	// ring slot the buffer belongs to
+	uint32_t depth;	// requested/granted pipeline depth
 };
 
 
+/*
+ * The client's first message and the server's answer, carried in the
+ * private data of the connect request and of the accept when both
+ * sides know to look there. With -d/-r the request also says how the
+ * server is to test back, which iperf sends in a client_hdr over TCP.
+ * All of it must fit the 56 bytes of an IB CM REQ.
+ */
+#define IPERF_PDATA_MAGIC	0x69707264	/* "iprd" */
+
+#define IPERF_PDATA_DUAL	0x00000001	/* test back: -d or -r */
+#define IPERF_PDATA_NOW		0x00000002	/* ... at once, -d */
+
+struct iperf_pdata {
+	uint32_t magic;
+	uint32_t flags;			/* IPERF_PDATA_*, the request's */
+	struct iperf_rdma_info info;
+	uint16_t port;			/* -d/-r: the client's -L or -p */
+	uint16_t threads;		/* ... its -P */
+	int32_t amount;			/* ... -n, or -t in 10 ms as < 0 */
+	uint32_t rate;			/* ... -b, for -G ud */
+};
+
 #define MODE_RDMA_ACTRD      0x00000001
 #define MODE_RDMA_ACTWR      0x00000002
 #define MODE_RDMA_PASRD      0x00000003
 #define MODE_RDMA_PASWR      0x00000004
+#define MODE_RDMA_LATWR      0x00000005
+#define MODE_RDMA_LATSN      0x00000006
+#define MODE_RDMA_LATRD      0x00000007
+#define MODE_RDMA_SNDRCV     0x00000008
+#define MODE_RDMA_FADD       0x00000009
+#define MODE_RDMA_CSWP       0x0000000a
+#define MODE_RDMA_CRDWR      0x0000000b
+#define MODE_RDMA_CONN       0x0000000c
+#define MODE_RDMA_UD         0x0000000d
 
 /*
  * Default max buffer size for IO...
@@ -128,6 +173,143 @@ struct iperf_rdma_info {
 #define IPERF_BUFSIZE 64*1024
 #define IPERF_RDMA_SQ_DEPTH 16
 
+/*
+ * Pipeline depth: number of ring slots, i.e. work requests kept
+ * outstanding per connection. The client asks for its -X depth
+ * (default 1, stop-and-wait), the server grants up to its own limit.
+ */
+#define IPERF_RDMA_DEF_DEPTH	1
+#define IPERF_RDMA_MAX_DEPTH	128
+
+/* completions reaped per ibv_poll_cq call */
+#define IPERF_WC_BATCH		16
+
+/* how completions are reaped, see iperf_get_wc() */
+#define IPERF_CQ_EVENT		0	/* cq_thread sleeps on the channel */
+#define IPERF_CQ_POLL		1	/* data thread spins on ibv_poll_cq */
+#define IPERF_CQ_HYBRID		2	/* spin a while, then arm and sleep */
+#define IPERF_CQ_SHARED		3	/* a poller thread serves many QPs */
+#define IPERF_CQ_WORKER		4	/* a worker's epoll loop reaps it */
+
+/* empty polls before hybrid mode goes to sleep */
+#define IPERF_CQ_SPIN		1000
+
+/* completion batches a worker reaps off one connection per wakeup */
+#define IPERF_WORKER_BUDGET	8
+
+/* initial entries of a shared CQ (grown up to max_cqe), and buckets
+ * of its qp_num table */
+#define IPERF_SHARED_CQE	16384
+#define IPERF_CONN_HASH		256
+
+/* registration pool: smallest class 2^6, page aligned beyond that */
+#define IPERF_POOL_MIN_SHIFT	6
+#define IPERF_POOL_CLASSES	48
+#define IPERF_POOL_ALIGN	4096
+
+/*
+ * Latency modes keep one message in flight over a ring of two slots:
+ * slot 0 goes out, the peer's message lands in slot 1.
+ */
+#define IPERF_LAT_DEPTH		2
+
+/* pongs the server answers between two reports */
+#define IPERF_LAT_BATCH		1000
+
+/* spins on the landing buffer between two looks at the CQ */
+#define IPERF_LAT_SPIN		1024
+
+/*
+ * Datagrams (-G ud): a received one lands behind the 40 byte GRH, and
+ * the UD QPs of both sides use the same Q_Key.
+ */
+#define IPERF_UD_GRH		40
+#define IPERF_UD_QKEY		0x11111111
+
+/*
+ * Latency histogram in nanoseconds: exact below 2^(SUB_BITS+1), then
+ * 2^SUB_BITS buckets per power of two, i.e. within 1.6%.
+ */
+#define IPERF_HIST_SUB_BITS	6
+#define IPERF_HIST_BUCKETS	((64 - IPERF_HIST_SUB_BITS + 1) << IPERF_HIST_SUB_BITS)
+
+typedef struct iperf_lat_hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t bucket[IPERF_HIST_BUCKETS];
+} iperf_lat_hist;
+
+/*
+ * Message rate (-X rate): a deeper ring, a completion for every
+ * IPERF_RATE_SIGNAL WRs, chains of IPERF_RATE_BATCH WRs per doorbell,
+ * and up to IPERF_RATE_INLINE bytes copied into the WQE.
+ */
+#define IPERF_RATE_DEPTH	64
+#define IPERF_RATE_SIGNAL	16
+#define IPERF_RATE_BATCH	16
+#define IPERF_RATE_INLINE	512
+
+/*
+ * Parameter sweep (-X sweep=size+depth+op): the axes stepped, each
+ * doubling up to -l and the granted depth, and READ and WRITE in turn
+ * on the one connection of -G ac/aw.
+ */
+#define IPERF_SWEEP_SIZE	0x1
+#define IPERF_SWEEP_DEPTH	0x2
+#define IPERF_SWEEP_OP		0x4
+#define IPERF_SWEEP_ALL		(IPERF_SWEEP_SIZE | IPERF_SWEEP_DEPTH | \
+				 IPERF_SWEEP_OP)
+
+/*
+ * Gather/scatter (-X sge): a slot spread over at most IPERF_MAX_SGE
+ * separately registered regions. Without a port limit or -X chunk a
+ * WR carries at most IPERF_MAX_CHUNK bytes.
+ */
+#define IPERF_MAX_SGE		16
+#define IPERF_MAX_CHUNK		0x80000000U
+
+/*
+ * Buffer memory (-X mem), from plain to preferred: heap, 4KB pages,
+ * 2MB and 1GB huge pages, the mapped ones bound to the device's NUMA
+ * node. COMPARE runs the client once over each.
+ */
+#define IPERF_MEM_MALLOC	0
+#define IPERF_MEM_NUMA		1
+#define IPERF_MEM_HUGE		2
+#define IPERF_MEM_HUGE1G	3
+#define IPERF_MEM_COMPARE	4
+
+/*
+ * Placement (-X numa): threads and buffers near the device, on the CPUs
+ * sysfs lists as local to it and its NUMA node, or on a node of the
+ * user's choosing, or left to the OS.
+ */
+#define IPERF_NUMA_AUTO		-1
+#define IPERF_NUMA_OFF		-2
+#define IPERF_CPUS_LEN		256
+
+/*
+ * Atomics: the words of the server's region, a cache line apart so
+ * that distinct words do not share one.
+ */
+#define IPERF_ATOMIC_WORDS	4096
+#define IPERF_ATOMIC_STRIDE	64
+
+/*
+ * Credit writes (-G cw): unless -X credits says otherwise the server
+ * returns credits once a 1/IPERF_CREDIT_SHARE of the ring is used up,
+ * or sooner when it runs out of completions to reap.
+ */
+#define IPERF_CREDIT_SHARE	4
+
+/* work request types, see struct iperf_wr */
+#define IPERF_WR_RECV		1
+#define IPERF_WR_SEND		2
+#define IPERF_WR_RDMA		3
+#define IPERF_WR_DATA		4	/* receive into a data buffer */
+
 /* Default string for print data and
  * minimum buffer size
  */
@@ -141,6 +323,189 @@ struct iperf_rdma_info {
 extern int PseudoSock;
 extern pthread_mutex_t PseudoSockCond;
 
+struct rdma_cb;
+
+/*
+ * Work request context. Its address is the wr_id of every WR we post,
+ * so a completion leads back to its connection and ring slot.
+ */
+typedef struct iperf_wr {
+	struct rdma_cb *cb;
+	int type;			/* IPERF_WR_RECV, _SEND or _RDMA */
+	int slot;			/* ring slot or message index */
+	int retire;			/* slots its completion frees */
+} iperf_wr;
+
+/*
+ * One buffer of the pipelined ring.
+ */
+typedef struct iperf_slot {
+	char *buf;			/* slice of rdma_buf */
+	uint32_t len;			/* bytes carried this round */
+	int busy;			/* advertised, waiting for the peer */
+	uint32_t word;			/* atomics: the word it works on */
+	uint64_t expect;		/* ... what a CMP_AND_SWP expects */
+	uint64_t posted;		/* iperf_cycles() at post, timed */
+	struct iperf_wr rdma_ctx;
+	struct iperf_wr send_ctx;
+} iperf_slot;
+
+/* a datagram received, see svr_ud_recv() */
+typedef struct iperf_ud_msg {
+	char *buf;			/* past the GRH */
+	uint32_t len;
+	int slot;			/* ... of the receive ring */
+} iperf_ud_msg;
+
+struct iperf_rdma_dev;
+
+/*
+ * A completion vector of a device and the CPUs its interrupt goes to,
+ * from /proc, see iperf_vec_init().
+ */
+typedef struct iperf_comp_vec {
+	int vector;
+	int irq;			/* -1 if not found */
+	char cpus[IPERF_CPUS_LEN / 4];	/* its smp_affinity_list */
+} iperf_comp_vec;
+
+/*
+ * A completion queue shared by the connections of a device, with the
+ * thread that drains it.
+ */
+typedef struct iperf_shared_cq {
+	struct iperf_rdma_dev *dev;
+	struct ibv_comp_channel *channel;
+	struct ibv_cq *cq;
+	struct iperf_comp_vec *vec;	/* it signals on */
+	int cqe;			/* entries */
+	int used;			/* entries reserved by connections */
+	pthread_t poller;
+} iperf_shared_cq;
+
+/*
+ * Pre-registered memory that connections draw their buffers from.
+ */
+typedef struct iperf_pool {
+	char *base;
+	size_t size;
+	size_t used;			/* carved so far */
+	struct ibv_mr *mr;		/* NULL: no pool */
+	void *free[IPERF_POOL_CLASSES];	/* returned buffers by size class */
+	pthread_mutex_t lock;
+} iperf_pool;
+
+/*
+ * Registration cache, see iperf_mr_get(). mem is the IPERF_MEM_* a
+ * buffer of our own was asked with, -1 for memory that is not ours.
+ */
+typedef struct iperf_mr_entry {
+	char *addr;
+	size_t len;
+	int access;
+	int mem;
+	int mem_got;
+	int refs;
+	unsigned long last_use;
+	struct ibv_mr *mr;
+	struct iperf_mr_entry *next;
+} iperf_mr_entry;
+
+typedef struct iperf_mr_cache {
+	struct iperf_mr_entry *entries;
+	size_t cap;			/* idle bytes kept registered */
+	size_t idle;			/* ... right now */
+	unsigned long tick;
+	unsigned long evictions;
+	pthread_mutex_t lock;
+} iperf_mr_cache;
+
+/* registration benchmark: per size, at most ITERS rounds */
+#define IPERF_REG_ITERS		100
+#define IPERF_REG_MIN		4096
+#define IPERF_REG_MAX		(64 * 1024 * 1024)
+
+typedef struct iperf_reg_stat {
+	int iters;
+	double reg_usec;
+	double dereg_usec;
+	double hit_usec;		/* get and put of a cached range */
+} iperf_reg_stat;
+
+/*
+ * -X mmap: the -F file mapped, and the server READing straight out of
+ * it, see iperf_file_post(). Without on-demand paging it is registered
+ * IPERF_FILE_CHUNK bytes at a time.
+ */
+#define IPERF_FILE_CHUNK	(1024 * 1024 * 1024)
+
+typedef struct iperf_file_src {
+	char *map;			/* NULL: no file */
+	size_t len;
+	size_t off;			/* next byte to hand out */
+	size_t chunk;			/* bytes registered at once */
+	size_t reg_off;			/* where the registered chunk starts */
+	struct ibv_mr *mr;		/* ... and its MR, NULL if none */
+	int odp;			/* registered with on-demand paging */
+	unsigned long regs;		/* registrations */
+	unsigned long reg_usec;		/* ... and the time they took */
+} iperf_file_src;
+
+/*
+ * Connection rate (-X connrate): the phases of a connection's life,
+ * conn_at[p] of its cb being when phase p began and conn_at[p + 1]
+ * when it ended.
+ */
+#define IPERF_CONN_ADDR		0	/* rdma_resolve_addr */
+#define IPERF_CONN_ROUTE	1	/* rdma_resolve_route */
+#define IPERF_CONN_QP		2	/* CQ and QP */
+#define IPERF_CONN_REG		3	/* buffers registered, receives posted */
+#define IPERF_CONN_ESTAB	4	/* rdma_connect until ESTABLISHED */
+#define IPERF_CONN_TEARDOWN	5	/* disconnect, free it all */
+#define IPERF_CONN_PHASES	6
+/* probes in a row -X connrate lets fail before it stops */
+#define IPERF_CONN_RETRIES	100
+
+/*
+ * Per device state shared by all connections on it.
+ */
+typedef struct iperf_rdma_dev {
+	struct ibv_context *verbs;
+	struct ibv_pd *pd;
+	struct iperf_pool pool;
+	int pool_mem;			/* IPERF_MEM_* the pool was asked for */
+	int pool_mem_got;		/* ... and what it got */
+	int numa_node;			/* of the device, -1 if unknown */
+	int node;			/* ... where its buffers go, -1: anywhere */
+	char cpus[IPERF_CPUS_LEN];	/* ... and its threads, a sysfs cpulist */
+	int numa;			/* -X numa it was set up with */
+	struct iperf_comp_vec *vecs;	/* local ones first */
+	int nvec;
+	int nlocal;			/* ... of them local, 0: none known */
+	unsigned int next_vec;		/* round robin over them */
+	struct iperf_mr_cache mrc;
+	struct iperf_shared_cq *cqs;
+	int ncq;
+	int max_cqe;			/* what a shared CQ may grow to */
+	pthread_mutex_t lock;		/* guards used, conns, srq, atomic_mr */
+	struct rdma_cb *conns[IPERF_CONN_HASH];	/* by qp_num */
+
+	/* shared receive queue, see iperf_create_srq() */
+	struct ibv_srq *srq;
+	char *srq_buf;			/* srq_size buffers of srq_len */
+	struct ibv_mr *srq_mr;
+	struct iperf_wr *srq_ctx;	/* one per buffer, cb NULL */
+	int srq_size;
+	int srq_len;
+	int srq_posted;			/* receives in the SRQ right now */
+	unsigned long srq_dry;		/* ... times it dropped to 0 */
+
+	/* atomics: IPERF_ATOMIC_WORDS words all clients work on */
+	char *atomic_buf;
+	struct ibv_mr *atomic_mr;
+	struct iperf_rdma_dev *next;
+} iperf_rdma_dev;
+
 /*
  * RDMA Control block struct.
  */
@@ -153,29 +518,118 @@ typedef struct rdma_cb {
 	struct ibv_pd *pd;
 	struct ibv_qp *qp;
 
-	struct ibv_recv_wr rq_wr;	/* recv work request record */
-	struct ibv_sge recv_sgl;	/* recv single SGE */
-	struct iperf_rdma_info recv_buf;/* malloc'd buffer */
-	struct ibv_mr *recv_mr;		/* MR associated with this buffer */
-
-	struct ibv_send_wr sq_wr;	/* send work request record */
-	struct ibv_sge send_sgl;
-	struct iperf_rdma_info send_buf;/* single send buf */
-	struct ibv_mr *send_mr;
-
-	struct ibv_send_wr rdma_sq_wr;	/* rdma work request record */
-	struct ibv_sge rdma_sgl;	/* rdma single SGE */
-	char *rdma_buf;			/* used as rdma sink */
+	/*
+	 * Control messages: depth + 1 receive slots followed by
+	 * depth + 1 send slots, the last of each for handshake/FIN.
+	 */
+	struct iperf_rdma_info *msg_buf;
+	struct ibv_mr *msg_mr;
+	struct iperf_wr *recv_ctx;	/* one per receive message */
+	struct iperf_wr ctrl_ctx;	/* FIN and its ack */
+
+	struct iperf_slot *ring;	/* pipelined buffer ring */
+	char *rdma_buf;			/* depth * size, sliced into ring */
 	struct ibv_mr *rdma_mr;
+	int depth;			/* ring slots / max outstanding WRs */
+	int ring_depth;			/* slots actually in the ring */
+	int nsge;			/* client: regions a slot spans */
+	int sge_len;			/* bytes of a slot in each region */
+	char *sge_buf[IPERF_MAX_SGE];	/* the first is rdma_buf */
+	struct ibv_mr *sge_mr[IPERF_MAX_SGE];
+	uint32_t chunk;			/* largest WR */
+	int chunks;			/* client: WRs per slot at most */
+	unsigned char lat_seq;		/* latency: last byte of the last ping */
+	int lat_rcvd;			/* latency: pings/pongs not yet seen */
+	int granted;			/* depth agreed with the peer */
+	int outstanding;		/* slots waiting on the peer */
+	int inflight;			/* sweep: slots out at most, 0: granted */
+	int next_slot;			/* where to look for a free slot */
+	int rate;			/* message rate: ask for inline data */
+	int signal;			/* signal every signal-th WR */
+	int batch;			/* WRs posted per ibv_post_send */
+	int max_inline;			/* bytes the QP can inline */
+	int unsignaled;			/* WRs queued since the last signal */
+	struct ibv_send_wr *pend_wr;	/* queued, not yet posted */
+	struct ibv_sge *pend_sge;
+	int npend;
+	struct iperf_wr flush_ctx;	/* collects an unsignaled tail */
+	unsigned long msgs;		/* slots done */
+	struct iperf_lat_hist *slot_lat;	/* sweep: post to done, timed */
+	unsigned long doorbells;	/* ibv_post_send calls for them */
+	int fin;			/* 1 while FIN is exchanged, 2 after */
+	uint64_t fin_bytes;		/* total the client reported in FIN */
+
+	int rd_atom;			/* RDMA READs we accept as target */
+	int init_rd_atom;		/* RDMA READs we issue in parallel */
+	int peer_rd_atom;		/* as asked by the connect request */
+	int peer_init_rd_atom;
+
+	int cq_mode;			/* IPERF_CQ_EVENT, _POLL, _HYBRID, _SHARED,
+					   _WORKER */
+	int cq_spin;			/* hybrid: empty polls before sleeping */
+
+	int shared_cqs;			/* > 0: attach to the device's CQs */
+	struct iperf_rdma_dev *dev;
+	struct iperf_shared_cq *scq;
+	struct rdma_cb *dev_next;	/* qp_num table chain */
+	uint32_t qp_num;
+
+	int srq_size;			/* > 0: receive from the device's SRQ */
+	struct ibv_srq *srq;		/* attached SRQ, receives go there */
+	int recv_posted;		/* send/recv: ring receives posted */
+	unsigned long recv_dry;		/* ... times they dropped to 0 */
+	long rnr_base;			/* RNR hardware counter at setup */
+
+	size_t pool_size;		/* bytes to pre-register per device */
+	int mem;			/* IPERF_MEM_* to get buffers from */
+	int mem_got;			/* ... least of what they came from */
+	int numa;			/* IPERF_NUMA_* or a node, see above */
+	int pinned;			/* data thread has a CPU of its own */
+	struct iperf_comp_vec *vec;	/* its CQ signals on */
+	struct iperf_pdata conn_pdata;	/* with the connect request */
+	struct iperf_pdata accept_pdata;/* ... and the accept */
+	int reply;			/* server: answer in accept_pdata */
+	unsigned long connect_usec;	/* client: CM id to connected */
+	uint64_t conn_at[IPERF_CONN_PHASES + 1];	/* client: cycles */
+	unsigned long setup_usec;	/* QP, CQ and buffer setup */
+	unsigned long reg_usec;		/* ... of it spent getting buffers */
+	unsigned long teardown_usec;
+	int buf_pooled;			/* buffers served by the pool */
+	int buf_reg;			/* buffers registered on their own */
+	int buf_cached;			/* ... taken back from the cache */
+	int atomic_words;		/* client: words to spread atomics over */
+	uint32_t atomic_next;		/* ... the next one to use */
+	uint64_t *atomic_seen;		/* ... CMP_AND_SWP: last value seen */
+	unsigned long cas_tries;
+	unsigned long cas_won;
+	int credit_batch;		/* server: credits returned per message */
+	int credits_held;		/* ... slots consumed, not yet returned */
+	int credit_last;		/* ... the last of them */
+	unsigned long credit_msgs;	/* credit messages sent or received */
+	unsigned long credits;		/* ... and the credits they carried */
+	size_t mr_cache;		/* idle bytes the device may cache */
+	unsigned long mr_hits;		/* registrations the cache spared */
+	unsigned long mr_misses;	/* ... and the ones it took in */
+
+	/* completion reaping statistics */
+	unsigned long cq_polls;		/* ibv_poll_cq calls */
+	unsigned long cq_empty;		/* ... that found nothing */
+	unsigned long cq_wcs;		/* completions reaped */
+	unsigned long cq_events;	/* completion channel wakeups */
+
+	/* completions handed from cq_thread to the data thread */
+	struct ibv_wc *wc_ring;
+	int wc_size;
+	int wc_head;
+	int wc_count;
+	pthread_mutex_t wc_lock;
+	sem_t wc_sem;
 
 	uint32_t remote_rkey;		/* remote guys RKEY */
 	uint64_t remote_addr;		/* remote guys TO */
 	uint32_t remote_len;		/* remote guys LEN */
 	uint32_t remote_mode;		/* remote guys transfer MODE */
 
-	char *start_buf;		/* rdma read src */
-	struct ibv_mr *start_mr;
-
 	enum test_state state;		/* used for cond/signalling */
 	sem_t sem;
 
@@ -184,7 +638,9 @@ typedef struct rdma_cb {
 	int verbose;			/* verbose logging */
 	int count;			/* ping count */
 	int size;			/* ping data size */
-	int validate;			/* validate ping data */
+	int validate;			/* -E: stamp or check every buffer */
+	struct iperf_check_stat check;	/* ... how that went */
+	struct iperf_file_src file;	/* -X mmap: -F, mapped */
 
 	/* CM stuff */
 	pthread_t cmthread;
@@ -192,10 +648,23 @@ typedef struct rdma_cb {
 	struct rdma_cm_id *cm_id;	/* connection on client side,*/
 					/* listener on service side. */
 	struct rdma_cm_id *child_cm_id;	/* connection on server side */
+	void *owner;			/* server: its worker pool connection */
 	
 	RdmaTransMode trans_mode;	/* rdma transfer mode */
 	
 	FILE* outputfile;
+	struct iperf_disk_file *disk_file;	/* -X odirect: -O instead */
+	struct iperf_disk disk;		/* ... and our writes to it */
+
+	/* -G ud: the data goes over a UD QP, RC carries the rest */
+	struct ibv_cq *ud_cq;
+	struct ibv_qp *ud_qp;
+	struct ibv_ah *ud_ah;		/* client: to the server's UD QP */
+	uint32_t ud_qpn;		/* ... its number */
+	int ud_sig;			/* ... one send in ud_sig signaled */
+	uint64_t ud_posted;		/* ... sends posted */
+	uint64_t ud_done;		/* ... and known to be done */
+	int ud_held;			/* server: receives out to the caller */
 	
 // 	int firstrans; for debug
 } rdma_cb;
@@ -203,6 +672,9 @@ typedef struct rdma_cb {
 
 typedef struct wcm_id {
 	struct rdma_cm_id *child_cm_id;
+	int initiator_depth;		/* from the connect request */
+	int responder_resources;
+	struct iperf_pdata pdata;
 	
 	TAILQ_ENTRY(wcm_id) entries;
 } wcm_id;
@@ -224,6 +696,8 @@ void *cq_thread(void *arg);
 
 int rdma_init( struct rdma_cb *cb );
 
+int rdma_init_client(struct rdma_cb *cb);
+
 
 int iperf_create_qp(struct rdma_cb *cb);
 
@@ -235,13 +709,52 @@ int iperf_setup_buffers(struct rdma_cb *cb);
 
 void iperf_free_buffers(struct rdma_cb *cb);
 
-void iperf_setup_wr(struct rdma_cb *cb);
+int iperf_setup_ring(struct rdma_cb *cb, int depth, int size);
+
+int iperf_post_recvs(struct rdma_cb *cb);
+
+int iperf_get_wc(struct rdma_cb *cb, struct ibv_wc *wc, int max);
+
+int iperf_start_cq(struct rdma_cb *cb);
+
+void iperf_stop_cq(struct rdma_cb *cb);
+
+const char *iperf_cq_mode_str(int mode);
+
+int iperf_try_wc(struct rdma_cb *cb, struct ibv_wc *wc, int max);
+
+int iperf_is_latency(struct rdma_cb *cb);
+
+uint64_t iperf_cycles(void);
+
+double iperf_cycles_per_usec(void);
+
+void iperf_hist_reset(struct iperf_lat_hist *h);
+
+void iperf_hist_add(struct iperf_lat_hist *h, uint64_t ns);
+
+void iperf_hist_merge(struct iperf_lat_hist *dst, struct iperf_lat_hist *src);
+
+uint64_t iperf_hist_quantile(struct iperf_lat_hist *h, double q);
 
 int rdma_connect_client(struct rdma_cb *cb);
 
 int iperf_accept(struct rdma_cb *cb);
 
-void iperf_format_send(struct rdma_cb *cb, char *buf, struct ibv_mr *mr);
+void iperf_format_send(struct rdma_cb *cb, struct iperf_rdma_info *info,
+		       char *buf, uint32_t rkey, uint32_t size, int slot);
+
+/* pipelined ring, client side */
+
+char *iperf_slot_buf(struct rdma_cb *cb);
+int iperf_slot_post(struct rdma_cb *cb, int len);
+int iperf_slot_reap(struct rdma_cb *cb);
+int iperf_send_fin(struct rdma_cb *cb, uint64_t total);
+int cli_act_rdma_start(struct rdma_cb *cb);
+
+/* pipelined ring, server side */
+
+int svr_rdma_start(struct rdma_cb *cb);
 
 /* data transfer method */
 
@@ -255,6 +768,62 @@ int svr_act_rdma_wr(struct rdma_cb *cb);
 int svr_pas_rdma_rd(struct rdma_cb *cb);
 int svr_pas_rdma_wr(struct rdma_cb *cb);
 
+/* latency modes */
+
+int cli_lat_rdma_start(struct rdma_cb *cb);
+int cli_lat_ping(struct rdma_cb *cb, uint64_t *sent, uint64_t *rcvd);
+int svr_lat_pong(struct rdma_cb *cb);
+int iperf_is_atomic(struct rdma_cb *cb);
+int cli_atomic_start(struct rdma_cb *cb);
+int cli_atomic_xfer(struct rdma_cb *cb, struct iperf_lat_hist *h,
+		    uint64_t *done);
+int svr_atomic_wait(struct rdma_cb *cb);
+int svr_accept_info(struct rdma_cb *cb);
+
+/* send/recv streaming */
+
+int cli_snd_rdma_start(struct rdma_cb *cb);
+int svr_snd_rdma_recv(struct rdma_cb *cb);
+long iperf_rnr_count(struct rdma_cb *cb);
+const char *iperf_mem_str(int mem);
+const char *iperf_conn_phase_str(int phase);
+int iperf_place_str(struct rdma_cb *cb, char *buf, size_t len);
+int iperf_cm_failed(int event);
+int iperf_wait_disconnect(struct rdma_cb *cb);
+int iperf_remap_ring(struct rdma_cb *cb, int mem);
+struct ibv_mr *iperf_mr_get(struct rdma_cb *cb, char *addr, size_t len,
+			    int access);
+int iperf_mr_put(struct rdma_cb *cb, struct ibv_mr *mr);
+int iperf_reg_bench(struct rdma_cb *cb, size_t len, struct iperf_reg_stat *st);
+
+/* credit writes */
+
+int svr_crd_rdma_recv(struct rdma_cb *cb);
+
+/* worker pool */
+
+int iperf_worker_ok(struct iperf_pdata *pdata);
+struct rdma_event_channel *iperf_worker_channel(void);
+int iperf_worker_attach(struct rdma_cb *cb, struct rdma_event_channel *ch);
+int iperf_worker_fd(struct rdma_cb *cb);
+int iperf_worker_arm(struct rdma_cb *cb);
+struct rdma_cb *iperf_worker_cm(struct rdma_event_channel *ch, int *event);
+int iperf_accept_post(struct rdma_cb *cb);
+int svr_rdma_handle(struct rdma_cb *cb, struct ibv_wc *wc, int n);
+
+/* datagrams */
+
+int cli_ud_rdma_start(struct rdma_cb *cb);
+char *cli_ud_buf(struct rdma_cb *cb);
+int cli_ud_send(struct rdma_cb *cb, uint32_t len);
+int svr_ud_recv(struct rdma_cb *cb, struct iperf_ud_msg *msg, int max);
+
+/* mapped file source */
+
+int iperf_file_open(struct rdma_cb *cb, const char *name);
+int iperf_file_post(struct rdma_cb *cb);
+void iperf_file_close(struct rdma_cb *cb);
+
 
 #ifdef __cplusplus
 } /* end extern "C" */
@@ -54,9 +54,18 @@
 #ifndef REPORT_CSV_H
 #define REPORT_CSV_H
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 void CSV_stats( Transfer_Info *stats );
 void *CSV_peer( Connection_Info *stats, int ID);
 void CSV_serverstats( Connection_Info *conn, Transfer_Info *stats );
+void CSV_timestamp( char *timestamp, int length );
+
+#ifdef __cplusplus
+} /* end extern "C" */
+#endif
 
 
 #endif // REPORT_CSV_H
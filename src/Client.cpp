@@ -60,6 +60,7 @@
 #include "delay.hpp"
 #include "util.h"
 #include "Locale.h"
+#include "report_CSV.h"
 #include "rdma.h"
 
 /* -------------------------------------------------------------------
@@ -69,6 +70,8 @@
 Client::Client( thread_Settings *inSettings ) {
     mSettings = inSettings;
     mBuf = NULL;
+    mConnTmpl = NULL;
+    mConnected = false;
 
     // initialize buffer
     mBuf = new char[ mSettings->mBufLen ];
@@ -92,7 +95,9 @@ Client::Client( thread_Settings *inSettings ) {
 	Settings_Initialize_Cb( mCb );
 	mCb->size = mSettings->mBufLen;
 	DPRINTF(("client buffer size is %d\n", mCb->size));
-	rdma_init( mCb );
+	Timestamp connectStart;
+	// every stream's CM events arrive on one shared channel
+	mConnected = ( rdma_init_client( mCb ) == 0 );
 
 	{
 	// addr
@@ -110,6 +115,15 @@ Client::Client( thread_Settings *inSettings ) {
 	mCb->size = mSettings->mBufLen;
 	DPRINTF(("client buffer size is %d\n", mCb->size));
 	
+	mCb->depth = mSettings->mRdmaDepth;
+	mCb->cq_mode = mSettings->mRdmaCqMode;
+	mCb->cq_spin = mSettings->mRdmaSpin;
+	mCb->pool_size = mSettings->mRdmaPool;
+	mCb->mem = ( mSettings->mRdmaMem == IPERF_MEM_COMPARE ?
+		     IPERF_MEM_MALLOC : mSettings->mRdmaMem );
+	mCb->mr_cache = mSettings->mRdmaMrCache;
+	mCb->numa = mSettings->mRdmaNuma;
+	
 	switch ( mSettings->mMode ) {
 	case kTest_RDMA_ActRead:
 	    mCb->trans_mode = kRdmaTrans_ActRead;
@@ -123,14 +137,163 @@ Client::Client( thread_Settings *inSettings ) {
 	case kTest_RDMA_PasWrte:
 	    mCb->trans_mode = kRdmaTrans_PasWrte;
 	    break;
+	case kTest_RDMA_LatWrite:
+	    mCb->trans_mode = kRdmaTrans_LatWrite;
+	    break;
+	case kTest_RDMA_LatSend:
+	    mCb->trans_mode = kRdmaTrans_LatSend;
+	    break;
+	case kTest_RDMA_LatRead:
+	    mCb->trans_mode = kRdmaTrans_LatRead;
+	    break;
+	case kTest_RDMA_SendRecv:
+	    mCb->trans_mode = kRdmaTrans_SendRecv;
+	    break;
+	case kTest_RDMA_FetchAdd:
+	    mCb->trans_mode = kRdmaTrans_FetchAdd;
+	    break;
+	case kTest_RDMA_CmpSwap:
+	    mCb->trans_mode = kRdmaTrans_CmpSwap;
+	    break;
+	case kTest_RDMA_CreditWrite:
+	    mCb->trans_mode = kRdmaTrans_CreditWrite;
+	    break;
+	case kTest_RDMA_Datagram:
+	    mCb->trans_mode = kRdmaTrans_Datagram;
+	    break;
 	default:
 	    fprintf(stderr, "unrecognize transfer mode %d\n", mSettings->mMode);
 	    break;
 	} // end switch
+
+	// connection rate: nothing is moved, whatever -G says
+	if ( mSettings->mRdmaConnRate )
+	    mCb->trans_mode = kRdmaTrans_Connect;
+
+	// one ping at a time, and nothing on the round trip may sleep
+	if ( iperf_is_latency( mCb ) ) {
+	    mCb->depth = IPERF_LAT_DEPTH;
+	    if ( mCb->cq_mode == IPERF_CQ_EVENT )
+		mCb->cq_mode = IPERF_CQ_POLL;
+	}
+
+	// atomics: 8 byte results, timed each, over one or many words
+	if ( iperf_is_atomic( mCb ) ) {
+	    mCb->size = sizeof(uint64_t);
+	    if ( mCb->cq_mode == IPERF_CQ_EVENT )
+		mCb->cq_mode = IPERF_CQ_POLL;
+	    mCb->atomic_words = ( mSettings->mRdmaWords > 0 ? 
+				  mSettings->mRdmaWords : 1 );
+	} else if ( mSettings->mRdmaWords > 0 ) {
+	    fprintf( stderr, warn_invalid_rdma_words );
+	    mSettings->mRdmaWords = 0;
+	}
+
+	// message rate: a deep ring, few completions, chained posts
+	if ( mSettings->mRdmaRate ) {
+	    if ( mCb->trans_mode != kRdmaTrans_ActRead &&
+		 mCb->trans_mode != kRdmaTrans_ActWrte &&
+		 mCb->trans_mode != kRdmaTrans_SendRecv &&
+		 mCb->trans_mode != kRdmaTrans_CreditWrite ) {
+		fprintf( stderr, warn_invalid_rdma_rate );
+		mSettings->mRdmaRate = 0;
+		mSettings->mRdmaSweep = 0;
+	    } else {
+		if ( mSettings->mRdmaDepth == 0 )
+		    mSettings->mRdmaDepth = mCb->depth = IPERF_RATE_DEPTH;
+		if ( mSettings->mRdmaSignal == 0 )
+		    mSettings->mRdmaSignal = IPERF_RATE_SIGNAL;
+		if ( mSettings->mRdmaBatch == 0 )
+		    mSettings->mRdmaBatch = IPERF_RATE_BATCH;
+		mCb->rate = 1;
+	    }
+	}
+	mCb->signal = mSettings->mRdmaSignal;
+	mCb->batch = mSettings->mRdmaBatch;
+
+	// gather/scatter: only WRs we build ourselves, over whole slots
+	if ( mSettings->mRdmaSge > 1 &&
+	     ( isFileInput( mSettings ) ||
+	       ( mCb->trans_mode != kRdmaTrans_ActRead &&
+		 mCb->trans_mode != kRdmaTrans_ActWrte &&
+		 mCb->trans_mode != kRdmaTrans_SendRecv &&
+		 mCb->trans_mode != kRdmaTrans_CreditWrite ) ) ) {
+	    fprintf( stderr, warn_invalid_rdma_sge );
+	    mSettings->mRdmaSge = 0;
+	}
+	mCb->nsge = mSettings->mRdmaSge;
+
+	// the server learns a slot's length from the WRITE that names it,
+	// and takes one SEND per receive it posted
+	if ( ( mCb->trans_mode == kRdmaTrans_CreditWrite ||
+	       mCb->trans_mode == kRdmaTrans_SendRecv ) && 
+	     mSettings->mRdmaChunk > 0 ) {
+	    fprintf( stderr, warn_invalid_rdma_chunk );
+	    mSettings->mRdmaChunk = 0;
+	}
+	mCb->chunk = ( mSettings->mRdmaChunk > 0 && 
+		       mSettings->mRdmaChunk < IPERF_MAX_CHUNK ?
+		       (uint32_t) mSettings->mRdmaChunk : 0 );
+
+	// -X mmap: pr READs from wherever the client points the server
+	if ( mSettings->mRdmaMmap &&
+	     ( mCb->trans_mode != kRdmaTrans_PasRead ||
+	       !isFileInput( mSettings ) || isSTDIN( mSettings ) ||
+	       mSettings->mRdmaSweep != 0 || mSettings->mRdmaRegBench > 0 ||
+	       mSettings->mRdmaConnRate ||
+	       mSettings->mRdmaMem == IPERF_MEM_COMPARE ) ) {
+	    fprintf( stderr, warn_rdma_mmap );
+	    mSettings->mRdmaMmap = 0;
+	}
+
+	// -E: one stamp per slot, checked as the server consumes it
+	if ( isValidate( mSettings ) ) {
+	    if ( ( mCb->trans_mode != kRdmaTrans_PasRead &&
+		   mCb->trans_mode != kRdmaTrans_SendRecv &&
+		   mCb->trans_mode != kRdmaTrans_CreditWrite ) ||
+		 mSettings->mRdmaSweep != 0 || mSettings->mRdmaRegBench > 0 ||
+		 mSettings->mRdmaConnRate || mSettings->mRdmaMmap || 
+		 mSettings->mRdmaMem == IPERF_MEM_COMPARE ||
+		 mCb->nsge > 1 || mCb->size < IPERF_STAMP_LEN ||
+		 // each chunk would land as a message of its own
+		 ( mCb->trans_mode == kRdmaTrans_SendRecv && 
+		   mCb->chunk > 0 && mCb->chunk < (uint32_t) mCb->size ) ) {
+		fprintf( stderr, warn_rdma_validate, IPERF_STAMP_LEN );
+		unsetValidate( mSettings );
+	    } else
+		mCb->validate = 1;
+	}
+
+	// -G ud: every datagram carries its number and send time
+	if ( mCb->trans_mode == kRdmaTrans_Datagram &&
+	     mCb->size < (int) sizeof( UDP_datagram ) ) {
+	    mSettings->mBufLen = mCb->size = sizeof( UDP_datagram );
+	    fprintf( stderr, warn_buffer_too_small, mCb->size );
+	}
 	
 	
 	}
-	ConnectRDMA( );
+	// later probes start out from the same settings
+	if ( mSettings->mRdmaConnRate ) {
+	    mConnTmpl = new rdma_cb;
+	    memcpy( mConnTmpl, mCb, sizeof(rdma_cb) );
+	    mConnTmpl->cm_id = NULL;
+	}
+	// let the server know about our settings, the first connection only
+	Settings_GenerateRdmaHdr( mSettings, &mCb->conn_pdata );
+	mConnected = mConnected && ConnectRDMA( ) == 0;
+	mCb->connect_usec = Timestamp().subUsec( connectStart );
+
+	// report what the device left of it
+	mSettings->mRdmaSge = mCb->nsge;
+	mSettings->mRdmaChunk = mCb->chunk;
+	if ( iperf_is_atomic( mCb ) )
+	    mSettings->mRdmaWords = mCb->atomic_words;
+	if ( mCb->trans_mode == kRdmaTrans_Datagram &&
+	     mCb->size < mSettings->mBufLen ) {
+	    fprintf( stderr, warn_rdma_ud_len, mCb->size );
+	    mSettings->mBufLen = mCb->size;
+	}
     }
     else
     	fprintf(stderr, "err thread mode: %d\n", mSettings->mThreadMode);
@@ -159,6 +322,7 @@ Client::~Client() {
         mSettings->mSock = INVALID_SOCKET;
     }
     DELETE_ARRAY( mBuf );
+    DELETE_PTR( mConnTmpl );
 } // end ~Client
 
 const double kSecs_to_usecs = 1e6; 
@@ -176,6 +340,20 @@ void Client::RunTCP( void ) {
     // Indicates if the stream is readable 
     bool canRead = true, mMode_Time = isModeTime( mSettings ); 
 
+    // -E: every buffer starts with a stamp the server checks
+    bool validate = isValidate( mSettings ) && 
+                    mSettings->mBufLen >= IPERF_STAMP_LEN;
+    iperf_check_stat check;
+
+    memset( &check, 0, sizeof(check) );
+    if ( isValidate( mSettings ) && !validate ) {
+        fprintf( stderr, warn_rdma_validate, IPERF_STAMP_LEN );
+    }
+    if ( validate && isFileInput( mSettings ) ) {
+        Extractor_reduceReadSize( IPERF_STAMP_LEN, mSettings );
+        readAt += IPERF_STAMP_LEN;
+    }
+
     ReportStruct *reportstruct = NULL;
 
     // InitReport handles Barrier for multiple Streams
@@ -205,7 +383,24 @@ void Client::RunTCP( void ) {
             canRead = true; 
 
         // perform write 
-        currLen = write( mSettings->mSock, mBuf, mSettings->mBufLen ); 
+        if ( validate ) {
+            // the server checks whole buffers, so finish each one
+            long n;
+            iperf_stamp_buf( &check, mBuf, mSettings->mBufLen );
+            currLen = 0;
+            do {
+                n = write( mSettings->mSock, mBuf + currLen, 
+                           mSettings->mBufLen - currLen );
+                if ( n > 0 )
+                    currLen += n;
+            } while ( n > 0 && currLen < (unsigned long) mSettings->mBufLen );
+            if ( n < 0 ) {
+                WARN_errno( n < 0, "write2" );
+                totLen += currLen;
+                break;
+            }
+        } else
+            currLen = write( mSettings->mSock, mBuf, mSettings->mBufLen ); 
         if ( currLen < 0 ) {
             WARN_errno( currLen < 0, "write2" ); 
             break; 
@@ -242,25 +437,91 @@ void Client::RunTCP( void ) {
 
     DELETE_PTR( reportstruct );
     EndReport( mSettings->reporthdr );
+
+    if ( validate && mSettings->mReportMode != kReport_CSV ) {
+        ReportStamped( &check );
+    }
+}
+
+/* -------------------------------------------------------------------
+ * What -E stamped into the buffers sent.
+ * ------------------------------------------------------------------- */
+void Client::ReportStamped( iperf_check_stat *inCheck ) {
+    printf( report_stamped, mSettings->mSock,
+            (unsigned long long) inCheck->bufs,
+            (unsigned long long) inCheck->shorts,
+            iperf_check_share( inCheck ) * 100,
+            iperf_check_rate( inCheck ) / 1e9 );
 }
 
 
 void Client::RunRDMA( void ) {
-    unsigned long currLen = 0; 
+    long currLen = 0; 
     struct itimerval it;
     max_size_t totLen = 0;
+    double secs;
 
     int err;
 
-    char* readAt = mBuf;
+    char* readAt;
 
-    struct ibv_send_wr* bad_wr;
-    
     // Indicates if the stream is readable 
     bool canRead = true, mMode_Time = isModeTime( mSettings ); 
 
+    // file input is only consumed when the server reads our buffers
+    bool fillRing = isFileInput( mSettings )
+		&& ( (mCb->trans_mode == kRdmaTrans_ActWrte) ||
+		(mCb->trans_mode == kRdmaTrans_PasRead) ||
+		(mCb->trans_mode == kRdmaTrans_SendRecv) ||
+		(mCb->trans_mode == kRdmaTrans_CreditWrite) );
+
+    // -E: each slot opens with its stamp, file data follows it
+    int stamp = ( mCb->validate ? IPERF_STAMP_LEN : 0 );
+
+    // -X mmap: the server READs the file itself, nothing is copied
+    bool mapped = false;
+
     ReportStruct *reportstruct = NULL;
 
+    // there is no ring to use nor a server to send FIN to
+    if ( !mConnected ) {
+        fprintf( stderr, "RDMA connection failed, no test run\n" );
+        return;
+    }
+
+    if ( iperf_is_latency( mCb ) || iperf_is_atomic( mCb ) ) {
+        RunRDMALatency();
+        return;
+    }
+    if ( mSettings->mRdmaSweep != 0 ) {
+        RunRDMASweep();
+        return;
+    }
+    if ( mSettings->mRdmaRegBench > 0 ) {
+        RunRDMARegBench();
+        return;
+    }
+    if ( mSettings->mRdmaConnRate ) {
+        RunRDMAConnRate();
+        return;
+    }
+    if ( mCb->trans_mode == kRdmaTrans_Datagram ) {
+        RunRDMADatagram();
+        return;
+    }
+    if ( mSettings->mRdmaMem == IPERF_MEM_COMPARE ) {
+        RunRDMAMemCompare();
+        return;
+    }
+
+    if ( fillRing && stamp > 0 )
+        Extractor_reduceReadSize( stamp, mSettings );
+    if ( fillRing && mSettings->mRdmaMmap ) {
+        mapped = ( iperf_file_open( mCb, mSettings->mFileName ) == 0 );
+        if ( !mapped )
+            fprintf( stderr, warn_rdma_mmap );
+    }
+
     // InitReport handles Barrier for multiple Streams
     mSettings->reporthdr = InitReport( mSettings );
     reportstruct = new ReportStruct;
@@ -280,84 +541,66 @@ void Client::RunRDMA( void ) {
     }
 
     do {
-        // Read the next data block from 
-        // the file if it's file input 
-        if ( isFileInput( mSettings ) 
-		&& ( (mCb->trans_mode == kRdmaTrans_ActWrte) ||
-		(mCb->trans_mode == kRdmaTrans_PasRead) ) ) {
-            // Extractor_getNextDataBlock( readAt, mSettings );
-            mCb->size = Extractor_getNextDataBlock( mCb->start_buf, mSettings );
-            canRead = Extractor_canRead( mSettings ) != 0;
-        } else
-            canRead = true;
+        // Keep every free ring slot advertised, reading the next 
+        // data block from the file if it's file input. With -n, 
+        // stop advertising once the bytes in flight cover the rest.
+	while ( canRead && ( mMode_Time || (max_size_t) mCb->outstanding
+			     * mCb->size < mSettings->mAmount ) 
+		&& (readAt = iperf_slot_buf( mCb )) != NULL ) {
+	    int len = mCb->size;
+	    if ( mapped ) {
+		len = iperf_file_post( mCb );
+		canRead = len >= 0 && mCb->file.off < mCb->file.len;
+		if ( len <= 0 )
+		    break;
+		continue;
+	    }
+	    if ( fillRing ) {
+		len = Extractor_getNextDataBlock( readAt + stamp, mSettings );
+		canRead = Extractor_canRead( mSettings ) != 0;
+		if ( len <= 0 ) {
+		    canRead = false;
+		    break;
+		}
+		len += stamp;
+	    }
+	    if ( stamp > 0 )
+		iperf_stamp_buf( &mCb->check, readAt, len );
+	    if ( iperf_slot_post( mCb, len ) != 0 ) {
+		canRead = false;
+		break;
+	    }
+	}
 
         // perform RDMA read or write
-//        currLen = write( mSettings->mSock, mBuf, mSettings->mBufLen );
 	switch ( mCb->trans_mode ) {
 	case kRdmaTrans_ActRead:
-		break;
 	case kRdmaTrans_ActWrte:
+		// our own READs/WRITEs into the server's region
+		currLen = iperf_slot_reap( mCb );
 		break;
 	case kRdmaTrans_PasRead:
-		currLen = cli_pas_rdma_rd( mCb );
-		break;
 	case kRdmaTrans_PasWrte:
-		currLen = cli_pas_rdma_wr( mCb );
+		// the server works through the ring, wait for its acks
+		currLen = iperf_slot_reap( mCb );
+		break;
+	case kRdmaTrans_SendRecv:
+		// our SENDs, done once they are acked
+		currLen = iperf_slot_reap( mCb );
+		break;
+	case kRdmaTrans_CreditWrite:
+		// our WRITEs, done once the server returns their credits
+		currLen = iperf_slot_reap( mCb );
 		break;
 	default:
 		fprintf(stderr, "unrecognized transfer mode %d\n", \
 			mCb->trans_mode);
+		currLen = -1;
 		break;
 	}
-	
-/*	DPRINTF(("client start transfer data via rdma\n"));
-	mCb->state = RDMA_READ_ADV;
-	
-	iperf_format_send(mCb, mCb->start_buf, mCb->start_mr);
 
-	err = ibv_post_send(mCb->qp, &mCb->sq_wr, &bad_wr);
-	if (err) {
-		fprintf(stderr, "post send error %d\n", err);
-		break;
-	}
-	DPRINTF(("client ibv_post_send success\n"));
-
-	/* Wait for server to ACK read complete */
-/*	DPRINTF(("client RunRDMA cb @ %x\n", (unsigned long)mCb));
-	DPRINTF(("client RunRDMA sem_wait @ %x\n", (unsigned long)&mCb->sem));
-	DPRINTF(("wait server to say go ahead\n"));
-	sem_wait(&mCb->sem);
-	if (mCb->state != RDMA_WRITE_ADV) {
-		fprintf(stderr, "wait for RDMA_WRITE_ADV state %d\n",
-			mCb->state);
-		err = -1;
-		break;
-	}
-	DPRINTF(("client Wait for server to ACK read complete success\n"));
-	
-
-	iperf_format_send(mCb, mCb->rdma_buf, mCb->rdma_mr);
-	err = ibv_post_send(mCb->qp, &mCb->sq_wr, &bad_wr);
-	if (err) {
-		fprintf(stderr, "post send error %d\n", err);
-		break;
-	}
-
-	/* Wait for the server to say the RDMA Write is complete.
-	sem_wait(&mCb->sem);
-	if (mCb->state != RDMA_WRITE_COMPLETE) {
-		fprintf(stderr, "wait for RDMA_WRITE_COMPLETE state %d\n",
-			mCb->state);
-		err = -1;
-		break;
-	} */
-	
-//	currLen = 2 * ( mCb->size + sizeof( iperf_rdma_info ) );
-//	currLen = 2 * mCb->size;
-	// iperf_rdma_info is transfer via rdma recv/send
-	
         if ( currLen < 0 ) {
-            WARN_errno( currLen < 0, "write2" ); 
+            fprintf( stderr, "RDMA transfer failed\n" );
             break;
         }
 	totLen += currLen;
@@ -370,7 +613,7 @@ void Client::RunRDMA( void ) {
 
         if ( !mMode_Time ) {
             /* mAmount may be unsigned, so don't let it underflow! */
-            if( mSettings->mAmount >= currLen ) {
+            if( mSettings->mAmount >= (max_size_t) currLen ) {
                 mSettings->mAmount -= currLen;
             } else {
                 mSettings->mAmount = 0;
@@ -378,7 +621,21 @@ void Client::RunRDMA( void ) {
         }
 
     } while ( ! (sInterupted  || 
-                   (!mMode_Time  &&  0 >= mSettings->mAmount)) && canRead ); 
+                   (!mMode_Time  &&  0 >= mSettings->mAmount)) 
+              && ( canRead || mCb->outstanding > 0 ) ); 
+
+    // collect the slots still in flight
+    while ( currLen >= 0 && mCb->outstanding > 0 ) {
+	currLen = iperf_slot_reap( mCb );
+	if ( currLen > 0 ) {
+	    totLen += currLen;
+	    if( mSettings->mInterval > 0 ) {
+		gettimeofday( &(reportstruct->packetTime), NULL );
+		reportstruct->packetLen = currLen;
+		ReportPacket( mSettings->reporthdr, reportstruct );
+	    }
+	}
+    }
 
     // stop timing
     gettimeofday( &(reportstruct->packetTime), NULL );
@@ -389,9 +646,749 @@ void Client::RunRDMA( void ) {
         ReportPacket( mSettings->reporthdr, reportstruct );
     }
     CloseReport( mSettings->reporthdr, reportstruct );
+    secs = -lastPacketTime.subUsec( reportstruct->packetTime ) / 
+           (double) rMillion;
 
     DELETE_PTR( reportstruct );
     EndReport( mSettings->reporthdr );
+
+    if ( mSettings->mRdmaRate && mSettings->mReportMode != kReport_CSV ) {
+        printf( report_rdma_msgrate, mSettings->mSock, 0.0, secs, 
+                mCb->msgs, ( secs > 0 ? mCb->msgs / secs / 1e6 : 0 ),
+                ( mCb->doorbells > 0 ? 
+                  (double) mCb->msgs / mCb->doorbells : 0 ),
+                mCb->max_inline );
+    }
+    if ( stamp > 0 && mSettings->mReportMode != kReport_CSV ) {
+        ReportStamped( &mCb->check );
+    }
+    if ( mapped ) {
+        if ( mSettings->mReportMode != kReport_CSV ) {
+            char bytes[ 32 ], how[ 64 ];
+
+            byte_snprintf( bytes, sizeof(bytes), (double) mCb->file.off,
+                           toupper( mSettings->mFormat ) );
+            if ( mCb->file.odp ) {
+                strcpy( how, "on-demand paging" );
+            } else {
+                byte_snprintf( how, sizeof(how), (double) mCb->file.chunk,
+                               'A' );
+                strcat( how, " pinned at a time" );
+            }
+            printf( report_rdma_mmap, mSettings->mSock, bytes, how,
+                    mCb->file.regs, mCb->file.reg_usec / 1e3 );
+        }
+        iperf_file_close( mCb );
+    }
+
+    CloseRDMA( totLen, currLen >= 0 );
+}
+
+/* ------------------------------------------------------------------- 
+ * Keep the ring full of size byte transfers for phase seconds, then
+ * drain it, adding what moved to totLen. Returns the seconds it took,
+ * or -1 if a transfer failed.
+ * ------------------------------------------------------------------- */
+
+double Client::RunRDMAPhase( int size, double phase, max_size_t *totLen ) {
+    double cpu = iperf_cycles_per_usec();
+    uint64_t start, end;
+    long currLen = 0;
+
+    start = iperf_cycles();
+    end = start + (uint64_t) (phase * rMillion * cpu);
+
+    do {
+        while ( currLen >= 0 && iperf_slot_buf( mCb ) != NULL )
+            if ( iperf_slot_post( mCb, size ) != 0 )
+                currLen = -1;
+        if ( currLen >= 0 )
+            currLen = iperf_slot_reap( mCb );
+        if ( currLen > 0 )
+            *totLen += currLen;
+    } while ( currLen >= 0 && !sInterupted && iperf_cycles() < end );
+
+    // the next phase starts from an empty ring
+    while ( currLen >= 0 && mCb->outstanding > 0 ) {
+        currLen = iperf_slot_reap( mCb );
+        if ( currLen > 0 )
+            *totLen += currLen;
+    }
+    if ( currLen < 0 ) {
+        fprintf( stderr, "RDMA transfer failed\n" );
+        return -1;
+    }
+    return (iperf_cycles() - start) / cpu / rMillion;
+}
+
+/* ------------------------------------------------------------------- 
+ * A parameter sweep on the one connection and its registered ring:
+ * message rate, throughput and post to completion latency at sizes
+ * from 1 byte up to the buffer length and at depths from 1 up to the
+ * granted one, both doubling, and with -G ac/aw for READs and WRITEs
+ * in turn, each point for the -t time (1 second with -n). Axes left
+ * out of -X sweep= stay at -l, the granted depth and the -G op. Prints
+ * one line per point, or with -y c one CSV record; the reporter gets
+ * the whole transfer as one packet.
+ * ------------------------------------------------------------------- */
+
+static void latency_summary( iperf_lat_hist *h, Latency_Info *info );
+
+// 1, 2, 4, ... top, past top after it
+static int sweep_next( int at, int top ) {
+    if ( at >= top )
+        return top + 1;
+    return ( at * 2 < top ? at * 2 : top );
+}
+
+static const char *sweep_op( RdmaTransMode mode ) {
+    switch ( mode ) {
+        case kRdmaTrans_ActRead:     return "read";
+        case kRdmaTrans_ActWrte:     return "write";
+        case kRdmaTrans_SendRecv:    return "send";
+        default:                     return "wrimm";
+    }
+}
+
+void Client::RunRDMASweep( void ) {
+    double phase = ( isModeTime( mSettings ) ? 
+                     mSettings->mAmount / 100.0 : 1.0 );
+    double secs = 0;
+    unsigned long msgs;
+    max_size_t totLen = 0, bytes;
+    int sweep = mSettings->mRdmaSweep;
+    int size, depth, op, ops = 1;
+    RdmaTransMode modes[ 2 ] = { mCb->trans_mode, mCb->trans_mode };
+    iperf_lat_hist *hist = new iperf_lat_hist;
+    Latency_Info lat;
+    char timestamp[ 80 ];
+    char *peer = NULL;
+
+    ReportStruct *reportstruct = NULL;
+
+    // the server's region takes either, its side does not change
+    if ( (sweep & IPERF_SWEEP_OP) != 0 &&
+         ( mCb->trans_mode == kRdmaTrans_ActRead ||
+           mCb->trans_mode == kRdmaTrans_ActWrte ) ) {
+        modes[ 1 ] = ( mCb->trans_mode == kRdmaTrans_ActRead ?
+                       kRdmaTrans_ActWrte : kRdmaTrans_ActRead );
+        ops = 2;
+    }
+
+    // InitReport handles Barrier for multiple Streams
+    mSettings->reporthdr = InitReport( mSettings );
+    reportstruct = new ReportStruct;
+    memset( reportstruct, 0, sizeof(ReportStruct) );
+
+    if ( mSettings->mReportMode == kReport_CSV )
+        peer = (char *) CSV_peer( &mSettings->reporthdr->report.connection,
+                                  mSettings->mSock );
+    else
+        printf( report_rdma_sweep_header );
+
+    mCb->slot_lat = hist;
+    for ( op = 0; op < ops && secs >= 0 && !sInterupted; op++ ) {
+        mCb->trans_mode = modes[ op ];
+        for ( depth = ( (sweep & IPERF_SWEEP_DEPTH) != 0 ? 1 : mCb->granted );
+              depth <= mCb->granted && secs >= 0 && !sInterupted;
+              depth = sweep_next( depth, mCb->granted ) ) {
+            mCb->inflight = depth;
+            for ( size = ( (sweep & IPERF_SWEEP_SIZE) != 0 ? 1 : mCb->size );
+                  size <= mCb->size && !sInterupted;
+                  size = sweep_next( size, mCb->size ) ) {
+                iperf_hist_reset( hist );
+                msgs = mCb->msgs;
+                bytes = totLen;
+                secs = RunRDMAPhase( size, phase, &totLen );
+                if ( secs < 0 )
+                    break;
+                msgs = mCb->msgs - msgs;
+                bytes = totLen - bytes;
+                latency_summary( hist, &lat );
+                if ( peer != NULL ) {
+                    CSV_timestamp( timestamp, sizeof(timestamp) );
+                    printf( reportCSV_rdma_sweep_format, timestamp, peer,
+                            mSettings->mSock, sweep_op( mCb->trans_mode ),
+                            size, depth, secs, (double) bytes,
+                            bytes * 8.0 / secs, msgs, msgs / secs,
+                            lat.avg, lat.p50, lat.p99 );
+                } else {
+                    printf( report_rdma_sweep_format, mSettings->mSock,
+                            sweep_op( mCb->trans_mode ), size, depth, msgs,
+                            msgs / secs / 1e6, bytes * 8.0 / secs / 1e9,
+                            lat.avg, lat.p50, lat.p99 );
+                }
+            }
+        }
+    }
+    mCb->slot_lat = NULL;
+    mCb->inflight = 0;
+    mCb->trans_mode = modes[ 0 ];
+    DELETE_PTR( hist );
+    if ( peer != NULL )
+        free( peer );
+
+    // stop timing
+    gettimeofday( &(reportstruct->packetTime), NULL );
+    reportstruct->packetLen = totLen;
+    ReportPacket( mSettings->reporthdr, reportstruct );
+    CloseReport( mSettings->reporthdr, reportstruct );
+
+    DELETE_PTR( reportstruct );
+    EndReport( mSettings->reporthdr );
+
+    CloseRDMA( totLen, secs >= 0 );
+}
+
+/* ------------------------------------------------------------------- 
+ * Throughput with the ring in each kind of buffer memory in turn, for
+ * the -t time each (1 second with -n), one line per kind. Where a kind
+ * is not to be had the line names what the ring fell back to.
+ * ------------------------------------------------------------------- */
+
+void Client::RunRDMAMemCompare( void ) {
+    double phase = ( isModeTime( mSettings ) ? 
+                     mSettings->mAmount / 100.0 : 1.0 );
+    double secs = 0;
+    max_size_t totLen = 0, phaseLen;
+    char buffer[ 64 ];
+    int mem;
+
+    ReportStruct *reportstruct = NULL;
+
+    // InitReport handles Barrier for multiple Streams
+    mSettings->reporthdr = InitReport( mSettings );
+    reportstruct = new ReportStruct;
+    memset( reportstruct, 0, sizeof(ReportStruct) );
+
+    if ( mSettings->mReportMode != kReport_CSV )
+        printf( report_rdma_mem_header );
+
+    for ( mem = IPERF_MEM_MALLOC; mem <= IPERF_MEM_HUGE1G && !sInterupted;
+          mem++ ) {
+        if ( mem != mCb->mem && iperf_remap_ring( mCb, mem ) != 0 ) {
+            fprintf( stderr, "RDMA ring remap failed\n" );
+            secs = -1;
+            break;
+        }
+        phaseLen = 0;
+        secs = RunRDMAPhase( mCb->size, phase, &phaseLen );
+        if ( secs < 0 )
+            break;
+        totLen += phaseLen;
+        if ( mSettings->mReportMode != kReport_CSV && secs > 0 ) {
+            byte_snprintf( buffer, sizeof(buffer)/2, (double) phaseLen,
+                           toupper( mSettings->mFormat ) );
+            byte_snprintf( &buffer[sizeof(buffer)/2], sizeof(buffer)/2,
+                           phaseLen / secs, mSettings->mFormat );
+            printf( report_rdma_mem_format, mSettings->mSock,
+                    iperf_mem_str( mCb->mem_got ), buffer,
+                    &buffer[sizeof(buffer)/2] );
+        }
+    }
+
+    // stop timing
+    gettimeofday( &(reportstruct->packetTime), NULL );
+    reportstruct->packetLen = totLen;
+    ReportPacket( mSettings->reporthdr, reportstruct );
+    CloseReport( mSettings->reporthdr, reportstruct );
+
+    DELETE_PTR( reportstruct );
+    EndReport( mSettings->reporthdr );
+
+    CloseRDMA( totLen, secs >= 0 );
+}
+
+/* ------------------------------------------------------------------- 
+ * Cost of memory registration on the connection's device, per size
+ * from 4KB up to -X regbench, doubling: ibv_reg_mr and ibv_dereg_mr
+ * of a buffer already faulted in, and a hit in the registration cache
+ * for the same range. Nothing is transferred.
+ * ------------------------------------------------------------------- */
+
+void Client::RunRDMARegBench( void ) {
+    iperf_reg_stat st;
+    max_size_t len;
+    bool ok = true;
+
+    ReportStruct *reportstruct = NULL;
+
+    // InitReport handles Barrier for multiple Streams
+    mSettings->reporthdr = InitReport( mSettings );
+    reportstruct = new ReportStruct;
+    memset( reportstruct, 0, sizeof(ReportStruct) );
+
+    if ( mSettings->mReportMode != kReport_CSV )
+        printf( report_rdma_reg_header );
+
+    for ( len = IPERF_REG_MIN; len <= mSettings->mRdmaRegBench && 
+          !sInterupted; len *= 2 ) {
+        if ( iperf_reg_bench( mCb, len, &st ) != 0 ) {
+            fprintf( stderr, "RDMA registration of %lu bytes failed\n",
+                     (unsigned long) len );
+            ok = false;
+            break;
+        }
+        if ( mSettings->mReportMode != kReport_CSV ) {
+            printf( report_rdma_reg_format, mSettings->mSock, 
+                    (unsigned long) len, st.reg_usec, st.dereg_usec,
+                    len / st.reg_usec / 1e3, st.hit_usec );
+        }
+    }
+
+    gettimeofday( &(reportstruct->packetTime), NULL );
+    reportstruct->packetLen = 0;
+    ReportPacket( mSettings->reporthdr, reportstruct );
+    CloseReport( mSettings->reporthdr, reportstruct );
+
+    DELETE_PTR( reportstruct );
+    EndReport( mSettings->reporthdr );
+
+    CloseRDMA( 0, ok );
+}
+
+/* ------------------------------------------------------------------- 
+ * Ping-pong latency over RDMA. One message is in flight at a time and
+ * each round trip is timed with iperf_cycles(). Samples go into a
+ * histogram here; the reporter only gets a summary per interval and
+ * one for the whole test, so the loop never waits for it.
+ *
+ * Atomics run through the same loop, with up to depth operations in
+ * flight, each timed from post to completion.
+ * ------------------------------------------------------------------- */
+
+static void latency_summary( iperf_lat_hist *h, Latency_Info *info ) {
+    info->count = h->count;
+    info->min  = h->min / 1000.0;
+    info->avg  = ( h->count > 0 ? (double) h->sum / h->count / 1000.0 : 0 );
+    info->p50  = iperf_hist_quantile( h, 0.5 ) / 1000.0;
+    info->p99  = iperf_hist_quantile( h, 0.99 ) / 1000.0;
+    info->p999 = iperf_hist_quantile( h, 0.999 ) / 1000.0;
+    info->max  = h->max / 1000.0;
+}
+
+void Client::RunRDMALatency( void ) {
+    struct itimerval it;
+    struct timeval now, boundary = {0, 0}, end;
+    max_size_t totLen = 0, lastLen = 0;
+    uint64_t sent, rcvd, next = 0, step = 0;
+    double cpu = iperf_cycles_per_usec(), secs;
+    bool ok = true, mMode_Time = isModeTime( mSettings );
+    bool atomic = iperf_is_atomic( mCb ) != 0;
+    struct timeval start;
+    int err, ops;
+
+    iperf_lat_hist *interval = new iperf_lat_hist;
+    iperf_lat_hist *total = new iperf_lat_hist;
+    iperf_hist_reset( interval );
+    iperf_hist_reset( total );
+
+    ReportStruct *reportstruct = NULL;
+
+    // InitReport handles Barrier for multiple Streams
+    mSettings->reporthdr = InitReport( mSettings );
+    reportstruct = new ReportStruct;
+    memset( reportstruct, 0, sizeof(ReportStruct) );
+
+    if ( mMode_Time ) {
+	memset (&it, 0, sizeof (it));
+	it.it_value.tv_sec = (int) (mSettings->mAmount / 100.0);
+	it.it_value.tv_usec = (int) 10000 * (mSettings->mAmount -
+	    it.it_value.tv_sec * 100.0);
+	err = setitimer( ITIMER_REAL, &it, NULL );
+	if ( err != 0 ) {
+	    perror("setitimer");
+	    exit(1);
+	}
+    }
+
+    // follow the reporter's interval ends on the cycle counter
+    if ( mSettings->reporthdr != NULL && mSettings->mInterval > 0 ) {
+        boundary = mSettings->reporthdr->report.nextTime;
+        gettimeofday( &now, NULL );
+        step = (uint64_t) (mSettings->mInterval * rMillion * cpu);
+        next = iperf_cycles() + 
+               (uint64_t) ((TimeDifference( boundary, now )) * rMillion * cpu);
+    }
+
+    gettimeofday( &start, NULL );
+    while ( !sInterupted && ( mMode_Time || mSettings->mAmount > 0 ) ) {
+        if ( atomic ) {
+            ops = cli_atomic_xfer( mCb, interval, &rcvd );
+            if ( ops < 0 ) {
+                fprintf( stderr, "RDMA atomic failed\n" );
+                ok = false;
+                break;
+            }
+        } else {
+            if ( cli_lat_ping( mCb, &sent, &rcvd ) != 0 ) {
+                fprintf( stderr, "RDMA ping failed\n" );
+                ok = false;
+                break;
+            }
+            iperf_hist_add( interval, 
+                            (uint64_t) ((rcvd - sent) * 1000 / cpu) );
+            ops = 1;
+        }
+        totLen += (max_size_t) ops * mCb->size;
+
+        if ( !mMode_Time ) {
+            if( mSettings->mAmount >= (max_size_t) ops * mCb->size ) {
+                mSettings->mAmount -= (max_size_t) ops * mCb->size;
+            } else {
+                mSettings->mAmount = 0;
+            }
+        }
+
+        if ( step > 0 && rcvd >= next ) {
+            // date the summary just before the interval's end, so the
+            // reporter counts it in the interval it covers
+            do {
+                end = boundary;
+                TimeAdd( boundary, mSettings->reporthdr->report.intervalTime );
+                next += step;
+            } while ( rcvd >= next );
+            if ( end.tv_usec == 0 ) {
+                end.tv_sec--;
+                end.tv_usec = rMillion;
+            }
+            end.tv_usec--;
+
+            reportstruct->packetTime = end;
+            reportstruct->packetLen = totLen - lastLen;
+            lastLen = totLen;
+            latency_summary( interval, &reportstruct->latency );
+            ReportPacket( mSettings->reporthdr, reportstruct );
+            iperf_hist_merge( total, interval );
+            iperf_hist_reset( interval );
+        }
+    }
+    iperf_hist_merge( total, interval );
+
+    // stop timing
+    gettimeofday( &(reportstruct->packetTime), NULL );
+    reportstruct->packetLen = totLen - lastLen;
+    reportstruct->latency.count = 0;
+    ReportPacket( mSettings->reporthdr, reportstruct );
+
+    latency_summary( total, &reportstruct->latency );
+    CloseReport( mSettings->reporthdr, reportstruct );
+
+    secs = TimeDifference( reportstruct->packetTime, start );
+    DELETE_PTR( reportstruct );
+    EndReport( mSettings->reporthdr );
+
+    if ( atomic && mSettings->mReportMode != kReport_CSV ) {
+        printf( report_rdma_atomic, mSettings->mSock, 
+                (unsigned long) total->count, secs,
+                ( secs > 0 ? total->count / secs / 1e6 : 0 ),
+                mCb->atomic_words );
+        if ( mCb->trans_mode == kRdmaTrans_CmpSwap ) {
+            printf( report_rdma_cas, mSettings->mSock, mCb->cas_won,
+                    mCb->cas_tries, ( mCb->cas_tries > 0 ? 
+                    100.0 * mCb->cas_won / mCb->cas_tries : 0 ) );
+        }
+    }
+    DELETE_PTR( interval );
+    DELETE_PTR( total );
+
+    CloseRDMA( totLen, ok );
+}
+
+/* ------------------------------------------------------------------- 
+ * Datagrams over UD, paced to -b and each stamped with its number and
+ * send time the way Run() stamps UDP's, for the server's loss,
+ * out-of-order and jitter accounting. FIN goes over the RC connection
+ * and tells the server how many were sent.
+ * ------------------------------------------------------------------- */
+void Client::RunRDMADatagram( void ) {
+    struct UDP_datagram* dgram;
+    struct itimerval it;
+    max_size_t sent;
+    bool ok = true, mMode_Time = isModeTime( mSettings );
+    int delay_target, delay = 0, adjust, err;
+
+    // compute delay for bandwidth restriction, constrained to [0,1] seconds 
+    delay_target = (int) ( mCb->size * ((kSecs_to_usecs * kBytes_to_Bits) 
+                                        / mSettings->mUDPRate) ); 
+    if ( delay_target < 0  || 
+         delay_target > (int) 1 * kSecs_to_usecs ) {
+        fprintf( stderr, warn_delay_large, delay_target / kSecs_to_usecs ); 
+        delay_target = (int) kSecs_to_usecs * 1; 
+    }
+
+    ReportStruct *reportstruct = NULL;
+
+    // InitReport handles Barrier for multiple Streams
+    mSettings->reporthdr = InitReport( mSettings );
+    reportstruct = new ReportStruct;
+    memset( reportstruct, 0, sizeof(ReportStruct) );
+
+    if ( mMode_Time ) {
+	memset (&it, 0, sizeof (it));
+	it.it_value.tv_sec = (int) (mSettings->mAmount / 100.0);
+	it.it_value.tv_usec = (int) 10000 * (mSettings->mAmount -
+	    it.it_value.tv_sec * 100.0);
+	err = setitimer( ITIMER_REAL, &it, NULL );
+	if ( err != 0 ) {
+	    perror("setitimer");
+	    exit(1);
+	}
+    }
+
+    lastPacketTime.setnow();
+    while ( !sInterupted && ( mMode_Time || mSettings->mAmount > 0 ) ) {
+        // a full ring waits here, before the datagram is stamped
+        dgram = (struct UDP_datagram*) cli_ud_buf( mCb );
+        if ( dgram == NULL ) {
+            ok = false;
+            break;
+        }
+        gettimeofday( &(reportstruct->packetTime), NULL );
+
+        // store datagram ID into buffer 
+        dgram->id      = htonl( (reportstruct->packetID)++ ); 
+        dgram->tv_sec  = htonl( reportstruct->packetTime.tv_sec ); 
+        dgram->tv_usec = htonl( reportstruct->packetTime.tv_usec );
+
+        // make an adjustment for how long the last loop iteration took 
+        adjust = delay_target + lastPacketTime.subUsec( reportstruct->packetTime ); 
+        lastPacketTime.set( reportstruct->packetTime.tv_sec, 
+                            reportstruct->packetTime.tv_usec ); 
+        if ( adjust > 0  ||  delay > 0 ) {
+            delay += adjust; 
+        }
+
+        if ( cli_ud_send( mCb, mCb->size ) != 0 ) {
+            ok = false;
+            break;
+        }
+
+        // report packets 
+        reportstruct->packetLen = mCb->size;
+        ReportPacket( mSettings->reporthdr, reportstruct );
+
+        if ( delay > 0 ) {
+            delay_loop( delay ); 
+        }
+        if ( !mMode_Time ) {
+            if( mSettings->mAmount >= (max_size_t) mCb->size ) {
+                mSettings->mAmount -= mCb->size;
+            } else {
+                mSettings->mAmount = 0;
+            }
+        }
+    }
+    if ( !ok )
+        fprintf( stderr, "RDMA datagram send failed\n" );
+    sent = reportstruct->packetID;
+
+    // stop timing
+    gettimeofday( &(reportstruct->packetTime), NULL );
+    CloseReport( mSettings->reporthdr, reportstruct );
+
+    DELETE_PTR( reportstruct );
+    EndReport( mSettings->reporthdr );
+
+    CloseRDMA( sent, ok );
+}
+
+/* ------------------------------------------------------------------- 
+ * Connection rate: close the connection and open the next one, as
+ * fast as possible, for -t seconds or until -n of them are done, each
+ * set up like the first, with the constructor's. Every phase of every
+ * connection goes into a histogram of its own; the server sees the
+ * mode and only accepts. Under load the server may refuse some; they
+ * are counted and the next is tried, up to IPERF_CONN_RETRIES in a
+ * row. With -P the threads add theirs up and the last to finish
+ * reports the sum.
+ * ------------------------------------------------------------------- */
+
+static pthread_mutex_t connrate_lock = PTHREAD_MUTEX_INITIALIZER;
+static iperf_lat_hist connrate_sum[ IPERF_CONN_PHASES ];
+static unsigned long connrate_count;
+static unsigned long connrate_failed;
+static double connrate_secs;
+static int connrate_done;
+
+// one line per phase, id < 0 for the sum
+static void connrate_print( int id, int phase, iperf_lat_hist *h ) {
+    Latency_Info info;
+
+    latency_summary( h, &info );
+    if ( id < 0 )
+        printf( report_rdma_conn_sum_format, iperf_conn_phase_str( phase ),
+                (unsigned long) info.count, info.min, info.avg, info.p50,
+                info.p99, info.max );
+    else
+        printf( report_rdma_conn_format, id, iperf_conn_phase_str( phase ),
+                (unsigned long) info.count, info.min, info.avg, info.p50,
+                info.p99, info.max );
+}
+
+void Client::RunRDMAConnRate( void ) {
+    double cpu = iperf_cycles_per_usec(), secs;
+    bool gone, mMode_Time = isModeTime( mSettings );
+    uint64_t start, end = 0;
+    unsigned long count = 0, failed = 0;
+    int p, tries;
+
+    iperf_lat_hist *hist = new iperf_lat_hist[ IPERF_CONN_PHASES ];
+    for ( p = 0; p < IPERF_CONN_PHASES; p++ )
+        iperf_hist_reset( &hist[ p ] );
+
+    ReportStruct *reportstruct = NULL;
+
+    // InitReport handles Barrier for multiple Streams
+    mSettings->reporthdr = InitReport( mSettings );
+    reportstruct = new ReportStruct;
+    memset( reportstruct, 0, sizeof(ReportStruct) );
+
+    start = iperf_cycles();
+    if ( mMode_Time )
+        end = start + (uint64_t) (mSettings->mAmount / 100.0 * rMillion * cpu);
+
+    while ( mCb->state == CONNECTED ) {
+        mCb->conn_at[ IPERF_CONN_TEARDOWN ] = iperf_cycles();
+        rdma_disconnect( mCb->cm_id );
+        gone = ( iperf_wait_disconnect( mCb ) == 0 );
+        iperf_stop_cq( mCb );
+        iperf_free_buffers( mCb );
+        iperf_free_qp( mCb );
+        rdma_destroy_id( mCb->cm_id );
+        mCb->conn_at[ IPERF_CONN_PHASES ] = iperf_cycles();
+        if ( !gone ) {
+            fprintf( stderr, "RDMA disconnect failed\n" );
+            break;
+        }
+
+        for ( p = 0; p < IPERF_CONN_PHASES; p++ )
+            iperf_hist_add( &hist[ p ], (uint64_t) 
+                            ((mCb->conn_at[ p + 1 ] - mCb->conn_at[ p ]) *
+                             1000 / cpu) );
+        count++;
+        if ( sInterupted || ( mMode_Time ? iperf_cycles() >= end : 
+                              count >= mSettings->mAmount ) )
+            break;
+
+        // the next one, from scratch
+        for ( tries = 1; ; tries++ ) {
+            memcpy( mCb, mConnTmpl, sizeof(rdma_cb) );
+            sem_init( &mCb->sem, 0, 0 );
+            sem_init( &mCb->wc_sem, 0, 0 );
+            pthread_mutex_init( &mCb->wc_lock, NULL );
+            if ( rdma_init_client( mCb ) == 0 && ConnectRDMA() == 0 )
+                break;
+            if ( mCb->cm_id != NULL )
+                rdma_destroy_id( mCb->cm_id );
+            mCb->state = ERROR;
+            failed++;
+            if ( tries >= IPERF_CONN_RETRIES ) {
+                fprintf( stderr, "RDMA connection failed %d times in a "
+                         "row, stopping\n", tries );
+                break;
+            }
+            if ( sInterupted || ( mMode_Time && iperf_cycles() >= end ) )
+                break;
+        }
+    }
+    secs = (iperf_cycles() - start) / cpu / rMillion;
+
+    gettimeofday( &(reportstruct->packetTime), NULL );
+    reportstruct->packetLen = 0;
+    ReportPacket( mSettings->reporthdr, reportstruct );
+    CloseReport( mSettings->reporthdr, reportstruct );
+
+    DELETE_PTR( reportstruct );
+    EndReport( mSettings->reporthdr );
+
+    pthread_mutex_lock( &connrate_lock );
+    if ( mSettings->mReportMode != kReport_CSV ) {
+        printf( report_rdma_conn_header );
+        for ( p = 0; p < IPERF_CONN_PHASES; p++ )
+            connrate_print( mSettings->mSock, p, &hist[ p ] );
+        printf( report_rdma_conn, mSettings->mSock, count, secs,
+                ( secs > 0 ? count / secs : 0 ), failed );
+    }
+    for ( p = 0; p < IPERF_CONN_PHASES; p++ ) {
+        if ( connrate_done == 0 )
+            iperf_hist_reset( &connrate_sum[ p ] );
+        iperf_hist_merge( &connrate_sum[ p ], &hist[ p ] );
+    }
+    connrate_count += count;
+    connrate_failed += failed;
+    if ( secs > connrate_secs )
+        connrate_secs = secs;
+    if ( ++connrate_done == mSettings->mThreads && 
+         mSettings->mThreads > 1 &&
+         mSettings->mReportMode != kReport_CSV ) {
+        for ( p = 0; p < IPERF_CONN_PHASES; p++ )
+            connrate_print( -1, p, &connrate_sum[ p ] );
+        printf( report_rdma_conn_sum, connrate_count, connrate_secs,
+                ( connrate_secs > 0 ? connrate_count / connrate_secs : 0 ),
+                connrate_failed );
+    }
+    pthread_mutex_unlock( &connrate_lock );
+
+    DELETE_ARRAY( hist );
+}
+
+/* ------------------------------------------------------------------- 
+ * Tell the server we are done, if we got that far, and tear the
+ * connection down.
+ * ------------------------------------------------------------------- */
+
+void Client::CloseRDMA( max_size_t totLen, bool ok ) {
+    if ( ok && iperf_send_fin( mCb, totLen ) != 0 )
+	fprintf( stderr, "RDMA FIN not acknowledged\n" );
+    rdma_disconnect( mCb->cm_id );
+    iperf_stop_cq( mCb );
+    if ( mSettings->mReportMode != kReport_CSV ) {
+        printf( report_rdma_cq, mSettings->mSock, 
+                iperf_cq_mode_str( mCb->cq_mode ), mCb->cq_wcs, 
+                mCb->cq_polls, mCb->cq_empty, mCb->cq_events );
+    }
+    if ( mCb->trans_mode == kRdmaTrans_SendRecv &&
+         mSettings->mReportMode != kReport_CSV ) {
+        long rnr = iperf_rnr_count( mCb );
+        char count[ 32 ];
+
+        if ( rnr < 0 )
+            strcpy( count, "n/a" );
+        else
+            snprintf( count, sizeof(count), "%ld", rnr );
+        printf( report_rdma_rnr, mSettings->mSock, count );
+    }
+    if ( mCb->trans_mode == kRdmaTrans_CreditWrite &&
+         mSettings->mReportMode != kReport_CSV ) {
+        printf( report_rdma_credits, mSettings->mSock, mCb->credits,
+                mCb->credit_msgs, ( mCb->credit_msgs > 0 ? 
+                  (double) mCb->credits / mCb->credit_msgs : 0 ) );
+    }
+    if ( mSettings->mRdmaMem > 0 && 
+         mSettings->mRdmaMem != IPERF_MEM_COMPARE &&
+         mSettings->mReportMode != kReport_CSV ) {
+        printf( report_rdma_mem, mSettings->mSock, 
+                iperf_mem_str( mCb->mem_got ), mCb->dev->numa_node );
+    }
+    if ( mSettings->mReportMode != kReport_CSV ) {
+        char place[ 2 * IPERF_CPUS_LEN ];
+
+        iperf_place_str( mCb, place, sizeof(place) );
+        printf( report_rdma_place, mSettings->mSock, place );
+    }
+    iperf_free_buffers( mCb );
+    iperf_free_qp( mCb );
+    if ( mSettings->mReportMode != kReport_CSV ) {
+        printf( report_rdma_cost, mSettings->mSock, mCb->setup_usec,
+                mCb->reg_usec, mCb->buf_pooled, mCb->buf_reg,
+                mCb->teardown_usec );
+        printf( report_rdma_connect, mSettings->mSock, mCb->connect_usec );
+        if ( mCb->mr_cache > 0 ) {
+            printf( report_rdma_mrcache, mSettings->mSock, 
+                    mCb->mr_hits, mCb->mr_misses );
+        }
+    }
 }
 
 
@@ -628,9 +1625,8 @@ void Client::Connect( ) {
  * which outgoing interface to use.
  * ------------------------------------------------------------------- */
 
-void Client::ConnectRDMA( ) {
+int Client::ConnectRDMA( ) {
     int rc;
-    struct ibv_recv_wr* bad_wr;
     SockAddr_remoteAddr( mSettings );
 
     assert( mSettings->inHostname != NULL );
@@ -676,44 +1672,88 @@ void Client::ConnectRDMA( ) {
 	else
 		((struct sockaddr_in6 *) &mCb->sin)->sin6_port = htons(mCb->port);
 
+	mCb->conn_at[IPERF_CONN_ADDR] = iperf_cycles();
 	rc = rdma_resolve_addr(mCb->cm_id, NULL, \
 		(struct sockaddr *) &mSettings->peer, 2000);
 	if (rc) {
 		perror("rdma_resolve_addr");
-		return;
+		return -1;
 	}
 
 	sem_wait(&mCb->sem);
 	if (mCb->state != ROUTE_RESOLVED) {
 		fprintf(stderr, "waiting for addr/route resolution state %d\n",
 			mCb->state);
-		return;
+		return -1;
 	}
 
+	mCb->conn_at[IPERF_CONN_QP] = iperf_cycles();
 	rc = iperf_setup_qp(mCb, mCb->cm_id);
 	if (rc) {
 		fprintf(stderr, "iperf_setup_qp failed: %d\n", rc);
-		return;
+		return -1;
 	}
 	
+	mCb->conn_at[IPERF_CONN_REG] = iperf_cycles();
 	rc = iperf_setup_buffers(mCb);
 	if (rc) {
 		fprintf(stderr, "rdma_setup_buffers failed: %d\n", rc);
 		goto err1;
 	}
 	
-	rc = ibv_post_recv(mCb->qp, &mCb->rq_wr, &bad_wr);
+	rc = iperf_post_recvs(mCb);
 	if (rc) {
-		fprintf(stderr, "ibv_post_recv failed: %d\n", rc);
+		fprintf(stderr, "iperf_post_recvs failed: %d\n", rc);
 		goto err2;
 	}
 
-	pthread_create(&mCb->cqthread, NULL, cq_thread, mCb);
+	iperf_start_cq(mCb);
 
+	mCb->conn_at[IPERF_CONN_ESTAB] = iperf_cycles();
 	rc = rdma_connect_client(mCb);
 	if (rc) {
 		fprintf(stderr, "connect error %d\n", rc);
-		goto err2;
+		goto err3;
+	}
+	mCb->conn_at[IPERF_CONN_TEARDOWN] = iperf_cycles();
+
+	// one-sided modes need the server's region before anything else
+	if ( mCb->trans_mode == kRdmaTrans_ActRead ||
+	     mCb->trans_mode == kRdmaTrans_ActWrte ||
+	     mCb->trans_mode == kRdmaTrans_CreditWrite ) {
+		rc = cli_act_rdma_start(mCb);
+		if (rc) {
+			fprintf(stderr, "no region advertised by server\n");
+			rdma_disconnect(mCb->cm_id);
+			goto err3;
+		}
+	} else if ( iperf_is_latency(mCb) ) {
+		rc = cli_lat_rdma_start(mCb);
+		if (rc) {
+			fprintf(stderr, "no region advertised by server\n");
+			rdma_disconnect(mCb->cm_id);
+			goto err3;
+		}
+	} else if ( iperf_is_atomic(mCb) ) {
+		rc = cli_atomic_start(mCb);
+		if (rc) {
+			fprintf(stderr, "no atomic words advertised by server\n");
+			rdma_disconnect(mCb->cm_id);
+			goto err3;
+		}
+	} else if ( mCb->trans_mode == kRdmaTrans_SendRecv ) {
+		rc = cli_snd_rdma_start(mCb);
+		if (rc) {
+			rdma_disconnect(mCb->cm_id);
+			goto err3;
+		}
+	} else if ( mCb->trans_mode == kRdmaTrans_Datagram ) {
+		rc = cli_ud_rdma_start(mCb);
+		if (rc) {
+			fprintf(stderr, "no datagram QP advertised by server\n");
+			rdma_disconnect(mCb->cm_id);
+			goto err3;
+		}
 	}
 
 	memcpy(&mSettings->local, rdma_get_local_addr(mCb->cm_id), \
@@ -721,17 +1761,23 @@ void Client::ConnectRDMA( ) {
 	memcpy(&mSettings->peer, rdma_get_peer_addr(mCb->cm_id), \
 		sizeof(iperf_sockaddr)) ;
 
-	Mutex_Lock( &PseudoSockCond );
-	mSettings->mSock = ++ PseudoSock;
-	Mutex_Unlock( &PseudoSockCond );
+	// connection-rate probes keep the first one's number
+	if ( mSettings->mSock == INVALID_SOCKET ) {
+		Mutex_Lock( &PseudoSockCond );
+		mSettings->mSock = ++ PseudoSock;
+		Mutex_Unlock( &PseudoSockCond );
+	}
 	
-	return;
+	return 0;
 //	rping_test_client(cb);
 //	rdma_disconnect(cb->cm_id);
+err3:
+	iperf_stop_cq(mCb);
 err2:
 	iperf_free_buffers(mCb);
 err1:
 	iperf_free_qp(mCb);
+	return -1;
 
 } // end ConnectRDMA
 
@@ -227,8 +227,8 @@ void rdma_client_spawn( thread_Settings *thread ) {
     //start up the client
     theClient = new Client( thread );
 
-    // Let the server know about our settings
-    // theClient->InitiateServer();
+    // The server learns of our settings from the connect request,
+    // see Settings_GenerateRdmaHdr
 
     // Run the test
     theClient->RunRDMA();
@@ -77,8 +77,10 @@
 #include "Listener.hpp"
 #include "SocketAddr.h"
 #include "PerfSocket.hpp"
+#include "Server.hpp"
 #include "List.h"
 #include "util.h" 
+#include "Locale.h"
 
 extern struct acptq acceptedTqh;
 
@@ -95,7 +97,24 @@ Listener::Listener( thread_Settings *inSettings ) {
     // initialize buffer
     mBuf = new char[ mSettings->mBufLen ];
 
-    if ( mSettings->mOutputDataFileName != NULL )
+    // -X odirect: RDMA servers write -O themselves, straight from
+    // their buffers, so a worker's epoll loop cannot serve them
+    if ( mSettings->mRdmaODirect &&
+         ( mSettings->mThreadMode != kMode_RDMA_Listener ||
+           mSettings->mOutputDataFileName == NULL ||
+           mSettings->mRdmaWorkers > 0 ) ) {
+        fprintf( stderr, warn_rdma_odirect );
+        mSettings->mRdmaODirect = 0;
+    }
+    if ( mSettings->mRdmaODirect ) {
+        mSettings->Output_disk = new iperf_disk_file;
+        if ( iperf_disk_open( mSettings->Output_disk, 
+                              mSettings->mOutputDataFileName ) ) {
+            fprintf( stderr, "Unable to open the outfile stream\n");
+            DELETE_PTR( mSettings->Output_disk );
+            mSettings->mRdmaODirect = 0;
+        }
+    } else if ( mSettings->mOutputDataFileName != NULL )
 	    if ( (mSettings->Output_file = \
                 fopen (mSettings->mOutputDataFileName, "ab")) == NULL )
                 fprintf( stderr, "Unable to open the outfile stream\n");
@@ -319,12 +338,10 @@ void Listener::Run( void ) {
 
 void Listener::RunRDMA( void ) {
 
-        bool client = false, UDP = isUDP( mSettings ), mCount = (mSettings->mThreads != 0);
+        bool client = false, mCount = (mSettings->mThreads != 0);
         thread_Settings *tempSettings = NULL;
         rdma_cb *tepmCb = NULL;
         Iperf_ListEntry *exist, *listtemp;
-        client_hdr* hdr = ( UDP ? (client_hdr*) (((UDP_datagram*)mBuf) + 1) : 
-                                  (client_hdr*) mBuf);
         
         if ( mSettings->mHost != NULL ) {
             client = true;
@@ -347,9 +364,6 @@ void Listener::RunRDMA( void ) {
 		DPRINTF(("start a new server\n"));
 		DPRINTF(("RunRDMA: mCb->child_cm_id %p\n", mCb->child_cm_id));
 		
-//		server->child_cm_id = mCb->child_cm_id;
-		server->child_cm_id->context = server;
-		
 		memcpy(&server->local, \
 			rdma_get_local_addr(server->child_cm_id), \
 			sizeof(iperf_sockaddr)) ;
@@ -386,25 +400,12 @@ void Listener::RunRDMA( void ) {
             // Store entry in connection list
             Iperf_pushback( listtemp, &clients ); 
             Mutex_Unlock( &clients_mutex ); 
-/*
-            tempSettings = NULL;
-            if ( !isCompat( mSettings ) && !isMulticast( mSettings ) ) {
-                if ( !UDP ) {
-                    // TCP does not have the info yet
-                    if ( recv( server->mSock, (char*)hdr, sizeof(client_hdr), 0) > 0 ) {
-                        Settings_GenerateClientSettings( server, &tempSettings, 
-                                                          hdr );
-                    }
-                } else {
-                    Settings_GenerateClientSettings( server, &tempSettings, 
-                                                      hdr );
-                }
-            }
-    
-    
+            // the client's connect request says whether to test back
+            Settings_GenerateRdmaClientSettings( server, &tempSettings, 
+                                                 &server->child_pdata );
             if ( tempSettings != NULL ) {
                 client_init( tempSettings );
-                if ( tempSettings->mMode == kTest_DualTest ) {
+                if ( tempSettings->mRdmaDual == kTest_DualTest ) {
 #ifdef HAVE_THREAD
                     server->runNow =  tempSettings;
 #else
@@ -414,9 +415,14 @@ void Listener::RunRDMA( void ) {
                     server->runNext =  tempSettings;
                 }
             }
-*/
 		
-            thread_start( server );
+            // a worker takes it if it can, else a thread of its own
+            if ( mSettings->mRdmaWorkers > 0 && tempSettings == NULL &&
+                 iperf_worker_ok( &server->child_pdata ) ) {
+                Server::AssignRDMA( server );
+            } else {
+                thread_start( server );
+            }
     
             // Prep for next connection
             if ( !isSingleClient( mSettings ) ) {
@@ -701,6 +707,9 @@ void Listener::AcceptRDMA( thread_Settings *server ) {
 	
 	item = TAILQ_FIRST(&acceptedTqh);
 	server->child_cm_id = item->child_cm_id;
+	server->child_initiator_depth = item->initiator_depth;
+	server->child_responder_resources = item->responder_resources;
+	server->child_pdata = item->pdata;
 	TAILQ_REMOVE(&acceptedTqh, item, entries);
 	
 	TAILQ_UNLOCK(&acceptedTqh);
@@ -86,8 +86,85 @@ Client/Server:\n\
   -w, --window    #[KM]    TCP window size (socket buffer size)\n\
   -B, --bind      <host>   bind to <host>, an interface or multicast address\n\
   -C, --compatibility      for use with older versions does not sent extra msgs\n\
-  -G, --rdma_style[ar/aw/pr/pw]  RDMA  with active/passive read/write mode \n\
+  -E, --validate           stamp every buffer with a sequence number and a\n\
+                           CRC32C and check them on receipt (TCP, and RDMA\n\
+                           -G pr/sr/cw; give it to both sides)\n\
+  -G, --rdma_style[ac/aw/pr/pw]  RDMA  with active/passive read/write mode \n\
+                 [lw/ls/lr]     or ping-pong latency over write/send/read\n\
+                 [fa/cs]        or atomic fetch-and-add/compare-and-swap\n\
+                 [sr]           or two-sided send/recv streaming\n\
+                 [cw]           or writes with immediate data, paced\n\
+                                by credits the server returns\n\
+                 [ud]           or unreliable datagrams, paced to -b\n\
+                                and reported for loss and jitter like -u\n\
   -H, --rdma               RDMA bw test \n\
+  -X, --rdma_opts <opts>   RDMA options, comma separated:\n\
+                             depth=#  work requests kept outstanding\n\
+                                      (client default 1, server max 128)\n\
+                             cq=event|poll|hybrid  completion reaping\n\
+                             spin=#   hybrid: empty polls before sleeping\n\
+                             cqs=#    server: share # CQs and poller\n\
+                                      threads per device among all\n\
+                                      connections\n\
+                             pool=#[KMG]  pre-register # bytes per device\n\
+                                      and draw buffers from them\n\
+                             srq=#    server: receive sends into a shared\n\
+                                      queue of # buffers per device\n\
+                             credits=#  server, cw: return credits #\n\
+                                      slots at a time (default: a\n\
+                                      quarter of the ring)\n\
+                             workers=#  server: serve all connections\n\
+                                      from # threads, each an epoll\n\
+                                      loop over their CM and completion\n\
+                                      channels (latency modes keep a\n\
+                                      thread of their own)\n\
+                             pinworkers  server: pin worker # to CPU #\n\
+                             numa=auto|off|#  run threads on the CPUs\n\
+                                      local to the device and keep\n\
+                                      buffers on its NUMA node (auto,\n\
+                                      the default), leave both to the\n\
+                                      OS, or use node # instead; CQs\n\
+                                      take the device's completion\n\
+                                      vectors in turn either way\n\
+                             odirect  server: write -O from the receive\n\
+                                      buffers, O_DIRECT by io_uring, and\n\
+                                      give them back once on disk\n\
+                             rate     report messages per second, with\n\
+                                      inline sends, few completions and\n\
+                                      chained posts (ac/aw/sr/cw)\n\
+                             sweep[=size+depth+op]  rate and latency\n\
+                                      on one connection at sizes 1 byte\n\
+                                      to -l and depths 1 to depth=,\n\
+                                      doubling, and READ and WRITE for\n\
+                                      ac/aw, -t seconds a point (default:\n\
+                                      all three axes); CSV with -y c\n\
+                             signal=# ask for a completion every # WRs\n\
+                             batch=#  post # WRs per doorbell\n\
+                             sge=#    gather/scatter each transfer over #\n\
+                                      separately registered regions\n\
+                                      (ac/aw/sr/cw)\n\
+                             chunk=#[KMG]  split transfers into linked\n\
+                                      WRs of at most # bytes (default:\n\
+                                      the port's largest message;\n\
+                                      ac/aw)\n\
+                             mem=malloc|numa|huge|huge1g|compare\n\
+                                      buffers from the heap, or pre-faulted\n\
+                                      4KB, 2MB or 1GB pages on the device's\n\
+                                      NUMA node; compare: client runs -t\n\
+                                      seconds on each\n\
+                             words=#  fa/cs: spread atomics over # words\n\
+                                      of the server's (default 1, hot)\n\
+                             mrcache=#[KMG]  keep up to # bytes of idle\n\
+                                      regions registered per device\n\
+                             regbench[=#[KMG]]  client: time memory\n\
+                                      registration from 4KB up to #\n\
+                                      (default 64M) instead of a transfer\n\
+                             connrate  client: open and close connections\n\
+                                      back to back instead of a transfer,\n\
+                                      -t seconds or -n of them, and time\n\
+                                      each phase\n\
+                             mmap     client, pr: map the -F file and\n\
+                                      have the server READ it in place\n\
   -M, --mss       #        set TCP maximum segment size (MTU - 40 bytes)\n\
   -N, --nodelay            set TCP no delay, disabling Nagle's Algorithm\n\
   -V, --IPv6Version        Set the domain to IPv6\n\
@@ -163,6 +240,57 @@ const char rdma_server_port[] =
 const char rdma_client_port[] =
 "RDMA Client connecting to %s, %s port %d\n";
 
+const char rdma_depth[] =
+"RDMA pipeline depth: %d outstanding work requests\n";
+
+const char rdma_depth_max[] =
+"RDMA pipeline depth: up to %d outstanding work requests\n";
+
+const char rdma_cq_mode[] =
+"RDMA completions: %s\n";
+
+const char rdma_pool[] =
+"RDMA registration pool: %s per device\n";
+
+const char rdma_shared_cqs[] =
+"RDMA completions: shared, %d CQs per device\n";
+
+const char rdma_msgrate[] =
+"RDMA message rate: a completion every %d WRs, %d WRs per doorbell\n";
+
+const char rdma_sge[] =
+"RDMA work requests: %d SGEs from separate regions, at most %s each\n";
+
+const char rdma_mem[] =
+"RDMA buffers: %s\n";
+
+const char rdma_numa[] =
+"RDMA placement: %s\n";
+
+const char rdma_mrcache[] =
+"RDMA registration cache: up to %s of idle regions per device\n";
+
+const char rdma_atomic[] =
+"RDMA atomics: %d word(s) of the server's region, %s\n";
+
+const char rdma_srq[] =
+"RDMA shared receive queue: %d buffers per device\n";
+
+const char rdma_credits[] =
+"RDMA credit writes: credits returned %d slots at a time\n";
+
+const char rdma_workers[] =
+"RDMA worker pool: %d threads%s\n";
+
+const char rdma_mmap[] =
+"RDMA file source: -F mapped, the server READs it in place\n";
+
+const char rdma_odirect[] =
+"RDMA output file: written from the receive buffers, O_DIRECT where it can\n";
+
+const char validate_on[] =
+"Validating every buffer: sequence number and CRC32C (%s)\n";
+
 const char bind_address[] =
 "Binding to local address %s\n";
 
@@ -206,6 +334,12 @@ const char report_bw_header[] =
 const char report_bw_format[] =
 "[%3d] %4.1f-%4.1f sec  %ss  %ss/sec\n";
 
+const char report_latency_header[] =
+"[ ID] Interval       Round trips  min/avg/p50/p99/p99.9/max (usec)\n";
+
+const char report_latency_format[] =
+"[%3d] %4.1f-%4.1f sec  %11lu  %.2f/%.2f/%.2f/%.2f/%.2f/%.2f\n";
+
 const char report_sum_bw_format[] =
 "[SUM] %4.1f-%4.1f sec  %ss  %ss/sec\n";
 
@@ -240,12 +374,96 @@ const char report_datagrams[] =
 const char report_sum_datagrams[] =
 "[SUM] Sent %d datagrams\n";
 
+const char report_rdma_cost[] =
+"[%3d] RDMA setup %lu us (%lu us for %d pooled + %d registered buffers), teardown %lu us\n";
+
+const char report_rdma_connect[] =
+"[%3d] RDMA connect %lu us (address, route, QP and connection)\n";
+
+const char report_rdma_recv[] =
+"[%3d] RDMA receives: %d x %d bytes %s, ran dry %lu times, %s RNR NAKs sent by the device\n";
+
+const char report_rdma_rnr[] =
+"[%3d] RDMA receiver not ready: %s RNR NAKs received by the device\n";
+
+const char report_rdma_msgrate[] =
+"[%3d] %4.1f-%4.1f sec  %lu messages  %.3f Mmsg/s  (%.1f per doorbell, inline up to %d bytes)\n";
+
+const char report_rdma_sweep_header[] =
+"[ ID] Op        Size  Depth     Messages     Mmsg/s   Gbits/sec  Latency avg/p50/p99 us\n";
+
+const char report_rdma_sweep_format[] =
+"[%3d] %-5s %8d  %5d  %11lu  %9.3f  %10.3f  %.2f/%.2f/%.2f\n";
+
+const char report_rdma_mem[] =
+"[%3d] RDMA buffers: %s, device on NUMA node %d\n";
+
+const char report_rdma_place[] =
+"[%3d] RDMA placement: %s\n";
+
+const char report_rdma_mmap[] =
+"[%3d] Mapped file: %s READ in place, %s, %lu registrations took %.1f ms\n";
+
+const char report_rdma_disk[] =
+"[%3d] Disk: %s in %.2f sec of writes, %s/sec; %llu direct and %llu buffered writes by %s, at most %d in flight, %llu failed\n";
+
+const char report_rdma_mem_header[] =
+"[ ID] Buffers                Transfer     Bandwidth\n";
+
+const char report_rdma_mem_format[] =
+"[%3d] %-20s  %ss  %ss/sec\n";
+
+const char report_rdma_mrcache[] =
+"[%3d] RDMA registration cache: %lu hits, %lu misses\n";
+
+const char report_rdma_reg_header[] =
+"[ ID]       Size    Reg us  Dereg us   Reg GB/s  Cached us\n";
+
+const char report_rdma_reg_format[] =
+"[%3d] %10lu  %8.2f  %8.2f  %9.3f  %9.3f\n";
+
+const char report_rdma_conn_header[] =
+"[ ID] Phase             Count    Min us    Avg us    p50 us    p99 us    Max us\n";
+
+const char report_rdma_conn_format[] =
+"[%3d] %-14s %8lu %9.1f %9.1f %9.1f %9.1f %9.1f\n";
+
+const char report_rdma_conn_sum_format[] =
+"[SUM] %-14s %8lu %9.1f %9.1f %9.1f %9.1f %9.1f\n";
+
+const char report_rdma_conn[] =
+"[%3d] RDMA connections: %lu in %.2f sec, %.1f per sec, %lu failed\n";
+
+const char report_rdma_conn_sum[] =
+"[SUM] RDMA connections: %lu in %.2f sec, %.1f per sec, %lu failed\n";
+
+const char report_rdma_atomic[] =
+"[%3d] RDMA atomics: %lu ops in %.1f sec, %.3f Mops/s over %d word(s)\n";
+
+const char report_rdma_cas[] =
+"[%3d] RDMA compare-and-swap: %lu of %lu succeeded (%.1f%%)\n";
+
+const char report_rdma_credits[] =
+"[%3d] RDMA credits: %lu returned in %lu messages (%.1f per message)\n";
+
+const char report_stamped[] =
+"[%3d] Validation: %llu buffers stamped, %llu too short; CRC32C took %.1f%% of the time (%.2f GBytes/sec)\n";
+
+const char report_checked[] =
+"[%3d] Validation: %llu buffers checked, %llu corrupt, %llu out of sequence, %llu too short; CRC32C took %.1f%% of the time (%.2f GBytes/sec)\n";
+
+const char report_rdma_cq[] =
+"[%3d] RDMA %s completions: %lu in %lu polls (%lu empty), %lu channel events\n";
+
 const char server_reporting[] =
 "[%3d] Server Report:\n";
 
 const char reportCSV_peer[] =
 "%s,%u,%s,%u";
 
+const char reportCSV_rdma_sweep_format[] =
+"%s,%s,%d,%s,%d,%d,%.1f,%.0f,%.0f,%lu,%.0f,%.3f,%.3f,%.3f\n";
+
 #ifdef HAVE_QUAD_SUPPORT
 #ifdef HAVE_PRINTF_QD
 const char reportCSV_bw_format[] =
@@ -341,6 +559,33 @@ const char warn_invalid_report[] =
 const char warn_invalid_rdma_style[] =
 "WARNING: unknown rdma type\n\n";
 
+const char warn_invalid_rdma_rate[] =
+"WARNING: -X rate and sweep need -G ac, aw, sr or cw, ignored\n";
+
+const char warn_invalid_rdma_sge[] =
+"WARNING: -X sge needs -G ac, aw, sr or cw and no -F, ignored\n";
+
+const char warn_invalid_rdma_chunk[] =
+"WARNING: -X chunk does not go with -G sr or cw, ignored\n";
+
+const char warn_rdma_validate[] =
+"WARNING: -E needs -G pr, sr or cw streaming, one SGE and -l of at least %d bytes, ignored\n";
+
+const char warn_rdma_ud_len[] =
+"WARNING: datagrams cut to %d bytes, the most the path carries\n";
+
+const char warn_rdma_mmap[] =
+"WARNING: -X mmap needs -G pr and a -F file that can be mapped, ignored\n";
+
+const char warn_rdma_odirect[] =
+"WARNING: -X odirect needs -O and no -X workers, ignored\n";
+
+const char warn_invalid_rdma_words[] =
+"WARNING: -X words needs -G fa or cs, ignored\n";
+
+const char warn_invalid_rdma_option[] =
+"WARNING: unknown or invalid rdma option \"%s\", ignored\n";
+
 #ifdef __cplusplus
 } /* end extern "C" */
 #endif
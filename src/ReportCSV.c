@@ -55,8 +55,6 @@
 #include "Reporter.h"
 #include "report_CSV.h"
 #include "Locale.h"
-
-void CSV_timestamp( char *timestamp, int length );
  
 void CSV_stats( Transfer_Info *stats ) {
     // $TIMESTAMP,$ID,$INTERVAL,$BYTE,$SPEED,$JITTER,$LOSS,$PACKET,$%LOSS
@@ -101,6 +101,17 @@ void reporter_printstats( Transfer_Info *stats ) {
                     stats->endTime, stats->cntOutofOrder );
         }
     }
+    if ( stats->latency.count > 0 ) {
+        static char latency_header_printed = 0;
+        if ( !latency_header_printed ) {
+            printf( report_latency_header );
+            latency_header_printed = 1;
+        }
+        printf( report_latency_format, stats->transferID,
+                stats->startTime, stats->endTime, stats->latency.count,
+                stats->latency.min, stats->latency.avg, stats->latency.p50,
+                stats->latency.p99, stats->latency.p999, stats->latency.max );
+    }
     if ( stats->free == 1 && stats->mUDP == (char)kMode_Client ) {
         printf( report_datagrams, stats->transferID, stats->cntDatagrams ); 
     }
@@ -180,6 +191,78 @@ void reporter_reportsettings( ReporterData *data ) {
                 (isUDP( data ) ? "UDP" : "TCP"),
                 data->mPort );
     }
+
+    if ( data->mThreadMode == kMode_RDMA_Listener ) {
+        printf( rdma_depth_max, (data->mRdmaDepth > 0 ?
+                                 data->mRdmaDepth : IPERF_RDMA_MAX_DEPTH) );
+    } else if ( data->mThreadMode == kMode_RDMA_Client ) {
+        printf( rdma_depth, (data->mRdmaDepth > 0 ?
+                             data->mRdmaDepth : IPERF_RDMA_DEF_DEPTH) );
+    }
+    if ( data->mThreadMode == kMode_RDMA_Listener &&
+         data->mRdmaSharedCqs > 0 ) {
+        printf( rdma_shared_cqs, data->mRdmaSharedCqs );
+    } else if ( data->mThreadMode == kMode_RDMA_Listener ||
+                data->mThreadMode == kMode_RDMA_Client ) {
+        printf( rdma_cq_mode, iperf_cq_mode_str( data->mRdmaCqMode ) );
+    }
+    if ( (data->mThreadMode == kMode_RDMA_Listener ||
+          data->mThreadMode == kMode_RDMA_Client) && data->mRdmaPool > 0 ) {
+        byte_snprintf( buffer, sizeof(buffer), data->mRdmaPool, 'A' );
+        printf( rdma_pool, buffer );
+    }
+    if ( data->mThreadMode == kMode_RDMA_Listener && data->mRdmaSrq > 0 ) {
+        printf( rdma_srq, data->mRdmaSrq );
+    }
+    if ( data->mThreadMode == kMode_RDMA_Listener && data->mRdmaCredits > 0 ) {
+        printf( rdma_credits, data->mRdmaCredits );
+    }
+    if ( data->mThreadMode == kMode_RDMA_Listener && data->mRdmaWorkers > 0 ) {
+        printf( rdma_workers, data->mRdmaWorkers,
+                ( data->mRdmaPinWorkers ? ", pinned to CPUs" : "" ) );
+    }
+    if ( data->mThreadMode == kMode_RDMA_Client && data->mRdmaMmap ) {
+        printf( rdma_mmap );
+    }
+    if ( data->mThreadMode == kMode_RDMA_Listener && data->mRdmaODirect ) {
+        printf( rdma_odirect );
+    }
+    if ( data->mThreadMode == kMode_RDMA_Client && data->mRdmaRate ) {
+        printf( rdma_msgrate, data->mRdmaSignal, data->mRdmaBatch );
+    }
+    if ( data->mThreadMode == kMode_RDMA_Client && 
+         ( data->mRdmaSge > 1 || 
+           ( data->mRdmaChunk > 0 && data->mRdmaChunk < data->mBufLen ) ) ) {
+        byte_snprintf( buffer, sizeof(buffer), data->mRdmaChunk, 'A' );
+        printf( rdma_sge, (data->mRdmaSge > 1 ? data->mRdmaSge : 1), buffer );
+    }
+    if ( (data->mThreadMode == kMode_RDMA_Listener ||
+          data->mThreadMode == kMode_RDMA_Client) && data->mRdmaMem > 0 ) {
+        printf( rdma_mem, iperf_mem_str( data->mRdmaMem ) );
+    }
+    if ( data->mThreadMode == kMode_RDMA_Listener ||
+         data->mThreadMode == kMode_RDMA_Client ) {
+        if ( data->mRdmaNuma == IPERF_NUMA_OFF )
+            strcpy( buffer, "left to the OS" );
+        else if ( data->mRdmaNuma == IPERF_NUMA_AUTO )
+            strcpy( buffer, "CPUs and NUMA node of the device" );
+        else
+            snprintf( buffer, sizeof(buffer), "CPUs and memory of NUMA node %d",
+                      data->mRdmaNuma );
+        printf( rdma_numa, buffer );
+    }
+    if ( data->mThreadMode == kMode_RDMA_Client && data->mRdmaWords > 0 ) {
+        printf( rdma_atomic, data->mRdmaWords, 
+                ( data->mRdmaWords == 1 ? "one hot word" : "distinct words" ) );
+    }
+    if ( (data->mThreadMode == kMode_RDMA_Listener ||
+          data->mThreadMode == kMode_RDMA_Client) && data->mRdmaMrCache > 0 ) {
+        byte_snprintf( buffer, sizeof(buffer), data->mRdmaMrCache, 'A' );
+        printf( rdma_mrcache, buffer );
+    }
+    if ( isValidate( data ) && !isUDP( data ) ) {
+        printf( validate_on, iperf_crc32c_str( ) );
+    }
     
     if ( data->mLocalhost != NULL ) {
         printf( bind_address, data->mLocalhost );
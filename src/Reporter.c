@@ -119,6 +119,21 @@ int reporter_condprintstats( ReporterData *stats, MultiHeader *multireport, int
 int reporter_print( ReporterData *stats, int type, int end );
 void PrintMSS( ReporterData *stats );
 
+/*
+ * Which side of a UDP test agent is, for the reports; RDMA datagrams
+ * (-G ud) are reported the same way.
+ */
+static char udp_mode( thread_Settings *agent ) {
+    switch ( agent->mThreadMode ) {
+    case kMode_RDMA_Server:
+        return (char)kMode_Server;
+    case kMode_RDMA_Client:
+        return (char)kMode_Client;
+    default:
+        return (char)agent->mThreadMode;
+    }
+}
+
 MultiHeader* InitMulti( thread_Settings *agent, int inID ) {
     MultiHeader *multihdr = NULL;
     if ( agent->mThreads > 1 || agent->mThreadMode == kMode_Server \
@@ -164,7 +179,7 @@ MultiHeader* InitMulti( thread_Settings *agent, int inID ) {
                 data->info.mFormat = agent->mFormat;
                 data->info.mTTL = agent->mTTL;
                 if ( isUDP( agent ) ) {
-                    multihdr->report->info.mUDP = (char)agent->mThreadMode;
+                    multihdr->report->info.mUDP = udp_mode( agent );
                 }
                 if ( isConnectionReport( agent ) ) {
                     data->type |= CONNECTION_REPORT;
@@ -239,13 +254,18 @@ ReportHeader* InitReport( thread_Settings *agent ) {
             data->mBufLen = agent->mBufLen;
             data->mMSS = agent->mMSS;
             data->mTCPWin = agent->mTCPWin;
+            data->mRdmaLatency = ( agent->mMode == kTest_RDMA_LatWrite ||
+                                   agent->mMode == kTest_RDMA_LatSend ||
+                                   agent->mMode == kTest_RDMA_LatRead ||
+                                   agent->mMode == kTest_RDMA_FetchAdd ||
+                                   agent->mMode == kTest_RDMA_CmpSwap );
             data->flags = agent->flags;
             data->mThreadMode = agent->mThreadMode;
             data->mode = agent->mReportMode;
             data->info.mFormat = agent->mFormat;
             data->info.mTTL = agent->mTTL;
             if ( isUDP( agent ) ) {
-                reporthdr->report.info.mUDP = (char)agent->mThreadMode;
+                reporthdr->report.info.mUDP = udp_mode( agent );
             }
         } else {
             FAIL(1, "Out of Memory!!\n", agent);
@@ -444,6 +464,26 @@ void ReportSettings( thread_Settings *agent ) {
             data->mBufLen = agent->mBufLen;
             data->mMSS = agent->mMSS;
             data->mTCPWin = agent->mTCPWin;
+            data->mRdmaDepth = agent->mRdmaDepth;
+            data->mRdmaCqMode = agent->mRdmaCqMode;
+            data->mRdmaSharedCqs = agent->mRdmaSharedCqs;
+            data->mRdmaPool = agent->mRdmaPool;
+            data->mRdmaSrq = agent->mRdmaSrq;
+            data->mRdmaCredits = agent->mRdmaCredits;
+            data->mRdmaWorkers = agent->mRdmaWorkers;
+            data->mRdmaPinWorkers = agent->mRdmaPinWorkers;
+            data->mRdmaNuma = agent->mRdmaNuma;
+            data->mRdmaODirect = agent->mRdmaODirect;
+            data->mRdmaRate = agent->mRdmaRate;
+            data->mRdmaSignal = agent->mRdmaSignal;
+            data->mRdmaBatch = agent->mRdmaBatch;
+            data->mRdmaSge = agent->mRdmaSge;
+            data->mRdmaChunk = agent->mRdmaChunk;
+            data->mRdmaMem = agent->mRdmaMem;
+            data->mRdmaMrCache = agent->mRdmaMrCache;
+            data->mRdmaRegBench = agent->mRdmaRegBench;
+            data->mRdmaWords = agent->mRdmaWords;
+            data->mRdmaMmap = agent->mRdmaMmap;
             data->flags = agent->flags;
             data->mThreadMode = agent->mThreadMode;
             data->mPort = agent->mPort;
@@ -718,6 +758,12 @@ int reporter_handle_packet( ReportHeader *reporthdr ) {
         }
     }
 
+    // latency tests hand in a summary per interval and one at the end;
+    // taken after any interval it closes was printed above
+    if ( data->mRdmaLatency && packet->latency.count > 0 ) {
+        data->latency = packet->latency;
+    }
+
     // Print a report if appropriate
     return reporter_condprintstats( &reporthdr->report, reporthdr->multireport, finished );
 }
@@ -796,6 +842,7 @@ int reporter_condprintstats( ReporterData *stats, MultiHeader *multireport, int
         stats->info.TotalLen = stats->TotalLen;
         stats->info.startTime = 0;
         stats->info.endTime = TimeDifference( stats->packetTime, stats->startTime );
+        stats->info.latency = stats->latency;
         stats->info.free = 1;
         reporter_print( stats, TRANSFER_REPORT, force );
         if ( isMultipleReport(stats) ) {
@@ -822,6 +869,8 @@ int reporter_condprintstats( ReporterData *stats, MultiHeader *multireport, int
         stats->info.startTime = stats->info.endTime;
         stats->info.endTime = TimeDifference( stats->nextTime, stats->startTime );
         TimeAdd( stats->nextTime, stats->intervalTime );
+        stats->info.latency = stats->latency;
+        stats->latency.count = 0;
         stats->info.free = 0;
         reporter_print( stats, TRANSFER_REPORT, force );
         if ( isMultipleReport(stats) ) {
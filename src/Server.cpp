@@ -62,6 +62,10 @@
 #include "Reporter.h"
 #include "Locale.h"
 
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
 /* -------------------------------------------------------------------
  * Stores connected socket and socket info.
  * ------------------------------------------------------------------- */
@@ -69,6 +73,12 @@
 Server::Server( thread_Settings *inSettings ) {
     mSettings = inSettings;
     mBuf = NULL;
+    mWorker = NULL;
+    mWorkerFd = -1;
+    mNext = mNextReady = NULL;
+    mReady = mDone = false;
+    mReport = NULL;
+    mTotLen = 0;
 
     // initialize buffer
     mBuf = new char[ mSettings->mBufLen ];
@@ -96,9 +106,30 @@ Server::Server( thread_Settings *inSettings ) {
 	DPRINTF(("server buffer size is %d\n", mCb->size));
 	
 	mCb->outputfile = mSettings->Output_file;
+	mCb->disk_file = mSettings->Output_disk;
 	}
 	
+	mCb->depth = ( mSettings->mRdmaDepth > 0 ?
+		       mSettings->mRdmaDepth : IPERF_RDMA_MAX_DEPTH );
+	mCb->cq_mode = mSettings->mRdmaCqMode;
+	mCb->cq_spin = mSettings->mRdmaSpin;
+	mCb->shared_cqs = mSettings->mRdmaSharedCqs;
+	mCb->pool_size = mSettings->mRdmaPool;
+	mCb->srq_size = mSettings->mRdmaSrq;
+	mCb->credit_batch = mSettings->mRdmaCredits;
+	mCb->mr_cache = mSettings->mRdmaMrCache;
+	mCb->numa = mSettings->mRdmaNuma;
+	mCb->validate = isValidate( mSettings );
+	// -X mem=compare is the client's business
+	mCb->mem = ( mSettings->mRdmaMem == IPERF_MEM_COMPARE ?
+		     IPERF_MEM_MALLOC : mSettings->mRdmaMem );
+	mCb->peer_init_rd_atom = inSettings->child_initiator_depth;
+	mCb->peer_rd_atom = inSettings->child_responder_resources;
+	mCb->conn_pdata = inSettings->child_pdata;
+	
 	mCb->child_cm_id = inSettings->child_cm_id;
+	// CM events on this id now belong to this server thread
+	mCb->child_cm_id->context = mCb;
     	DPRINTF(("mCb->child_cm_id  %p\n", mCb->child_cm_id));
     }
 	
@@ -110,7 +141,9 @@ Server::Server( thread_Settings *inSettings ) {
 
 Server::~Server() {
     DPRINTF(("close %d\n", mSettings->mSock));
-    if ( mSettings->mSock != INVALID_SOCKET ) {
+    // an RDMA server's socket is only a number for the reports
+    if ( mSettings->mThreadMode != kMode_RDMA_Server &&
+         mSettings->mSock != INVALID_SOCKET ) {
         int rc = close( mSettings->mSock );
         WARN_errno( rc == SOCKET_ERROR, "close" );
         mSettings->mSock = INVALID_SOCKET;
@@ -130,6 +163,12 @@ void Server::Run( void ) {
     long currLen; 
     max_size_t totLen = 0;
     struct UDP_datagram* mBuf_UDP  = (struct UDP_datagram*) mBuf; 
+    // -E: read whole buffers, each begins with a stamp
+    bool validate = isValidate( mSettings ) && !isUDP( mSettings );
+    iperf_check_stat check;
+    int skip = 0;
+
+    memset( &check, 0, sizeof(check) );
 
     ReportStruct *reportstruct = NULL;
 
@@ -139,7 +178,19 @@ void Server::Run( void ) {
         mSettings->reporthdr = InitReport( mSettings );
         do {
             // perform read 
-            currLen = recv( mSettings->mSock, mBuf, mSettings->mBufLen, 0 ); 
+            currLen = recv( mSettings->mSock, mBuf, mSettings->mBufLen, 
+                            ( validate ? MSG_WAITALL : 0 ) ); 
+
+            if ( validate && currLen > 0 ) {
+                // only the sender's last buffer may come short
+                if ( currLen == mSettings->mBufLen ) {
+                    iperf_check_buf( &check, mBuf, currLen );
+                    skip = IPERF_STAMP_LEN;
+                } else {
+                    check.shorts++;
+                    skip = 0;
+                }
+            }
         
             if ( isUDP( mSettings ) ) {
                 // read the datagram ID and sentTime out of the buffer 
@@ -167,8 +218,9 @@ void Server::Run( void ) {
                 ReportPacket( mSettings->reporthdr, reportstruct );
             }
 
-            if (mSettings->Output_file != NULL)
-	        if ( fwrite( mBuf, currLen, 1, mSettings->Output_file ) < 0 )
+            if (mSettings->Output_file != NULL && currLen > skip)
+	        if ( fwrite( mBuf + skip, currLen - skip, 1, 
+	                     mSettings->Output_file ) < 0 )
 	            fprintf( stderr, "Unable to write to the file stream\n");
 
         } while ( currLen > 0 ); 
@@ -184,6 +236,10 @@ void Server::Run( void ) {
 		ReportPacket( mSettings->reporthdr, reportstruct );
 	}
         CloseReport( mSettings->reporthdr, reportstruct );
+
+        if ( validate && mSettings->mReportMode != kReport_CSV ) {
+            ReportChecked( &check );
+        }
         
         // send a acknowledgement back only if we're NOT receiving multicast 
         if ( isUDP( mSettings ) && !isMulticast( mSettings ) ) {
@@ -205,21 +261,14 @@ void Server::Run( void ) {
 
 void Server::RunRDMA( void ) {
 	DPRINTF(("in RunRDMA\n"));
-//	rdma_cb *cb = NULL;
-    
-	struct ibv_send_wr *bad_send_wr;
-	struct ibv_recv_wr *bad_recv_wr;
 	int ret;
 	
-    long currLen; 
+    long currLen = 0; 
     max_size_t totLen = 0;
-    struct UDP_datagram* mBuf_UDP  = (struct UDP_datagram*) mBuf; 
 
     ReportStruct *reportstruct = NULL;
 
     reportstruct = new ReportStruct;
-    DPRINTF(("before Rdma_Settings_Copy\n"));
-//    Rdma_Settings_Copy(mCb, &cb);
 	DPRINTF(("before iperf_setup_qp\n"));
 	ret = iperf_setup_qp(mCb, mCb->child_cm_id);
 	if (ret) {
@@ -236,15 +285,22 @@ void Server::RunRDMA( void ) {
 	}
 	DPRINTF(("iperf_setup_buffers success\n"));
 
-	DPRINTF(("before ibv_post_recv\n"));
-	ret = ibv_post_recv(mCb->qp, &mCb->rq_wr, &bad_recv_wr);
+	DPRINTF(("before iperf_post_recvs\n"));
+	ret = iperf_post_recvs(mCb);
 	if (ret) {
-		fprintf(stderr, "ibv_post_recv failed: %d\n", ret);
+		fprintf(stderr, "iperf_post_recvs failed: %d\n", ret);
 		goto err2;
 	}
-	DPRINTF(("ibv_post_recv success\n"));
+	DPRINTF(("iperf_post_recvs success\n"));
+
+	iperf_start_cq(mCb);
 
-	pthread_create(&mCb->cqthread, NULL, cq_thread, mCb);
+	// set up before accepting if the connect request said what for
+	ret = svr_accept_info(mCb);
+	if (ret) {
+		fprintf(stderr, "bad first message in connect request\n");
+		goto err3;
+	}
 
 	DPRINTF(("before iperf_accept\n"));
 	ret = iperf_accept(mCb);
@@ -253,161 +309,55 @@ void Server::RunRDMA( void ) {
 		goto err3;
 	}
 	DPRINTF(("iperf_accept success\n"));
+
+	// the first advertisement tells the mode, size and depth
+	ret = svr_rdma_start(mCb);
+	if (ret) {
+		fprintf(stderr, "no advertisement from client\n");
+		goto err4;
+	}
+	DPRINTF(("server start transfer data via rdma\n"));
+
+	// a connection-rate probe: let it go again, quietly
+	if ( mCb->trans_mode == kRdmaTrans_Connect ) {
+		iperf_wait_disconnect( mCb );
+		Mutex_Lock( &clients_mutex );
+		Iperf_delete( &(mSettings->peer), &clients );
+		Mutex_Unlock( &clients_mutex );
+		goto err4;
+	}
+
+	// latency modes poll, nothing may sleep on the round trip
+	if ( iperf_is_latency( mCb ) && mCb->cq_mode == IPERF_CQ_EVENT ) {
+		iperf_stop_cq( mCb );
+		mCb->cq_mode = IPERF_CQ_POLL;
+	}
 	
     if ( reportstruct != NULL ) {
         reportstruct->packetID = 0;
+        // datagrams are reported the way UDP's are
+        if ( mCb->trans_mode == kRdmaTrans_Datagram )
+            setUDP( mSettings );
         mSettings->reporthdr = InitReport( mSettings );
         
-        int first = 1;
-        
+        if ( mCb->trans_mode == kRdmaTrans_Datagram ) {
+            RecvDatagrams( reportstruct );
+        } else {
         do {
-            // perform read 
-//            currLen = recv( mSettings->mSock, mBuf, mSettings->mBufLen, 0 ); 
-            
-	    DPRINTF(("server start transfer data via rdma\n"));
-	    DPRINTF(("cb @ %x\n", (unsigned long)mCb));
-	    DPRINTF(("server cb state: %d\n", mCb->state));
-            	
-            	
-	        /*
-	        mCb->state = RDMA_READ_ADV;
-	        
-		if (mCb->state != RDMA_READ_ADV) {
-			fprintf(stderr, "wait for RDMA_READ_ADV state %d\n",
-				mCb->state);
-			ret = -1;
-			break;
-		}*/
-		switch ( mCb->trans_mode ) {
-		case kRdmaTrans_ActRead:
-			if ( !first )
-			    sem_wait(&mCb->sem);
-			first = 0;
-			currLen = svr_act_rdma_rd( mCb );
-			break;
-		case kRdmaTrans_ActWrte:
-			currLen = svr_act_rdma_wr( mCb );
-			break;
-		case kRdmaTrans_PasRead:
-			currLen = svr_pas_rdma_rd( mCb );
-			break;
-		case kRdmaTrans_PasWrte:
-			currLen = svr_pas_rdma_wr( mCb );
-			break;
-		}
-		DEBUG_LOG("server received sink adv\n");
-
-		/* Issue RDMA Read.
-		mCb->rdma_sq_wr.opcode = IBV_WR_RDMA_READ;
-		mCb->rdma_sq_wr.wr.rdma.rkey = mCb->remote_rkey;
-		mCb->rdma_sq_wr.wr.rdma.remote_addr = mCb->remote_addr;
-		mCb->rdma_sq_wr.sg_list->length = mCb->remote_len;
-
-		ret = ibv_post_send(mCb->qp, &mCb->rdma_sq_wr, &bad_send_wr);
-		if (ret) {
-			fprintf(stderr, "post send error %d\n", ret);
-			break;
-		}
-		DEBUG_LOG("server posted rdma read req\n"); */
-
-		/* Wait for read completion
-		sem_wait(&mCb->sem);
-		if (mCb->state != RDMA_READ_COMPLETE) {
-			fprintf(stderr, "wait for RDMA_READ_COMPLETE state %d\n",
-				mCb->state);
-			ret = -1;
-			break;
-		}
-		DEBUG_LOG("server received read complete\n"); */
-
-		/* Display data in recv buf
-		if (mCb->verbose)
-			printf("server ping data: %s\n", mCb->rdma_buf); */
-			
-		/* Tell client to continue
-		ret = ibv_post_send(mCb->qp, &mCb->sq_wr, &bad_send_wr);
-		if (ret) {
-			fprintf(stderr, "post send error %d\n", ret);
-			break;
-		}
-		DEBUG_LOG("server posted go ahead\n"); */
-// sleep(5);
-
-		/* Wait for client's RDMA STAG/TO/Len
-		sem_wait(&mCb->sem);
-		if (mCb->state != RDMA_WRITE_ADV) {
-			fprintf(stderr, "wait for RDMA_WRITE_ADV state %d\n",
-				mCb->state);
-			ret = -1;
-			break;
-		}
-		DEBUG_LOG("server received sink adv\n"); */
-
-		/* RDMA Write echo data
-		mCb->rdma_sq_wr.opcode = IBV_WR_RDMA_WRITE;
-		mCb->rdma_sq_wr.wr.rdma.rkey = mCb->remote_rkey;
-		mCb->rdma_sq_wr.wr.rdma.remote_addr = mCb->remote_addr;
-		mCb->rdma_sq_wr.sg_list->length = strlen(mCb->rdma_buf) + 1;
-		DEBUG_LOG("rdma write from lkey %x laddr %x len %d\n",
-			  mCb->rdma_sq_wr.sg_list->lkey,
-			  mCb->rdma_sq_wr.sg_list->addr,
-			  mCb->rdma_sq_wr.sg_list->length);
-
-		ret = ibv_post_send(mCb->qp, &mCb->rdma_sq_wr, &bad_send_wr);
-		if (ret) {
-			fprintf(stderr, "post send error %d\n", ret);
-			break;
-		} */
-
-		/* Wait for completion
-		ret = sem_wait(&mCb->sem);
-		if (mCb->state != RDMA_WRITE_COMPLETE) {
-			fprintf(stderr, "wait for RDMA_WRITE_COMPLETE state %d\n",
-				mCb->state);
-			ret = -1;
-			break;
-		}
-		DEBUG_LOG("server rdma write complete \n"); */
-
-		/* Tell client to begin again
-		ret = ibv_post_send(mCb->qp, &mCb->sq_wr, &bad_send_wr);
-		if (ret) {
-			fprintf(stderr, "post send error %d\n", ret);
-			break;
-		}
-		DEBUG_LOG("server posted go ahead\n"); */
-		
-//            currLen = 2 * ( mCb->remote_len + sizeof( iperf_rdma_info ) );
-            DEBUG_LOG("server: RDMA read %ld byte this time\n", currLen);
+            currLen = MoveRDMA( );
+            DEBUG_LOG("server: RDMA moved %ld byte this time\n", currLen);
             
-            if ( isUDP( mSettings ) ) {
-                // read the datagram ID and sentTime out of the buffer 
-                reportstruct->packetID = ntohl( mBuf_UDP->id ); 
-                reportstruct->sentTime.tv_sec = ntohl( mBuf_UDP->tv_sec  );
-                reportstruct->sentTime.tv_usec = ntohl( mBuf_UDP->tv_usec ); 
-		reportstruct->packetLen = currLen;
-		gettimeofday( &(reportstruct->packetTime), NULL );
-            } else {
+            if ( currLen > 0 ) {
 		totLen += currLen;
 	    }
-        
-            // terminate when datagram begins with negative index 
-            // the datagram ID should be correct, just negated 
-            DPRINTF(("packetID %d\n", reportstruct->packetID));
-	    if ( reportstruct->packetID < 0 ) {
-                reportstruct->packetID = -reportstruct->packetID;
-                currLen = -1; 
-            }
 
-	    if ( isUDP (mSettings)) {
-		ReportPacket( mSettings->reporthdr, reportstruct );
-            } else if ( !isUDP (mSettings) && mSettings->mInterval > 0) {
+	    if ( mSettings->mInterval > 0 && currLen > 0 ) {
                 reportstruct->packetLen = currLen;
                 gettimeofday( &(reportstruct->packetTime), NULL );
                 ReportPacket( mSettings->reporthdr, reportstruct );
             }
             
-            DPRINTF(("server currLen = %d\n", currLen));
+            DPRINTF(("server currLen = %ld\n", currLen));
 
         } while ( currLen > 0 ); 
         
@@ -415,19 +365,12 @@ void Server::RunRDMA( void ) {
         // stop timing 
         gettimeofday( &(reportstruct->packetTime), NULL );
         
-	if ( !isUDP (mSettings)) {
-		if(0.0 == mSettings->mInterval) {
-                        reportstruct->packetLen = totLen;
-                }
-		ReportPacket( mSettings->reporthdr, reportstruct );
-	}
-        CloseReport( mSettings->reporthdr, reportstruct );
-        
-        // send a acknowledgement back only if we're NOT receiving multicast 
-        if ( isUDP( mSettings ) && !isMulticast( mSettings ) ) {
-            // send back an acknowledgement of the terminating datagram 
-            write_UDP_AckFIN( ); 
+	if(0.0 == mSettings->mInterval) {
+                reportstruct->packetLen = totLen;
         }
+	ReportPacket( mSettings->reporthdr, reportstruct );
+        }
+        CloseReport( mSettings->reporthdr, reportstruct );
     } else {
         FAIL(1, "Out of memory! Closing server thread\n", mSettings);
     }
@@ -436,32 +379,565 @@ void Server::RunRDMA( void ) {
     Iperf_delete( &(mSettings->peer), &clients ); 
     Mutex_Unlock( &clients_mutex );
 
-//	iperf_test_server(cb);
-	rdma_disconnect(mCb->child_cm_id);
-	iperf_free_buffers(mCb);
-	iperf_free_qp(mCb);
-	pthread_cancel(mCb->cqthread);
-	pthread_join(mCb->cqthread, NULL);
-	rdma_destroy_id(mCb->child_cm_id);
-	delete mCb;
-
-
     DELETE_PTR( reportstruct );
     EndReport( mSettings->reporthdr );
-    
-    return;
+
+    StatsRDMA( );
+
+err4:
+	rdma_disconnect(mCb->child_cm_id);
 err3:
-	pthread_cancel(mCb->cqthread);
-	pthread_join(mCb->cqthread, NULL);
+	// the cq thread must be gone before its CQ is destroyed
+	iperf_stop_cq(mCb);
 err2:
 	iperf_free_buffers(mCb);
 err1:
 	iperf_free_qp(mCb);
+	// reportstruct is only gone once the test ran to its end
+	if ( reportstruct == NULL )
+		CostRDMA( );
 err0:
+	rdma_destroy_id(mCb->child_cm_id);
 	delete mCb;
+	DELETE_PTR( reportstruct );
 	return;
 } 
 
+/* -------------------------------------------------------------------
+ * Datagrams (-G ud): each goes to the reporter the way Run() hands it
+ * UDP's, for loss, out-of-order and jitter. The client's FIN says how
+ * many it sent and stands in for UDP's last datagram: numbered one
+ * past them, so that those lost at the end count too, and as late as
+ * the last one that came, so that it adds no jitter.
+ * ------------------------------------------------------------------- */
+void Server::RecvDatagrams( ReportStruct *reportstruct ) {
+    iperf_ud_msg msg[ IPERF_WC_BATCH ];
+    struct UDP_datagram* dgram;
+    long transit = 0;
+    int i, n;
+
+    while ( (n = svr_ud_recv( mCb, msg, IPERF_WC_BATCH )) > 0 ) {
+        for ( i = 0; i < n; i++ ) {
+            if ( msg[i].len < sizeof(struct UDP_datagram) ) 
+                continue;
+            // read the datagram ID and sentTime out of the buffer 
+            dgram = (struct UDP_datagram*) msg[i].buf;
+            reportstruct->packetID = ntohl( dgram->id ); 
+            reportstruct->sentTime.tv_sec = ntohl( dgram->tv_sec  );
+            reportstruct->sentTime.tv_usec = ntohl( dgram->tv_usec ); 
+            reportstruct->packetLen = msg[i].len;
+            gettimeofday( &(reportstruct->packetTime), NULL );
+            transit = (long) (TimeDifference( reportstruct->packetTime,
+                                              reportstruct->sentTime ) * rMillion);
+            ReportPacket( mSettings->reporthdr, reportstruct );
+        }
+    }
+    if ( n < 0 ) {
+        fprintf( stderr, "RDMA datagram receive failed\n" );
+        return;
+    }
+    if ( mCb->fin_bytes == 0 )
+        return;
+
+    gettimeofday( &(reportstruct->packetTime), NULL );
+    reportstruct->sentTime = reportstruct->packetTime;
+    reportstruct->sentTime.tv_sec -= transit / rMillion;
+    reportstruct->sentTime.tv_usec -= transit % rMillion;
+    if ( reportstruct->sentTime.tv_usec < 0 ) {
+        reportstruct->sentTime.tv_sec--;
+        reportstruct->sentTime.tv_usec += rMillion;
+    } else if ( reportstruct->sentTime.tv_usec >= rMillion ) {
+        reportstruct->sentTime.tv_sec++;
+        reportstruct->sentTime.tv_usec -= rMillion;
+    }
+    reportstruct->packetID = (int) mCb->fin_bytes;
+    reportstruct->packetLen = 0;
+    ReportPacket( mSettings->reporthdr, reportstruct );
+}
+
+/* -------------------------------------------------------------------
+ * One step of the test in the connection's mode: the bytes moved,
+ * 0 once it is over, -1 on error.
+ * ------------------------------------------------------------------- */
+long Server::MoveRDMA( void ) {
+    switch ( mCb->trans_mode ) {
+    case kRdmaTrans_ActRead:
+        return svr_act_rdma_rd( mCb );
+    case kRdmaTrans_ActWrte:
+        return svr_act_rdma_wr( mCb );
+    case kRdmaTrans_PasRead:
+        return svr_pas_rdma_rd( mCb );
+    case kRdmaTrans_PasWrte:
+        return svr_pas_rdma_wr( mCb );
+    case kRdmaTrans_LatWrite:
+    case kRdmaTrans_LatSend:
+    case kRdmaTrans_LatRead:
+        return svr_lat_pong( mCb );
+    case kRdmaTrans_SendRecv:
+        return svr_snd_rdma_recv( mCb );
+    case kRdmaTrans_CreditWrite:
+        return svr_crd_rdma_recv( mCb );
+    case kRdmaTrans_FetchAdd:
+    case kRdmaTrans_CmpSwap:
+        return svr_atomic_wait( mCb );
+    default:
+        return -1;
+    }
+}
+
+/* -------------------------------------------------------------------
+ * What the connection's CQ, receives, credits and buffers were up to,
+ * after its final report.
+ * ------------------------------------------------------------------- */
+void Server::StatsRDMA( void ) {
+    if ( mSettings->mReportMode != kReport_CSV ) {
+        printf( report_rdma_cq, mSettings->mSock, 
+                iperf_cq_mode_str( mCb->cq_mode ), mCb->cq_wcs, 
+                mCb->cq_polls, mCb->cq_empty, mCb->cq_events );
+    }
+    if ( mCb->trans_mode == kRdmaTrans_SendRecv &&
+         mSettings->mReportMode != kReport_CSV ) {
+        long rnr = iperf_rnr_count( mCb );
+        char count[ 32 ];
+
+        if ( rnr < 0 )
+            strcpy( count, "n/a" );
+        else
+            snprintf( count, sizeof(count), "%ld", rnr );
+        if ( mCb->srq ) {
+            printf( report_rdma_recv, mSettings->mSock, mCb->dev->srq_size,
+                    mCb->dev->srq_len, "shared by all connections",
+                    mCb->dev->srq_dry, count );
+        } else {
+            printf( report_rdma_recv, mSettings->mSock, mCb->ring_depth,
+                    mCb->size, "of its own", mCb->recv_dry, count );
+        }
+    }
+    if ( mCb->trans_mode == kRdmaTrans_CreditWrite &&
+         mSettings->mReportMode != kReport_CSV ) {
+        printf( report_rdma_credits, mSettings->mSock, mCb->credits,
+                mCb->credit_msgs, ( mCb->credit_msgs > 0 ? 
+                  (double) mCb->credits / mCb->credit_msgs : 0 ) );
+    }
+    if ( mCb->mem > 0 && mSettings->mReportMode != kReport_CSV ) {
+        printf( report_rdma_mem, mSettings->mSock, 
+                iperf_mem_str( mCb->mem_got ), mCb->dev->numa_node );
+    }
+    if ( mSettings->mReportMode != kReport_CSV ) {
+        char place[ 2 * IPERF_CPUS_LEN ];
+
+        iperf_place_str( mCb, place, sizeof(place) );
+        printf( report_rdma_place, mSettings->mSock, place );
+    }
+    if ( mCb->validate && mSettings->mReportMode != kReport_CSV ) {
+        ReportChecked( &mCb->check );
+    }
+    if ( mCb->disk.file != NULL && mSettings->mReportMode != kReport_CSV ) {
+        char bytes[ 32 ], rate[ 32 ];
+        double secs = iperf_disk_secs( &mCb->disk );
+
+        byte_snprintf( bytes, sizeof(bytes), (double) mCb->disk.bytes,
+                       toupper( mSettings->mFormat ) );
+        byte_snprintf( rate, sizeof(rate), ( secs > 0 ? 
+                       mCb->disk.bytes / secs : 0 ), mSettings->mFormat );
+        printf( report_rdma_disk, mSettings->mSock, bytes, secs, rate,
+                (unsigned long long) mCb->disk.direct,
+                (unsigned long long) mCb->disk.buffered,
+                iperf_disk_str( &mCb->disk ), mCb->disk.peak,
+                (unsigned long long) mCb->disk.errors );
+    }
+}
+
+/* -------------------------------------------------------------------
+ * What -E found in the buffers received.
+ * ------------------------------------------------------------------- */
+void Server::ReportChecked( iperf_check_stat *inCheck ) {
+    printf( report_checked, mSettings->mSock,
+            (unsigned long long) inCheck->bufs,
+            (unsigned long long) inCheck->bad,
+            (unsigned long long) inCheck->unordered,
+            (unsigned long long) inCheck->shorts,
+            iperf_check_share( inCheck ) * 100,
+            iperf_check_rate( inCheck ) / 1e9 );
+}
+
+/* -------------------------------------------------------------------
+ * What setting up and tearing down the connection cost, once it is
+ * torn down.
+ * ------------------------------------------------------------------- */
+void Server::CostRDMA( void ) {
+    if ( mSettings->mReportMode == kReport_CSV )
+        return;
+    printf( report_rdma_cost, mSettings->mSock, mCb->setup_usec,
+            mCb->reg_usec, mCb->buf_pooled, mCb->buf_reg,
+            mCb->teardown_usec );
+    if ( mCb->mr_cache > 0 ) {
+        printf( report_rdma_mrcache, mSettings->mSock,
+                mCb->mr_hits, mCb->mr_misses );
+    }
+}
+
+/* -------------------------------------------------------------------
+ * Worker pool (-X workers=#).
+ *
+ * A thread per connection, and one more on its CQ, runs out of CPUs
+ * long before the HCA runs out of QPs. With workers, the listener
+ * hands each connection to the one serving the fewest, and its test
+ * runs from that worker's epoll loop one event at a time: OpenRDMA()
+ * sets it up and accepts, EventRDMA() takes its CM events, PollRDMA()
+ * its completions, and EndRDMA() reports and tears it down. Latency
+ * modes spin on their round trips and keep a thread of their own.
+ * ------------------------------------------------------------------- */
+
+struct RdmaWorker {
+    int id;
+    int cpu;                            // pinned to, or -1
+    int epfd;
+    int wake;                           // eventfd: incoming is not empty
+    struct rdma_event_channel *cm;      // its connections' CM events
+    pthread_t tid;
+    Mutex lock;                         // for incoming
+    Server *incoming;                   // handed over, not yet opened
+    Server *ready;                      // completions left over budget
+    Server *dead;                       // deleted at the end of a round
+    int conns;
+};
+
+static RdmaWorker *sWorkers = NULL;
+static int sNumWorkers = 0;
+
+// epoll events taken per round
+const int kWorkerEvents = 64;
+
+/* -------------------------------------------------------------------
+ * Called by the listener instead of thread_start(): takes over
+ * inSettings, starting the pool on the first call.
+ * ------------------------------------------------------------------- */
+void Server::AssignRDMA( thread_Settings *inSettings ) {
+    struct epoll_event ev;
+    RdmaWorker *w;
+    Server *theServer;
+    uint64_t one = 1;
+    int i, ncpu;
+
+    if ( sWorkers == NULL ) {
+        ncpu = sysconf( _SC_NPROCESSORS_ONLN );
+        sNumWorkers = inSettings->mRdmaWorkers;
+        sWorkers = new RdmaWorker[ sNumWorkers ];
+        for ( i = 0; i < sNumWorkers; i++ ) {
+            w = &sWorkers[ i ];
+            memset( w, 0, sizeof(*w) );
+            w->id = i;
+            w->cpu = ( inSettings->mRdmaPinWorkers && ncpu > 0 ?
+                       i % ncpu : -1 );
+            Mutex_Initialize( &w->lock );
+            w->epfd = epoll_create( kWorkerEvents );
+            w->wake = eventfd( 0, EFD_NONBLOCK );
+            w->cm = iperf_worker_channel( );
+            FAIL_errno( w->epfd < 0 || w->wake < 0 || w->cm == NULL,
+                        "RDMA worker", inSettings );
+
+            ev.events = EPOLLIN;
+            ev.data.ptr = &w->wake;
+            FAIL_errno( epoll_ctl( w->epfd, EPOLL_CTL_ADD, w->wake, &ev ),
+                        "epoll_ctl", inSettings );
+            ev.data.ptr = w->cm;
+            FAIL_errno( epoll_ctl( w->epfd, EPOLL_CTL_ADD, w->cm->fd, &ev ),
+                        "epoll_ctl", inSettings );
+            FAIL_errno( pthread_create( &w->tid, NULL, WorkerRDMA, w ),
+                        "pthread_create", inSettings );
+        }
+    }
+
+    w = &sWorkers[ 0 ];
+    for ( i = 1; i < sNumWorkers; i++ ) {
+        if ( sWorkers[ i ].conns < w->conns )
+            w = &sWorkers[ i ];
+    }
+    __sync_fetch_and_add( &w->conns, 1 );
+
+    theServer = new Server( inSettings );
+    Mutex_Lock( &w->lock );
+    theServer->mNext = w->incoming;
+    w->incoming = theServer;
+    Mutex_Unlock( &w->lock );
+    if ( write( w->wake, &one, sizeof(one) ) != sizeof(one) )
+        WARN_errno( 1, "write eventfd" );
+}
+
+/* -------------------------------------------------------------------
+ * A worker's loop. Connections that had more completions than their
+ * budget go on the ready list and are polled again after this round's
+ * events, without waiting for more; ended ones are deleted only after
+ * that, as events taken in the same round may still name them.
+ * ------------------------------------------------------------------- */
+void *Server::WorkerRDMA( void *inWorker ) {
+    RdmaWorker *w = (RdmaWorker*) inWorker;
+    struct epoll_event ev[ kWorkerEvents ];
+    thread_Settings *settings;
+    Server *s, *next;
+    rdma_cb *cb;
+    uint64_t count;
+    int i, n, event;
+
+    if ( w->cpu >= 0 ) {
+        cpu_set_t set;
+
+        CPU_ZERO( &set );
+        CPU_SET( w->cpu, &set );
+        if ( pthread_setaffinity_np( pthread_self( ), sizeof(set), &set ) )
+            fprintf( stderr, "RDMA worker %d: cannot pin to CPU %d\n",
+                     w->id, w->cpu );
+    }
+
+    while ( true ) {
+        n = epoll_wait( w->epfd, ev, kWorkerEvents,
+                        ( w->ready != NULL ? 0 : -1 ) );
+        if ( n < 0 ) {
+            if ( errno == EINTR )
+                continue;
+            WARN_errno( 1, "epoll_wait" );
+            break;
+        }
+
+        for ( i = 0; i < n; i++ ) {
+            if ( ev[ i ].data.ptr == &w->wake ) {
+                if ( read( w->wake, &count, sizeof(count) ) < 0 )
+                    continue;
+                Mutex_Lock( &w->lock );
+                s = w->incoming;
+                w->incoming = NULL;
+                Mutex_Unlock( &w->lock );
+                for ( ; s != NULL; s = next ) {
+                    next = s->mNext;
+                    s->OpenRDMA( w );
+                }
+            } else if ( ev[ i ].data.ptr == w->cm ) {
+                while ( (cb = iperf_worker_cm( w->cm, &event )) != NULL ) {
+                    s = (Server*) cb->owner;
+                    if ( !s->mDone )
+                        s->EventRDMA( event );
+                }
+            } else {
+                s = (Server*) ev[ i ].data.ptr;
+                if ( s->mDone )
+                    continue;
+                if ( iperf_worker_arm( s->mCb ) )
+                    s->EndRDMA( );
+                else
+                    s->PollRDMA( IPERF_WORKER_BUDGET );
+            }
+        }
+
+        s = w->ready;
+        w->ready = NULL;
+        for ( ; s != NULL; s = next ) {
+            next = s->mNextReady;
+            s->mReady = false;
+            if ( !s->mDone )
+                s->PollRDMA( IPERF_WORKER_BUDGET );
+        }
+
+        for ( s = w->dead; s != NULL; s = next ) {
+            next = s->mNext;
+            settings = s->mSettings;
+            delete s->mCb;
+            delete s;
+            Settings_Destroy( settings );
+        }
+        w->dead = NULL;
+    }
+    return NULL;
+}
+
+/* -------------------------------------------------------------------
+ * Set the connection up on inWorker and accept it. The first message
+ * came with the connect request, see iperf_worker_ok(), so the mode is
+ * known and the answer goes with the accept.
+ * ------------------------------------------------------------------- */
+void Server::OpenRDMA( RdmaWorker *inWorker ) {
+    struct epoll_event ev;
+    int fd;
+
+    mWorker = inWorker;
+    mCb->owner = this;
+    // -X pinworkers: the worker keeps its CPU
+    mCb->pinned = ( mWorker->cpu >= 0 );
+    if ( iperf_worker_attach( mCb, mWorker->cm ) )
+        goto err0;
+    if ( iperf_setup_qp( mCb, mCb->child_cm_id ) ) {
+        fprintf( stderr, "setup_qp failed\n" );
+        goto err0;
+    }
+    if ( iperf_setup_buffers( mCb ) ) {
+        fprintf( stderr, "rping_setup_buffers failed\n" );
+        goto err1;
+    }
+    if ( iperf_post_recvs( mCb ) ) {
+        fprintf( stderr, "iperf_post_recvs failed\n" );
+        goto err2;
+    }
+    if ( svr_accept_info( mCb ) ) {
+        fprintf( stderr, "bad first message in connect request\n" );
+        goto err2;
+    }
+
+    fd = iperf_worker_fd( mCb );
+    mWorkerFd = fd;
+    ev.events = EPOLLIN;
+    ev.data.ptr = this;
+    if ( fd < 0 || epoll_ctl( mWorker->epfd, EPOLL_CTL_ADD, fd, &ev ) ) {
+        WARN_errno( 1, "epoll_ctl" );
+        goto err2;
+    }
+    if ( iperf_accept_post( mCb ) ) {
+        epoll_ctl( mWorker->epfd, EPOLL_CTL_DEL, fd, NULL );
+        goto err2;
+    }
+    return;
+
+err2:
+    iperf_free_buffers( mCb );
+err1:
+    iperf_free_qp( mCb );
+err0:
+    mDone = true;
+    Mutex_Lock( &clients_mutex );
+    Iperf_delete( &(mSettings->peer), &clients );
+    Mutex_Unlock( &clients_mutex );
+    // the client is still waiting for an answer
+    rdma_reject( mCb->child_cm_id, NULL, 0 );
+    rdma_destroy_id( mCb->child_cm_id );
+    mNext = mWorker->dead;
+    mWorker->dead = this;
+    __sync_fetch_and_sub( &mWorker->conns, 1 );
+}
+
+/* -------------------------------------------------------------------
+ * A CM event for the connection, or -1 for one that failed it.
+ * ------------------------------------------------------------------- */
+void Server::EventRDMA( int inEvent ) {
+    switch ( inEvent ) {
+    case RDMA_CM_EVENT_ESTABLISHED:
+        BeginRDMA( );
+        break;
+    case RDMA_CM_EVENT_DISCONNECTED:
+        // what completed before the client left still counts
+        PollRDMA( INT_MAX );
+        EndRDMA( );
+        break;
+    case -1:
+        EndRDMA( );
+        break;
+    default:
+        break;
+    }
+}
+
+/* -------------------------------------------------------------------
+ * Reap up to inBudget batches of completions off the connection,
+ * ending it on FIN or error. If that is not all, it goes on the
+ * worker's ready list.
+ * ------------------------------------------------------------------- */
+void Server::PollRDMA( int inBudget ) {
+    struct ibv_wc wc[ IPERF_WC_BATCH ];
+    long currLen;
+    int n;
+
+    while ( !mDone && inBudget-- > 0 ) {
+        n = iperf_try_wc( mCb, wc, IPERF_WC_BATCH );
+        if ( n < 0 || (currLen = svr_rdma_handle( mCb, wc, n )) < 0 ) {
+            EndRDMA( );
+            return;
+        }
+        if ( currLen > 0 )
+            AccountRDMA( currLen );
+        if ( mCb->fin == 2 ) {
+            EndRDMA( );
+            return;
+        }
+        if ( n < IPERF_WC_BATCH )
+            return;
+    }
+
+    if ( !mDone && !mReady ) {
+        mReady = true;
+        mNextReady = mWorker->ready;
+        mWorker->ready = this;
+    }
+}
+
+/* -------------------------------------------------------------------
+ * Start reporting, when the connection is established or its first
+ * data came in, whatever happens first. Probes are not reported.
+ * ------------------------------------------------------------------- */
+void Server::BeginRDMA( void ) {
+    if ( mReport != NULL || mCb->trans_mode == kRdmaTrans_Connect )
+        return;
+    mReport = new ReportStruct;
+    mReport->packetID = 0;
+    mSettings->reporthdr = InitReport( mSettings );
+}
+
+void Server::AccountRDMA( long inLen ) {
+    BeginRDMA( );
+    if ( mReport == NULL )
+        return;
+    mTotLen += inLen;
+    if ( mSettings->mInterval > 0 ) {
+        mReport->packetLen = inLen;
+        gettimeofday( &(mReport->packetTime), NULL );
+        ReportPacket( mSettings->reporthdr, mReport );
+    }
+}
+
+/* -------------------------------------------------------------------
+ * The test is over, or failed: report as RunRDMA() does, tear the
+ * connection down and leave it for the worker to delete.
+ * ------------------------------------------------------------------- */
+void Server::EndRDMA( void ) {
+    long currLen;
+
+    if ( mDone )
+        return;
+    mDone = true;
+
+    // what FIN tells, in the passive modes
+    if ( mCb->fin == 2 ) {
+        while ( (currLen = MoveRDMA( )) > 0 )
+            AccountRDMA( currLen );
+    }
+
+    if ( mReport != NULL ) {
+        gettimeofday( &(mReport->packetTime), NULL );
+        mReport->packetLen = ( 0.0 == mSettings->mInterval ? mTotLen : 0 );
+        ReportPacket( mSettings->reporthdr, mReport );
+        CloseReport( mSettings->reporthdr, mReport );
+    }
+
+    Mutex_Lock( &clients_mutex );
+    Iperf_delete( &(mSettings->peer), &clients );
+    Mutex_Unlock( &clients_mutex );
+
+    if ( mReport != NULL ) {
+        EndReport( mSettings->reporthdr );
+        StatsRDMA( );
+    }
+
+    epoll_ctl( mWorker->epfd, EPOLL_CTL_DEL, mWorkerFd, NULL );
+    rdma_disconnect( mCb->child_cm_id );
+    iperf_free_buffers( mCb );
+    iperf_free_qp( mCb );
+    if ( mReport != NULL )
+        CostRDMA( );
+    DELETE_PTR( mReport );
+    rdma_destroy_id( mCb->child_cm_id );
+
+    mNext = mWorker->dead;
+    mWorker->dead = this;
+    __sync_fetch_and_sub( &mWorker->conns, 1 );
+}
+
 /* ------------------------------------------------------------------- 
  * Send an AckFIN (a datagram acknowledging a FIN) on the socket, 
  * then select on the socket for some time. If additional datagrams 
@@ -72,6 +72,8 @@
 #include "gnu_getopt.h"
 
 void Settings_Interpret( char option, const char *optarg, thread_Settings *mExtSettings );
+void Settings_InterpretRdma( const char *optarg, thread_Settings *mExtSettings );
+void Settings_SetTestMode( thread_Settings *mExtSettings, TestMode mode );
 
 /* -------------------------------------------------------------------
  * command line options
@@ -108,6 +110,7 @@ const struct option long_options[] =
 {"bind",       required_argument, NULL, 'B'},
 {"compatibility",    no_argument, NULL, 'C'},
 {"daemon",           no_argument, NULL, 'D'},
+{"validate",         no_argument, NULL, 'E'},
 {"file_input", required_argument, NULL, 'F'},
 {"rdma_style", required_argument, NULL, 'G'},
 {"rdma",             no_argument, NULL, 'H'},
@@ -123,6 +126,7 @@ const struct option long_options[] =
 {"single_udp",       no_argument, NULL, 'U'},
 {"ipv6_domain",      no_argument, NULL, 'V'},
 {"suggest_win_size", no_argument, NULL, 'W'},
+{"rdma_opts",  required_argument, NULL, 'X'},
 {"linux-congestion", required_argument, NULL, 'Z'},
 {0, 0, 0, 0}
 };
@@ -155,6 +159,7 @@ const struct option env_options[] =
 {"IPERF_BIND",       required_argument, NULL, 'B'},
 {"IPERF_COMPAT",           no_argument, NULL, 'C'},
 {"IPERF_DAEMON",           no_argument, NULL, 'D'},
+{"IPERF_VALIDATE",         no_argument, NULL, 'E'},
 {"IPERF_FILE_INPUT", required_argument, NULL, 'F'},
 {"IPERF_USE_RDMA",         no_argument, NULL, 'H'},
 {"IPERF_STDIN_INPUT",      no_argument, NULL, 'I'},
@@ -168,13 +173,14 @@ const struct option env_options[] =
 {"IPERF_SINGLE_UDP",       no_argument, NULL, 'U'},
 {"IPERF_IPV6_DOMAIN",      no_argument, NULL, 'V'},
 {"IPERF_SUGGEST_WIN_SIZE", required_argument, NULL, 'W'},
+{"IPERF_RDMA_OPTS",  required_argument, NULL, 'X'},
 {"IPERF_CONGESTION_CONTROL",  required_argument, NULL, 'Z'},
 {0, 0, 0, 0}
 };
 
 #define SHORT_OPTIONS()
 
-const char short_options[] = "1b:c:df:hi:l:mn:o:p:rst:uvw:x:y:B:CDF:G:HIL:M:NO:P:RS:T:UVWZ:";
+const char short_options[] = "1b:c:df:hi:l:mn:o:p:rst:uvw:x:y:B:CDEF:G:HIL:M:NO:P:RS:T:UVWX:Z:";
 
 /* -------------------------------------------------------------------
  * defaults
@@ -234,6 +240,7 @@ void Settings_Initialize( thread_Settings *main ) {
     //main->mRemoveService = false;      // -R,
     //main->mTOS          = 0;           // -S,  ie. don't set type of service
     main->mTTL          = 1;             // -T,  link-local TTL
+    main->mRdmaNuma     = IPERF_NUMA_AUTO; // -X numa, near the device
     //main->mDomain     = kMode_IPv4;    // -V,
     //main->mSuggestWin = false;         // -W,  Suggest the window size.
 
@@ -243,12 +250,15 @@ void Settings_Initialize_Cb( rdma_cb* main_cb )
 {
 	memset(main_cb, 0, sizeof(*main_cb));
 	main_cb->server = -1;
+	main_cb->numa = IPERF_NUMA_AUTO;
 	main_cb->state = IDLE;
 	main_cb->size = 64;
 	main_cb->sin.ss_family = PF_INET;
 	main_cb->port = htons(8402);
 	main_cb->outputfile = NULL;
 	sem_init(&main_cb->sem, 0, 0);
+	sem_init(&main_cb->wc_sem, 0, 0);
+	pthread_mutex_init(&main_cb->wc_lock, NULL);
 }
 
 void Settings_Copy( thread_Settings *from, thread_Settings **into ) {
@@ -395,7 +405,8 @@ void Settings_Interpret( char option, const char *optarg, thread_Settings *mExtS
             break;
 
         case 'd': // Dual-test Mode
-            if ( mExtSettings->mThreadMode != kMode_Client ) {
+            if ( mExtSettings->mThreadMode != kMode_Client &&
+                 mExtSettings->mThreadMode != kMode_RDMA_Client ) {
                 fprintf( stderr, warn_invalid_server_option, option );
                 break;
             }
@@ -403,10 +414,10 @@ void Settings_Interpret( char option, const char *optarg, thread_Settings *mExtS
                 fprintf( stderr, warn_invalid_compatibility_option, option );
             }
 #ifdef HAVE_THREAD
-            mExtSettings->mMode = kTest_DualTest;
+            Settings_SetTestMode( mExtSettings, kTest_DualTest );
 #else
             fprintf( stderr, warn_invalid_single_threaded, option );
-            mExtSettings->mMode = kTest_TradeOff;
+            Settings_SetTestMode( mExtSettings, kTest_TradeOff );
 #endif
             break;
 
@@ -475,7 +486,8 @@ void Settings_Interpret( char option, const char *optarg, thread_Settings *mExtS
             break;
 
         case 'r': // test mode tradeoff
-            if ( mExtSettings->mThreadMode != kMode_Client ) {
+            if ( mExtSettings->mThreadMode != kMode_Client &&
+                 mExtSettings->mThreadMode != kMode_RDMA_Client ) {
                 fprintf( stderr, warn_invalid_server_option, option );
                 break;
             }
@@ -483,7 +495,7 @@ void Settings_Interpret( char option, const char *optarg, thread_Settings *mExtS
                 fprintf( stderr, warn_invalid_compatibility_option, option );
             }
 
-            mExtSettings->mMode = kTest_TradeOff;
+            Settings_SetTestMode( mExtSettings, kTest_TradeOff );
             break;
 
         case 's': // server mode
@@ -592,18 +604,29 @@ void Settings_Interpret( char option, const char *optarg, thread_Settings *mExtS
 
         case 'C': // Run in Compatibility Mode
             setCompat( mExtSettings );
-            if ( mExtSettings->mMode != kTest_Normal ) {
+            if ( mExtSettings->mMode == kTest_DualTest ||
+                 mExtSettings->mMode == kTest_TradeOff ) {
                 fprintf( stderr, warn_invalid_compatibility_option,
                         ( mExtSettings->mMode == kTest_DualTest ?
                           'd' : 'r' ) );
                 mExtSettings->mMode = kTest_Normal;
             }
+            if ( mExtSettings->mRdmaDual != kTest_Normal ) {
+                fprintf( stderr, warn_invalid_compatibility_option,
+                        ( mExtSettings->mRdmaDual == kTest_DualTest ?
+                          'd' : 'r' ) );
+                mExtSettings->mRdmaDual = kTest_Normal;
+            }
             break;
 
         case 'D': // Run as a daemon
             setDaemon( mExtSettings );
             break;
 
+        case 'E': // stamp every buffer sent, check every one received
+            setValidate( mExtSettings );
+            break;
+
         case 'F' : // Get the input for the data stream from a file
             if ( (mExtSettings->mThreadMode != kMode_Client) 
 	    	&& (mExtSettings->mThreadMode != kMode_RDMA_Client)
@@ -620,6 +643,12 @@ void Settings_Interpret( char option, const char *optarg, thread_Settings *mExtS
         case 'G' : // Get the rdma client transfer style
             if ( mExtSettings->mThreadMode == kMode_RDMA_Client ) {
                 // Settings_GetUpperCaseArg(optarg,outarg);
+	    // the style takes mMode over, a -d/-r still in it is kept apart
+	    if ( mExtSettings->mMode == kTest_DualTest ||
+	         mExtSettings->mMode == kTest_TradeOff ) {
+	        mExtSettings->mRdmaDual = mExtSettings->mMode;
+	        mExtSettings->mMode = kTest_Normal;
+	    }
 	    if ( strcmp(optarg, "ac") == 0 )
 	    	mExtSettings->mMode = kTest_RDMA_ActRead;
 	    else if ( strcmp(optarg, "aw") == 0 )
@@ -628,6 +657,30 @@ void Settings_Interpret( char option, const char *optarg, thread_Settings *mExtS
 	        mExtSettings->mMode = kTest_RDMA_PasRead;
 	    else if ( strcmp(optarg, "pw") == 0 )
 	        mExtSettings->mMode = kTest_RDMA_PasWrte;
+	    else if ( strcmp(optarg, "lw") == 0 )
+	        mExtSettings->mMode = kTest_RDMA_LatWrite;
+	    else if ( strcmp(optarg, "ls") == 0 )
+	        mExtSettings->mMode = kTest_RDMA_LatSend;
+	    else if ( strcmp(optarg, "lr") == 0 )
+	        mExtSettings->mMode = kTest_RDMA_LatRead;
+	    else if ( strcmp(optarg, "sr") == 0 )
+	        mExtSettings->mMode = kTest_RDMA_SendRecv;
+	    else if ( strcmp(optarg, "fa") == 0 )
+	        mExtSettings->mMode = kTest_RDMA_FetchAdd;
+	    else if ( strcmp(optarg, "cs") == 0 )
+	        mExtSettings->mMode = kTest_RDMA_CmpSwap;
+	    else if ( strcmp(optarg, "cw") == 0 )
+	        mExtSettings->mMode = kTest_RDMA_CreditWrite;
+	    else if ( strcmp(optarg, "ud") == 0 ) {
+	        // datagrams, paced and stamped the way -u does
+	        mExtSettings->mMode = kTest_RDMA_Datagram;
+	        if ( !isUDP( mExtSettings ) ) {
+	            setUDP( mExtSettings );
+	            mExtSettings->mUDPRate = kDefault_UDPRate;
+	        }
+	        if ( !isBuflenSet( mExtSettings ) )
+	            mExtSettings->mBufLen = kDefault_UDPBufLen;
+	    }
 	    else
 	        fprintf( stderr, "unrecognized rdma transfer style\n" );
 	    
@@ -639,9 +692,15 @@ void Settings_Interpret( char option, const char *optarg, thread_Settings *mExtS
         case 'H': // Run as RDMA style
 	    if ( mExtSettings->mThreadMode == kMode_Listener )
 		mExtSettings->mThreadMode = kMode_RDMA_Listener;
-	    else if ( mExtSettings->mThreadMode == kMode_Client )
+	    else if ( mExtSettings->mThreadMode == kMode_Client ) {
 		mExtSettings->mThreadMode = kMode_RDMA_Client;
-	    else
+		// -G takes mMode over, an earlier -d/-r is kept apart
+		if ( mExtSettings->mMode == kTest_DualTest ||
+		     mExtSettings->mMode == kTest_TradeOff ) {
+		    mExtSettings->mRdmaDual = mExtSettings->mMode;
+		    mExtSettings->mMode = kTest_Normal;
+		}
+	    } else
 		fprintf( stderr, warn_invalid_report_style );
 
 	    break;
@@ -659,7 +718,8 @@ void Settings_Interpret( char option, const char *optarg, thread_Settings *mExtS
             break;
 
         case 'L': // Listen Port (bidirectional testing client-side)
-            if ( mExtSettings->mThreadMode != kMode_Client ) {
+            if ( mExtSettings->mThreadMode != kMode_Client &&
+                 mExtSettings->mThreadMode != kMode_RDMA_Client ) {
                 fprintf( stderr, warn_invalid_server_option, option );
                 break;
             }
@@ -738,6 +798,10 @@ void Settings_Interpret( char option, const char *optarg, thread_Settings *mExtS
             fprintf( stderr, "The -W option is not available in this release\n");
             break;
 
+        case 'X': // RDMA tuning, a comma separated key[=value] list
+            Settings_InterpretRdma( optarg, mExtSettings );
+            break;
+
         case 'Z':
 #ifdef TCP_CONGESTION
 	    setCongestionControl( mExtSettings );
@@ -753,6 +817,178 @@ void Settings_Interpret( char option, const char *optarg, thread_Settings *mExtS
     }
 } // end Interpret
 
+/* -------------------------------------------------------------------
+ * -d/-r. An RDMA client's mMode is the -G style, so there the test
+ * back is kept in mRdmaDual instead.
+ * ------------------------------------------------------------------- */
+
+void Settings_SetTestMode( thread_Settings *mExtSettings, TestMode mode ) {
+    if ( mExtSettings->mThreadMode == kMode_RDMA_Client ) {
+        mExtSettings->mRdmaDual = mode;
+    } else {
+        mExtSettings->mMode = mode;
+    }
+}
+
+/* -------------------------------------------------------------------
+ * Interpret the -X list of RDMA options, e.g. "depth=16".
+ * ------------------------------------------------------------------- */
+
+void Settings_InterpretRdma( const char *optarg, thread_Settings *mExtSettings ) {
+    char *opts = new char[ strlen( optarg ) + 1 ];
+    char *key, *val, *next;
+
+    strcpy( opts, optarg );
+    for ( key = opts; key != NULL; key = next ) {
+        next = strchr( key, ',' );
+        if ( next != NULL ) {
+            *next++ = '\0';
+        }
+        val = strchr( key, '=' );
+        if ( val != NULL ) {
+            *val++ = '\0';
+        }
+
+        if ( strcmp( key, "depth" ) == 0 && val != NULL ) {
+            mExtSettings->mRdmaDepth = atoi( val );
+            if ( mExtSettings->mRdmaDepth < 1 ) {
+                fprintf( stderr, warn_invalid_rdma_option, key );
+                mExtSettings->mRdmaDepth = 0;
+            }
+        } else if ( strcmp( key, "cq" ) == 0 && val != NULL ) {
+            if ( strcmp( val, "event" ) == 0 )
+                mExtSettings->mRdmaCqMode = IPERF_CQ_EVENT;
+            else if ( strcmp( val, "poll" ) == 0 )
+                mExtSettings->mRdmaCqMode = IPERF_CQ_POLL;
+            else if ( strcmp( val, "hybrid" ) == 0 )
+                mExtSettings->mRdmaCqMode = IPERF_CQ_HYBRID;
+            else
+                fprintf( stderr, warn_invalid_rdma_option, val );
+        } else if ( strcmp( key, "spin" ) == 0 && val != NULL ) {
+            mExtSettings->mRdmaSpin = atoi( val );
+        } else if ( strcmp( key, "pool" ) == 0 && val != NULL ) {
+            mExtSettings->mRdmaPool = byte_atoi( val );
+        } else if ( strcmp( key, "cqs" ) == 0 && val != NULL ) {
+            mExtSettings->mRdmaSharedCqs = atoi( val );
+            if ( mExtSettings->mRdmaSharedCqs < 0 ) {
+                fprintf( stderr, warn_invalid_rdma_option, key );
+                mExtSettings->mRdmaSharedCqs = 0;
+            }
+        } else if ( strcmp( key, "rate" ) == 0 ) {
+            mExtSettings->mRdmaRate = 1;
+        } else if ( strcmp( key, "sweep" ) == 0 ) {
+            mExtSettings->mRdmaSweep = ( val != NULL ? 0 : IPERF_SWEEP_ALL );
+            // the axes, '+' separated: size+depth+op
+            for ( key = val; key != NULL; key = val ) {
+                val = strchr( key, '+' );
+                if ( val != NULL ) {
+                    *val++ = '\0';
+                }
+                if ( strcmp( key, "size" ) == 0 )
+                    mExtSettings->mRdmaSweep |= IPERF_SWEEP_SIZE;
+                else if ( strcmp( key, "depth" ) == 0 )
+                    mExtSettings->mRdmaSweep |= IPERF_SWEEP_DEPTH;
+                else if ( strcmp( key, "op" ) == 0 )
+                    mExtSettings->mRdmaSweep |= IPERF_SWEEP_OP;
+                else
+                    fprintf( stderr, warn_invalid_rdma_option, key );
+            }
+            // a sweep is a series of -X rate tests
+            if ( mExtSettings->mRdmaSweep != 0 ) {
+                mExtSettings->mRdmaRate = 1;
+            }
+        } else if ( strcmp( key, "signal" ) == 0 && val != NULL ) {
+            mExtSettings->mRdmaSignal = atoi( val );
+            if ( mExtSettings->mRdmaSignal < 1 ) {
+                fprintf( stderr, warn_invalid_rdma_option, key );
+                mExtSettings->mRdmaSignal = 0;
+            }
+        } else if ( strcmp( key, "batch" ) == 0 && val != NULL ) {
+            mExtSettings->mRdmaBatch = atoi( val );
+            if ( mExtSettings->mRdmaBatch < 1 ) {
+                fprintf( stderr, warn_invalid_rdma_option, key );
+                mExtSettings->mRdmaBatch = 0;
+            }
+        } else if ( strcmp( key, "sge" ) == 0 && val != NULL ) {
+            mExtSettings->mRdmaSge = atoi( val );
+            if ( mExtSettings->mRdmaSge < 1 || 
+                 mExtSettings->mRdmaSge > IPERF_MAX_SGE ) {
+                fprintf( stderr, warn_invalid_rdma_option, key );
+                mExtSettings->mRdmaSge = 0;
+            }
+        } else if ( strcmp( key, "chunk" ) == 0 && val != NULL ) {
+            mExtSettings->mRdmaChunk = byte_atoi( val );
+        } else if ( strcmp( key, "mem" ) == 0 && val != NULL ) {
+            if ( strcmp( val, "malloc" ) == 0 )
+                mExtSettings->mRdmaMem = IPERF_MEM_MALLOC;
+            else if ( strcmp( val, "numa" ) == 0 )
+                mExtSettings->mRdmaMem = IPERF_MEM_NUMA;
+            else if ( strcmp( val, "huge" ) == 0 )
+                mExtSettings->mRdmaMem = IPERF_MEM_HUGE;
+            else if ( strcmp( val, "huge1g" ) == 0 )
+                mExtSettings->mRdmaMem = IPERF_MEM_HUGE1G;
+            else if ( strcmp( val, "compare" ) == 0 )
+                mExtSettings->mRdmaMem = IPERF_MEM_COMPARE;
+            else
+                fprintf( stderr, warn_invalid_rdma_option, val );
+        } else if ( strcmp( key, "words" ) == 0 && val != NULL ) {
+            mExtSettings->mRdmaWords = atoi( val );
+            if ( mExtSettings->mRdmaWords < 1 || 
+                 mExtSettings->mRdmaWords > IPERF_ATOMIC_WORDS ) {
+                fprintf( stderr, warn_invalid_rdma_option, key );
+                mExtSettings->mRdmaWords = 0;
+            }
+        } else if ( strcmp( key, "mrcache" ) == 0 && val != NULL ) {
+            mExtSettings->mRdmaMrCache = byte_atoi( val );
+        } else if ( strcmp( key, "regbench" ) == 0 ) {
+            mExtSettings->mRdmaRegBench = ( val != NULL ? 
+                                            byte_atoi( val ) : IPERF_REG_MAX );
+            if ( mExtSettings->mRdmaRegBench < IPERF_REG_MIN ) {
+                fprintf( stderr, warn_invalid_rdma_option, key );
+                mExtSettings->mRdmaRegBench = 0;
+            }
+        } else if ( strcmp( key, "connrate" ) == 0 ) {
+            mExtSettings->mRdmaConnRate = 1;
+        } else if ( strcmp( key, "mmap" ) == 0 ) {
+            mExtSettings->mRdmaMmap = 1;
+        } else if ( strcmp( key, "srq" ) == 0 && val != NULL ) {
+            mExtSettings->mRdmaSrq = atoi( val );
+            if ( mExtSettings->mRdmaSrq < 0 ) {
+                fprintf( stderr, warn_invalid_rdma_option, key );
+                mExtSettings->mRdmaSrq = 0;
+            }
+        } else if ( strcmp( key, "credits" ) == 0 && val != NULL ) {
+            mExtSettings->mRdmaCredits = atoi( val );
+            if ( mExtSettings->mRdmaCredits < 1 ) {
+                fprintf( stderr, warn_invalid_rdma_option, key );
+                mExtSettings->mRdmaCredits = 0;
+            }
+        } else if ( strcmp( key, "workers" ) == 0 && val != NULL ) {
+            mExtSettings->mRdmaWorkers = atoi( val );
+            if ( mExtSettings->mRdmaWorkers < 0 ) {
+                fprintf( stderr, warn_invalid_rdma_option, key );
+                mExtSettings->mRdmaWorkers = 0;
+            }
+        } else if ( strcmp( key, "numa" ) == 0 && val != NULL ) {
+            if ( strcmp( val, "off" ) == 0 )
+                mExtSettings->mRdmaNuma = IPERF_NUMA_OFF;
+            else if ( strcmp( val, "auto" ) == 0 )
+                mExtSettings->mRdmaNuma = IPERF_NUMA_AUTO;
+            else if ( isdigit( (unsigned char) val[0] ) )
+                mExtSettings->mRdmaNuma = atoi( val );
+            else
+                fprintf( stderr, warn_invalid_rdma_option, val );
+        } else if ( strcmp( key, "pinworkers" ) == 0 ) {
+            mExtSettings->mRdmaPinWorkers = 1;
+        } else if ( strcmp( key, "odirect" ) == 0 ) {
+            mExtSettings->mRdmaODirect = 1;
+        } else {
+            fprintf( stderr, warn_invalid_rdma_option, key );
+        }
+    }
+    DELETE_ARRAY( opts );
+} // end InterpretRdma
+
 void Settings_GetUpperCaseArg(const char *inarg, char *outarg) {
 
     int len = strlen(inarg);
@@ -782,8 +1018,11 @@ void Settings_GetLowerCaseArg(const char *inarg, char *outarg) {
  * for client side execution 
  */
 void Settings_GenerateListenerSettings( thread_Settings *client, thread_Settings **listener ) {
+    bool rdma = client->mThreadMode == kMode_RDMA_Client;
+
     if ( !isCompat( client ) && 
-         (client->mMode == kTest_DualTest || client->mMode == kTest_TradeOff) ) {
+         (client->mMode == kTest_DualTest || client->mMode == kTest_TradeOff ||
+          (rdma && client->mRdmaDual != kTest_Normal)) ) {
         *listener = new thread_Settings;
         memcpy(*listener, client, sizeof( thread_Settings ));
         setCompat( (*listener) );
@@ -799,7 +1038,8 @@ void Settings_GenerateListenerSettings( thread_Settings *client, thread_Settings
         (*listener)->mOutputFileName = NULL;
         (*listener)->mOutputDataFileName = NULL;
         (*listener)->mMode       = kTest_Normal;
-        (*listener)->mThreadMode = kMode_Listener;
+        (*listener)->mRdmaDual   = kTest_Normal;
+        (*listener)->mThreadMode = ( rdma ? kMode_RDMA_Listener : kMode_Listener );
         if ( client->mHost != NULL ) {
             (*listener)->mHost = new char[strlen( client->mHost ) + 1];
             strcpy( (*listener)->mHost, client->mHost );
@@ -918,3 +1158,120 @@ void Settings_GenerateClientHdr( thread_Settings *client, client_hdr *hdr ) {
         hdr->flags |= htonl(RUN_NOW);
     }
 }
+
+/*
+ * Settings_RdmaStyle
+ * The -G style a client's first message names, kTest_Normal for one
+ * that cannot be tested back.
+ */
+static TestMode Settings_RdmaStyle( uint32_t mode ) {
+    switch ( mode ) {
+        case MODE_RDMA_ACTRD:  return kTest_RDMA_ActRead;
+        case MODE_RDMA_ACTWR:  return kTest_RDMA_ActWrte;
+        case MODE_RDMA_PASRD:  return kTest_RDMA_PasRead;
+        case MODE_RDMA_PASWR:  return kTest_RDMA_PasWrte;
+        case MODE_RDMA_LATWR:  return kTest_RDMA_LatWrite;
+        case MODE_RDMA_LATSN:  return kTest_RDMA_LatSend;
+        case MODE_RDMA_LATRD:  return kTest_RDMA_LatRead;
+        case MODE_RDMA_SNDRCV: return kTest_RDMA_SendRecv;
+        case MODE_RDMA_FADD:   return kTest_RDMA_FetchAdd;
+        case MODE_RDMA_CSWP:   return kTest_RDMA_CmpSwap;
+        case MODE_RDMA_CRDWR:  return kTest_RDMA_CreditWrite;
+        case MODE_RDMA_UD:     return kTest_RDMA_Datagram;
+        default:               return kTest_Normal;
+    }
+}
+
+/*
+ * Settings_GenerateRdmaClientSettings
+ * GenerateClientSettings for an RDMA server: the client's connect
+ * request carried what GenerateClientHdr would have sent, see
+ * GenerateRdmaHdr, and the test back runs in the client's -G style,
+ * buffer size and depth.
+ */
+void Settings_GenerateRdmaClientSettings( thread_Settings *server, 
+                                          thread_Settings **client,
+                                          struct iperf_pdata *pdata ) {
+    int flags = ntohl(pdata->flags);
+    TestMode style = Settings_RdmaStyle( ntohl(pdata->info.mode) );
+    int32_t amount;
+
+    if ( pdata->magic == htonl(IPERF_PDATA_MAGIC) && 
+         (flags & IPERF_PDATA_DUAL) != 0 && style != kTest_Normal &&
+         !isCompat( server ) ) {
+        *client = new thread_Settings;
+        memcpy(*client, server, sizeof( thread_Settings ));
+        setCompat( (*client) );
+        (*client)->mTID = thread_zeroid();
+        (*client)->mPort       = ntohs(pdata->port);
+        (*client)->mThreads    = ntohs(pdata->threads);
+        (*client)->mBufLen     = ntohl(pdata->info.size);
+        (*client)->mRdmaDepth  = ntohl(pdata->info.depth);
+        amount = (int32_t) ntohl(pdata->amount);
+        if ( amount < 0 ) {
+            setModeTime( (*client) );
+            (*client)->mAmount = -amount;
+        } else {
+            (*client)->mAmount = amount;
+        }
+        if ( style == kTest_RDMA_Datagram ) {
+            setUDP( (*client) );
+            (*client)->mUDPRate = ( pdata->rate != 0 ? 
+                                    ntohl(pdata->rate) : kDefault_UDPRate );
+        }
+        (*client)->mFileName   = NULL;
+        (*client)->mHost       = NULL;
+        (*client)->mLocalhost  = NULL;
+        (*client)->mOutputFileName = NULL;
+        (*client)->mMode       = style;
+        (*client)->mRdmaDual   = ((flags & IPERF_PDATA_NOW) == 0 ?
+                                   kTest_TradeOff : kTest_DualTest);
+        (*client)->mThreadMode = kMode_RDMA_Client;
+        if ( server->mLocalhost != NULL ) {
+            (*client)->mLocalhost = new char[strlen( server->mLocalhost ) + 1];
+            strcpy( (*client)->mLocalhost, server->mLocalhost );
+        }
+        (*client)->mHost = new char[REPORT_ADDRLEN];
+        if ( ((sockaddr*)&server->peer)->sa_family == AF_INET ) {
+            inet_ntop( AF_INET, &((sockaddr_in*)&server->peer)->sin_addr, 
+                       (*client)->mHost, REPORT_ADDRLEN);
+        }
+#ifdef HAVE_IPV6
+          else {
+            inet_ntop( AF_INET6, &((sockaddr_in6*)&server->peer)->sin6_addr, 
+                       (*client)->mHost, REPORT_ADDRLEN);
+        }
+#endif
+    } else {
+        *client = NULL;
+    }
+}
+
+/*
+ * Settings_GenerateRdmaHdr
+ * GenerateClientHdr for an RDMA client: with -d/-r, put it into the
+ * private data of the connect request, next to the first message.
+ */
+void Settings_GenerateRdmaHdr( thread_Settings *client, struct iperf_pdata *pdata ) {
+    if ( isCompat( client ) || client->mRdmaDual == kTest_Normal ) {
+        pdata->flags = 0;
+        return;
+    }
+    pdata->flags = htonl(IPERF_PDATA_DUAL);
+    if ( client->mRdmaDual == kTest_DualTest ) {
+        pdata->flags |= htonl(IPERF_PDATA_NOW);
+    }
+    if ( client->mListenPort != 0 ) {
+        pdata->port = htons(client->mListenPort);
+    } else {
+        pdata->port = htons(client->mPort);
+    }
+    pdata->threads = htons(client->mThreads);
+    if ( isModeTime( client ) ) {
+        pdata->amount = htonl(-(long)client->mAmount);
+    } else {
+        pdata->amount = htonl((long)client->mAmount);
+        pdata->amount &= htonl( 0x7FFFFFFF );
+    }
+    pdata->rate = ( isUDP( client ) ? htonl(client->mUDPRate) : 0 );
+}